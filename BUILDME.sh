@@ -147,6 +147,11 @@ mkdir -p "$FINAL_OUTPUT_DIR"
 mkdir -p "$FINAL_OUTPUT_DIR/os"
 cp -r ../sdcontent/* "$FINAL_OUTPUT_DIR"
 
+# Index the OS folders shipped with NOOBS, so the recovery does not have to parse their JSON files on every boot
+if ls "$FINAL_OUTPUT_DIR"/os/*/os.json >/dev/null 2>&1; then
+    python ../recovery/mkcatalogindex.py "$FINAL_OUTPUT_DIR/os"
+fi
+
 if [ $SKIP_KERNEL_REBUILD -ne 1 ]; then
     # Rebuild kernel for ARMv7
     select_kernelconfig armv7
@@ -11,7 +11,7 @@ RECOVERY_SITE_METHOD = local
 RECOVERY_LICENSE = BSD-3c
 RECOVERY_LICENSE_FILES = LICENSE.txt
 RECOVERY_INSTALL_STAGING = NO
-RECOVERY_DEPENDENCIES = qt qjson
+RECOVERY_DEPENDENCIES = qt xz zlib bzip2 lzo libaio zstd lz4
 
 define RECOVERY_BUILD_CMDS
 	(cd $(@D) ; $(QT_QMAKE))
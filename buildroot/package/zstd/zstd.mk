@@ -0,0 +1,35 @@
+################################################################################
+#
+# zstd
+#
+################################################################################
+
+ZSTD_VERSION = v1.3.3
+ZSTD_SITE = $(call github,facebook,zstd,$(ZSTD_VERSION))
+ZSTD_INSTALL_STAGING = YES
+ZSTD_LICENSE = BSD-3c
+ZSTD_LICENSE_FILES = LICENSE
+
+ifeq ($(BR2_STATIC_LIBS),y)
+ZSTD_BUILD_TARGETS = libzstd.a
+ZSTD_INSTALL_TARGETS = install-pc install-static install-includes
+else
+ZSTD_BUILD_TARGETS = libzstd
+ZSTD_INSTALL_TARGETS = install
+endif
+
+define ZSTD_BUILD_CMDS
+	$(MAKE) $(TARGET_CONFIGURE_OPTS) -C $(@D)/lib $(ZSTD_BUILD_TARGETS)
+endef
+
+define ZSTD_INSTALL_STAGING_CMDS
+	$(MAKE) $(TARGET_CONFIGURE_OPTS) -C $(@D)/lib $(ZSTD_INSTALL_TARGETS) \
+		PREFIX=/usr DESTDIR=$(STAGING_DIR)
+endef
+
+define ZSTD_INSTALL_TARGET_CMDS
+	$(MAKE) $(TARGET_CONFIGURE_OPTS) -C $(@D)/lib $(ZSTD_INSTALL_TARGETS) \
+		PREFIX=/usr DESTDIR=$(TARGET_DIR)
+endef
+
+$(eval $(generic-package))
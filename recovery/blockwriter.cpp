@@ -0,0 +1,324 @@
+#include "blockwriter.h"
+#include "writeverifier.h"
+#include <QFile>
+#include <QVector>
+#include <QDebug>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+
+/* Asynchronous direct I/O block device writer
+ *
+ * Maintained by Raspberry Pi
+ *
+ * See LICENSE.txt for license details
+ *
+ */
+
+BlockWriter::BlockWriter(int queueDepth, int chunkSize)
+    : _queueDepth(qMax(queueDepth, 1)), _fd(-1), _bufferedFd(-1), _direct(false), _async(false), _failed(false),
+      _inFlight(0), _current(NULL), _verifier(NULL)
+{
+    /* Chunks must be a multiple of the alignment */
+    _chunkSize = qMax(BLOCKWRITER_ALIGNMENT, chunkSize - chunkSize % BLOCKWRITER_ALIGNMENT);
+    memset(&_ctx, 0, sizeof(_ctx));
+}
+
+BlockWriter::~BlockWriter()
+{
+    if (_bufferedFd != -1)
+        close();
+}
+
+int BlockWriter::fd() const
+{
+    return _bufferedFd;
+}
+
+void BlockWriter::setVerifier(WriteVerifier *verifier)
+{
+    _verifier = verifier;
+}
+
+bool BlockWriter::isAsync() const
+{
+    return _async;
+}
+
+QString BlockWriter::errorString() const
+{
+    return _error;
+}
+
+bool BlockWriter::fail(const QString &msg)
+{
+    if (!_failed)
+    {
+        qDebug() << msg;
+        _error = msg;
+        _failed = true;
+    }
+    return false;
+}
+
+bool BlockWriter::open(const QString &device)
+{
+    QByteArray path = QFile::encodeName(device);
+
+    _bufferedFd = ::open(path.constData(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (_bufferedFd == -1)
+        return fail("Error opening "+device+": "+strerror(errno));
+
+    /* Not all file systems support O_DIRECT */
+    _fd = ::open(path.constData(), O_WRONLY | O_DIRECT | O_CLOEXEC);
+    _direct = (_fd != -1);
+    if (!_direct)
+        _fd = _bufferedFd;
+
+    for (int i = 0; i < _queueDepth; i++)
+    {
+        void *data;
+        if (posix_memalign(&data, BLOCKWRITER_ALIGNMENT, _chunkSize) != 0)
+            return fail("Out of memory allocating write buffers");
+
+        Buffer *b = new Buffer;
+        b->data = (char *) data;
+        b->offset = 0;
+        b->len = 0;
+        b->inFlight = false;
+        _buffers.append(b);
+        _free.append(b);
+    }
+
+    if (_direct)
+    {
+        int ret = io_setup(_queueDepth, &_ctx);
+        if (ret == 0)
+            _async = true;
+        else
+            qDebug() << "AIO not available (" << strerror(-ret) << "), using blocking writes";
+    }
+
+    qDebug() << "Writing to" << device << (_direct ? "with direct I/O," : "through page cache,")
+             << (_async ? QString::number(_queueDepth)+" writes in flight," : QString("blocking,"))
+             << "chunk size" << _chunkSize/1024 << "KB";
+
+    return true;
+}
+
+bool BlockWriter::writeBlocking(int fd, qint64 offset, const char *data, qint64 len)
+{
+    while (len)
+    {
+        ssize_t n = ::pwrite(fd, data, len, offset);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return fail(QString("Error writing to SD card: ")+strerror(errno));
+        }
+        data   += n;
+        offset += n;
+        len    -= n;
+    }
+
+    return true;
+}
+
+/* Collect completed writes. Returns false if any of them failed */
+bool BlockWriter::reap(int minEvents)
+{
+    QVector<struct io_event> events(_queueDepth);
+    int n;
+
+    do
+    {
+        n = io_getevents(_ctx, minEvents, _queueDepth, events.data(), NULL);
+    } while (n == -EINTR);
+
+    if (n < 0)
+        return fail(QString("Error waiting for writes to complete: ")+strerror(-n));
+
+    for (int i = 0; i < n; i++)
+    {
+        Buffer *b = (Buffer *) events[i].data;
+        long res = (long) events[i].res;
+
+        if (res < 0)
+            fail(QString("Error writing to SD card: ")+strerror(-res));
+        else if (res != b->len)
+            fail("Error writing to SD card: short write");
+
+        b->inFlight = false;
+        _free.append(b);
+        _inFlight--;
+    }
+
+    return !_failed;
+}
+
+bool BlockWriter::waitForAll()
+{
+    while (_inFlight)
+    {
+        if (!reap(_inFlight))
+            return false;
+    }
+
+    return !_failed;
+}
+
+bool BlockWriter::submitCurrent()
+{
+    Buffer *b = _current;
+    _current = NULL;
+
+    if (!b || !b->len)
+    {
+        if (b)
+            _free.append(b);
+        return !_failed;
+    }
+    if (_verifier)
+        _verifier->record(b->offset, b->data, b->len);
+
+    /* Direct I/O needs aligned offsets and sizes. The rare unaligned write
+     * (e.g. the end of an image that is not a multiple of 4 KB) goes through
+     * the page cache, and is synced by flush() */
+    bool aligned = _direct && !(b->offset % BLOCKWRITER_ALIGNMENT) && !(b->len % BLOCKWRITER_ALIGNMENT);
+
+    if (!aligned || !_async)
+    {
+        /* A partial page write reads the page in first, and would write back stale data
+         * over a direct write to the same page that is still in flight */
+        while (!aligned && overlapsInFlight(b->offset, b->len))
+        {
+            if (!reap(1))
+            {
+                _free.append(b);
+                return false;
+            }
+        }
+
+        bool ok = writeBlocking(aligned ? _fd : _bufferedFd, b->offset, b->data, b->len);
+        _free.append(b);
+        return ok;
+    }
+
+    io_prep_pwrite(&b->cb, _fd, b->data, b->len, b->offset);
+    b->cb.data = b;
+    struct iocb *cbs[1] = { &b->cb };
+
+    int ret = io_submit(_ctx, 1, cbs);
+    if (ret != 1)
+    {
+        _free.append(b);
+        return fail(QString("Error submitting write: ")+strerror(ret < 0 ? -ret : EAGAIN));
+    }
+    b->inFlight = true;
+    _inFlight++;
+
+    return true;
+}
+
+/* Whether a direct write in flight touches the pages of offset to offset+len */
+bool BlockWriter::overlapsInFlight(qint64 offset, qint64 len) const
+{
+    qint64 start = offset / BLOCKWRITER_ALIGNMENT * BLOCKWRITER_ALIGNMENT;
+    qint64 end   = (offset + len + BLOCKWRITER_ALIGNMENT - 1) / BLOCKWRITER_ALIGNMENT * BLOCKWRITER_ALIGNMENT;
+
+    foreach (const Buffer *b, _buffers)
+    {
+        if (b->inFlight && b->offset < end && b->offset + b->len > start)
+            return true;
+    }
+
+    return false;
+}
+
+bool BlockWriter::write(qint64 offset, const char *data, qint64 len)
+{
+    if (_failed)
+        return false;
+
+    while (len)
+    {
+        /* Start a new chunk when full, or if the data is not contiguous */
+        if (_current && (_current->len == _chunkSize || offset != _current->offset + _current->len))
+        {
+            if (!submitCurrent())
+                return false;
+        }
+        if (!_current)
+        {
+            if (_free.isEmpty() && !reap(1))
+                return false;
+            _current = _free.takeLast();
+            _current->offset = offset;
+            _current->len = 0;
+        }
+
+        int n = qMin(len, (qint64) (_chunkSize - _current->len));
+        memcpy(_current->data + _current->len, data, n);
+        _current->len += n;
+        offset += n;
+        data   += n;
+        len    -= n;
+    }
+
+    return true;
+}
+
+bool BlockWriter::flush()
+{
+    if (!submitCurrent() || !waitForAll())
+        return false;
+
+    /* Flushes the page cache for unaligned writes, and the card's write cache */
+    if (::fsync(_bufferedFd) != 0)
+        return fail(QString("Error syncing data to SD card: ")+strerror(errno));
+
+    return true;
+}
+
+bool BlockWriter::close()
+{
+    bool ok = flush();
+
+    /* In-flight writes must complete before their buffers can be freed, also after a write
+     * failed. Only io_getevents() failing itself stops reaping */
+    while (_inFlight)
+    {
+        int inFlight = _inFlight;
+        reap(_inFlight);
+        if (_inFlight == inFlight)
+            break;
+    }
+    if (_inFlight)
+    {
+        qDebug() << "Abandoning" << _inFlight << "writes";
+        _buffers.clear();
+    }
+
+    if (_async)
+        io_destroy(_ctx);
+    if (_direct)
+        ::close(_fd);
+    if (_bufferedFd != -1 && ::close(_bufferedFd) != 0 && ok)
+        ok = fail(QString("Error closing SD card device: ")+strerror(errno));
+
+    foreach (Buffer *b, _buffers)
+    {
+        free(b->data);
+        delete b;
+    }
+    _buffers.clear();
+    _free.clear();
+    _current = NULL;
+    _fd = _bufferedFd = -1;
+    _async = _direct = false;
+
+    return ok;
+}
@@ -0,0 +1,80 @@
+#ifndef BLOCKWRITER_H
+#define BLOCKWRITER_H
+
+/* Asynchronous direct I/O block device writer
+ *
+ * Writes bypass the page cache (O_DIRECT), so installing a large
+ * image does not fill memory with dirty pages that all have to be
+ * flushed at the end. Data is collected in aligned chunks, and
+ * several chunks are kept in flight with Linux native AIO (libaio).
+ *
+ * Falls back to blocking writes if AIO or O_DIRECT is not available,
+ * and to buffered writes for the odd write that is not sector aligned.
+ * Data is only guaranteed to be on disk after flush().
+ *
+ * Maintained by Raspberry Pi
+ *
+ * See LICENSE.txt for license details
+ *
+ */
+
+#include <QString>
+#include <QList>
+#include <libaio.h>
+
+class WriteVerifier;
+
+#define BLOCKWRITER_DEFAULT_QUEUE_DEPTH  8
+#define BLOCKWRITER_DEFAULT_CHUNK_SIZE   (1024 * 1024)
+/* O_DIRECT buffer, offset and size alignment */
+#define BLOCKWRITER_ALIGNMENT            4096
+
+class BlockWriter
+{
+public:
+    explicit BlockWriter(int queueDepth = BLOCKWRITER_DEFAULT_QUEUE_DEPTH, int chunkSize = BLOCKWRITER_DEFAULT_CHUNK_SIZE);
+    virtual ~BlockWriter();
+
+    bool open(const QString &device);
+    /* Queue data to be written at offset. The data is copied, so the caller may reuse its buffer */
+    bool write(qint64 offset, const char *data, qint64 len);
+    /* Wait for all queued writes and sync them to the card */
+    bool flush();
+    bool close();
+    /* Record everything written for read-back verification */
+    void setVerifier(WriteVerifier *verifier);
+
+    /* Buffered file descriptor, for reading and for ioctls */
+    int fd() const;
+    bool isAsync() const;
+    QString errorString() const;
+
+protected:
+    struct Buffer
+    {
+        char *data;
+        qint64 offset;
+        int len;
+        bool inFlight;
+        struct iocb cb;
+    };
+
+    bool submitCurrent();
+    bool reap(int minEvents);
+    bool waitForAll();
+    bool overlapsInFlight(qint64 offset, qint64 len) const;
+    bool writeBlocking(int fd, qint64 offset, const char *data, qint64 len);
+    bool fail(const QString &msg);
+
+    int _queueDepth, _chunkSize;
+    int _fd, _bufferedFd;
+    bool _direct, _async, _failed;
+    io_context_t _ctx;
+    QList<Buffer *> _buffers, _free;
+    int _inFlight;
+    Buffer *_current;
+    WriteVerifier *_verifier;
+    QString _error;
+};
+
+#endif // BLOCKWRITER_H
@@ -10,8 +10,11 @@
 #include "bootselectiondialog.h"
 #include "ui_bootselectiondialog.h"
 #include "config.h"
-#include "json.h"
 #include "util.h"
+#include "mountmanager.h"
+#include "iconstore.h"
+#include "twoiconsdelegate.h"
+#include "oscatalog.h"
 #include <QDir>
 #include <QMessageBox>
 #include <QProcess>
@@ -24,13 +27,16 @@
 #include <QWSServer>
 #include <QDebug>
 
-BootSelectionDialog::BootSelectionDialog(const QString &defaultPartition, QWidget *parent) :
+BootSelectionDialog::BootSelectionDialog(const QString &defaultPartition, OsCatalog *catalog, QWidget *parent) :
     QDialog(parent),
     _countdown(11),
+    _icons(new IconStore),
+    _catalog(catalog),
     ui(new Ui::BootSelectionDialog)
 {
     setWindowFlags(Qt::Window | Qt::CustomizeWindowHint | Qt::WindowTitleHint);
     ui->setupUi(this);
+    ui->list->setItemDelegate(new TwoIconsDelegate(this, _icons));
     QRect s = QApplication::desktop()->screenGeometry();
     if (s.height() < 500)
         resize(s.width()-10, s.height()-100);
@@ -38,55 +44,54 @@ BootSelectionDialog::BootSelectionDialog(const QString &defaultPartition, QWidge
     QDir dir;
     dir.mkdir("/settings");
 
-    if (QProcess::execute("mount -t ext4 -o ro " SETTINGS_PARTITION " /settings") != 0)
+    if (!MountManager::mountSettings())
     {
         QMessageBox::critical(this, tr("Cannot display boot menu"), tr("Error mounting settings partition"));
         return;
     }
 
     /* Also mount /dev/mmcblk0p1 as it may contain icons we need */
-    if (QProcess::execute("mount -t vfat -o ro /dev/mmcblk0p1 /mnt") != 0)
+    if (!MountManager::mount("/dev/mmcblk0p1", "/mnt", "vfat", true))
     {
         /* Not fatal if this fails */
     }
 
-    QVariantList installed_os = Json::loadFromFile("/settings/installed_os.json").toList();
+    /* The settings partition was not mounted when the installer read it, or an install changed it */
+    _catalog->setInstalled(_catalog->loadInstalled());
     QSize currentsize = ui->list->iconSize();
 
-    foreach (QVariant v, installed_os)
+    foreach (const OsRecord &r, _catalog->installed())
     {
-        QVariantMap m = v.toMap();
-        QString iconfilename = m.value("icon").toString();
-        QIcon icon;
+        QString iconfilename = r.icon;
 
-        if (!iconfilename.isEmpty() && QFile::exists(iconfilename))
+        /* Only decoded if the store does not have the current version. The delegate draws it */
+        bool hasicon = !iconfilename.isEmpty() && _icons->addFile(iconfilename);
+        if (hasicon)
         {
-            icon = QIcon(iconfilename);
-            QList<QSize> avs = icon.availableSizes();
-            if (avs.isEmpty())
-            {
-                /* Icon file corrupt */
-                icon = QIcon();
-            }
-            else
-            {
-                QSize iconsize = avs.first();
+            QSize iconsize = _icons->size(iconfilename);
 
-                if (iconsize.width() > currentsize.width() || iconsize.height() > currentsize.height())
-                {
-                    /* Make all icons as large as the largest icon we have */
-                    currentsize = QSize(qMax(iconsize.width(), currentsize.width()),qMax(iconsize.height(), currentsize.height()));
-                    ui->list->setIconSize(currentsize);
-                }
+            if (iconsize.width() > currentsize.width() || iconsize.height() > currentsize.height())
+            {
+                /* Make all icons as large as the largest icon we have */
+                currentsize = QSize(qMax(iconsize.width(), currentsize.width()),qMax(iconsize.height(), currentsize.height()));
+                ui->list->setIconSize(currentsize);
             }
         }
-        if (canBootOs(m.value("name").toString(), m))
+        if (r.is(OsRecord::CanBoot))
         {
-            QListWidgetItem *item = new QListWidgetItem(icon, m.value("name").toString()+"\n"+m.value("description").toString(), ui->list);
-            item->setData(Qt::UserRole, m);
+            QListWidgetItem *item = new QListWidgetItem(r.name+"\n"+r.description, ui->list);
+            item->setData(Qt::UserRole, r.name);
+            if (hasicon)
+                item->setData(IconSourceRole, iconfilename);
         }
     }
 
+    if (_icons->isModified())
+    {
+        SettingsWriteLocker lock;
+        _icons->save();
+    }
+
     if (ui->list->count() != 0)
     {
         // If default boot partition set then boot to that after 5 seconds
@@ -107,8 +112,8 @@ BootSelectionDialog::BootSelectionDialog(const QString &defaultPartition, QWidge
             QByteArray partstr = "/dev/mmcblk0p"+QByteArray::number(partition);
             for (int i=0; i<ui->list->count(); i++)
             {
-                QVariantMap m = ui->list->item(i)->data(Qt::UserRole).toMap();
-                if (m.value("partitions").toList().first() == partstr)
+                OsRecord r = _catalog->value(ui->list->item(i)->data(Qt::UserRole).toString());
+                if (r.partitions.first() == partstr)
                 {
                     ui->list->setCurrentRow(i);
                     break;
@@ -132,6 +137,7 @@ BootSelectionDialog::BootSelectionDialog(const QString &defaultPartition, QWidge
 BootSelectionDialog::~BootSelectionDialog()
 {
     delete ui;
+    delete _icons;
 }
 
 void BootSelectionDialog::bootPartition()
@@ -150,8 +156,8 @@ void BootSelectionDialog::accept()
         return;
 
     QSettings settings("/settings/noobs.conf", QSettings::IniFormat, this);
-    QVariantMap m = item->data(Qt::UserRole).toMap();
-    QByteArray partition = m.value("partitions").toList().first().toByteArray();
+    OsRecord r = _catalog->value(item->data(Qt::UserRole).toString());
+    QByteArray partition = r.partitions.first().toAscii();
     partition.replace("/dev/mmcblk0p", "");
     int partitionNr    = partition.toInt();
     int oldpartitionNr = settings.value("default_partition_to_boot", 0).toInt();
@@ -159,10 +165,9 @@ void BootSelectionDialog::accept()
     if (partitionNr != oldpartitionNr)
     {
         // Save OS boot choice as the new default
-        QProcess::execute("mount -o remount,rw /settings");
+        SettingsWriteLocker lock;
         settings.setValue("default_partition_to_boot", partitionNr);
         settings.sync();
-        QProcess::execute("mount -o remount,ro /settings");
     }
 
     bootPartition();
@@ -18,13 +18,15 @@
 namespace Ui {
 class BootSelectionDialog;
 }
+class IconStore;
+class OsCatalog;
 
 class BootSelectionDialog : public QDialog
 {
     Q_OBJECT
 
 public:
-    explicit BootSelectionDialog(const QString &defaultPartition, QWidget *parent = 0);
+    explicit BootSelectionDialog(const QString &defaultPartition, OsCatalog *catalog, QWidget *parent = 0);
     ~BootSelectionDialog();
     virtual void accept();
     void setDisplayMode();
@@ -40,6 +42,8 @@ private slots:
 protected:
     QTimer _timer;
     int _countdown;
+    IconStore *_icons;
+    OsCatalog *_catalog;
     void stopCountdown();
 
 private:
@@ -0,0 +1,433 @@
+#include "catalogindex.h"
+#include "config.h"
+#include "json.h"
+#include "util.h"
+#include <QFile>
+#include <QFileInfo>
+#include <QDateTime>
+#include <QCryptographicHash>
+#include <QDebug>
+#include <string.h>
+
+/* Index of the OS folders in /mnt/os
+ *
+ * Maintained by Raspberry Pi
+ *
+ * See LICENSE.txt for license details
+ *
+ */
+
+/* Header: magic, version and folder count */
+#define CATALOG_INDEX_HEADER_SIZE  (8 + 4 + 4)
+
+static const char *jsonFiles[] = { "/os.json", "/flavours.json", "/partitions.json" };
+
+/* Reads numbers and strings from the index, until the first read past its end */
+class IndexReader
+{
+public:
+    IndexReader(const QByteArray &data)
+        : _p(data.constData()), _end(data.constData()+data.size()), _ok(true)
+    {
+    }
+
+    bool ok() const
+    {
+        return _ok;
+    }
+
+    const char *take(int len)
+    {
+        if (!_ok || _end - _p < len)
+        {
+            _ok = false;
+            return NULL;
+        }
+        const char *p = _p;
+        _p += len;
+        return p;
+    }
+
+    quint32 u8()
+    {
+        const char *p = take(1);
+        return p ? uchar(*p) : 0;
+    }
+
+    quint32 u16()
+    {
+        const uchar *u = (const uchar *) take(2);
+        return u ? (u[0] | (u[1] << 8)) : 0;
+    }
+
+    quint32 u32()
+    {
+        const uchar *u = (const uchar *) take(4);
+        return u ? (u[0] | (u[1] << 8) | (u[2] << 16) | (quint32(u[3]) << 24)) : 0;
+    }
+
+    quint64 u64()
+    {
+        quint64 lo = u32();
+        return lo | (quint64(u32()) << 32);
+    }
+
+    QString string()
+    {
+        int len = u16();
+        const char *p = take(len);
+        return p ? QString::fromUtf8(p, len) : QString();
+    }
+
+protected:
+    const char *_p, *_end;
+    bool _ok;
+};
+
+static void appendU8(QByteArray &a, quint32 v)
+{
+    a.append(char(v & 0xff));
+}
+
+static void appendU32(QByteArray &a, quint32 v)
+{
+    for (int i = 0; i < 32; i += 8)
+        a.append(char((v >> i) & 0xff));
+}
+
+static void appendU64(QByteArray &a, quint64 v)
+{
+    appendU32(a, quint32(v));
+    appendU32(a, quint32(v >> 32));
+}
+
+static void appendString(QByteArray &a, const QString &s)
+{
+    QByteArray u = s.toUtf8().left(0xffff);
+    a.append(char(u.size() & 0xff));
+    a.append(char(u.size() >> 8));
+    a.append(u);
+}
+
+CatalogEntry::CatalogEntry()
+    : bootable(true), hasFeatureLevel(false), hasSupportedRevisions(false), hasSupportedHexRevisions(false),
+      featureLevel(0), nominalSize(0)
+{
+}
+
+QVariantMap CatalogEntry::toMap(const QString &folder) const
+{
+    QVariantMap m;
+
+    m.insert("name", name);
+    m.insert("folder", folder);
+    m.insert("nominal_size", nominalSize);
+    if (!description.isEmpty())
+        m.insert("description", description);
+    if (!icon.isEmpty())
+        m.insert("icon", icon);
+    if (!releaseDate.isEmpty())
+        m.insert("release_date", releaseDate);
+    if (hasSupportedRevisions)
+        m.insert("supported_revisions", supportedRevisions);
+    if (hasSupportedHexRevisions)
+        m.insert("supported_hex_revisions", supportedHexRevisions);
+    if (hasFeatureLevel)
+        m.insert("feature_level", featureLevel);
+    if (!bootable)
+        m.insert("bootable", false);
+
+    return m;
+}
+
+CatalogFolder::CatalogFolder()
+    : bootable(true), hasRiscosOffset(false), riscosOffset(0)
+{
+    memset(mtimes, 0, sizeof(mtimes));
+}
+
+QVariantMap CatalogFolder::osInfo() const
+{
+    QVariantMap m;
+
+    m.insert("name", osName);
+    m.insert("bootable", bootable);
+    if (hasRiscosOffset)
+        m.insert(RISCOS_OFFSET_KEY, riscosOffset);
+
+    return m;
+}
+
+CatalogIndex::CatalogIndex()
+    : _modified(false)
+{
+}
+
+bool CatalogIndex::load(const QString &filename)
+{
+    QFile f(filename);
+
+    if (!f.open(QIODevice::ReadOnly))
+        return false;
+    if (!parse(f.readAll()))
+    {
+        qDebug() << "Ignoring catalog index" << filename << ": damaged or of unknown format";
+        return false;
+    }
+
+    return true;
+}
+
+bool CatalogIndex::parse(const QByteArray &data)
+{
+    if (data.size() < CATALOG_INDEX_HEADER_SIZE || !data.startsWith(CATALOG_INDEX_MAGIC))
+        return false;
+
+    IndexReader r(data);
+    r.take(8);
+    if (r.u32() != CATALOG_INDEX_VERSION)
+        return false;
+
+    /* Read completely before any of it is used */
+    QList<CatalogFolder> folders;
+    quint32 count = r.u32();
+    for (quint32 i = 0; i < count && r.ok(); i++)
+    {
+        CatalogFolder f;
+        f.name = r.string();
+        for (int j = 0; j < 4; j++)
+            f.mtimes[j] = r.u32();
+        const char *hash = r.take(20);
+        if (hash)
+            f.hash = QByteArray(hash, 20);
+        f.osName = r.string();
+        quint32 flags = r.u8();
+        f.bootable = flags & 1;
+        f.hasRiscosOffset = flags & 2;
+        f.riscosOffset = qint32(r.u32());
+
+        quint32 entries = r.u32();
+        for (quint32 j = 0; j < entries && r.ok(); j++)
+        {
+            CatalogEntry e;
+            e.name = r.string();
+            e.description = r.string();
+            e.icon = r.string();
+            e.releaseDate = r.string();
+            e.supportedRevisions = r.string();
+            e.supportedHexRevisions = r.string();
+            flags = r.u8();
+            e.bootable = flags & 1;
+            e.hasFeatureLevel = flags & 2;
+            e.hasSupportedRevisions = flags & 4;
+            e.hasSupportedHexRevisions = flags & 8;
+            e.featureLevel = r.u64();
+            e.nominalSize = r.u32();
+            f.entries.append(e);
+        }
+        folders.append(f);
+    }
+    if (!r.ok())
+        return false;
+
+    foreach (const CatalogFolder &f, folders)
+    {
+        if (!_folders.contains(f.name))
+            _folders.insert(f.name, f);
+    }
+
+    return true;
+}
+
+bool CatalogIndex::save(const QString &filename)
+{
+    QByteArray data(CATALOG_INDEX_MAGIC);
+    appendU32(data, CATALOG_INDEX_VERSION);
+    appendU32(data, _folders.size());
+
+    foreach (const CatalogFolder &f, _folders)
+    {
+        appendString(data, f.name);
+        for (int i = 0; i < 4; i++)
+            appendU32(data, f.mtimes[i]);
+        data.append(f.hash);
+        appendString(data, f.osName);
+        appendU8(data, (f.bootable ? 1 : 0) | (f.hasRiscosOffset ? 2 : 0));
+        appendU32(data, quint32(f.riscosOffset));
+
+        appendU32(data, f.entries.size());
+        foreach (const CatalogEntry &e, f.entries)
+        {
+            appendString(data, e.name);
+            appendString(data, e.description);
+            appendString(data, e.icon);
+            appendString(data, e.releaseDate);
+            appendString(data, e.supportedRevisions);
+            appendString(data, e.supportedHexRevisions);
+            appendU8(data, (e.bootable ? 1 : 0) | (e.hasFeatureLevel ? 2 : 0)
+                     | (e.hasSupportedRevisions ? 4 : 0) | (e.hasSupportedHexRevisions ? 8 : 0));
+            appendU64(data, e.featureLevel);
+            appendU32(data, e.nominalSize);
+        }
+    }
+
+    if (!writeFileAtomically(filename, data))
+    {
+        qDebug() << "Error writing catalog index" << filename;
+        return false;
+    }
+
+    _modified = false;
+    return true;
+}
+
+void CatalogIndex::stat(const QString &dir, quint32 *mtimes)
+{
+    QFileInfo fi(dir);
+    mtimes[0] = fi.exists() ? fi.lastModified().toTime_t() : 0;
+
+    for (int i = 0; i < 3; i++)
+    {
+        fi.setFile(dir+jsonFiles[i]);
+        mtimes[i+1] = fi.exists() ? fi.lastModified().toTime_t() : 0;
+    }
+}
+
+QByteArray CatalogIndex::hash(const QString &dir)
+{
+    QCryptographicHash h(QCryptographicHash::Sha1);
+
+    for (int i = 0; i < 3; i++)
+    {
+        QFile f(dir+jsonFiles[i]);
+        QByteArray len, data;
+        quint32 size = 0xffffffff;
+
+        if (f.open(QIODevice::ReadOnly))
+        {
+            data = f.readAll();
+            size = data.size();
+        }
+        appendU32(len, size);
+        h.addData(len);
+        h.addData(data);
+    }
+
+    return h.result();
+}
+
+/* Read the JSON files of an OS folder, as listImages() did */
+bool CatalogIndex::scan(const QString &dir, CatalogFolder &f)
+{
+    QVariantMap osv = Json::loadFromFile(dir+"/os.json").toMap();
+
+    f.osName = osv.value("name").toString();
+    f.bootable = osv.value("bootable", true).toBool();
+    f.hasRiscosOffset = osv.contains(RISCOS_OFFSET_KEY);
+    f.riscosOffset = osv.value(RISCOS_OFFSET_KEY).toInt();
+    f.entries.clear();
+
+    /* Calculate nominal_size based on information inside partitions.json */
+    int nominal_size = 0;
+    QVariantMap pv = Json::loadFromFile(dir+"/partitions.json", QStringList() << "partitions");
+    foreach (QVariant v, pv.value("partitions").toList())
+    {
+        nominal_size += v.toMap().value("partition_size_nominal").toInt();
+        nominal_size += 1; /* Overhead per partition for EBR */
+    }
+
+    QList<QVariantMap> maps;
+    if (QFile::exists(dir+"/flavours.json"))
+    {
+        QVariantMap v = Json::loadFromFile(dir+"/flavours.json", QStringList() << "flavours");
+
+        foreach (QVariant fv, v.value("flavours").toList())
+        {
+            QVariantMap fm = fv.toMap();
+            if (fm.contains("name"))
+            {
+                fm["release_date"] = osv.value("release_date");
+                maps.append(fm);
+            }
+        }
+    }
+    else
+    {
+        maps.append(osv);
+    }
+
+    foreach (const QVariantMap &m, maps)
+    {
+        CatalogEntry e;
+        e.name = m.value("name").toString();
+        e.description = m.value("description").toString();
+        e.icon = m.value("icon").toString();
+        e.releaseDate = m.value("release_date").toString();
+        e.supportedRevisions = m.value("supported_revisions").toString();
+        e.supportedHexRevisions = m.value("supported_hex_revisions").toString();
+        e.bootable = m.value("bootable", true).toBool();
+        e.hasFeatureLevel = m.contains("feature_level");
+        e.hasSupportedRevisions = m.contains("supported_revisions");
+        e.hasSupportedHexRevisions = m.contains("supported_hex_revisions");
+        e.featureLevel = m.value("feature_level").toULongLong();
+        e.nominalSize = m.contains("nominal_size") ? m.value("nominal_size").toInt() : nominal_size;
+        f.entries.append(e);
+    }
+
+    return true;
+}
+
+const CatalogFolder *CatalogIndex::folder(const QString &name)
+{
+    QString dir = "/mnt/os/"+name;
+    quint32 mtimes[4];
+
+    stat(dir, mtimes);
+    if (!mtimes[1])
+        return NULL;
+
+    QMap<QString,CatalogFolder>::iterator it = _folders.find(name);
+    if (it != _folders.end() && !memcmp(it.value().mtimes, mtimes, sizeof(mtimes)))
+        return &it.value();
+
+    /* Changed, or copied with new mtimes */
+    QByteArray h = hash(dir);
+    if (it != _folders.end() && it.value().hash == h)
+    {
+        memcpy(it.value().mtimes, mtimes, sizeof(mtimes));
+        _modified = true;
+        return &it.value();
+    }
+
+    qDebug() << "Reading OS folder" << dir;
+    CatalogFolder f;
+    f.name = name;
+    memcpy(f.mtimes, mtimes, sizeof(mtimes));
+    f.hash = h;
+    scan(dir, f);
+    _modified = true;
+
+    return &_folders.insert(name, f).value();
+}
+
+void CatalogIndex::retainFolders(const QStringList &names)
+{
+    QMap<QString,CatalogFolder>::iterator it = _folders.begin();
+    while (it != _folders.end())
+    {
+        if (!names.contains(it.key()))
+        {
+            it = _folders.erase(it);
+            _modified = true;
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
+
+bool CatalogIndex::isModified() const
+{
+    return _modified;
+}
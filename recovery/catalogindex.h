@@ -0,0 +1,117 @@
+#ifndef CATALOGINDEX_H
+#define CATALOGINDEX_H
+
+/* Index of the OS folders in /mnt/os
+ *
+ * Parsing os.json, flavours.json and partitions.json of every folder
+ * takes a while on a Pi 1, so the list entries made from them are kept
+ * in a binary index: names, descriptions and icons of every flavour,
+ * nominal sizes worked out from partitions.json, and what is needed to
+ * tell whether the OS can be installed on the board.
+ *
+ * BUILDME.sh generates the index for the OS folders that ship with
+ * NOOBS, as /mnt/os/catalog.idx (see mkcatalogindex.py), and an
+ * updated copy is kept on the settings partition. A folder is read
+ * again if the mtime of the folder or one of its JSON files changed,
+ * and the SHA-1 of the JSON files differs from the one in the index.
+ * The SHA-1 makes the index generated at build time valid after the
+ * files were copied to the SD card with new mtimes.
+ *
+ * All numbers are little endian, strings are a uint16 length followed
+ * by UTF-8:
+ *
+ *   8 bytes   magic "NOOBSCAT"
+ *   uint32    version, 1
+ *   uint32    number of folders
+ *   per folder:
+ *     string    folder name in /mnt/os
+ *     uint32    mtime of the folder, os.json, flavours.json and partitions.json,
+ *               0 if unknown or the file does not exist
+ *     20 bytes  SHA-1 over os.json, flavours.json and partitions.json, each as
+ *               a uint32 length (0xffffffff if it does not exist) and its contents
+ *     string    name of the OS
+ *     uint8     flags: 1 = bootable, 2 = has riscos_offset
+ *     int32     riscos_offset
+ *     uint32    number of list entries, the flavours or the OS itself
+ *     per entry:
+ *       string  name, description, icon, release_date,
+ *               supported_revisions, supported_hex_revisions
+ *       uint8   flags: 1 = bootable, 2 = has feature_level,
+ *               4 = has supported_revisions, 8 = has supported_hex_revisions
+ *       uint64  feature_level, a bitset of the board revisions supported
+ *       uint32  nominal size in MB
+ *
+ * Maintained by Raspberry Pi
+ *
+ * See LICENSE.txt for license details
+ *
+ */
+
+#include <QString>
+#include <QByteArray>
+#include <QStringList>
+#include <QList>
+#include <QMap>
+#include <QVariant>
+
+#define CATALOG_INDEX_MAGIC     "NOOBSCAT"
+#define CATALOG_INDEX_VERSION   1
+#define CATALOG_INDEX_FILE      "/settings/catalog.idx"
+#define CATALOG_INDEX_BUILTIN   "/mnt/os/catalog.idx"
+
+struct CatalogEntry
+{
+    QString name, description, icon, releaseDate;
+    QString supportedRevisions, supportedHexRevisions;
+    bool bootable, hasFeatureLevel, hasSupportedRevisions, hasSupportedHexRevisions;
+    quint64 featureLevel;
+    int nominalSize;
+
+    CatalogEntry();
+    /* Details as listImages() puts them in the list */
+    QVariantMap toMap(const QString &folder) const;
+};
+
+struct CatalogFolder
+{
+    QString name;
+    quint32 mtimes[4];
+    QByteArray hash;
+    QString osName;
+    bool bootable, hasRiscosOffset;
+    int riscosOffset;
+    QList<CatalogEntry> entries;
+
+    CatalogFolder();
+    /* What canInstallOs() looks at */
+    QVariantMap osInfo() const;
+};
+
+class CatalogIndex
+{
+public:
+    CatalogIndex();
+
+    /* Folders already known are kept, so the first file loaded takes precedence */
+    bool load(const QString &filename);
+    bool save(const QString &filename);
+
+    /* Folder of /mnt/os, from the index if it is up to date.
+     * NULL if the folder has no os.json */
+    const CatalogFolder *folder(const QString &name);
+    /* Forget all folders but those given */
+    void retainFolders(const QStringList &names);
+    /* Whether folders were read or dropped since the index was loaded */
+    bool isModified() const;
+
+protected:
+    bool parse(const QByteArray &data);
+    static bool scan(const QString &dir, CatalogFolder &f);
+    static void stat(const QString &dir, quint32 *mtimes);
+    static QByteArray hash(const QString &dir);
+
+    QMap<QString,CatalogFolder> _folders;
+    bool _modified;
+};
+
+#endif // CATALOGINDEX_H
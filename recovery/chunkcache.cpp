@@ -0,0 +1,315 @@
+#include "chunkcache.h"
+#include "json.h"
+#include "util.h"
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QVariant>
+#include <QCryptographicHash>
+#include <QMutexLocker>
+#include <QDebug>
+#include <sys/statvfs.h>
+#include <sys/types.h>
+#include <utime.h>
+#include <unistd.h>
+#include <stdio.h>
+
+/* Content-addressed cache of downloaded OS images
+ *
+ * Maintained by Raspberry Pi
+ *
+ * See LICENSE.txt for license details
+ *
+ */
+
+CacheManifest::CacheManifest()
+    : size(0), chunkSize(CACHE_CHUNK_SIZE)
+{
+}
+
+CacheManifest::CacheManifest(const QString &url, qint64 size, const QByteArray &validator)
+    : url(url), size(size), validator(validator), chunkSize(CACHE_CHUNK_SIZE)
+{
+    for (int i = 0; i < chunkCount(); i++)
+        chunks.append(QByteArray());
+}
+
+int CacheManifest::chunkCount() const
+{
+    return (size + chunkSize - 1) / chunkSize;
+}
+
+bool CacheManifest::isComplete() const
+{
+    foreach (const QByteArray &hash, chunks)
+    {
+        if (hash.isEmpty())
+            return false;
+    }
+    return true;
+}
+
+qint64 CacheManifest::chunkOffset(int chunk) const
+{
+    return qint64(chunk) * chunkSize;
+}
+
+int CacheManifest::chunkLength(int chunk) const
+{
+    return qMin(qint64(chunkSize), size - chunkOffset(chunk));
+}
+
+ChunkCache::ChunkCache(const QString &dir)
+    : _dir(dir), _budget(0), _used(0), _tmpCounter(0), _useCounter(0)
+{
+}
+
+QString ChunkCache::errorString() const
+{
+    return _error;
+}
+
+qint64 ChunkCache::budget() const
+{
+    return _budget;
+}
+
+qint64 ChunkCache::bytesUsed() const
+{
+    QMutexLocker lock(&_mutex);
+    return _used;
+}
+
+QString ChunkCache::chunkPath(const QByteArray &hash) const
+{
+    return _dir+"/chunks/"+hash;
+}
+
+/* Manifests are named after the hash of the URL, which may contain any character */
+QString ChunkCache::manifestPath(const QString &url) const
+{
+    return _dir+"/manifests/"+QCryptographicHash::hash(url.toUtf8(), QCryptographicHash::Sha1).toHex()+".json";
+}
+
+bool ChunkCache::open()
+{
+    QDir dir;
+
+    if (!dir.mkpath(_dir+"/chunks") || !dir.mkpath(_dir+"/manifests"))
+    {
+        _error = "Error creating cache directories in "+_dir;
+        return false;
+    }
+
+    struct statvfs st;
+    if (::statvfs(QFile::encodeName(_dir).constData(), &st) != 0)
+    {
+        _error = "Error querying size of "+_dir;
+        return false;
+    }
+    _budget = qint64(st.f_blocks) * st.f_frsize / 100 * CACHE_BUDGET_PERCENT;
+
+    /* Oldest first. Anything else than a complete chunk is left over from an interrupted write */
+    QFileInfoList files = QDir(_dir+"/chunks").entryInfoList(QDir::Files, QDir::Time | QDir::Reversed);
+    foreach (const QFileInfo &fi, files)
+    {
+        QByteArray name = QFile::encodeName(fi.fileName());
+
+        if (name.size() != 40 || name.contains('.'))
+        {
+            QFile::remove(fi.absoluteFilePath());
+            continue;
+        }
+        insert(name, fi.size());
+        _used += fi.size();
+    }
+
+    qDebug() << "Download cache" << _dir << "holds" << _lru.size() << "chunks," << _used/1048576 << "of" << _budget/1048576 << "MB";
+    return true;
+}
+
+bool ChunkCache::loadManifest(const QString &url, CacheManifest &m)
+{
+    QVariantMap v = Json::loadFromFile(manifestPath(url)).toMap();
+    QVariantList chunks = v.value("chunks").toList();
+
+    if (v.value("url").toString() != url)
+        return false;
+
+    m.url       = url;
+    m.size      = v.value("size").toLongLong();
+    m.validator = v.value("validator").toString().toLatin1();
+    m.chunkSize = v.value("chunk_size").toInt();
+    if (m.size <= 0 || m.chunkSize <= 0 || chunks.size() != m.chunkCount())
+        return false;
+
+    m.chunks.clear();
+    foreach (const QVariant &c, chunks)
+        m.chunks.append(c.toString().toLatin1());
+
+    return true;
+}
+
+bool ChunkCache::saveManifest(const CacheManifest &m)
+{
+    QVariantList chunks;
+    foreach (const QByteArray &hash, m.chunks)
+        chunks.append(QString(hash));
+
+    QVariantMap v;
+    v.insert("url", m.url);
+    v.insert("size", m.size);
+    v.insert("validator", QString(m.validator));
+    v.insert("chunk_size", m.chunkSize);
+    v.insert("chunks", chunks);
+
+    return writeFileAtomically(manifestPath(m.url), Json::serialize(v));
+}
+
+void ChunkCache::removeManifest(const QString &url)
+{
+    QFile::remove(manifestPath(url));
+}
+
+void ChunkCache::pin(const QByteArray &hash)
+{
+    QMutexLocker lock(&_mutex);
+    _pinned[hash]++;
+}
+
+void ChunkCache::unpin(const QByteArray &hash)
+{
+    QMutexLocker lock(&_mutex);
+
+    if (--_pinned[hash] <= 0)
+        _pinned.remove(hash);
+}
+
+/* Called with _mutex locked */
+void ChunkCache::insert(const QByteArray &hash, qint64 size)
+{
+    CachedChunk c;
+    c.size    = size;
+    c.lastUse = _useCounter++;
+    _chunks.insert(hash, c);
+    _lru.insert(c.lastUse, hash);
+}
+
+/* Called with _mutex locked */
+void ChunkCache::touch(const QByteArray &hash)
+{
+    CachedChunk &c = _chunks[hash];
+    _lru.remove(c.lastUse);
+    c.lastUse = _useCounter++;
+    _lru.insert(c.lastUse, hash);
+    ::utime(QFile::encodeName(chunkPath(hash)).constData(), NULL);
+}
+
+/* Called with _mutex locked */
+void ChunkCache::remove(const QByteArray &hash)
+{
+    QFile::remove(chunkPath(hash));
+    CachedChunk c = _chunks.take(hash);
+    _used -= c.size;
+    _lru.remove(c.lastUse);
+}
+
+/* Evict least recently used chunks until len more bytes fit. Called with _mutex locked */
+bool ChunkCache::makeRoom(qint64 len)
+{
+    QMap<quint64,QByteArray>::const_iterator it = _lru.constBegin();
+
+    while (_used + len > _budget)
+    {
+        while (it != _lru.constEnd() && _pinned.contains(it.value()))
+            ++it;
+        if (it == _lru.constEnd())
+            return false;
+
+        /* Removing the chunk does not invalidate the iterator past it */
+        QByteArray hash = it.value();
+        ++it;
+        remove(hash);
+    }
+
+    return true;
+}
+
+bool ChunkCache::contains(const QByteArray &hash) const
+{
+    QMutexLocker lock(&_mutex);
+    return _chunks.contains(hash);
+}
+
+bool ChunkCache::read(const QByteArray &hash, QByteArray &data)
+{
+    {
+        QMutexLocker lock(&_mutex);
+        if (!_chunks.contains(hash))
+            return false;
+    }
+
+    QFile f(chunkPath(hash));
+    if (f.open(QIODevice::ReadOnly))
+        data = f.readAll();
+
+    QMutexLocker lock(&_mutex);
+    if (!f.isOpen() || QCryptographicHash::hash(data, QCryptographicHash::Sha1).toHex() != hash)
+    {
+        qDebug() << "Removing corrupt chunk" << hash << "from download cache";
+        if (_chunks.contains(hash))
+            remove(hash);
+        data.clear();
+        return false;
+    }
+    touch(hash);
+
+    return true;
+}
+
+QByteArray ChunkCache::store(const QByteArray &data)
+{
+    QByteArray hash = QCryptographicHash::hash(data, QCryptographicHash::Sha1).toHex();
+    QString tmp;
+
+    {
+        QMutexLocker lock(&_mutex);
+
+        if (_chunks.contains(hash))
+        {
+            touch(hash);
+            return hash;
+        }
+        if (!makeRoom(data.size()))
+            return QByteArray();
+
+        /* Space is claimed before writing, so concurrent downloads cannot overfill the cache */
+        _used += data.size();
+        tmp = chunkPath(hash)+".tmp"+QString::number(_tmpCounter++);
+    }
+
+    /* Synced before the rename, so a power cut cannot leave an empty chunk under its hash */
+    QFile f(tmp);
+    bool ok = f.open(QIODevice::WriteOnly) && f.write(data) == data.size() && f.flush() && ::fsync(f.handle()) == 0;
+    f.close();
+    ok = ok && ::rename(QFile::encodeName(tmp).constData(), QFile::encodeName(chunkPath(hash)).constData()) == 0;
+
+    QMutexLocker lock(&_mutex);
+    if (!ok)
+    {
+        QFile::remove(tmp);
+        _used -= data.size();
+        return QByteArray();
+    }
+    if (_chunks.contains(hash))
+    {
+        /* Stored by another download in the meantime */
+        _used -= data.size();
+    }
+    else
+    {
+        insert(hash, data.size());
+    }
+
+    return hash;
+}
@@ -0,0 +1,113 @@
+#ifndef CHUNKCACHE_H
+#define CHUNKCACHE_H
+
+/* Content-addressed cache of downloaded OS images
+ *
+ * Downloads are stored in fixed-size chunks on the cache partition.
+ * Chunk files are named after the SHA-1 of their contents, so chunks
+ * that several downloads have in common are stored once, and are
+ * verified every time they are read back.
+ *
+ * For every URL a manifest lists the hashes of its chunks, together
+ * with the size and ETag/Last-Modified the server reported for it.
+ * The manifest is saved after every chunk, so an interrupted download
+ * resumes at the first chunk that is missing, and a file that changed
+ * on the server is not served from the cache.
+ *
+ * When the cache is full, the least recently used chunks are evicted.
+ * The modification time of a chunk file records its last use, so the
+ * order survives a reboot. Chunks pinned by a download in progress
+ * are never evicted.
+ *
+ * All functions may be called from several install steps at once.
+ *
+ * Maintained by Raspberry Pi
+ *
+ * See LICENSE.txt for license details
+ *
+ */
+
+#include <QString>
+#include <QByteArray>
+#include <QList>
+#include <QHash>
+#include <QMap>
+#include <QMutex>
+
+#define CACHE_CHUNK_SIZE        (4 * 1024 * 1024)
+/* Part of the cache file system that may be filled with chunks */
+#define CACHE_BUDGET_PERCENT    90
+
+struct CacheManifest
+{
+    QString url;
+    qint64 size;
+    /* ETag, or Last-Modified if the server does not send one */
+    QByteArray validator;
+    int chunkSize;
+    /* Hex SHA-1 of every chunk, empty if it is not cached */
+    QList<QByteArray> chunks;
+
+    CacheManifest();
+    CacheManifest(const QString &url, qint64 size, const QByteArray &validator);
+    int chunkCount() const;
+    bool isComplete() const;
+    qint64 chunkOffset(int chunk) const;
+    int chunkLength(int chunk) const;
+};
+
+class ChunkCache
+{
+public:
+    explicit ChunkCache(const QString &dir);
+
+    /* Creates the directories if needed, and indexes the chunks already in the cache */
+    bool open();
+    QString errorString() const;
+    qint64 budget() const;
+    qint64 bytesUsed() const;
+
+    bool loadManifest(const QString &url, CacheManifest &m);
+    bool saveManifest(const CacheManifest &m);
+    /* Forget what is cached of url, e.g. because it failed verification */
+    void removeManifest(const QString &url);
+
+    /* Chunks pinned by a download in progress are not evicted until unpinned */
+    void pin(const QByteArray &hash);
+    void unpin(const QByteArray &hash);
+
+    bool contains(const QByteArray &hash) const;
+    /* Returns false if the chunk is missing or corrupt, a corrupt chunk is removed */
+    bool read(const QByteArray &hash, QByteArray &data);
+    /* Returns the hash of the stored chunk, or an empty array if it could not be stored */
+    QByteArray store(const QByteArray &data);
+
+protected:
+    QString chunkPath(const QByteArray &hash) const;
+    QString manifestPath(const QString &url) const;
+    void insert(const QByteArray &hash, qint64 size);
+    void touch(const QByteArray &hash);
+    void remove(const QByteArray &hash);
+    bool makeRoom(qint64 len);
+
+    QString _dir, _error;
+    qint64 _budget, _used;
+    int _tmpCounter;
+
+    struct CachedChunk
+    {
+        qint64 size;
+        /* Key in _lru */
+        quint64 lastUse;
+    };
+
+    /* Protected by _mutex. _lru maps a use counter to the chunk used then, so it is ordered
+     * from least to most recently used, and a use only moves one entry */
+    mutable QMutex _mutex;
+    QHash<QByteArray,CachedChunk> _chunks;
+    QMap<quint64,QByteArray> _lru;
+    quint64 _useCounter;
+    QHash<QByteArray,int> _pinned;
+};
+
+#endif // CHUNKCACHE_H
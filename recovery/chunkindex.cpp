@@ -0,0 +1,323 @@
+#include "chunkindex.h"
+#include "chunkcache.h"
+#include "httpconnection.h"
+#include <QFile>
+#include <QCryptographicHash>
+#include <QDebug>
+#include <fcntl.h>
+#include <unistd.h>
+
+/* Content-defined chunk indexes for delta downloads
+ *
+ * Maintained by Raspberry Pi
+ *
+ * See LICENSE.txt for license details
+ *
+ */
+
+/* Header: magic, version, 3 chunk sizes, image size and chunk count */
+#define CHUNKINDEX_HEADER_SIZE  (8 + 4 + 12 + 8 + 4)
+#define CHUNKINDEX_ENTRY_SIZE   (4 + 20)
+
+static inline quint32 le32(const char *p)
+{
+    const uchar *u = (const uchar *) p;
+    return u[0] | (u[1] << 8) | (u[2] << 16) | (quint32(u[3]) << 24);
+}
+
+static inline quint64 le64(const char *p)
+{
+    return le32(p) | (quint64(le32(p+4)) << 32);
+}
+
+static inline quint32 rol32(quint32 v, int n)
+{
+    return (v << n) | (v >> ((32 - n) & 31));
+}
+
+static quint32 buzhashTable[256];
+
+static void initBuzhashTable()
+{
+    quint32 s = 0x2545F491;
+
+    for (int i = 0; i < 256; i++)
+    {
+        s ^= s << 13;
+        s ^= s >> 17;
+        s ^= s << 5;
+        buzhashTable[i] = s;
+    }
+}
+
+Chunker::Chunker(quint32 minSize, quint32 avgSize, quint32 maxSize)
+    : _minSize(minSize), _avgSize(avgSize), _maxSize(maxSize), _hash(0), _length(0), _windowPos(0)
+{
+    if (!buzhashTable[0])
+        initBuzhashTable();
+
+    /* Hash of a window of zero bytes */
+    for (int i = 0; i < CHUNKER_WINDOW_SIZE; i++)
+    {
+        _window[i] = 0;
+        _hash ^= rol32(buzhashTable[0], i % 32);
+    }
+}
+
+int Chunker::findBoundary(const char *data, int len)
+{
+    const uchar *u = (const uchar *) data;
+
+    for (int i = 0; i < len; i++)
+    {
+        uchar out = _window[_windowPos];
+        _window[_windowPos] = u[i];
+        if (++_windowPos == CHUNKER_WINDOW_SIZE)
+            _windowPos = 0;
+
+        _hash = rol32(_hash, 1) ^ rol32(buzhashTable[out], CHUNKER_WINDOW_SIZE % 32) ^ buzhashTable[u[i]];
+        _length++;
+
+        if ((_length >= _minSize && _hash % _avgSize == _avgSize - 1) || _length >= _maxSize)
+        {
+            _length = 0;
+            return i+1;
+        }
+    }
+
+    return -1;
+}
+
+ChunkIndex::ChunkIndex()
+    : _minSize(0), _avgSize(0), _maxSize(0), _size(0)
+{
+}
+
+bool ChunkIndex::load(const QString &url, const QString &store)
+{
+    QByteArray data;
+
+    if (url.startsWith("http"))
+    {
+        HttpConnection conn;
+        if (!conn.download(url, data))
+        {
+            _error = "Error downloading chunk index "+url+": "+conn.errorString();
+            return false;
+        }
+    }
+    else
+    {
+        QFile f(url);
+        if (!f.open(QIODevice::ReadOnly))
+        {
+            _error = "Error opening chunk index "+url+": "+f.errorString();
+            return false;
+        }
+        data = f.readAll();
+    }
+
+    _store = store.isEmpty() ? url.left(url.lastIndexOf('/')+1)+"chunks" : store;
+    if (_store.endsWith('/'))
+        _store.chop(1);
+
+    if (!parse(data))
+    {
+        _error = "Invalid chunk index "+url+": "+_error;
+        return false;
+    }
+
+    return true;
+}
+
+bool ChunkIndex::parse(const QByteArray &data)
+{
+    const char *p = data.constData();
+
+    if (data.size() < CHUNKINDEX_HEADER_SIZE || !data.startsWith(CHUNKINDEX_MAGIC))
+    {
+        _error = "not a chunk index";
+        return false;
+    }
+    if (le32(p+8) != CHUNKINDEX_VERSION)
+    {
+        _error = "unsupported version "+QString::number(le32(p+8));
+        return false;
+    }
+
+    _minSize = le32(p+12);
+    _avgSize = le32(p+16);
+    _maxSize = le32(p+20);
+    _size    = le64(p+24);
+    quint32 count = le32(p+32);
+
+    if (_minSize < CHUNKER_WINDOW_SIZE || _avgSize == 0 || _minSize > _maxSize
+            || count > quint32((data.size() - CHUNKINDEX_HEADER_SIZE) / CHUNKINDEX_ENTRY_SIZE))
+    {
+        _error = "bad header";
+        return false;
+    }
+
+    _chunks.resize(count);
+    p += CHUNKINDEX_HEADER_SIZE;
+    qint64 offset = 0;
+
+    for (quint32 i = 0; i < count; i++, p += CHUNKINDEX_ENTRY_SIZE)
+    {
+        Chunk &c = _chunks[i];
+        c.offset = offset;
+        c.length = le32(p);
+        c.hash   = QByteArray(p+4, 20).toHex();
+
+        if (c.length == 0 || quint32(c.length) > _maxSize)
+        {
+            _error = "bad chunk length";
+            return false;
+        }
+        offset += c.length;
+    }
+
+    if (offset != _size)
+    {
+        _error = "chunks do not add up to the image size";
+        return false;
+    }
+
+    return true;
+}
+
+QString ChunkIndex::errorString() const
+{
+    return _error;
+}
+
+qint64 ChunkIndex::size() const
+{
+    return _size;
+}
+
+int ChunkIndex::chunkCount() const
+{
+    return _chunks.size();
+}
+
+const ChunkIndex::Chunk &ChunkIndex::chunk(int i) const
+{
+    return _chunks.at(i);
+}
+
+QString ChunkIndex::chunkUrl(int i) const
+{
+    const QByteArray &hash = _chunks.at(i).hash;
+    return _store+"/"+hash.left(4)+"/"+hash+".zst";
+}
+
+quint32 ChunkIndex::minSize() const
+{
+    return _minSize;
+}
+
+quint32 ChunkIndex::avgSize() const
+{
+    return _avgSize;
+}
+
+quint32 ChunkIndex::maxSize() const
+{
+    return _maxSize;
+}
+
+ChunkSeeder::ChunkSeeder(ChunkCache *cache)
+    : _cache(cache)
+{
+}
+
+/* Chunks that are cached already are pinned, so storing the ones found does not evict them */
+ChunkSeeder::~ChunkSeeder()
+{
+    foreach (const QByteArray &hash, _pinned)
+        _cache->unpin(hash);
+}
+
+void ChunkSeeder::want(const ChunkIndex &index)
+{
+    for (int i = 0; i < index.chunkCount(); i++)
+    {
+        const ChunkIndex::Chunk &c = index.chunk(i);
+
+        if (_wanted.contains(c.hash) || _pinned.contains(c.hash))
+            continue;
+
+        if (_cache->contains(c.hash))
+        {
+            _cache->pin(c.hash);
+            _pinned.insert(c.hash);
+        }
+        else
+        {
+            _wanted.insert(c.hash);
+            _wantedLengths[c.length]++;
+        }
+    }
+}
+
+int ChunkSeeder::wantedCount() const
+{
+    return _wanted.size();
+}
+
+qint64 ChunkSeeder::scan(const QString &device, qint64 offset, qint64 length, const ChunkIndex &index)
+{
+    int fd = ::open(QFile::encodeName(device).constData(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return 0;
+    ::posix_fadvise(fd, offset, length, POSIX_FADV_SEQUENTIAL);
+
+    Chunker chunker(index.minSize(), index.avgSize(), index.maxSize());
+    QByteArray buf(SEED_READ_SIZE, 0), chunk(index.maxSize(), 0);
+    qint64 pos = offset, end = offset+length, found = 0;
+    int chunkLength = 0;
+
+    while (pos < end && !_wanted.isEmpty())
+    {
+        ssize_t n = ::pread(fd, buf.data(), qMin(qint64(buf.size()), end-pos), pos);
+        if (n <= 0)
+            break;
+        pos += n;
+
+        const char *data = buf.constData();
+        while (n)
+        {
+            int boundary = chunker.findBoundary(data, n);
+            int len = (boundary == -1) ? n : boundary;
+
+            memcpy(chunk.data()+chunkLength, data, len);
+            chunkLength += len;
+            data += len;
+            n    -= len;
+
+            if (boundary == -1)
+                continue;
+
+            if (_wantedLengths.contains(chunkLength))
+            {
+                QByteArray c = QByteArray::fromRawData(chunk.constData(), chunkLength);
+                QByteArray hash = QCryptographicHash::hash(c, QCryptographicHash::Sha1).toHex();
+
+                if (_wanted.contains(hash) && !_cache->store(c).isEmpty())
+                {
+                    _cache->pin(hash);
+                    _pinned.insert(hash);
+                    _wanted.remove(hash);
+                    if (--_wantedLengths[chunkLength] == 0)
+                        _wantedLengths.remove(chunkLength);
+                    found += chunkLength;
+                }
+            }
+            chunkLength = 0;
+        }
+    }
+
+    ::close(fd);
+    return found;
+}
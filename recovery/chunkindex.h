@@ -0,0 +1,137 @@
+#ifndef CHUNKINDEX_H
+#define CHUNKINDEX_H
+
+/* Content-defined chunk indexes for delta downloads
+ *
+ * Like casync, the uncompressed image (the tar stream, or the raw
+ * partition image) is split into chunks at positions chosen by a
+ * rolling hash of the last 48 bytes, so a change in the image only
+ * changes the chunks around it. A new release of an OS shares most of
+ * its chunks with the previous one, and only the chunks that cannot
+ * be found locally, in the download cache or on the partitions of the
+ * installed release, need to be downloaded.
+ *
+ * The index is published next to the image, and referred to by the
+ * "chunk_index" key of the partition in partitions.json. All numbers
+ * are little endian:
+ *
+ *   8 bytes   magic "NOOBSCIX"
+ *   uint32    version, 1
+ *   uint32    minimum, average and maximum chunk size
+ *   uint64    size of the uncompressed image
+ *   uint32    number of chunks
+ *   per chunk: uint32 length, followed by the 20 byte SHA-1 of the chunk
+ *
+ * Every chunk is stored as a single zstd frame in the chunk store, as
+ * <store>/<first 4 hex digits of the SHA-1>/<hex SHA-1>.zst. The store
+ * is given by the "chunk_store" key, or is the directory "chunks" next
+ * to the index. Several releases can share one store.
+ *
+ * Chunk boundaries are found with a buzhash over a 48 byte window:
+ *
+ *   h = rol(h, 1) ^ rol(T[byte leaving the window], 16) ^ T[byte entering]
+ *
+ * with 32 bit h, where T[i] is the (i+1)th output of the xorshift32
+ * generator with shifts 13, 17, 5, seeded with 0x2545F491. The window
+ * starts out filled with zero bytes. A chunk ends after a byte
+ * at which h % average == average - 1, provided it is at least the
+ * minimum size, or when it reaches the maximum size.
+ *
+ * Maintained by Raspberry Pi
+ *
+ * See LICENSE.txt for license details
+ *
+ */
+
+#include <QString>
+#include <QByteArray>
+#include <QVector>
+#include <QHash>
+#include <QSet>
+
+#define CHUNKINDEX_MAGIC        "NOOBSCIX"
+#define CHUNKINDEX_VERSION      1
+#define CHUNKER_WINDOW_SIZE     48
+/* Size of the blocks the partitions are read in when looking for chunks */
+#define SEED_READ_SIZE          (1024 * 1024)
+/* Old partitions are searched up to this multiple of the image size. A file system
+ * that was filled in one go has most of its file data at the start */
+#define SEED_SCAN_FACTOR        2
+
+class ChunkCache;
+
+class Chunker
+{
+public:
+    Chunker(quint32 minSize, quint32 avgSize, quint32 maxSize);
+
+    /* Returns the number of bytes of data that complete the current chunk,
+     * or -1 if all of data belongs to it and the chunk continues */
+    int findBoundary(const char *data, int len);
+
+protected:
+    quint32 _minSize, _avgSize, _maxSize;
+    quint32 _hash, _length;
+    uchar _window[CHUNKER_WINDOW_SIZE];
+    int _windowPos;
+};
+
+class ChunkIndex
+{
+public:
+    struct Chunk
+    {
+        qint64 offset;
+        int length;
+        /* Hex SHA-1, as used by ChunkCache */
+        QByteArray hash;
+    };
+
+    ChunkIndex();
+
+    /* Download (or read) and parse the index. store may be empty for the default location */
+    bool load(const QString &url, const QString &store = QString());
+    bool parse(const QByteArray &data);
+    QString errorString() const;
+
+    qint64 size() const;
+    int chunkCount() const;
+    const Chunk &chunk(int i) const;
+    QString chunkUrl(int i) const;
+    quint32 minSize() const;
+    quint32 avgSize() const;
+    quint32 maxSize() const;
+
+protected:
+    QString _store, _error;
+    quint32 _minSize, _avgSize, _maxSize;
+    qint64 _size;
+    QVector<Chunk> _chunks;
+};
+
+/* Copies the chunks of indexes that are not in the cache yet from
+ * existing data, in particular the partitions an OS is reinstalled over.
+ * The chunks of the indexes are kept pinned in the cache as long as the
+ * seeder exists */
+class ChunkSeeder
+{
+public:
+    explicit ChunkSeeder(ChunkCache *cache);
+    ~ChunkSeeder();
+
+    /* Look for the chunks of index that are missing from the cache */
+    void want(const ChunkIndex &index);
+    int wantedCount() const;
+
+    /* Chunk length bytes of device from offset on like index does, and store the wanted chunks found.
+     * Returns the number of bytes stored */
+    qint64 scan(const QString &device, qint64 offset, qint64 length, const ChunkIndex &index);
+
+protected:
+    ChunkCache *_cache;
+    QSet<QByteArray> _wanted, _pinned;
+    /* Only chunks of a length that is wanted are hashed */
+    QHash<int,int> _wantedLengths;
+};
+
+#endif // CHUNKINDEX_H
@@ -10,10 +10,10 @@
 #include "confeditdialog.h"
 #include "ui_confeditdialog.h"
 #include "config.h"
+#include "mountmanager.h"
 #include <QDir>
 #include <QFile>
 #include <QtGui/QPlainTextEdit>
-#include <QProcess>
 #include <QMessageBox>
 #include <unistd.h>
 
@@ -76,7 +76,7 @@ ConfEditDialog::ConfEditDialog(const QString &partition, QWidget *parent) :
     ui->setupUi(this);
     ui->tabWidget->clear();
 
-    if (QProcess::execute("mount -t vfat "+partition+" /boot") != 0)
+    if (!MountManager::mount(partition, "/boot", "vfat"))
     {
         QMessageBox::critical(this,
                               tr("Error"),
@@ -92,7 +92,7 @@ ConfEditDialog::ConfEditDialog(const QString &partition, QWidget *parent) :
 ConfEditDialog::~ConfEditDialog()
 {
     delete ui;
-    QProcess::execute("umount /boot");
+    MountManager::umount("/boot");
 }
 
 void ConfEditDialog::accept()
@@ -0,0 +1,1127 @@
+#include "decompressor.h"
+#include "parallelxzdecompressor.h"
+#include "parallelzstddecompressor.h"
+#include <QDebug>
+#include <lzma.h>
+#include <zlib.h>
+#include <bzlib.h>
+#include <lzo/lzo1x.h>
+#include <lz4.h>
+#include <zstd.h>
+#include <string.h>
+
+/* Streaming decompressor for OS images
+ *
+ * Maintained by Raspberry Pi
+ *
+ * See LICENSE.txt for license details
+ *
+ */
+
+static inline quint16 le16(const char *p)
+{
+    const uchar *u = (const uchar *) p;
+    return u[0] | (u[1] << 8);
+}
+
+static inline quint32 le32(const char *p)
+{
+    const uchar *u = (const uchar *) p;
+    return u[0] | (u[1] << 8) | (u[2] << 16) | (quint32(u[3]) << 24);
+}
+
+static inline quint64 le64(const char *p)
+{
+    return le32(p) | (quint64(le32(p+4)) << 32);
+}
+
+static inline quint32 be32(const char *p)
+{
+    const uchar *u = (const uchar *) p;
+    return (quint32(u[0]) << 24) | (u[1] << 16) | (u[2] << 8) | u[3];
+}
+
+static inline quint16 be16(const char *p)
+{
+    const uchar *u = (const uchar *) p;
+    return (u[0] << 8) | u[1];
+}
+
+qint64 readFromDevice(QIODevice *dev, char *data, qint64 maxlen)
+{
+    forever
+    {
+        qint64 n = dev->read(data, maxlen);
+
+        if (n != 0 || !dev->isSequential())
+            return n;
+
+        if (!dev->waitForReadyRead(-1))
+        {
+            /* Also returns false if the last data arrived together with end of stream */
+            return dev->read(data, maxlen);
+        }
+    }
+}
+
+bool readFullyFromDevice(QIODevice *dev, char *data, qint64 len)
+{
+    while (len)
+    {
+        qint64 n = readFromDevice(dev, data, len);
+        if (n <= 0)
+            return false;
+        data += n;
+        len  -= n;
+    }
+
+    return true;
+}
+
+Decompressor::Decompressor(QIODevice *source, QObject *parent)
+    : QIODevice(parent), _source(source), _inbuf(DECOMPRESSOR_INPUT_BUFFER_SIZE, 0),
+      _inptr(NULL), _inavail(0), _inputEnd(false), _streamEnd(false), _failed(false),
+      _bytesIn(0), _bytesOut(0)
+{
+    open(QIODevice::ReadOnly | QIODevice::Unbuffered);
+}
+
+Decompressor::~Decompressor()
+{
+}
+
+bool Decompressor::isSequential() const
+{
+    return true;
+}
+
+bool Decompressor::waitForReadyRead(int)
+{
+    /* read() blocks until data is available, so nothing to wait for
+     * if it returned nothing */
+    return false;
+}
+
+qint64 Decompressor::compressedBytesRead() const
+{
+    return _bytesIn;
+}
+
+qint64 Decompressor::uncompressedBytesRead() const
+{
+    return _bytesOut;
+}
+
+qint64 Decompressor::readData(char *data, qint64 maxlen)
+{
+    if (_failed)
+        return -1;
+    if (_streamEnd || maxlen <= 0)
+        return 0;
+
+    qint64 n = decompress(data, maxlen);
+    if (n > 0)
+        _bytesOut += n;
+    else if (n == 0)
+        _streamEnd = true;
+    else
+        _failed = true;
+
+    return n;
+}
+
+qint64 Decompressor::writeData(const char *, qint64)
+{
+    return -1;
+}
+
+bool Decompressor::fillInput()
+{
+    if (_inavail || _inputEnd)
+        return true;
+
+    qint64 n = readFromDevice(_source, _inbuf.data(), _inbuf.size());
+    if (n < 0)
+    {
+        fail("Error reading compressed data: "+_source->errorString());
+        return false;
+    }
+    if (n == 0)
+    {
+        _inputEnd = true;
+    }
+
+    _inptr    = _inbuf.constData();
+    _inavail  = n;
+    _bytesIn += n;
+
+    return true;
+}
+
+void Decompressor::consumeInput(qint64 len)
+{
+    _inptr   += len;
+    _inavail -= len;
+}
+
+bool Decompressor::readInput(char *dest, qint64 len)
+{
+    while (len)
+    {
+        if (!fillInput())
+            return false;
+        if (!_inavail)
+        {
+            fail("Unexpected end of compressed data");
+            return false;
+        }
+
+        qint64 n = qMin(len, _inavail);
+        memcpy(dest, _inptr, n);
+        consumeInput(n);
+        dest += n;
+        len  -= n;
+    }
+
+    return true;
+}
+
+qint64 Decompressor::fail(const QString &msg)
+{
+    qDebug() << msg;
+    setErrorString(msg);
+    _failed = true;
+    return -1;
+}
+
+/*
+ * .xz
+ */
+class XzDecompressor : public Decompressor
+{
+public:
+    XzDecompressor(QIODevice *source, QObject *parent)
+        : Decompressor(source, parent)
+    {
+        lzma_stream init = LZMA_STREAM_INIT;
+        _strm = init;
+        if (lzma_stream_decoder(&_strm, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK)
+            fail("Error initializing xz decoder");
+    }
+
+    virtual ~XzDecompressor()
+    {
+        lzma_end(&_strm);
+    }
+
+protected:
+    lzma_stream _strm;
+
+    virtual qint64 decompress(char *buf, qint64 maxlen)
+    {
+        _strm.next_out  = (uint8_t *) buf;
+        _strm.avail_out = maxlen;
+
+        while (_strm.avail_out == (size_t) maxlen)
+        {
+            if (!fillInput())
+                return -1;
+
+            _strm.next_in  = (const uint8_t *) _inptr;
+            _strm.avail_in = _inavail;
+            lzma_ret ret = lzma_code(&_strm, _inputEnd ? LZMA_FINISH : LZMA_RUN);
+            consumeInput(_inavail - _strm.avail_in);
+
+            if (ret == LZMA_STREAM_END)
+                break;
+            if (ret == LZMA_BUF_ERROR && _inputEnd)
+                return fail("Unexpected end of xz compressed data");
+            if (ret != LZMA_OK)
+                return fail("Error decompressing xz data (code "+QString::number(ret)+")");
+        }
+
+        return maxlen - _strm.avail_out;
+    }
+};
+
+/*
+ * .gz (concatenated gzip members are supported, like gzip -dc does)
+ */
+class GzDecompressor : public Decompressor
+{
+public:
+    GzDecompressor(QIODevice *source, QObject *parent, bool rawDeflate = false)
+        : Decompressor(source, parent), _memberEnd(false)
+    {
+        memset(&_strm, 0, sizeof(_strm));
+        /* 15+32: auto detect gzip or zlib header. -15: raw deflate (zip) */
+        if (inflateInit2(&_strm, rawDeflate ? -15 : 15+32) != Z_OK)
+            fail("Error initializing zlib");
+    }
+
+    virtual ~GzDecompressor()
+    {
+        inflateEnd(&_strm);
+    }
+
+protected:
+    z_stream _strm;
+    bool _memberEnd;
+
+    /* Returns true if another gzip member follows the one that just ended */
+    virtual bool nextMember()
+    {
+        if (!fillInput())
+            return false;
+        if (!_inavail || (uchar) *_inptr != 0x1f)
+        {
+            if (_inavail)
+                qDebug() << "Ignoring trailing garbage after gzip data";
+            return false;
+        }
+
+        inflateReset(&_strm);
+        _memberEnd = false;
+        return true;
+    }
+
+    virtual qint64 decompress(char *buf, qint64 maxlen)
+    {
+        _strm.next_out  = (Bytef *) buf;
+        _strm.avail_out = maxlen;
+
+        while (_strm.avail_out == (uInt) maxlen)
+        {
+            if (_memberEnd && (_failed || !nextMember()))
+                break;
+            if (!fillInput())
+                return -1;
+            if (!_inavail)
+                return fail("Unexpected end of deflate compressed data");
+
+            _strm.next_in  = (Bytef *) _inptr;
+            _strm.avail_in = _inavail;
+            int ret = inflate(&_strm, Z_NO_FLUSH);
+            consumeInput(_inavail - _strm.avail_in);
+
+            if (ret == Z_STREAM_END)
+                _memberEnd = true;
+            else if (ret != Z_OK)
+                return fail("Error decompressing deflate data: "+QString(_strm.msg ? _strm.msg : ""));
+        }
+
+        if (_failed)
+            return -1;
+
+        return maxlen - _strm.avail_out;
+    }
+};
+
+/*
+ * .bz2
+ */
+class Bz2Decompressor : public Decompressor
+{
+public:
+    Bz2Decompressor(QIODevice *source, QObject *parent)
+        : Decompressor(source, parent), _memberEnd(false)
+    {
+        memset(&_strm, 0, sizeof(_strm));
+        if (BZ2_bzDecompressInit(&_strm, 0, 0) != BZ_OK)
+            fail("Error initializing bzip2 decoder");
+    }
+
+    virtual ~Bz2Decompressor()
+    {
+        BZ2_bzDecompressEnd(&_strm);
+    }
+
+protected:
+    bz_stream _strm;
+    bool _memberEnd;
+
+    bool nextMember()
+    {
+        if (!fillInput())
+            return false;
+        if (!_inavail || *_inptr != 'B')
+            return false;
+
+        BZ2_bzDecompressEnd(&_strm);
+        memset(&_strm, 0, sizeof(_strm));
+        BZ2_bzDecompressInit(&_strm, 0, 0);
+        _memberEnd = false;
+        return true;
+    }
+
+    virtual qint64 decompress(char *buf, qint64 maxlen)
+    {
+        _strm.next_out  = buf;
+        _strm.avail_out = maxlen;
+
+        while (_strm.avail_out == (unsigned int) maxlen)
+        {
+            if (_memberEnd && (_failed || !nextMember()))
+                break;
+            if (!fillInput())
+                return -1;
+            if (!_inavail)
+                return fail("Unexpected end of bzip2 compressed data");
+
+            _strm.next_in  = (char *) _inptr;
+            _strm.avail_in = _inavail;
+            int ret = BZ2_bzDecompress(&_strm);
+            consumeInput(_inavail - _strm.avail_in);
+
+            if (ret == BZ_STREAM_END)
+                _memberEnd = true;
+            else if (ret != BZ_OK)
+                return fail("Error decompressing bzip2 data (code "+QString::number(ret)+")");
+        }
+
+        if (_failed)
+            return -1;
+
+        return maxlen - _strm.avail_out;
+    }
+};
+
+/*
+ * .lzo (lzop file format)
+ */
+#define LZOP_F_ADLER32_D     0x00000001
+#define LZOP_F_ADLER32_C     0x00000002
+#define LZOP_F_H_EXTRA_FIELD 0x00000040
+#define LZOP_F_CRC32_D       0x00000100
+#define LZOP_F_CRC32_C       0x00000200
+#define LZOP_F_H_FILTER      0x00000800
+#define LZOP_F_H_CRC32       0x00001000
+#define LZOP_MAX_BLOCK_SIZE  (64 * 1024 * 1024)
+
+class LzoDecompressor : public Decompressor
+{
+public:
+    LzoDecompressor(QIODevice *source, QObject *parent)
+        : Decompressor(source, parent), _headerRead(false), _flags(0), _blockPos(0), _blockLen(0)
+    {
+        if (lzo_init() != LZO_E_OK)
+            fail("Error initializing lzo library");
+    }
+
+protected:
+    bool _headerRead;
+    quint32 _flags;
+    QByteArray _block, _cblock;
+    int _blockPos, _blockLen;
+
+    /* Read len bytes of header, adding them to the header checksum data */
+    bool readHeader(char *dest, int len, QByteArray &hdr)
+    {
+        if (!readInput(dest, len))
+            return false;
+        hdr.append(dest, len);
+        return true;
+    }
+
+    bool readFileHeader()
+    {
+        static const char magic[9] = { '\x89', 'L', 'Z', 'O', '\0', '\r', '\n', '\x1a', '\n' };
+        char buf[256];
+        QByteArray hdr;
+
+        if (!readInput(buf, sizeof(magic)))
+            return false;
+        if (memcmp(buf, magic, sizeof(magic)) != 0)
+        {
+            fail("Not a lzop file");
+            return false;
+        }
+
+        if (!readHeader(buf, 4, hdr))
+            return false;
+        quint16 version = be16(buf);
+        if (version >= 0x0940 && !readHeader(buf, 2, hdr)) /* version needed to extract */
+            return false;
+        if (!readHeader(buf, 1, hdr)) /* method */
+            return false;
+        if (version >= 0x0940 && !readHeader(buf, 1, hdr)) /* level */
+            return false;
+        if (!readHeader(buf, 4, hdr))
+            return false;
+        _flags = be32(buf);
+        if ((_flags & LZOP_F_H_FILTER) && !readHeader(buf, 4, hdr))
+            return false;
+        /* mode, mtime */
+        if (!readHeader(buf, version >= 0x0940 ? 12 : 8, hdr))
+            return false;
+        if (!readHeader(buf, 1, hdr))
+            return false;
+        int namelen = (uchar) buf[0];
+        if (namelen && !readHeader(buf, namelen, hdr))
+            return false;
+
+        if (!readInput(buf, 4))
+            return false;
+        quint32 expected = be32(buf);
+        quint32 actual;
+        if (_flags & LZOP_F_H_CRC32)
+            actual = lzo_crc32(0, (const lzo_bytep) hdr.constData(), hdr.size());
+        else
+            actual = lzo_adler32(1, (const lzo_bytep) hdr.constData(), hdr.size());
+        if (actual != expected)
+        {
+            fail("lzop header checksum error");
+            return false;
+        }
+
+        if (_flags & LZOP_F_H_EXTRA_FIELD)
+        {
+            if (!readInput(buf, 4))
+                return false;
+            qint64 extralen = be32(buf) + 4; /* extra field + checksum */
+            while (extralen)
+            {
+                int n = qMin(extralen, (qint64) sizeof(buf));
+                if (!readInput(buf, n))
+                    return false;
+                extralen -= n;
+            }
+        }
+
+        return true;
+    }
+
+    /* Returns 1 if a block was read, 0 at end of stream, -1 on error */
+    int readBlock()
+    {
+        char buf[8];
+
+        if (!readInput(buf, 4))
+            return -1;
+        quint32 dstlen = be32(buf);
+        if (dstlen == 0)
+            return 0;
+        if (!readInput(buf, 4))
+            return -1;
+        quint32 srclen = be32(buf);
+
+        if (dstlen > LZOP_MAX_BLOCK_SIZE || srclen > dstlen)
+        {
+            fail("Invalid lzop block size");
+            return -1;
+        }
+
+        quint32 dstAdler = 0, dstCrc = 0;
+        if ((_flags & LZOP_F_ADLER32_D))
+        {
+            if (!readInput(buf, 4))
+                return -1;
+            dstAdler = be32(buf);
+        }
+        if ((_flags & LZOP_F_CRC32_D))
+        {
+            if (!readInput(buf, 4))
+                return -1;
+            dstCrc = be32(buf);
+        }
+        if (srclen < dstlen)
+        {
+            /* Checksums of compressed data are only stored for compressed blocks */
+            int n = ((_flags & LZOP_F_ADLER32_C) ? 4 : 0) + ((_flags & LZOP_F_CRC32_C) ? 4 : 0);
+            if (n && !readInput(buf, n))
+                return -1;
+        }
+
+        if (_block.size() < (int) dstlen)
+            _block.resize(dstlen);
+
+        if (srclen == dstlen)
+        {
+            /* Stored uncompressed */
+            if (!readInput(_block.data(), dstlen))
+                return -1;
+        }
+        else
+        {
+            if (_cblock.size() < (int) srclen)
+                _cblock.resize(srclen);
+            if (!readInput(_cblock.data(), srclen))
+                return -1;
+
+            lzo_uint outlen = dstlen;
+            int ret = lzo1x_decompress_safe((const lzo_bytep) _cblock.constData(), srclen,
+                                            (lzo_bytep) _block.data(), &outlen, NULL);
+            if (ret != LZO_E_OK || outlen != dstlen)
+            {
+                fail("Error decompressing lzo data (code "+QString::number(ret)+")");
+                return -1;
+            }
+        }
+
+        if ((_flags & LZOP_F_ADLER32_D) && lzo_adler32(1, (const lzo_bytep) _block.constData(), dstlen) != dstAdler)
+        {
+            fail("lzo data checksum error");
+            return -1;
+        }
+        if ((_flags & LZOP_F_CRC32_D) && lzo_crc32(0, (const lzo_bytep) _block.constData(), dstlen) != dstCrc)
+        {
+            fail("lzo data checksum error");
+            return -1;
+        }
+
+        _blockPos = 0;
+        _blockLen = dstlen;
+        return 1;
+    }
+
+    virtual qint64 decompress(char *buf, qint64 maxlen)
+    {
+        if (!_headerRead)
+        {
+            if (!readFileHeader())
+                return -1;
+            _headerRead = true;
+        }
+
+        if (_blockPos == _blockLen)
+        {
+            int ret = readBlock();
+            if (ret <= 0)
+                return ret;
+        }
+
+        qint64 n = qMin(maxlen, (qint64) (_blockLen - _blockPos));
+        memcpy(buf, _block.constData() + _blockPos, n);
+        _blockPos += n;
+
+        return n;
+    }
+};
+
+/*
+ * .zip (first member only, stored or deflated)
+ */
+#define ZIP_LOCAL_HEADER_SIGNATURE  0x04034b50
+#define ZIP_FLAG_DATA_DESCRIPTOR    0x0008
+#define ZIP_METHOD_STORED           0
+#define ZIP_METHOD_DEFLATED         8
+
+class ZipDecompressor : public GzDecompressor
+{
+public:
+    ZipDecompressor(QIODevice *source, QObject *parent)
+        : GzDecompressor(source, parent, true), _headerRead(false), _method(0), _storedLeft(0)
+    {
+    }
+
+protected:
+    bool _headerRead;
+    int _method;
+    qint64 _storedLeft;
+
+    bool readLocalHeader()
+    {
+        char hdr[30];
+
+        if (!readInput(hdr, sizeof(hdr)))
+            return false;
+        if (le32(hdr) != ZIP_LOCAL_HEADER_SIGNATURE)
+        {
+            fail("Not a zip file");
+            return false;
+        }
+
+        quint16 flags = le16(hdr+6);
+        _method = le16(hdr+8);
+        qint64 csize = le32(hdr+18);
+        int namelen = le16(hdr+26);
+        int extralen = le16(hdr+28);
+
+        QByteArray extra(namelen+extralen, 0);
+        if (!readInput(extra.data(), extra.size()))
+            return false;
+
+        /* Zip64 extended information extra field */
+        for (int pos = namelen; pos+4 <= extra.size(); )
+        {
+            int id = le16(extra.constData()+pos), len = le16(extra.constData()+pos+2);
+            if (id == 0x0001 && len >= 16 && pos+4+len <= extra.size())
+                csize = le64(extra.constData()+pos+12);
+            pos += 4+len;
+        }
+
+        if (_method == ZIP_METHOD_STORED)
+        {
+            if (flags & ZIP_FLAG_DATA_DESCRIPTOR)
+            {
+                fail("Streaming stored zip members is not supported");
+                return false;
+            }
+            _storedLeft = csize;
+        }
+        else if (_method != ZIP_METHOD_DEFLATED)
+        {
+            fail("Unsupported zip compression method "+QString::number(_method));
+            return false;
+        }
+
+        return true;
+    }
+
+    /* Only the first member is extracted */
+    virtual bool nextMember()
+    {
+        return false;
+    }
+
+    virtual qint64 decompress(char *buf, qint64 maxlen)
+    {
+        if (!_headerRead)
+        {
+            if (!readLocalHeader())
+                return -1;
+            _headerRead = true;
+        }
+
+        if (_method == ZIP_METHOD_DEFLATED)
+            return GzDecompressor::decompress(buf, maxlen);
+
+        qint64 n = qMin(maxlen, _storedLeft);
+        if (n && !readInput(buf, n))
+            return -1;
+        _storedLeft -= n;
+
+        return n;
+    }
+};
+
+/*
+ * .zst (concatenated and skippable frames are supported, like zstd -dc does)
+ */
+class ZstdDecompressor : public Decompressor
+{
+public:
+    ZstdDecompressor(QIODevice *source, QObject *parent)
+        : Decompressor(source, parent), _frameEnd(true)
+    {
+        _strm = ZSTD_createDStream();
+        if (!_strm || ZSTD_isError(ZSTD_initDStream(_strm)))
+            fail("Error initializing zstd decoder");
+    }
+
+    virtual ~ZstdDecompressor()
+    {
+        ZSTD_freeDStream(_strm);
+    }
+
+protected:
+    ZSTD_DStream *_strm;
+    bool _frameEnd;
+
+    virtual qint64 decompress(char *buf, qint64 maxlen)
+    {
+        ZSTD_outBuffer out = { buf, (size_t) maxlen, 0 };
+
+        while (!out.pos)
+        {
+            if (!fillInput())
+                return -1;
+            if (!_inavail)
+            {
+                if (!_frameEnd)
+                    return fail("Unexpected end of zstd compressed data");
+                break;
+            }
+
+            ZSTD_inBuffer in = { _inptr, (size_t) _inavail, 0 };
+            size_t ret = ZSTD_decompressStream(_strm, &out, &in);
+            consumeInput(in.pos);
+
+            if (ZSTD_isError(ret))
+                return fail("Error decompressing zstd data: "+QString(ZSTD_getErrorName(ret)));
+            /* 0 means a frame has been decoded and flushed completely, the next call starts a new one */
+            _frameEnd = (ret == 0);
+        }
+
+        return out.pos;
+    }
+};
+
+/* xxHash32, used for the checksums of the lz4 frame format */
+#define XXH_PRIME1  2654435761U
+#define XXH_PRIME2  2246822519U
+#define XXH_PRIME3  3266489917U
+#define XXH_PRIME4  668265263U
+#define XXH_PRIME5  374761393U
+
+class Xxh32
+{
+public:
+    Xxh32()
+    {
+        reset();
+    }
+
+    void reset()
+    {
+        _v[0] = XXH_PRIME1 + XXH_PRIME2;
+        _v[1] = XXH_PRIME2;
+        _v[2] = 0;
+        _v[3] = -XXH_PRIME1;
+        _total = 0;
+        _buflen = 0;
+    }
+
+    void update(const char *data, qint64 len)
+    {
+        _total += len;
+
+        if (_buflen)
+        {
+            int n = qMin(len, (qint64) (16 - _buflen));
+            memcpy(_buf + _buflen, data, n);
+            _buflen += n;
+            data += n;
+            len  -= n;
+            if (_buflen < 16)
+                return;
+            round(_buf);
+            _buflen = 0;
+        }
+        for (; len >= 16; data += 16, len -= 16)
+            round(data);
+
+        memcpy(_buf, data, len);
+        _buflen = len;
+    }
+
+    quint32 digest() const
+    {
+        quint32 h;
+
+        if (_total >= 16)
+            h = rotl(_v[0], 1) + rotl(_v[1], 7) + rotl(_v[2], 12) + rotl(_v[3], 18);
+        else
+            h = _v[2] + XXH_PRIME5;
+        h += (quint32) _total;
+
+        int i = 0;
+        for (; i+4 <= _buflen; i += 4)
+            h = rotl(h + le32(_buf+i) * XXH_PRIME3, 17) * XXH_PRIME4;
+        for (; i < _buflen; i++)
+            h = rotl(h + (uchar) _buf[i] * XXH_PRIME5, 11) * XXH_PRIME1;
+
+        h ^= h >> 15;
+        h *= XXH_PRIME2;
+        h ^= h >> 13;
+        h *= XXH_PRIME3;
+        h ^= h >> 16;
+        return h;
+    }
+
+    static quint32 hash(const char *data, qint64 len)
+    {
+        Xxh32 x;
+        x.update(data, len);
+        return x.digest();
+    }
+
+protected:
+    quint32 _v[4];
+    qint64 _total;
+    char _buf[16];
+    int _buflen;
+
+    static inline quint32 rotl(quint32 x, int r)
+    {
+        return (x << r) | (x >> (32 - r));
+    }
+
+    void round(const char *p)
+    {
+        for (int i = 0; i < 4; i++)
+            _v[i] = rotl(_v[i] + le32(p + 4*i) * XXH_PRIME2, 13) * XXH_PRIME1;
+    }
+};
+
+/*
+ * .lz4 (frame format and the legacy format of lz4 -l, concatenated and skippable frames)
+ */
+#define LZ4_FRAME_MAGIC         0x184D2204
+#define LZ4_LEGACY_MAGIC        0x184C2102
+#define LZ4_SKIPPABLE_MAGIC     0x184D2A50
+#define LZ4_LEGACY_BLOCK_SIZE   (8 * 1024 * 1024)
+/* Linked blocks may refer back this far into the previous output */
+#define LZ4_WINDOW_SIZE         (64 * 1024)
+#define LZ4_FLG_BLOCK_INDEPENDENT   0x20
+#define LZ4_FLG_BLOCK_CHECKSUM      0x10
+#define LZ4_FLG_CONTENT_SIZE        0x08
+#define LZ4_FLG_CONTENT_CHECKSUM    0x04
+#define LZ4_FLG_DICT_ID             0x01
+
+class Lz4Decompressor : public Decompressor
+{
+public:
+    Lz4Decompressor(QIODevice *source, QObject *parent)
+        : Decompressor(source, parent), _inFrame(false), _legacy(false), _flags(0), _blockMax(0),
+          _pendingMagic(0), _blockStart(0), _blockPos(0), _blockLen(0)
+    {
+    }
+
+protected:
+    bool _inFrame, _legacy;
+    int _flags, _blockMax;
+    quint32 _pendingMagic;
+    /* Decoded data of the current block starts at _blockStart, preceded by the window of linked blocks */
+    QByteArray _block, _cblock;
+    int _blockStart, _blockPos, _blockLen;
+    Xxh32 _contentHash;
+
+    bool skipInput(qint64 len)
+    {
+        char buf[4096];
+
+        while (len)
+        {
+            int n = qMin(len, (qint64) sizeof(buf));
+            if (!readInput(buf, n))
+                return false;
+            len -= n;
+        }
+        return true;
+    }
+
+    /* Returns 1 if a frame starts, 0 at end of stream, -1 on error */
+    int nextFrame()
+    {
+        char buf[16];
+
+        forever
+        {
+            quint32 magic = _pendingMagic;
+            _pendingMagic = 0;
+
+            if (!magic)
+            {
+                if (!fillInput())
+                    return -1;
+                if (!_inavail)
+                    return 0;
+                if (!readInput(buf, 4))
+                    return -1;
+                magic = le32(buf);
+            }
+
+            if ((magic & 0xFFFFFFF0) == LZ4_SKIPPABLE_MAGIC)
+            {
+                if (!readInput(buf, 4) || !skipInput(le32(buf)))
+                    return -1;
+                continue;
+            }
+
+            _blockStart = _blockLen = _blockPos = 0;
+
+            if (magic == LZ4_LEGACY_MAGIC)
+            {
+                _legacy = true;
+                _blockMax = LZ4_LEGACY_BLOCK_SIZE;
+                _flags = LZ4_FLG_BLOCK_INDEPENDENT;
+            }
+            else if (magic == LZ4_FRAME_MAGIC)
+            {
+                /* Frame descriptor: FLG, BD, optional content size and dictionary id, header checksum */
+                if (!readInput(buf, 2))
+                    return -1;
+                _legacy = false;
+                _flags = (uchar) buf[0];
+                int blockSizeId = ((uchar) buf[1] >> 4) & 7;
+                int len = 2 + ((_flags & LZ4_FLG_CONTENT_SIZE) ? 8 : 0) + ((_flags & LZ4_FLG_DICT_ID) ? 4 : 0);
+
+                if ((_flags >> 6) != 1 || blockSizeId < 4)
+                {
+                    fail("Unsupported lz4 frame version");
+                    return -1;
+                }
+                if (_flags & LZ4_FLG_DICT_ID)
+                {
+                    fail("lz4 frames compressed with a dictionary are not supported");
+                    return -1;
+                }
+                if (!readInput(buf+2, len+1-2))
+                    return -1;
+                if ((uchar) buf[len] != ((Xxh32::hash(buf, len) >> 8) & 0xFF))
+                {
+                    fail("lz4 frame header checksum error");
+                    return -1;
+                }
+                _blockMax = 1 << (2*blockSizeId + 8);
+                _contentHash.reset();
+            }
+            else
+            {
+                fail("Not lz4 compressed data");
+                return -1;
+            }
+
+            int needed = LZ4_WINDOW_SIZE + _blockMax;
+            if (_block.size() < needed)
+                _block.resize(needed);
+            if (_cblock.size() < LZ4_compressBound(_blockMax))
+                _cblock.resize(LZ4_compressBound(_blockMax));
+            _inFrame = true;
+            return 1;
+        }
+    }
+
+    /* Returns 1 if a block was read, 0 at end of frame, -1 on error */
+    int readBlock()
+    {
+        char buf[4];
+
+        if (!fillInput())
+            return -1;
+        if (_legacy && !_inavail)
+            return 0;
+        if (!readInput(buf, 4))
+            return -1;
+        quint32 size = le32(buf);
+
+        if (_legacy && (size == LZ4_LEGACY_MAGIC || size == LZ4_FRAME_MAGIC || (size & 0xFFFFFFF0) == LZ4_SKIPPABLE_MAGIC))
+        {
+            /* Legacy streams have no end mark, another stream or frame follows */
+            _pendingMagic = size;
+            return 0;
+        }
+        if (!_legacy && size == 0)
+        {
+            if (_flags & LZ4_FLG_CONTENT_CHECKSUM)
+            {
+                if (!readInput(buf, 4))
+                    return -1;
+                if (le32(buf) != _contentHash.digest())
+                {
+                    fail("lz4 data checksum error");
+                    return -1;
+                }
+            }
+            return 0;
+        }
+
+        bool stored = !_legacy && (size & 0x80000000);
+        size &= 0x7FFFFFFF;
+        if ((qint64) size > (stored ? _blockMax : _cblock.size()))
+        {
+            fail("Invalid lz4 block size");
+            return -1;
+        }
+        if (!readInput(_cblock.data(), size))
+            return -1;
+
+        if (_flags & LZ4_FLG_BLOCK_CHECKSUM)
+        {
+            if (!readInput(buf, 4))
+                return -1;
+            if (le32(buf) != Xxh32::hash(_cblock.constData(), size))
+            {
+                fail("lz4 block checksum error");
+                return -1;
+            }
+        }
+
+        /* Linked blocks: keep the last 64 KB of output in front of the new block */
+        int keep = 0;
+        if (!(_flags & LZ4_FLG_BLOCK_INDEPENDENT))
+        {
+            int end = _blockStart + _blockLen;
+            keep = qMin(end, LZ4_WINDOW_SIZE);
+            memmove(_block.data(), _block.constData() + end - keep, keep);
+        }
+        char *dst = _block.data() + keep;
+
+        int n;
+        if (stored)
+        {
+            memcpy(dst, _cblock.constData(), size);
+            n = size;
+        }
+        else if (keep)
+        {
+            n = LZ4_decompress_safe_usingDict(_cblock.constData(), dst, size, _blockMax, _block.constData(), keep);
+        }
+        else
+        {
+            n = LZ4_decompress_safe(_cblock.constData(), dst, size, _blockMax);
+        }
+        if (n < 0)
+        {
+            fail("Error decompressing lz4 data");
+            return -1;
+        }
+
+        if (_flags & LZ4_FLG_CONTENT_CHECKSUM)
+            _contentHash.update(dst, n);
+
+        _blockStart = keep;
+        _blockPos = 0;
+        _blockLen = n;
+        return 1;
+    }
+
+    virtual qint64 decompress(char *buf, qint64 maxlen)
+    {
+        while (_blockPos == _blockLen)
+        {
+            if (!_inFrame)
+            {
+                int ret = nextFrame();
+                if (ret <= 0)
+                    return ret;
+            }
+
+            int ret = readBlock();
+            if (ret < 0)
+                return -1;
+            if (ret == 0)
+                _inFrame = false;
+        }
+
+        qint64 n = qMin(maxlen, (qint64) (_blockLen - _blockPos));
+        memcpy(buf, _block.constData() + _blockStart + _blockPos, n);
+        _blockPos += n;
+
+        return n;
+    }
+};
+
+bool Decompressor::isSupported(const QString &filename)
+{
+    return filename.endsWith(".xz") || filename.endsWith(".gz") || filename.endsWith(".bz2")
+            || filename.endsWith(".lzo") || filename.endsWith(".zip") || filename.endsWith(".zst")
+            || filename.endsWith(".lz4");
+}
+
+Decompressor *Decompressor::create(const QString &filename, QIODevice *source, QObject *parent, qint64 memoryLimit)
+{
+    if (filename.endsWith(".xz"))
+    {
+        Decompressor *d = ParallelXzDecompressor::create(filename, source, parent, memoryLimit);
+        return d ? d : new XzDecompressor(source, parent);
+    }
+    else if (filename.endsWith(".gz"))
+        return new GzDecompressor(source, parent);
+    else if (filename.endsWith(".bz2"))
+        return new Bz2Decompressor(source, parent);
+    else if (filename.endsWith(".lzo"))
+        return new LzoDecompressor(source, parent);
+    else if (filename.endsWith(".zip"))
+        return new ZipDecompressor(source, parent);
+    else if (filename.endsWith(".zst"))
+    {
+        Decompressor *d = ParallelZstdDecompressor::create(filename, source, parent, memoryLimit);
+        return d ? d : new ZstdDecompressor(source, parent);
+    }
+    else if (filename.endsWith(".lz4"))
+        return new Lz4Decompressor(source, parent);
+    else
+        return NULL;
+}
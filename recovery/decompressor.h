@@ -0,0 +1,78 @@
+#ifndef DECOMPRESSOR_H
+#define DECOMPRESSOR_H
+
+/* Streaming decompressor for OS images
+ *
+ * Read-only sequential QIODevice that pulls compressed data
+ * from another device (local file or a download) and
+ * hands out the uncompressed stream.
+ *
+ * Supported formats: .xz, .gz, .bz2, .lzo, .zip, .zst and .lz4
+ * (.zip files must contain a single member)
+ *
+ * Maintained by Raspberry Pi
+ *
+ * See LICENSE.txt for license details
+ *
+ */
+
+#include <QIODevice>
+#include <QByteArray>
+#include <QString>
+
+/* Size of the buffer compressed data is read into */
+#define DECOMPRESSOR_INPUT_BUFFER_SIZE  (1024 * 1024)
+
+class Decompressor : public QIODevice
+{
+public:
+    /* Returns a decompressor for the format indicated by the file extension
+     * of 'filename', or NULL if the format is not supported.
+     * memoryLimit: bytes the decompressor may use, 0 for the available memory */
+    static Decompressor *create(const QString &filename, QIODevice *source, QObject *parent = 0, qint64 memoryLimit = 0);
+    static bool isSupported(const QString &filename);
+
+    virtual ~Decompressor();
+    virtual bool isSequential() const;
+    virtual bool waitForReadyRead(int msecs);
+
+    /* Number of bytes consumed from the source device */
+    qint64 compressedBytesRead() const;
+    /* Number of uncompressed bytes handed out through read() */
+    qint64 uncompressedBytesRead() const;
+
+protected:
+    Decompressor(QIODevice *source, QObject *parent);
+
+    /* Fill buf with up to maxlen bytes of uncompressed data
+     * Returns the number of bytes produced, 0 at end of stream, or -1 on error */
+    virtual qint64 decompress(char *buf, qint64 maxlen) = 0;
+
+    virtual qint64 readData(char *data, qint64 maxlen);
+    virtual qint64 writeData(const char *data, qint64 len);
+
+    /* Make sure there is compressed input available in _inptr/_inavail
+     * Returns false on read error. At end of input _inavail stays 0 and _inputEnd is set */
+    bool fillInput();
+    /* Copy exactly len bytes of compressed input to dest. Returns false on error or premature end */
+    bool readInput(char *dest, qint64 len);
+    void consumeInput(qint64 len);
+    /* Record an error. Always returns -1 */
+    qint64 fail(const QString &msg);
+
+    QIODevice *_source;
+    QByteArray _inbuf;
+    const char *_inptr;
+    qint64 _inavail;
+    bool _inputEnd, _streamEnd, _failed;
+    qint64 _bytesIn, _bytesOut;
+};
+
+/* Read from a device, waiting on sequential devices (pipes, decompressors)
+ * until data arrives. Returns 0 only at end of stream, -1 on error */
+qint64 readFromDevice(QIODevice *dev, char *data, qint64 maxlen);
+
+/* Read exactly len bytes. Returns false on error or premature end of stream */
+bool readFullyFromDevice(QIODevice *dev, char *data, qint64 len);
+
+#endif // DECOMPRESSOR_H
@@ -0,0 +1,1392 @@
+#include "ext4builder.h"
+#include <QDebug>
+#include <QtAlgorithms>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+
+/* Userspace ext4 populator
+ *
+ * Maintained by Raspberry Pi
+ *
+ * See LICENSE.txt for license details
+ *
+ */
+
+#define EXT4_SUPER_MAGIC            0xEF53
+#define EXT4_ROOT_INO               2
+#define EXT4_GOOD_OLD_INODE_SIZE    128
+#define EXT4_EXTRA_ISIZE            32
+#define EXT4_LINK_MAX               65000
+#define EXT4_MAX_EXTENT_LEN         32768
+#define EXT4_EXTENT_MAGIC           0xF30A
+#define EXT4_XATTR_MAGIC            0xEA020000
+
+#define EXT4_FEATURE_COMPAT_EXT_ATTR        0x0008
+#define EXT4_FEATURE_COMPAT_RESIZE_INODE    0x0010
+#define EXT4_FEATURE_COMPAT_SPARSE_SUPER2   0x0200
+#define EXT4_FEATURE_INCOMPAT_FILETYPE      0x0002
+#define EXT4_FEATURE_INCOMPAT_EXTENTS       0x0040
+#define EXT4_FEATURE_INCOMPAT_FLEX_BG       0x0200
+#define EXT4_FEATURE_RO_COMPAT_SPARSE_SUPER 0x0001
+#define EXT4_FEATURE_RO_COMPAT_LARGE_FILE   0x0002
+#define EXT4_FEATURE_RO_COMPAT_HUGE_FILE    0x0008
+#define EXT4_FEATURE_RO_COMPAT_GDT_CSUM     0x0010
+#define EXT4_FEATURE_RO_COMPAT_DIR_NLINK    0x0020
+#define EXT4_FEATURE_RO_COMPAT_EXTRA_ISIZE  0x0040
+
+#define EXT4_SUPPORTED_INCOMPAT     (EXT4_FEATURE_INCOMPAT_FILETYPE | EXT4_FEATURE_INCOMPAT_EXTENTS | EXT4_FEATURE_INCOMPAT_FLEX_BG)
+#define EXT4_SUPPORTED_RO_COMPAT    (EXT4_FEATURE_RO_COMPAT_SPARSE_SUPER | EXT4_FEATURE_RO_COMPAT_LARGE_FILE | EXT4_FEATURE_RO_COMPAT_HUGE_FILE \
+                                    | EXT4_FEATURE_RO_COMPAT_GDT_CSUM | EXT4_FEATURE_RO_COMPAT_DIR_NLINK | EXT4_FEATURE_RO_COMPAT_EXTRA_ISIZE)
+
+#define EXT4_BG_INODE_UNINIT        0x0001
+#define EXT4_BG_BLOCK_UNINIT        0x0002
+
+#define EXT4_EXTENTS_FL             0x00080000
+#define EXT4_INDEX_FL               0x00001000
+
+#define EXT4_FT_REG_FILE            1
+#define EXT4_FT_DIR                 2
+#define EXT4_FT_CHRDEV              3
+#define EXT4_FT_BLKDEV              4
+#define EXT4_FT_FIFO                5
+#define EXT4_FT_SOCK                6
+#define EXT4_FT_SYMLINK             7
+
+static inline quint16 le16(const char *p)
+{
+    const uchar *u = (const uchar *) p;
+    return u[0] | (u[1] << 8);
+}
+
+static inline quint32 le32(const char *p)
+{
+    return le16(p) | (quint32(le16(p+2)) << 16);
+}
+
+static inline void put16(char *p, quint16 v)
+{
+    p[0] = v & 0xFF;
+    p[1] = v >> 8;
+}
+
+static inline void put32(char *p, quint32 v)
+{
+    put16(p, v & 0xFFFF);
+    put16(p+2, v >> 16);
+}
+
+static inline bool testBit(const QByteArray &bitmap, quint32 bit)
+{
+    return bitmap.constData()[bit >> 3] & (1 << (bit & 7));
+}
+
+static inline void setBit(QByteArray &bitmap, quint32 bit)
+{
+    bitmap.data()[bit >> 3] |= (1 << (bit & 7));
+}
+
+static inline void clearBit(QByteArray &bitmap, quint32 bit)
+{
+    bitmap.data()[bit >> 3] &= ~(1 << (bit & 7));
+}
+
+/* CRC16 (polynomial 0x8005, reflected) as used for the group descriptor checksums */
+static quint16 crc16(quint16 crc, const char *data, int len)
+{
+    while (len--)
+    {
+        crc ^= (uchar) *data++;
+        for (int i = 0; i < 8; i++)
+            crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : (crc >> 1);
+    }
+
+    return crc;
+}
+
+static uchar fileType(uint mode)
+{
+    switch (mode & S_IFMT)
+    {
+    case S_IFREG:
+        return EXT4_FT_REG_FILE;
+    case S_IFDIR:
+        return EXT4_FT_DIR;
+    case S_IFCHR:
+        return EXT4_FT_CHRDEV;
+    case S_IFBLK:
+        return EXT4_FT_BLKDEV;
+    case S_IFIFO:
+        return EXT4_FT_FIFO;
+    case S_IFSOCK:
+        return EXT4_FT_SOCK;
+    case S_IFLNK:
+        return EXT4_FT_SYMLINK;
+    }
+
+    return 0;
+}
+
+/* Append a directory entry. Entries do not cross block boundaries,
+ * the last entry of a block is extended to the end of it */
+static void addDirEntry(QByteArray &data, int &pos, int &last, int blockSize, quint32 ino, const QByteArray &name, uchar type)
+{
+    int len = (8 + name.size() + 3) & ~3;
+
+    if (pos == data.size() || (pos % blockSize) + len > blockSize)
+    {
+        if (last >= 0)
+            put16(data.data()+last+4, data.size()-last);
+        pos = data.size();
+        data.append(QByteArray(blockSize, 0));
+    }
+
+    char *p = data.data()+pos;
+    put32(p, ino);
+    put16(p+4, len);
+    p[6] = name.size();
+    p[7] = type;
+    memcpy(p+8, name.constData(), name.size());
+
+    last = pos;
+    pos += len;
+}
+
+Ext4Builder::Ext4Builder(const QString &device)
+    : TarExtractor(device), _device(device),
+      _blockSize(0), _inodeSize(0), _descSize(32), _groupCount(0), _gdtBlocks(0), _reservedGdtBlocks(0),
+      _blocksCount(0), _inodesCount(0), _firstDataBlock(0), _blocksPerGroup(0), _inodesPerGroup(0), _firstIno(0),
+      _freeBlocks(0), _freeInodes(0), _compat(0), _incompat(0), _roCompat(0),
+      _blockCursor(0), _inodeCursor(0), _lastDir(NULL), _partialBlock(-1)
+{
+}
+
+Ext4Builder::~Ext4Builder()
+{
+    qDeleteAll(_nodes);
+    _writer.close();
+}
+
+bool Ext4Builder::readBlocks(quint32 block, char *buf, int count)
+{
+    qint64 offset = qint64(block) * _blockSize, len = qint64(count) * _blockSize;
+
+    while (len)
+    {
+        ssize_t n = ::pread(_writer.fd(), buf, len, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return fail(QString("Error reading block %1 of %2: %3").arg(QString::number(block), _device, n ? strerror(errno) : "end of device"));
+        buf    += n;
+        offset += n;
+        len    -= n;
+    }
+
+    return true;
+}
+
+quint16 Ext4Builder::groupChecksum(int group, const char *desc)
+{
+    char nr[4];
+    put32(nr, group);
+
+    quint16 crc = crc16(0xFFFF, _uuid.constData(), _uuid.size());
+    crc = crc16(crc, nr, 4);
+    return crc16(crc, desc, 0x1E);
+}
+
+bool Ext4Builder::hasSuperblock(int group) const
+{
+    if (group <= 1 || !(_roCompat & EXT4_FEATURE_RO_COMPAT_SPARSE_SUPER))
+        return true;
+    if (!(group & 1))
+        return false;
+
+    /* Powers of 3, 5 and 7 */
+    static const int bases[] = {3, 5, 7};
+    for (int i = 0; i < 3; i++)
+    {
+        int n = group;
+        while (n % bases[i] == 0)
+            n /= bases[i];
+        if (n == 1)
+            return true;
+    }
+
+    return false;
+}
+
+quint32 Ext4Builder::blocksInGroup(int group) const
+{
+    if (group == _groupCount-1)
+        return _blocksCount - _firstDataBlock - quint32(group) * _blocksPerGroup;
+
+    return _blocksPerGroup;
+}
+
+/* Block bitmap of a group that mkfs left uninitialized: only the superblock backup,
+ * group descriptors and any bitmaps and inode tables that are located in it are in use */
+void Ext4Builder::initBlockBitmap(int group, QByteArray &bitmap)
+{
+    quint32 first = _firstDataBlock + quint32(group) * _blocksPerGroup, count = blocksInGroup(group);
+    quint32 tableBlocks = (_inodesPerGroup * _inodeSize + _blockSize - 1) / _blockSize;
+
+    bitmap.fill(0);
+    if (hasSuperblock(group))
+    {
+        for (int i = 0; i < 1 + _gdtBlocks + _reservedGdtBlocks; i++)
+            setBit(bitmap, i);
+    }
+
+    for (int g = 0; g < _groupCount; g++)
+    {
+        const Group &grp = _groups.at(g);
+
+        if (grp.blockBitmap >= first && grp.blockBitmap < first+count)
+            setBit(bitmap, grp.blockBitmap-first);
+        if (grp.inodeBitmap >= first && grp.inodeBitmap < first+count)
+            setBit(bitmap, grp.inodeBitmap-first);
+        for (quint32 block = qMax(grp.inodeTable, first); block < qMin(grp.inodeTable+tableBlocks, first+count); block++)
+            setBit(bitmap, block-first);
+    }
+
+    /* Padding after the end of the group is marked in use */
+    for (quint32 i = count; i < quint32(_blockSize) * 8; i++)
+        setBit(bitmap, i);
+}
+
+void Ext4Builder::setVerifier(WriteVerifier *verifier)
+{
+    _writer.setVerifier(verifier);
+}
+
+bool Ext4Builder::open()
+{
+    if (!_writer.open(_device))
+        return fail(_writer.errorString());
+
+    _superblock = QByteArray(1024, 0);
+    if (::pread(_writer.fd(), _superblock.data(), 1024, 1024) != 1024)
+        return fail("Error reading superblock of "+_device);
+
+    const char *sb = _superblock.constData();
+    if (le16(sb+0x38) != EXT4_SUPER_MAGIC)
+        return fail(_device+" does not contain an ext4 file system");
+    if (le32(sb+0x18) > 6)
+        return fail("Invalid block size");
+
+    _blockSize      = 1024 << le32(sb+0x18);
+    _inodesCount    = le32(sb);
+    _blocksCount    = le32(sb+0x04);
+    _freeBlocks     = le32(sb+0x0C);
+    _freeInodes     = le32(sb+0x10);
+    _firstDataBlock = le32(sb+0x14);
+    _blocksPerGroup = le32(sb+0x20);
+    _inodesPerGroup = le32(sb+0x28);
+    _compat         = le32(sb+0x5C);
+    _incompat       = le32(sb+0x60);
+    _roCompat       = le32(sb+0x64);
+    _uuid           = QByteArray(sb+0x68, 16);
+
+    if (le32(sb+0x4C) >= 1)
+    {
+        _inodeSize = le16(sb+0x58);
+        _firstIno  = le32(sb+0x54);
+    }
+    else
+    {
+        _inodeSize = EXT4_GOOD_OLD_INODE_SIZE;
+        _firstIno  = 11;
+    }
+    if (_compat & EXT4_FEATURE_COMPAT_RESIZE_INODE)
+        _reservedGdtBlocks = le16(sb+0xCE);
+
+    if ((_incompat & ~EXT4_SUPPORTED_INCOMPAT) || (_roCompat & ~EXT4_SUPPORTED_RO_COMPAT) || (_compat & EXT4_FEATURE_COMPAT_SPARSE_SUPER2)
+            || !(_incompat & EXT4_FEATURE_INCOMPAT_EXTENTS) || !(_incompat & EXT4_FEATURE_INCOMPAT_FILETYPE))
+    {
+        return fail(QString("File system features not supported: compat %1 incompat %2 ro_compat %3")
+                    .arg(_compat, 0, 16).arg(_incompat, 0, 16).arg(_roCompat, 0, 16));
+    }
+    if (!(le16(sb+0x3A) & 1))
+        return fail("File system was not cleanly unmounted");
+    if (_inodeSize < EXT4_GOOD_OLD_INODE_SIZE || _inodeSize > _blockSize || (_inodeSize & (_inodeSize-1))
+            || !_blocksPerGroup || _blocksPerGroup > quint32(_blockSize) * 8
+            || !_inodesPerGroup || _inodesPerGroup > quint32(_blockSize) * 8 || _blocksCount <= _firstDataBlock)
+    {
+        return fail("Invalid superblock");
+    }
+
+    _groupCount = (_blocksCount - _firstDataBlock + _blocksPerGroup - 1) / _blocksPerGroup;
+    _gdtBlocks  = (_groupCount * _descSize + _blockSize - 1) / _blockSize;
+    if (quint64(_groupCount) * _inodesPerGroup != _inodesCount)
+        return fail("Invalid superblock");
+
+    _gdt = QByteArray(_gdtBlocks * _blockSize, 0);
+    if (!readBlocks(_firstDataBlock+1, _gdt.data(), _gdtBlocks))
+        return false;
+
+    bool csum = _roCompat & EXT4_FEATURE_RO_COMPAT_GDT_CSUM;
+
+    for (int g = 0; g < _groupCount; g++)
+    {
+        const char *desc = _gdt.constData() + g * _descSize;
+        Group grp;
+
+        grp.blockBitmap  = le32(desc);
+        grp.inodeBitmap  = le32(desc+0x04);
+        grp.inodeTable   = le32(desc+0x08);
+        grp.freeBlocks   = le16(desc+0x0C);
+        grp.freeInodes   = le16(desc+0x0E);
+        grp.usedDirs     = le16(desc+0x10);
+        grp.flags        = csum ? le16(desc+0x12) : 0;
+        grp.itableUnused = csum ? le16(desc+0x1C) : 0;
+        grp.blockBitmapChanged = grp.inodeBitmapChanged = false;
+
+        if (csum && le16(desc+0x1E) != groupChecksum(g, desc))
+            return fail(QString("Checksum of group descriptor %1 does not match").arg(g));
+
+        if (grp.flags & EXT4_BG_INODE_UNINIT)
+            grp.initialInodes = 0;
+        else
+            grp.initialInodes = _inodesPerGroup - grp.itableUnused;
+
+        _groups.append(grp);
+    }
+
+    _blockBitmaps.resize(_groupCount);
+    _inodeBitmaps.resize(_groupCount);
+
+    for (int g = 0; g < _groupCount; g++)
+    {
+        const Group &grp = _groups.at(g);
+        QByteArray &blockBitmap = _blockBitmaps[g], &inodeBitmap = _inodeBitmaps[g];
+        blockBitmap = QByteArray(_blockSize, 0);
+        inodeBitmap = QByteArray(_blockSize, 0);
+
+        if (grp.flags & EXT4_BG_BLOCK_UNINIT)
+        {
+            initBlockBitmap(g, blockBitmap);
+
+            quint32 free = 0;
+            for (quint32 i = 0; i < blocksInGroup(g); i++)
+            {
+                if (!testBit(blockBitmap, i))
+                    free++;
+            }
+            if (free != grp.freeBlocks)
+                return fail(QString("Unexpected layout of uninitialized block group %1").arg(g));
+        }
+        else if (!readBlocks(grp.blockBitmap, blockBitmap.data(), 1))
+        {
+            return false;
+        }
+
+        if (grp.flags & EXT4_BG_INODE_UNINIT)
+        {
+            for (quint32 i = _inodesPerGroup; i < quint32(_blockSize) * 8; i++)
+                setBit(inodeBitmap, i);
+        }
+        else if (!readBlocks(grp.inodeBitmap, inodeBitmap.data(), 1))
+        {
+            return false;
+        }
+    }
+
+    _blockCursor  = _firstDataBlock;
+    _inodeCursor  = _firstIno;
+    _partial      = QByteArray(_blockSize, 0);
+    _partialBlock = -1;
+
+    return node(EXT4_ROOT_INO) != NULL;
+}
+
+void Ext4Builder::markBlockUsed(quint32 block)
+{
+    int g = (block - _firstDataBlock) / _blocksPerGroup;
+    Group &grp = _groups[g];
+
+    setBit(_blockBitmaps[g], (block - _firstDataBlock) % _blocksPerGroup);
+    grp.freeBlocks--;
+    grp.flags &= ~EXT4_BG_BLOCK_UNINIT;
+    grp.blockBitmapChanged = true;
+    _freeBlocks--;
+}
+
+/* First fit from where the previous allocation ended, so data that arrives
+ * one after another ends up one after another on the card */
+bool Ext4Builder::allocateBlocks(quint32 wanted, quint32 &start, quint32 &count)
+{
+    count = 0;
+
+    for (int pass = 0; pass < 2 && !count; pass++)
+    {
+        quint32 block = pass ? _firstDataBlock : _blockCursor;
+        quint32 end   = pass ? _blockCursor : _blocksCount;
+
+        while (block < end)
+        {
+            quint32 bit = (block - _firstDataBlock) % _blocksPerGroup;
+            const QByteArray &bitmap = _blockBitmaps.at((block - _firstDataBlock) / _blocksPerGroup);
+
+            /* Skip over fully used bytes quickly */
+            if (!(bit & 7) && (uchar) bitmap.at(bit >> 3) == 0xFF)
+                block += 8;
+            else if (testBit(bitmap, bit))
+                block++;
+            else
+                break;
+        }
+        if (block >= end)
+            continue;
+
+        start = block;
+        while (count < wanted && block < _blocksCount
+               && !testBit(_blockBitmaps.at((block - _firstDataBlock) / _blocksPerGroup), (block - _firstDataBlock) % _blocksPerGroup))
+        {
+            markBlockUsed(block);
+            block++;
+            count++;
+        }
+        _blockCursor = block;
+    }
+
+    if (!count)
+        return fail("File system is full");
+
+    return true;
+}
+
+void Ext4Builder::freeBlocks(quint32 start, quint32 count)
+{
+    for (quint32 block = start; block < start+count; block++)
+    {
+        int g = (block - _firstDataBlock) / _blocksPerGroup;
+
+        clearBit(_blockBitmaps[g], (block - _firstDataBlock) % _blocksPerGroup);
+        _groups[g].freeBlocks++;
+        _groups[g].blockBitmapChanged = true;
+        _freeBlocks++;
+    }
+}
+
+quint32 Ext4Builder::allocateInode(bool isDir)
+{
+    for (quint32 ino = _inodeCursor; ino <= _inodesCount; ino++)
+    {
+        int g = (ino-1) / _inodesPerGroup;
+        quint32 bit = (ino-1) % _inodesPerGroup;
+
+        if (testBit(_inodeBitmaps.at(g), bit))
+            continue;
+
+        Group &grp = _groups[g];
+        setBit(_inodeBitmaps[g], bit);
+        grp.freeInodes--;
+        grp.flags &= ~EXT4_BG_INODE_UNINIT;
+        grp.inodeBitmapChanged = true;
+        if (isDir)
+            grp.usedDirs++;
+        _freeInodes--;
+        _inodeCursor = ino+1;
+
+        return ino;
+    }
+
+    fail("File system is out of inodes");
+    return 0;
+}
+
+/* Inode table contents. Blocks holding inodes that were in use when the
+ * file system was opened are read from disk, other blocks start out empty */
+char *Ext4Builder::inodeData(quint32 ino)
+{
+    int g = (ino-1) / _inodesPerGroup;
+    quint32 index = (ino-1) % _inodesPerGroup, perBlock = _blockSize / _inodeSize;
+    quint32 block = _groups.at(g).inodeTable + index / perBlock;
+
+    if (!_inodeTableBlocks.contains(block))
+    {
+        QByteArray data(_blockSize, 0);
+        if (index - index % perBlock < _groups.at(g).initialInodes && !readBlocks(block, data.data(), 1))
+            return NULL;
+        _inodeTableBlocks.insert(block, data);
+    }
+
+    return _inodeTableBlocks[block].data() + (index % perBlock) * _inodeSize;
+}
+
+Ext4Builder::Node *Ext4Builder::newNode(uint mode, const Entry *e)
+{
+    quint32 ino = allocateInode(S_ISDIR(mode));
+    if (!ino)
+        return NULL;
+
+    Node *n = new Node;
+    n->ino      = ino;
+    n->links    = 0;
+    n->mode     = mode;
+    n->uid      = e ? e->uid : 0;
+    n->gid      = e ? e->gid : 0;
+    n->mtime    = e ? e->mtime : ::time(NULL);
+    n->devmajor = e ? e->devmajor : 0;
+    n->devminor = e ? e->devminor : 0;
+    n->size     = 0;
+    n->dataBlocks = 0;
+    n->xattrBlock = 0;
+    n->xattrsInInode = false;
+    n->parent   = 0;
+    n->existing = false;
+    n->entriesChanged = S_ISDIR(mode);
+    if (e)
+        n->xattrs = e->xattrs;
+    _nodes.insert(ino, n);
+
+    return n;
+}
+
+Ext4Builder::Node *Ext4Builder::node(quint32 ino)
+{
+    Node *n = _nodes.value(ino);
+
+    /* Directories created by mkfs are read in when first needed */
+    if (!n)
+        n = loadDirectory(ino);
+
+    return n;
+}
+
+Ext4Builder::Node *Ext4Builder::loadDirectory(quint32 ino)
+{
+    const char *raw = inodeData(ino);
+    if (!raw)
+        return NULL;
+
+    const char *header = raw+0x28;
+    if (!S_ISDIR(le16(raw)) || !(le32(raw+0x20) & EXT4_EXTENTS_FL) || le16(header) != EXT4_EXTENT_MAGIC || le16(header+6) != 0)
+    {
+        fail(QString("Existing inode %1 is not a directory with a single level extent tree").arg(ino));
+        return NULL;
+    }
+
+    Node *n = new Node;
+    n->ino      = ino;
+    n->mode     = le16(raw);
+    n->uid      = le16(raw+0x02) | (quint32(le16(raw+0x78)) << 16);
+    n->gid      = le16(raw+0x18) | (quint32(le16(raw+0x7A)) << 16);
+    n->size     = le32(raw+0x04) | (qint64(le32(raw+0x6C)) << 32);
+    n->mtime    = le32(raw+0x10);
+    n->links    = le16(raw+0x1A);
+    n->devmajor = n->devminor = 0;
+    n->dataBlocks = 0;
+    n->xattrBlock = le32(raw+0x68);
+    n->xattrsInInode = false;
+    n->parent   = ino;
+    n->existing = true;
+    n->entriesChanged = false;
+
+    for (int i = 0; i < le16(header+2) && i < 4; i++)
+    {
+        const char *ext = header + 12 + i*12;
+        Extent x;
+        x.logical = le32(ext);
+        x.len     = le16(ext+4);
+        x.start   = le32(ext+8);
+        if (x.len > EXT4_MAX_EXTENT_LEN)
+            x.len -= EXT4_MAX_EXTENT_LEN;
+        n->extents.append(x);
+        n->dataBlocks += x.len;
+    }
+
+    QByteArray block(_blockSize, 0);
+    foreach (const Extent &x, n->extents)
+    {
+        for (quint32 b = 0; b < x.len; b++)
+        {
+            if (!readBlocks(x.start+b, block.data(), 1))
+            {
+                delete n;
+                return NULL;
+            }
+
+            for (int pos = 0; pos + 8 <= _blockSize; )
+            {
+                const char *p = block.constData()+pos;
+                int recLen = le16(p+4);
+                if (recLen < 8 || pos + recLen > _blockSize)
+                {
+                    delete n;
+                    fail(QString("Corrupt directory block in inode %1").arg(ino));
+                    return NULL;
+                }
+
+                DirEntry d;
+                d.ino  = le32(p);
+                d.type = p[7];
+                QByteArray name(p+8, qMin((int) (uchar) p[6], recLen-8));
+
+                if (name == "..")
+                    n->parent = d.ino;
+                else if (d.ino && name != ".")
+                    n->entries.insert(name, d);
+                pos += recLen;
+            }
+        }
+    }
+    _nodes.insert(ino, n);
+
+    return n;
+}
+
+/* Look up a directory by path. Missing directories are created, like tar does */
+Ext4Builder::Node *Ext4Builder::directory(const QByteArray &path, bool create)
+{
+    if (_lastDir && path == _lastDirPath)
+        return _lastDir;
+
+    Node *dir = node(EXT4_ROOT_INO);
+
+    foreach (QByteArray name, path.split('/'))
+    {
+        if (!dir)
+            return NULL;
+        if (name.isEmpty())
+            continue;
+
+        QMap<QByteArray,DirEntry>::const_iterator i = dir->entries.constFind(name);
+        if (i == dir->entries.constEnd())
+        {
+            if (!create)
+            {
+                fail("Directory '"+QString::fromLocal8Bit(path)+"' does not exist");
+                return NULL;
+            }
+
+            Node *child = newNode(S_IFDIR | 0755, NULL);
+            if (!child || !link(dir, name, child))
+                return NULL;
+            dir = child;
+        }
+        else if (i.value().type != EXT4_FT_DIR)
+        {
+            fail("'"+QString::fromLocal8Bit(path)+"' is not a directory");
+            return NULL;
+        }
+        else
+        {
+            dir = node(i.value().ino);
+        }
+    }
+
+    if (dir)
+    {
+        _lastDirPath = path;
+        _lastDir = dir;
+    }
+
+    return dir;
+}
+
+bool Ext4Builder::link(Node *dir, const QByteArray &name, Node *n)
+{
+    if (name.size() > 255)
+        return fail("File name too long: "+QString::fromLocal8Bit(name));
+
+    QMap<QByteArray,DirEntry>::iterator i = dir->entries.find(name);
+    if (i != dir->entries.end())
+    {
+        if (i.value().ino == n->ino)
+            return true;
+        if (i.value().type == EXT4_FT_DIR)
+            return fail("Cannot replace directory '"+QString::fromLocal8Bit(name)+"'");
+        if (!unlink(i.value().ino))
+            return false;
+    }
+
+    DirEntry d;
+    d.ino  = n->ino;
+    d.type = fileType(n->mode);
+    dir->entries.insert(name, d);
+    dir->entriesChanged = true;
+    n->links++;
+
+    if (S_ISDIR(n->mode))
+    {
+        /* '.' in the new directory, and '..' pointing to the parent */
+        n->links++;
+        n->parent = dir->ino;
+        dir->links++;
+    }
+
+    return true;
+}
+
+/* Remove a directory entry of a file that is replaced by a later tar member */
+bool Ext4Builder::unlink(quint32 ino)
+{
+    Node *n = _nodes.value(ino);
+    if (!n)
+        return fail(QString("Cannot replace existing inode %1").arg(ino));
+
+    if (--n->links)
+        return true;
+
+    foreach (const Extent &x, n->extents)
+        freeBlocks(x.start, x.len);
+
+    int g = (ino-1) / _inodesPerGroup;
+    clearBit(_inodeBitmaps[g], (ino-1) % _inodesPerGroup);
+    _groups[g].freeInodes++;
+    _groups[g].inodeBitmapChanged = true;
+    _freeInodes++;
+
+    _nodes.remove(ino);
+    delete n;
+
+    return true;
+}
+
+bool Ext4Builder::addBlocks(Node *n, quint32 logical, const char *data, quint32 count)
+{
+    while (count)
+    {
+        quint32 start, got;
+        if (!allocateBlocks(qMin(count, (quint32) EXT4_MAX_EXTENT_LEN), start, got))
+            return false;
+        if (!_writer.write(qint64(start) * _blockSize, data, qint64(got) * _blockSize))
+            return fail(_writer.errorString());
+
+        Extent *last = n->extents.isEmpty() ? NULL : &n->extents.last();
+        if (last && last->logical + last->len == logical && last->start + last->len == start && last->len + got <= EXT4_MAX_EXTENT_LEN)
+        {
+            last->len += got;
+        }
+        else
+        {
+            Extent x;
+            x.logical = logical;
+            x.start   = start;
+            x.len     = got;
+            n->extents.append(x);
+        }
+
+        n->dataBlocks += got;
+        logical += got;
+        data    += qint64(got) * _blockSize;
+        count   -= got;
+    }
+
+    return true;
+}
+
+bool Ext4Builder::flushPartialBlock(Node *n)
+{
+    if (_partialBlock < 0)
+        return true;
+
+    bool ok = addBlocks(n, _partialBlock, _partial.constData(), 1);
+    _partialBlock = -1;
+
+    return ok;
+}
+
+/* Add file data at the given offset. Offsets must be increasing, holes are left unallocated */
+bool Ext4Builder::appendData(Node *n, qint64 offset, const char *data, qint64 len)
+{
+    while (len > 0)
+    {
+        quint32 logical = offset / _blockSize;
+        int within = offset % _blockSize;
+
+        if (_partialBlock >= 0 && _partialBlock != logical && !flushPartialBlock(n))
+            return false;
+
+        /* Whole blocks are written straight from the caller's buffer */
+        if (_partialBlock < 0 && !within && len >= _blockSize)
+        {
+            quint32 count = len / _blockSize;
+            if (!addBlocks(n, logical, data, count))
+                return false;
+
+            qint64 done = qint64(count) * _blockSize;
+            offset += done;
+            data   += done;
+            len    -= done;
+            continue;
+        }
+
+        if (_partialBlock < 0)
+        {
+            _partial.fill(0);
+            _partialBlock = logical;
+        }
+
+        int chunk = qMin(len, (qint64) (_blockSize - within));
+        memcpy(_partial.data()+within, data, chunk);
+        offset += chunk;
+        data   += chunk;
+        len    -= chunk;
+
+        if (within + chunk == _blockSize && !flushPartialBlock(n))
+            return false;
+    }
+
+    return true;
+}
+
+bool Ext4Builder::extractData(Node *n, Entry &e)
+{
+    QList<QPair<qint64,qint64> > segments;
+    qint64 consumed = 0, end = 0;
+
+    if (e.sparse)
+    {
+        if (e.sparseMajor == 1 && !readSparseMap10(e, consumed))
+            return false;
+        segments = e.sparseMap;
+        n->size = e.realsize;
+    }
+    else
+    {
+        segments.append(qMakePair(qint64(0), e.size));
+        n->size = e.size;
+    }
+
+    for (int i = 0; i < segments.size(); i++)
+    {
+        qint64 offset = segments.at(i).first, len = segments.at(i).second;
+
+        if (offset < end || len < 0 || offset+len > n->size || consumed+len > e.size)
+            return fail("Invalid GNU sparse map");
+        end = offset+len;
+
+        while (len)
+        {
+            qint64 chunk = qMin(len, (qint64) _buffer.size());
+            if (!readStream(_buffer.data(), chunk) || !appendData(n, offset, _buffer.constData(), chunk))
+                return false;
+
+            offset    += chunk;
+            len       -= chunk;
+            consumed  += chunk;
+            _bytesWritten += chunk;
+        }
+    }
+
+    if (!flushPartialBlock(n))
+        return false;
+
+    return skipStream(paddedSize(e.size) - consumed);
+}
+
+bool Ext4Builder::extractEntry(Entry &e)
+{
+    QByteArray path = e.path;
+
+    if (!sanitizePath(path))
+    {
+        qDebug() << "Skipping tar member with '..' in its path:" << e.path;
+        return skipStream(paddedSize(e.size));
+    }
+    if (path.isEmpty() && e.type != '5')
+        return skipStream(paddedSize(e.size));
+
+    int slash = path.lastIndexOf('/');
+    QByteArray name = path.mid(slash+1);
+    Node *dir = directory(slash == -1 ? QByteArray() : path.left(slash));
+    if (!dir)
+        return false;
+
+    switch (e.type)
+    {
+    case '0':
+    case '7':
+    case 'S':
+    {
+        Node *n = newNode(S_IFREG | e.mode, &e);
+        if (!n || !link(dir, name, n) || !extractData(n, e))
+            return false;
+        _entries++;
+        return true;
+    }
+
+    case '1':
+    {
+        QByteArray linkpath = e.linkpath;
+        if (!sanitizePath(linkpath) || linkpath.isEmpty())
+        {
+            qDebug() << "Skipping hard link to invalid target:" << e.linkpath;
+            break;
+        }
+
+        int targetSlash = linkpath.lastIndexOf('/');
+        Node *targetDir = directory(targetSlash == -1 ? QByteArray() : linkpath.left(targetSlash), false);
+        if (!targetDir)
+            return false;
+
+        QMap<QByteArray,DirEntry>::const_iterator i = targetDir->entries.constFind(linkpath.mid(targetSlash+1));
+        Node *target = (i == targetDir->entries.constEnd()) ? NULL : _nodes.value(i.value().ino);
+        if (!target || S_ISDIR(target->mode))
+            return fail("Error creating hard link '"+QString::fromLocal8Bit(path)+"': invalid target");
+
+        /* The lookup of the target directory may have replaced the cached directory */
+        dir = directory(slash == -1 ? QByteArray() : path.left(slash));
+        if (!dir || !link(dir, name, target))
+            return false;
+        _entries++;
+        break;
+    }
+
+    case '2':
+    {
+        if (e.linkpath.size() >= _blockSize)
+            return fail("Symbolic link target too long: "+QString::fromLocal8Bit(path));
+
+        Node *n = newNode(S_IFLNK | 0777, &e);
+        if (!n || !link(dir, name, n))
+            return false;
+
+        /* Short targets are stored in the inode itself */
+        n->size = e.linkpath.size();
+        if (n->size < 60)
+            n->symlink = e.linkpath;
+        else if (!appendData(n, 0, e.linkpath.constData(), n->size) || !flushPartialBlock(n))
+            return false;
+        _entries++;
+        break;
+    }
+
+    case '5':
+    {
+        Node *n = dir;
+        if (!path.isEmpty())
+        {
+            QMap<QByteArray,DirEntry>::const_iterator i = dir->entries.constFind(name);
+            if (i != dir->entries.constEnd() && i.value().type == EXT4_FT_DIR)
+                n = node(i.value().ino);
+            else if ((n = newNode(S_IFDIR | e.mode, &e)) != NULL && !link(dir, name, n))
+                return false;
+            if (!n)
+                return false;
+        }
+        n->mode   = S_IFDIR | e.mode;
+        n->uid    = e.uid;
+        n->gid    = e.gid;
+        n->mtime  = e.mtime;
+        n->xattrs = e.xattrs;
+        _entries++;
+        break;
+    }
+
+    case '3':
+    case '4':
+    case '6':
+    {
+        uint type = (e.type == '3') ? S_IFCHR : (e.type == '4') ? S_IFBLK : S_IFIFO;
+        Node *n = newNode(type | e.mode, &e);
+        if (!n || !link(dir, name, n))
+            return false;
+        _entries++;
+        break;
+    }
+
+    default:
+        qDebug() << "Skipping tar member of unsupported type" << e.type << ":" << e.path;
+    }
+
+    return skipStream(paddedSize(e.size));
+}
+
+bool Ext4Builder::writeDirectory(Node *dir)
+{
+    /* Directories created by mkfs are rewritten completely */
+    foreach (const Extent &x, dir->extents)
+        freeBlocks(x.start, x.len);
+    dir->extents.clear();
+    dir->dataBlocks = 0;
+
+    QByteArray data;
+    int pos = 0, last = -1;
+
+    addDirEntry(data, pos, last, _blockSize, dir->ino, ".", EXT4_FT_DIR);
+    addDirEntry(data, pos, last, _blockSize, dir->parent, "..", EXT4_FT_DIR);
+    for (QMap<QByteArray,DirEntry>::const_iterator i = dir->entries.constBegin(); i != dir->entries.constEnd(); i++)
+        addDirEntry(data, pos, last, _blockSize, i.value().ino, i.key(), i.value().type);
+    put16(data.data()+last+4, data.size()-last);
+
+    dir->size = data.size();
+
+    return addBlocks(dir, 0, data.constData(), data.size() / _blockSize);
+}
+
+void Ext4Builder::encodeExtents(const QList<Extent> &extents, int first, int count, char *buf, int max)
+{
+    put16(buf, EXT4_EXTENT_MAGIC);
+    put16(buf+2, count);
+    put16(buf+4, max);
+    put16(buf+6, 0);
+    put32(buf+8, 0);
+
+    for (int i = 0; i < count; i++)
+    {
+        const Extent &x = extents.at(first+i);
+        char *p = buf + 12 + i*12;
+        put32(p, x.logical);
+        put16(p+4, x.len);
+        put16(p+6, 0);
+        put32(p+8, x.start);
+    }
+}
+
+/* Files with more than 4 extents get a second level of the extent tree */
+bool Ext4Builder::writeExtentTree(Node *n)
+{
+    int perLeaf = (_blockSize - 12) / 12;
+    int leaves = (n->extents.size() + perLeaf - 1) / perLeaf;
+    if (leaves > 4)
+        return fail(QString("File in inode %1 is too fragmented").arg(n->ino));
+
+    QByteArray data(_blockSize, 0);
+    for (int i = 0; i < leaves; i++)
+    {
+        quint32 block, got;
+        if (!allocateBlocks(1, block, got))
+            return false;
+
+        data.fill(0);
+        encodeExtents(n->extents, i*perLeaf, qMin(perLeaf, n->extents.size() - i*perLeaf), data.data(), perLeaf);
+        if (!_writer.write(qint64(block) * _blockSize, data.constData(), _blockSize))
+            return fail(_writer.errorString());
+        n->leaves.append(block);
+    }
+
+    return true;
+}
+
+/* Entries in an attribute block must be sorted the way the kernel looks them up */
+bool Ext4Builder::xattrLessThan(const Xattr &a, const Xattr &b)
+{
+    if (a.index != b.index)
+        return a.index < b.index;
+    if (a.name.size() != b.name.size())
+        return a.name.size() < b.name.size();
+    return a.name < b.name;
+}
+
+quint32 Ext4Builder::xattrHash(const Xattr &a)
+{
+    quint32 hash = 0;
+
+    for (int i = 0; i < a.name.size(); i++)
+        hash = (hash << 5) ^ (hash >> 27) ^ uchar(a.name.at(i));
+
+    QByteArray value = a.value;
+    value.append(QByteArray((4 - value.size() % 4) % 4, 0));
+    for (int i = 0; i < value.size(); i += 4)
+        hash = (hash << 16) ^ (hash >> 16) ^ le32(value.constData()+i);
+
+    return hash;
+}
+
+/* Lays out the attributes in buf, with the entries starting at offset first and the values at the end.
+ * Value offsets are relative to valueBase. Returns false if they do not fit */
+bool Ext4Builder::layoutXattrs(const QList<Xattr> &attrs, char *buf, int size, int first, int valueBase)
+{
+    int entryPos = first, valuePos = size;
+
+    foreach (const Xattr &a, attrs)
+    {
+        int entrySize = (16 + a.name.size() + 3) & ~3;
+        int valueSize = (a.value.size() + 3) & ~3;
+
+        if (entryPos + entrySize + 4 > valuePos - valueSize)
+            return false;
+
+        valuePos -= valueSize;
+        memcpy(buf+valuePos, a.value.constData(), a.value.size());
+
+        char *e = buf+entryPos;
+        e[0] = a.name.size();
+        e[1] = a.index;
+        put16(e+2, valuePos - valueBase);
+        put32(e+4, 0);
+        put32(e+8, a.value.size());
+        put32(e+12, xattrHash(a));
+        memcpy(e+16, a.name.constData(), a.name.size());
+        entryPos += entrySize;
+    }
+
+    return true;
+}
+
+QList<Ext4Builder::Xattr> Ext4Builder::xattrList(Node *n)
+{
+    static const struct
+    {
+        const char *prefix;
+        uchar index;
+    } prefixes[] = {
+        {"user.", 1}, {"trusted.", 4}, {"security.", 6}
+    };
+    QList<Xattr> attrs;
+
+    for (QMap<QByteArray,QByteArray>::const_iterator i = n->xattrs.constBegin(); i != n->xattrs.constEnd(); i++)
+    {
+        int p = 0;
+        while (p < 3 && !i.key().startsWith(prefixes[p].prefix))
+            p++;
+
+        Xattr a;
+        a.index = p < 3 ? prefixes[p].index : 0;
+        a.name = i.key().mid(p < 3 ? strlen(prefixes[p].prefix) : 0);
+        a.value = i.value();
+
+        if (p == 3 || a.name.size() > 255)
+            qDebug() << "Warning: unable to store extended attribute" << i.key() << "of inode" << n->ino;
+        else
+            attrs.append(a);
+    }
+
+    qSort(attrs.begin(), attrs.end(), xattrLessThan);
+    return attrs;
+}
+
+/* Extended attributes go in the inode after the extra fields if they fit there, else in a block of their own */
+bool Ext4Builder::writeXattrs(Node *n)
+{
+    if (!(_compat & EXT4_FEATURE_COMPAT_EXT_ATTR))
+    {
+        qDebug() << "Warning: file system does not support extended attributes, dropping those of inode" << n->ino;
+        return true;
+    }
+
+    QList<Xattr> attrs = xattrList(n);
+    if (attrs.isEmpty())
+        return true;
+
+    if (_inodeSize > EXT4_GOOD_OLD_INODE_SIZE)
+    {
+        int extra = n->existing ? le16(inodeData(n->ino)+0x80) : EXT4_EXTRA_ISIZE;
+        QByteArray region(_inodeSize - EXT4_GOOD_OLD_INODE_SIZE - extra, 0);
+        if (layoutXattrs(attrs, region.data(), region.size(), 4, 4))
+        {
+            n->xattrsInInode = true;
+            return true;
+        }
+    }
+
+    QByteArray data(_blockSize, 0);
+    if (!layoutXattrs(attrs, data.data(), _blockSize, 32, 0))
+    {
+        qDebug() << "Warning: extended attributes of inode" << n->ino << "do not fit in a block, dropping them";
+        return true;
+    }
+
+    quint32 blockHash = 0;
+    for (int i = 0; i < attrs.size(); i++)
+        blockHash = (blockHash << 16) ^ (blockHash >> 16) ^ xattrHash(attrs.at(i));
+
+    put32(data.data(),    EXT4_XATTR_MAGIC);
+    put32(data.data()+4,  1); /* Reference count */
+    put32(data.data()+8,  1); /* Blocks */
+    put32(data.data()+12, blockHash);
+
+    quint32 block, got;
+    if (n->xattrBlock)
+        freeBlocks(n->xattrBlock, 1);
+    if (!allocateBlocks(1, block, got))
+        return false;
+    if (!_writer.write(qint64(block) * _blockSize, data.constData(), _blockSize))
+        return fail(_writer.errorString());
+    n->xattrBlock = block;
+
+    return true;
+}
+
+bool Ext4Builder::encodeInode(Node *n)
+{
+    char *raw = inodeData(n->ino);
+    if (!raw)
+        return false;
+
+    quint32 flags = 0;
+    if (n->existing)
+        flags = le32(raw+0x20) & ~(EXT4_EXTENTS_FL | EXT4_INDEX_FL);
+    else
+        memset(raw, 0, _inodeSize);
+
+    quint32 links = n->links;
+    if (S_ISDIR(n->mode) && links >= EXT4_LINK_MAX)
+    {
+        links = 1;
+        _roCompat |= EXT4_FEATURE_RO_COMPAT_DIR_NLINK;
+    }
+    if (S_ISREG(n->mode) && n->size > 0x7FFFFFFF)
+        _roCompat |= EXT4_FEATURE_RO_COMPAT_LARGE_FILE;
+
+    quint64 sectors = quint64(n->dataBlocks + n->leaves.size() + (n->xattrBlock ? 1 : 0)) * (_blockSize / 512);
+
+    put16(raw,      n->mode);
+    put16(raw+0x02, n->uid & 0xFFFF);
+    put32(raw+0x04, n->size & 0xFFFFFFFF);
+    put32(raw+0x08, n->mtime);
+    put32(raw+0x0C, n->mtime);
+    put32(raw+0x10, n->mtime);
+    put16(raw+0x18, n->gid & 0xFFFF);
+    put16(raw+0x1A, links);
+    put32(raw+0x1C, sectors & 0xFFFFFFFF);
+    put32(raw+0x68, n->xattrBlock);
+    put32(raw+0x6C, n->size >> 32);
+    put16(raw+0x74, sectors >> 32);
+    put16(raw+0x78, n->uid >> 16);
+    put16(raw+0x7A, n->gid >> 16);
+
+    char *block = raw+0x28;
+    memset(block, 0, 60);
+
+    if (S_ISCHR(n->mode) || S_ISBLK(n->mode))
+    {
+        if (n->devmajor < 256 && n->devminor < 256)
+            put32(block, (n->devmajor << 8) | n->devminor);
+        else
+            put32(block+4, (n->devminor & 0xFF) | (n->devmajor << 8) | ((n->devminor & ~0xFF) << 12));
+    }
+    else if (S_ISLNK(n->mode) && n->extents.isEmpty())
+    {
+        memcpy(block, n->symlink.constData(), n->symlink.size());
+    }
+    else if (S_ISREG(n->mode) || S_ISDIR(n->mode) || S_ISLNK(n->mode))
+    {
+        flags |= EXT4_EXTENTS_FL;
+
+        if (n->leaves.isEmpty())
+        {
+            encodeExtents(n->extents, 0, n->extents.size(), block, 4);
+        }
+        else
+        {
+            int perLeaf = (_blockSize - 12) / 12;
+
+            put16(block, EXT4_EXTENT_MAGIC);
+            put16(block+2, n->leaves.size());
+            put16(block+4, 4);
+            put16(block+6, 1);
+            for (int i = 0; i < n->leaves.size(); i++)
+            {
+                char *p = block + 12 + i*12;
+                put32(p, n->extents.at(i*perLeaf).logical);
+                put32(p+4, n->leaves.at(i));
+            }
+        }
+    }
+    put32(raw+0x20, flags);
+
+    if (_inodeSize > EXT4_GOOD_OLD_INODE_SIZE)
+    {
+        if (!n->existing)
+        {
+            put16(raw+0x80, EXT4_EXTRA_ISIZE);
+            put32(raw+0x90, n->mtime);
+        }
+        if (n->xattrsInInode)
+        {
+            /* Extended attributes are stored in the inode, after the extra fields */
+            int extra = le16(raw+0x80);
+            char *region = raw + EXT4_GOOD_OLD_INODE_SIZE + extra;
+
+            memset(region, 0, _inodeSize - EXT4_GOOD_OLD_INODE_SIZE - extra);
+            put32(region, EXT4_XATTR_MAGIC);
+            layoutXattrs(xattrList(n), region, _inodeSize - EXT4_GOOD_OLD_INODE_SIZE - extra, 4, 4);
+        }
+    }
+
+    return true;
+}
+
+bool Ext4Builder::finishExtraction()
+{
+    QList<quint32> inodes = _nodes.keys();
+    qSort(inodes);
+
+    /* Directories and extent tree blocks end up after the file data */
+    foreach (quint32 ino, inodes)
+    {
+        Node *n = _nodes.value(ino);
+        if (S_ISDIR(n->mode) && n->entriesChanged && !writeDirectory(n))
+            return false;
+    }
+    foreach (quint32 ino, inodes)
+    {
+        Node *n = _nodes.value(ino);
+        if (n->extents.size() > 4 && !writeExtentTree(n))
+            return false;
+        if (!n->xattrs.isEmpty() && !writeXattrs(n))
+            return false;
+    }
+
+    foreach (quint32 ino, inodes)
+    {
+        if (!encodeInode(_nodes.value(ino)))
+            return false;
+    }
+
+    QList<quint32> tableBlocks = _inodeTableBlocks.keys();
+    qSort(tableBlocks);
+    foreach (quint32 block, tableBlocks)
+    {
+        if (!_writer.write(qint64(block) * _blockSize, _inodeTableBlocks.value(block).constData(), _blockSize))
+            return fail(_writer.errorString());
+    }
+
+    bool csum = _roCompat & EXT4_FEATURE_RO_COMPAT_GDT_CSUM;
+
+    for (int g = 0; g < _groupCount; g++)
+    {
+        Group &grp = _groups[g];
+        char *desc = _gdt.data() + g * _descSize;
+
+        if (csum && !(grp.flags & EXT4_BG_INODE_UNINIT))
+        {
+            /* Inodes after the last one in use do not have to be read by the kernel and fsck */
+            quint32 used = _inodesPerGroup;
+            while (used && !testBit(_inodeBitmaps.at(g), used-1))
+                used--;
+            grp.itableUnused = _inodesPerGroup - used;
+        }
+
+        if (grp.blockBitmapChanged && !_writer.write(qint64(grp.blockBitmap) * _blockSize, _blockBitmaps.at(g).constData(), _blockSize))
+            return fail(_writer.errorString());
+        if (grp.inodeBitmapChanged && !_writer.write(qint64(grp.inodeBitmap) * _blockSize, _inodeBitmaps.at(g).constData(), _blockSize))
+            return fail(_writer.errorString());
+
+        put16(desc+0x0C, grp.freeBlocks);
+        put16(desc+0x0E, grp.freeInodes);
+        put16(desc+0x10, grp.usedDirs);
+        if (csum)
+        {
+            put16(desc+0x12, grp.flags);
+            put16(desc+0x1C, grp.itableUnused);
+            put16(desc+0x1E, groupChecksum(g, desc));
+        }
+    }
+
+    if (!_writer.write(qint64(_firstDataBlock+1) * _blockSize, _gdt.constData(), _gdt.size()))
+        return fail(_writer.errorString());
+
+    char *sb = _superblock.data();
+    put32(sb+0x0C, _freeBlocks);
+    put32(sb+0x10, _freeInodes);
+    put32(sb+0x30, ::time(NULL));
+    put32(sb+0x64, _roCompat);
+    if (!_writer.write(1024, _superblock.constData(), _superblock.size()))
+        return fail(_writer.errorString());
+
+    if (!_writer.flush())
+        return fail(_writer.errorString());
+
+    qDebug() << "Populated" << _device << "with" << _nodes.size() << "inodes," << _freeBlocks << "blocks free";
+
+    return true;
+}
@@ -0,0 +1,151 @@
+#ifndef EXT4BUILDER_H
+#define EXT4BUILDER_H
+
+/* Userspace ext4 populator
+ *
+ * Fills an unmounted ext4 file system, as just created by mkfs.ext4,
+ * with the contents of a tar stream without going through the kernel.
+ * File data is allocated in the order it arrives in the stream and is
+ * written as large sequential chunks. Directories, inodes, bitmaps and
+ * group descriptors are kept in memory and written in one go at the
+ * end, instead of as many small scattered metadata and journal writes.
+ *
+ * The layout created by mkfs (journal, reserved GDT blocks, flex_bg
+ * placement of the tables) is kept as is. open() refuses file systems
+ * with features this code cannot update (e.g. metadata_csum, 64bit,
+ * bigalloc), which should be mounted and extracted to instead.
+ * Directories are written without htree index, like mke2fs -d does.
+ *
+ * Maintained by Raspberry Pi
+ *
+ * See LICENSE.txt for license details
+ *
+ */
+
+#include "tarextractor.h"
+#include "blockwriter.h"
+#include <QHash>
+#include <QVector>
+
+class Ext4Builder : public TarExtractor
+{
+public:
+    explicit Ext4Builder(const QString &device);
+    virtual ~Ext4Builder();
+
+    /* Reads the superblock, group descriptors and bitmaps.
+     * Returns false if the file system cannot be populated in userspace */
+    bool open();
+    /* Record the blocks written for read-back verification */
+    void setVerifier(WriteVerifier *verifier);
+
+protected:
+    struct Extent
+    {
+        quint32 logical, start, len;
+    };
+
+    struct DirEntry
+    {
+        quint32 ino;
+        uchar type;
+    };
+
+    struct Node
+    {
+        quint32 ino, links;
+        uint mode, uid, gid, devmajor, devminor;
+        qint64 size, mtime;
+        QList<Extent> extents;
+        quint32 dataBlocks;
+        /* Extent tree leaf blocks, for files with more than 4 extents */
+        QList<quint32> leaves;
+        QByteArray symlink;
+        QMap<QByteArray,QByteArray> xattrs;
+        quint32 xattrBlock;
+        bool xattrsInInode;
+        /* Directories only */
+        QMap<QByteArray,DirEntry> entries;
+        quint32 parent;
+        /* Existing inodes (root, lost+found) keep the fields this code does not set */
+        bool existing, entriesChanged;
+    };
+
+    struct Xattr
+    {
+        uchar index;
+        QByteArray name, value;
+    };
+
+    struct Group
+    {
+        quint32 blockBitmap, inodeBitmap, inodeTable;
+        quint32 freeBlocks, freeInodes, usedDirs, itableUnused;
+        quint16 flags;
+        /* Number of inodes in use when the file system was opened, their table blocks are read from disk */
+        quint32 initialInodes;
+        bool blockBitmapChanged, inodeBitmapChanged;
+    };
+
+    virtual bool extractEntry(Entry &e);
+    virtual bool finishExtraction();
+
+    bool extractData(Node *node, Entry &e);
+    bool appendData(Node *node, qint64 offset, const char *data, qint64 len);
+    bool flushPartialBlock(Node *node);
+    bool addBlocks(Node *node, quint32 logical, const char *data, quint32 count);
+
+    Node *newNode(uint mode, const Entry *e);
+    Node *node(quint32 ino);
+    Node *loadDirectory(quint32 ino);
+    Node *directory(const QByteArray &path, bool create = true);
+    bool link(Node *dir, const QByteArray &name, Node *n);
+    bool unlink(quint32 ino);
+
+    bool allocateBlocks(quint32 wanted, quint32 &start, quint32 &count);
+    void freeBlocks(quint32 start, quint32 count);
+    quint32 allocateInode(bool isDir);
+    void markBlockUsed(quint32 block);
+    void initBlockBitmap(int group, QByteArray &bitmap);
+    quint32 blocksInGroup(int group) const;
+    bool hasSuperblock(int group) const;
+
+    bool writeDirectory(Node *dir);
+    bool writeExtentTree(Node *n);
+    void encodeExtents(const QList<Extent> &extents, int first, int count, char *buf, int max);
+    bool encodeInode(Node *n);
+    QList<Xattr> xattrList(Node *n);
+    static bool xattrLessThan(const Xattr &a, const Xattr &b);
+    static quint32 xattrHash(const Xattr &a);
+    static bool layoutXattrs(const QList<Xattr> &attrs, char *buf, int size, int first, int valueBase);
+    bool writeXattrs(Node *n);
+    char *inodeData(quint32 ino);
+    bool readBlocks(quint32 block, char *buf, int count);
+    quint16 groupChecksum(int group, const char *desc);
+
+    QString _device;
+    BlockWriter _writer;
+    QByteArray _superblock, _gdt;
+    QByteArray _uuid;
+    int _blockSize, _inodeSize, _descSize, _groupCount, _gdtBlocks, _reservedGdtBlocks;
+    quint32 _blocksCount, _inodesCount, _firstDataBlock, _blocksPerGroup, _inodesPerGroup, _firstIno;
+    quint32 _freeBlocks, _freeInodes;
+    quint32 _compat, _incompat, _roCompat;
+
+    QList<Group> _groups;
+    QVector<QByteArray> _blockBitmaps, _inodeBitmaps;
+    quint32 _blockCursor, _inodeCursor;
+
+    QHash<quint32,Node *> _nodes;
+    QHash<quint32,QByteArray> _inodeTableBlocks;
+
+    /* Last directory looked up, tar members come grouped by directory */
+    QByteArray _lastDirPath;
+    Node *_lastDir;
+
+    /* File data that does not fill a complete block yet */
+    QByteArray _partial;
+    qint64 _partialBlock;
+};
+
+#endif // EXT4BUILDER_H
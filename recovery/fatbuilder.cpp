@@ -0,0 +1,745 @@
+#include "fatbuilder.h"
+#include "blockwriter.h"
+#include "util.h"
+#include <QDebug>
+#include <QQueue>
+#include <string.h>
+#include <time.h>
+
+/* In-memory FAT32 image builder
+ *
+ * Maintained by Raspberry Pi
+ *
+ * See LICENSE.txt for license details
+ *
+ */
+
+#define FAT_SECTOR_SIZE         512
+#define FAT_DIRENT_SIZE         32
+#define FAT_RESERVED_SECTORS    32
+#define FAT_MIN_CLUSTERS        65525
+#define FAT_MAX_CLUSTERS        0x0FFFFFF5
+#define FAT_EOC                 0x0FFFFFFF
+#define FAT_MAX_FILE_SIZE       Q_INT64_C(0xFFFFFFFF)
+
+#define FAT_ATTR_READ_ONLY      0x01
+#define FAT_ATTR_VOLUME_ID      0x08
+#define FAT_ATTR_DIRECTORY      0x10
+#define FAT_ATTR_ARCHIVE        0x20
+#define FAT_ATTR_LONG_NAME      0x0F
+
+/* Case of 8.3 names that are all lower case, as used by Linux and Windows NT */
+#define FAT_CASE_LOWER_BASE     0x08
+#define FAT_CASE_LOWER_EXT      0x10
+
+static inline void put16(char *p, quint16 v)
+{
+    p[0] = v & 0xFF;
+    p[1] = v >> 8;
+}
+
+static inline void put32(char *p, quint32 v)
+{
+    put16(p, v & 0xFFFF);
+    put16(p+2, v >> 16);
+}
+
+static QByteArray lowerName(const QByteArray &name)
+{
+    return QString::fromUtf8(name).toLower().toUtf8();
+}
+
+static bool isShortNameChar(char c)
+{
+    return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9')
+            || (c && strchr("$%'-_@~`!(){}^#&", c));
+}
+
+/* Letter case of a name part: 0 no letters, 1 lower, 2 upper, 3 mixed */
+static int letterCase(const QByteArray &s)
+{
+    int c = 0;
+
+    for (int i = 0; i < s.size(); i++)
+    {
+        if (s.at(i) >= 'a' && s.at(i) <= 'z')
+            c |= 1;
+        else if (s.at(i) >= 'A' && s.at(i) <= 'Z')
+            c |= 2;
+    }
+
+    return c;
+}
+
+/* Names that are valid 8.3 names in a single case are stored without long name entries */
+static bool exactShortName(const QByteArray &name, QByteArray &shortName, uchar &caseFlags)
+{
+    int dot = name.lastIndexOf('.');
+    QByteArray base = dot == -1 ? name : name.left(dot);
+    QByteArray ext  = dot == -1 ? QByteArray() : name.mid(dot+1);
+
+    if (base.isEmpty() || base.size() > 8 || ext.size() > 3 || (dot != -1 && ext.isEmpty()))
+        return false;
+    for (int i = 0; i < base.size(); i++)
+        if (!isShortNameChar(base.at(i)))
+            return false;
+    for (int i = 0; i < ext.size(); i++)
+        if (!isShortNameChar(ext.at(i)))
+            return false;
+
+    int baseCase = letterCase(base), extCase = letterCase(ext);
+    if (baseCase == 3 || extCase == 3)
+        return false;
+
+    caseFlags = (baseCase == 1 ? FAT_CASE_LOWER_BASE : 0) | (extCase == 1 ? FAT_CASE_LOWER_EXT : 0);
+    shortName = base.toUpper().leftJustified(8, ' ') + ext.toUpper().leftJustified(3, ' ');
+
+    return true;
+}
+
+static QByteArray shortNamePart(const QByteArray &s)
+{
+    QByteArray r;
+
+    for (int i = 0; i < s.size(); i++)
+    {
+        if (s.at(i) == ' ' || s.at(i) == '.')
+            continue;
+        r += isShortNameChar(s.at(i)) ? s.at(i) : '_';
+    }
+
+    return r.toUpper();
+}
+
+static uchar shortNameChecksum(const QByteArray &shortName)
+{
+    uchar sum = 0;
+
+    for (int i = 0; i < 11; i++)
+        sum = ((sum & 1) << 7) + (sum >> 1) + uchar(shortName.at(i));
+
+    return sum;
+}
+
+static void dosTime(qint64 t, quint16 &time, quint16 &date)
+{
+    struct tm tm;
+    time_t tt = t;
+
+    if (t < 315532800) /* 1980-01-01, the earliest FAT date */
+        tt = 315532800;
+    gmtime_r(&tt, &tm);
+    if (tm.tm_year > 207)
+    {
+        tm.tm_year = 207;
+        tm.tm_mon  = 11;
+        tm.tm_mday = 31;
+    }
+
+    time = (tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec / 2);
+    date = ((tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5) | tm.tm_mday;
+}
+
+FatBuilder::FatBuilder(const QByteArray &label, quint32 sectors, quint32 hiddenSectors, qint64 memoryLimit)
+    : TarExtractor(QString()), _label(label), _sectors(sectors), _hiddenSectors(hiddenSectors),
+      _dataBytes(0), _memoryLimit(memoryLimit ? memoryLimit : availableMemory() / 2)
+{
+    if (!geometry(sectors, _geometry))
+        memset(&_geometry, 0, sizeof(_geometry));
+    _clusterSize = _geometry.sectorsPerCluster * FAT_SECTOR_SIZE;
+
+    _root = newNode(NULL, QByteArray(), true);
+    _root->mode  = 0755;
+}
+
+FatBuilder::~FatBuilder()
+{
+    qDeleteAll(_nodes);
+}
+
+bool FatBuilder::geometry(quint32 sectors, Geometry &g)
+{
+    quint64 bytes = quint64(sectors) * FAT_SECTOR_SIZE;
+
+    if (sectors < FAT_RESERVED_SECTORS)
+        return false;
+
+    /* Cluster sizes as recommended by Microsoft for FAT32 */
+    if (bytes <= Q_UINT64_C(260) << 20)
+        g.sectorsPerCluster = 1;
+    else if (bytes <= Q_UINT64_C(8) << 30)
+        g.sectorsPerCluster = 8;
+    else if (bytes <= Q_UINT64_C(16) << 30)
+        g.sectorsPerCluster = 16;
+    else if (bytes <= Q_UINT64_C(32) << 30)
+        g.sectorsPerCluster = 32;
+    else
+        g.sectorsPerCluster = 64;
+
+    g.reservedSectors = FAT_RESERVED_SECTORS;
+    g.fatSectors = ((quint64(sectors - g.reservedSectors) / g.sectorsPerCluster + 2) * 4 + FAT_SECTOR_SIZE - 1) / FAT_SECTOR_SIZE;
+
+    /* Let the data area start on a cluster boundary */
+    g.reservedSectors += (g.sectorsPerCluster - (g.reservedSectors + 2*g.fatSectors) % g.sectorsPerCluster) % g.sectorsPerCluster;
+    if (sectors <= g.reservedSectors + 2*g.fatSectors)
+        return false;
+
+    g.clusters = (sectors - g.reservedSectors - 2*g.fatSectors) / g.sectorsPerCluster;
+
+    return g.clusters >= FAT_MIN_CLUSTERS && g.clusters <= FAT_MAX_CLUSTERS;
+}
+
+bool FatBuilder::canBuild(quint32 sectors)
+{
+    Geometry g;
+    return geometry(sectors, g);
+}
+
+FatBuilder::Node *FatBuilder::newNode(Node *dir, const QByteArray &name, bool isDir)
+{
+    Node *n = new Node;
+    n->name   = name;
+    n->isDir  = isDir;
+    n->mode   = isDir ? 0755 : 0644;
+    n->mtime  = ::time(NULL);
+    n->parent = dir;
+    n->caseFlags = 0;
+    n->lfnEntries = 0;
+    n->cluster = n->clusterCount = 0;
+    _nodes.append(n);
+
+    if (dir)
+    {
+        /* Names are case insensitive, an existing entry is replaced */
+        QByteArray key = lowerName(name);
+        Node *old = dir->index.value(key);
+        if (old)
+        {
+            dir->children.removeOne(old);
+            _dataBytes -= old->data.size();
+            old->data.clear();
+            old->children.clear();
+        }
+        dir->children.append(n);
+        dir->index.insert(key, n);
+    }
+
+    return n;
+}
+
+FatBuilder::Node *FatBuilder::lookup(const QByteArray &path, bool create)
+{
+    Node *n = _root;
+
+    foreach (const QByteArray &component, path.split('/'))
+    {
+        if (component.isEmpty() || component == ".")
+            continue;
+
+        Node *child = n->index.value(lowerName(component));
+        if (!child && create)
+        {
+            if (!checkName(component))
+                return NULL;
+            child = newNode(n, component, true);
+        }
+        if (!child || !child->isDir)
+        {
+            if (create)
+                fail("Error creating directory '"+QString::fromUtf8(path)+"': not a directory");
+            return NULL;
+        }
+        n = child;
+    }
+
+    return n;
+}
+
+bool FatBuilder::checkName(const QByteArray &name)
+{
+    if (name.isEmpty() || name == "." || name == "..")
+        return fail("Invalid file name '"+QString::fromUtf8(name)+"'");
+
+    for (int i = 0; i < name.size(); i++)
+    {
+        if (uchar(name.at(i)) < 0x20 || strchr("\"*/:<>?\\|", name.at(i)))
+            return fail("File name '"+QString::fromUtf8(name)+"' is not valid on a FAT file system");
+    }
+
+    if (QString::fromUtf8(name).size() > 255)
+        return fail("File name '"+QString::fromUtf8(name)+"' is too long for a FAT file system");
+
+    return true;
+}
+
+bool FatBuilder::checkMemory(qint64 extra)
+{
+    _dataBytes += extra;
+
+    if (!_geometry.clusters)
+        return fail("The partition is too small for a FAT32 file system");
+    if (_dataBytes > qint64(_geometry.clusters) * _clusterSize)
+        return fail("The files do not fit in the FAT partition");
+    if (_dataBytes > _memoryLimit)
+        return fail("Not enough memory to assemble the FAT partition");
+
+    return true;
+}
+
+bool FatBuilder::readData(Node *n, Entry &e)
+{
+    qint64 size = e.sparse ? e.realsize : e.size, consumed = 0, end = 0;
+    QList<QPair<qint64,qint64> > segments;
+
+    if (e.sparse && e.sparseMajor == 1 && !readSparseMap10(e, consumed))
+        return false;
+    if (size > FAT_MAX_FILE_SIZE)
+        return fail("File '"+QString::fromUtf8(e.path)+"' is too large for a FAT file system");
+    if (!checkMemory(size))
+        return false;
+
+    /* Holes of sparse files are filled with zeroes */
+    n->data.fill(0, size);
+
+    if (e.sparse)
+        segments = e.sparseMap;
+    else
+        segments.append(qMakePair(qint64(0), e.size));
+
+    for (int i = 0; i < segments.size(); i++)
+    {
+        qint64 offset = segments.at(i).first, len = segments.at(i).second;
+
+        if (offset < end || len < 0 || offset+len > size || consumed+len > e.size)
+            return fail("Invalid GNU sparse map");
+        end = offset+len;
+
+        if (!readStream(n->data.data()+offset, len))
+            return false;
+        consumed += len;
+        _bytesWritten += len;
+    }
+
+    return skipStream(paddedSize(e.size) - consumed);
+}
+
+bool FatBuilder::extractEntry(Entry &e)
+{
+    QByteArray path = e.path;
+
+    if (!sanitizePath(path))
+    {
+        qDebug() << "Skipping tar member with '..' in its path:" << e.path;
+        return skipStream(paddedSize(e.size));
+    }
+    /* The root directory has no attributes of its own */
+    if (path.isEmpty())
+        return skipStream(paddedSize(e.size));
+
+    int slash = path.lastIndexOf('/');
+    QByteArray name = path.mid(slash+1);
+    if (!checkName(name))
+        return false;
+
+    Node *dir = lookup(slash == -1 ? QByteArray() : path.left(slash), true);
+    if (!dir)
+        return false;
+
+    switch (e.type)
+    {
+    case '0':
+    case '7':
+    case 'S':
+    {
+        Node *n = newNode(dir, name, false);
+        n->mode  = e.mode;
+        n->mtime = e.mtime;
+        if (!readData(n, e))
+            return false;
+        _entries++;
+        return true;
+    }
+
+    case '1':
+    {
+        QByteArray linkpath = e.linkpath;
+        Node *target = sanitizePath(linkpath) ? find(linkpath) : NULL;
+        if (!target || target->isDir)
+            return fail("Error creating hard link '"+QString::fromUtf8(path)+"': invalid target");
+
+        /* FAT has no hard links, the file is stored twice. The data is shared in memory */
+        if (!checkMemory(target->data.size()))
+            return false;
+        Node *n = newNode(dir, name, false);
+        n->mode  = target->mode;
+        n->mtime = target->mtime;
+        n->data  = target->data;
+        _entries++;
+        break;
+    }
+
+    case '5':
+    {
+        Node *n = dir->index.value(lowerName(name));
+        if (!n || !n->isDir)
+            n = newNode(dir, name, true);
+        n->mode  = e.mode;
+        n->mtime = e.mtime;
+        _entries++;
+        break;
+    }
+
+    case '2':
+    case '3':
+    case '4':
+    case '6':
+        return fail("Error creating '"+QString::fromUtf8(path)+"': symbolic links and device nodes are not supported on FAT file systems");
+
+    default:
+        qDebug() << "Skipping tar member of unsupported type" << e.type << ":" << e.path;
+    }
+
+    return skipStream(paddedSize(e.size));
+}
+
+bool FatBuilder::addFile(const QByteArray &path, const QByteArray &data, bool append)
+{
+    int slash = path.lastIndexOf('/');
+    QByteArray name = path.mid(slash+1);
+
+    if (!checkName(name) || !checkMemory(data.size()))
+        return false;
+
+    Node *dir = lookup(slash == -1 ? QByteArray() : path.left(slash), true);
+    if (!dir)
+        return false;
+
+    Node *n = dir->index.value(lowerName(name));
+    if (n && !n->isDir && append)
+    {
+        n->data.append(data);
+        n->mtime = ::time(NULL);
+    }
+    else
+    {
+        n = newNode(dir, name, false);
+        n->data = data;
+    }
+
+    if (n->data.size() > FAT_MAX_FILE_SIZE)
+        return fail("File '"+QString::fromUtf8(path)+"' is too large for a FAT file system");
+
+    return true;
+}
+
+FatBuilder::Node *FatBuilder::find(const QByteArray &path)
+{
+    int slash = path.lastIndexOf('/');
+    Node *dir = lookup(slash == -1 ? QByteArray() : path.left(slash), false);
+
+    return dir ? dir->index.value(lowerName(path.mid(slash+1))) : NULL;
+}
+
+bool FatBuilder::exists(const QByteArray &path)
+{
+    return find(path) != NULL;
+}
+
+/* Generate unique 8.3 names for the entries of a directory, and its subdirectories */
+void FatBuilder::assignShortNames(Node *dir)
+{
+    QSet<QByteArray> used;
+    QList<Node *> generate;
+
+    foreach (Node *n, dir->children)
+    {
+        if (exactShortName(n->name, n->shortName, n->caseFlags) && !used.contains(n->shortName))
+            used.insert(n->shortName);
+        else
+            generate.append(n);
+    }
+
+    foreach (Node *n, generate)
+    {
+        QByteArray name = n->name;
+        while (name.startsWith('.'))
+            name.remove(0, 1);
+
+        int dot = name.lastIndexOf('.');
+        QByteArray base = shortNamePart(dot == -1 ? name : name.left(dot));
+        QByteArray ext  = shortNamePart(dot == -1 ? QByteArray() : name.mid(dot+1)).left(3);
+        if (base.isEmpty())
+            base = "_";
+
+        for (int i = 1; ; i++)
+        {
+            QByteArray tail = "~"+QByteArray::number(i);
+            n->shortName = (base.left(8 - tail.size()) + tail).leftJustified(8, ' ') + ext.leftJustified(3, ' ');
+            if (!used.contains(n->shortName))
+                break;
+        }
+        used.insert(n->shortName);
+
+        n->caseFlags  = 0;
+        n->lfnEntries = (QString::fromUtf8(n->name).size() + 12) / 13;
+    }
+
+    foreach (Node *n, dir->children)
+    {
+        if (n->isDir)
+            assignShortNames(n);
+    }
+}
+
+/* Directories first, breadth first, then the files. All of them in contiguous clusters */
+bool FatBuilder::layout(QList<Node *> &order, quint32 &usedClusters)
+{
+    QList<Node *> dirs;
+    QQueue<Node *> queue;
+
+    assignShortNames(_root);
+
+    queue.enqueue(_root);
+    while (!queue.isEmpty())
+    {
+        Node *dir = queue.dequeue();
+        int entries = (dir == _root) ? (_label.isEmpty() ? 0 : 1) : 2;
+
+        foreach (Node *n, dir->children)
+        {
+            entries += 1 + n->lfnEntries;
+            if (n->isDir)
+                queue.enqueue(n);
+        }
+
+        dir->clusterCount = qMax(quint32(1), quint32((qint64(entries) * FAT_DIRENT_SIZE + _clusterSize - 1) / _clusterSize));
+        dirs.append(dir);
+    }
+
+    order = dirs;
+    foreach (Node *dir, dirs)
+    {
+        foreach (Node *n, dir->children)
+        {
+            if (!n->isDir && !n->data.isEmpty())
+            {
+                n->clusterCount = (qint64(n->data.size()) + _clusterSize - 1) / _clusterSize;
+                order.append(n);
+            }
+        }
+    }
+
+    quint32 next = 2;
+    foreach (Node *n, order)
+    {
+        n->cluster = next;
+        next += n->clusterCount;
+        if (next - 2 > _geometry.clusters)
+            return fail("The files do not fit in the FAT partition");
+    }
+    usedClusters = next - 2;
+
+    return true;
+}
+
+void FatBuilder::appendDirEntry(QByteArray &data, const Node *n)
+{
+    char e[FAT_DIRENT_SIZE];
+
+    /* Long name entries precede the short name entry, last part first */
+    if (n->lfnEntries)
+    {
+        QString name = QString::fromUtf8(n->name);
+        uchar checksum = shortNameChecksum(n->shortName);
+        static const int offsets[13] = {1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30};
+
+        for (int i = n->lfnEntries; i > 0; i--)
+        {
+            memset(e, 0, sizeof(e));
+            e[0]  = i | (i == n->lfnEntries ? 0x40 : 0);
+            e[11] = FAT_ATTR_LONG_NAME;
+            e[13] = checksum;
+
+            for (int j = 0; j < 13; j++)
+            {
+                int pos = (i-1)*13 + j;
+                quint16 c = pos < name.size() ? name.at(pos).unicode() : (pos == name.size() ? 0 : 0xFFFF);
+                put16(e + offsets[j], c);
+            }
+            data.append(e, sizeof(e));
+        }
+    }
+
+    quint16 time, date;
+    dosTime(n->mtime, time, date);
+
+    memset(e, 0, sizeof(e));
+    memcpy(e, n->shortName.constData(), 11);
+    if (uchar(e[0]) == 0xE5)
+        e[0] = 0x05;
+    e[11] = n->isDir ? FAT_ATTR_DIRECTORY : (FAT_ATTR_ARCHIVE | ((n->mode & 0200) ? 0 : FAT_ATTR_READ_ONLY));
+    e[12] = n->caseFlags;
+    put16(e+14, time);
+    put16(e+16, date);
+    put16(e+18, date);
+    put16(e+20, n->cluster >> 16);
+    put16(e+22, time);
+    put16(e+24, date);
+    put16(e+26, n->cluster & 0xFFFF);
+    put32(e+28, n->isDir ? 0 : n->data.size());
+    data.append(e, sizeof(e));
+}
+
+QByteArray FatBuilder::directoryData(Node *dir)
+{
+    QByteArray data;
+
+    if (dir == _root)
+    {
+        if (!_label.isEmpty())
+        {
+            Node label;
+            label.shortName = _label.left(11).leftJustified(11, ' ');
+            label.isDir = false;
+            label.mode = 0644;
+            label.mtime = ::time(NULL);
+            label.caseFlags = 0;
+            label.lfnEntries = 0;
+            label.cluster = 0;
+
+            appendDirEntry(data, &label);
+            data[11] = FAT_ATTR_VOLUME_ID;
+        }
+    }
+    else
+    {
+        /* The . and .. entries. A cluster of 0 refers to the root directory */
+        Node dot = *dir;
+        dot.shortName = ".          ";
+        dot.caseFlags = 0;
+        dot.lfnEntries = 0;
+        appendDirEntry(data, &dot);
+
+        dot.shortName = "..         ";
+        dot.cluster = (dir->parent == _root) ? 0 : dir->parent->cluster;
+        appendDirEntry(data, &dot);
+    }
+
+    foreach (Node *n, dir->children)
+        appendDirEntry(data, n);
+
+    data.append(QByteArray(qint64(dir->clusterCount) * _clusterSize - data.size(), 0));
+    return data;
+}
+
+/* Boot sector and FS information sector, followed by their backup copies */
+QByteArray FatBuilder::bootSectors(quint32 freeClusters, quint32 nextFree)
+{
+    QByteArray data(_geometry.reservedSectors * FAT_SECTOR_SIZE, 0);
+    char *b = data.data();
+    quint32 volumeId = quint32(::time(NULL)) ^ (_hiddenSectors * 2654435761U);
+
+    /* Jump over the parameter block to code that just halts */
+    b[0] = 0xEB; b[1] = 0x58; b[2] = 0x90;
+    memcpy(b+3, "NOOBS   ", 8);
+    put16(b+0x0B, FAT_SECTOR_SIZE);
+    b[0x0D] = _geometry.sectorsPerCluster;
+    put16(b+0x0E, _geometry.reservedSectors);
+    b[0x10] = 2;                        /* Number of FATs */
+    b[0x15] = 0xF8;                     /* Media descriptor: fixed disk */
+    put16(b+0x18, 63);                  /* Sectors per track */
+    put16(b+0x1A, 255);                 /* Heads */
+    put32(b+0x1C, _hiddenSectors);
+    put32(b+0x20, _sectors);
+    put32(b+0x24, _geometry.fatSectors);
+    put32(b+0x2C, 2);                   /* Root directory cluster */
+    put16(b+0x30, 1);                   /* FS information sector */
+    put16(b+0x32, 6);                   /* Backup boot sector */
+    b[0x40] = 0x80;                     /* Drive number */
+    b[0x42] = 0x29;                     /* Extended boot signature */
+    put32(b+0x43, volumeId);
+    memcpy(b+0x47, (_label.isEmpty() ? QByteArray("NO NAME") : _label.left(11)).leftJustified(11, ' ').constData(), 11);
+    memcpy(b+0x52, "FAT32   ", 8);
+    b[0x5A] = 0xFA; b[0x5B] = 0xF4; b[0x5C] = 0xEB; b[0x5D] = 0xFD;
+    b[0x1FE] = 0x55; b[0x1FF] = 0xAA;
+
+    char *info = b + FAT_SECTOR_SIZE;
+    put32(info, 0x41615252);
+    put32(info+484, 0x61417272);
+    put32(info+488, freeClusters);
+    put32(info+492, nextFree);
+    put32(info+508, 0xAA550000);
+
+    memcpy(b + 6*FAT_SECTOR_SIZE, b, 2*FAT_SECTOR_SIZE);
+
+    return data;
+}
+
+bool FatBuilder::writeFats(BlockWriter &writer, const QList<Node *> &order, qint64 &offset)
+{
+    QByteArray fat(qint64(_geometry.fatSectors) * FAT_SECTOR_SIZE, 0);
+    char *f = fat.data();
+
+    put32(f,   0x0FFFFFF8);
+    put32(f+4, FAT_EOC);
+    foreach (Node *n, order)
+    {
+        for (quint32 c = n->cluster; c < n->cluster + n->clusterCount - 1; c++)
+            put32(f + c*4, c+1);
+        put32(f + (n->cluster + n->clusterCount - 1)*4, FAT_EOC);
+    }
+
+    for (int i = 0; i < 2; i++)
+    {
+        if (!writer.write(offset, fat.constData(), fat.size()))
+            return fail(writer.errorString());
+        offset += fat.size();
+    }
+
+    return true;
+}
+
+bool FatBuilder::writeTo(const QString &device, int queueDepth, int chunkSize, WriteVerifier *verifier)
+{
+    QList<Node *> order;
+    quint32 usedClusters;
+
+    if (!_geometry.clusters)
+        return fail("The partition is too small for a FAT32 file system");
+    if (!layout(order, usedClusters))
+        return false;
+
+    BlockWriter writer(queueDepth, chunkSize);
+    if (!writer.open(device))
+        return fail(writer.errorString());
+    writer.setVerifier(verifier);
+
+    /* Everything is written in a single pass, in disk order */
+    QByteArray data = bootSectors(_geometry.clusters - usedClusters, usedClusters + 2);
+    qint64 offset = 0;
+    if (!writer.write(offset, data.constData(), data.size()))
+        return fail(writer.errorString());
+    offset += data.size();
+
+    if (!writeFats(writer, order, offset))
+        return false;
+
+    QByteArray padding(_clusterSize, 0);
+    foreach (Node *n, order)
+    {
+        const QByteArray &d = n->isDir ? (data = directoryData(n)) : n->data;
+        int pad = qint64(n->clusterCount) * _clusterSize - d.size();
+
+        if (!writer.write(offset, d.constData(), d.size()) || !writer.write(offset + d.size(), padding.constData(), pad))
+            return fail(writer.errorString());
+        offset += d.size() + pad;
+    }
+
+    if (!writer.flush() || !writer.close())
+        return fail(writer.errorString());
+
+    qDebug() << "Wrote FAT32 file system of" << _entries << "entries to" << device << ":"
+             << usedClusters << "of" << _geometry.clusters << "clusters of" << _clusterSize << "bytes in use";
+
+    return true;
+}
@@ -0,0 +1,101 @@
+#ifndef FATBUILDER_H
+#define FATBUILDER_H
+
+/* In-memory FAT32 image builder
+ *
+ * Assembles a complete FAT32 file system in memory from a tar stream
+ * plus any files added afterwards (os_config.json, config.txt
+ * additions), and writes it to the partition in a single sequential
+ * pass from the first sector onwards: boot sectors, both FATs, then
+ * directories and file data in contiguous clusters.
+ *
+ * This replaces mkfs.fat, mounting, extracting through the vfat
+ * driver and patching files on the mounted file system, which all
+ * cause many small scattered FAT and directory updates on the card.
+ *
+ * Like the vfat driver, names are matched case-insensitively and
+ * symbolic links and device nodes cannot be stored.
+ *
+ * Maintained by Raspberry Pi
+ *
+ * See LICENSE.txt for license details
+ *
+ */
+
+#include "tarextractor.h"
+#include <QHash>
+#include <QSet>
+
+class BlockWriter;
+class WriteVerifier;
+
+class FatBuilder : public TarExtractor
+{
+public:
+    /* sectors: size of the partition, hiddenSectors: its start on the card,
+     * memoryLimit: bytes the file data may take up, 0 for half of the available memory */
+    FatBuilder(const QByteArray &label, quint32 sectors, quint32 hiddenSectors, qint64 memoryLimit = 0);
+    virtual ~FatBuilder();
+
+    /* Returns false if a partition of that many sectors is too small for FAT32 */
+    static bool canBuild(quint32 sectors);
+
+    /* Add a file, or append to it if it already exists. Parent directories are created */
+    bool addFile(const QByteArray &path, const QByteArray &data, bool append = false);
+    bool exists(const QByteArray &path);
+
+    /* Lay out the file system and write it to the device. What is written is recorded in verifier, if given */
+    bool writeTo(const QString &device, int queueDepth, int chunkSize, WriteVerifier *verifier = NULL);
+
+protected:
+    struct Geometry
+    {
+        quint32 sectorsPerCluster, reservedSectors, fatSectors, clusters;
+    };
+
+    struct Node
+    {
+        QByteArray name;
+        bool isDir;
+        uint mode;
+        qint64 mtime;
+        QByteArray data;
+        /* Directories only, in creation order, and indexed by lower case name */
+        QList<Node *> children;
+        QHash<QByteArray,Node *> index;
+        Node *parent;
+        /* Filled in by layout() */
+        QByteArray shortName;
+        uchar caseFlags;
+        int lfnEntries;
+        quint32 cluster, clusterCount;
+    };
+
+    static bool geometry(quint32 sectors, Geometry &g);
+    virtual bool extractEntry(Entry &e);
+
+    Node *newNode(Node *dir, const QByteArray &name, bool isDir);
+    /* Directory lookup, optionally creating missing directories */
+    Node *lookup(const QByteArray &path, bool create);
+    Node *find(const QByteArray &path);
+    bool readData(Node *n, Entry &e);
+    bool checkName(const QByteArray &name);
+    bool checkMemory(qint64 extra);
+
+    void assignShortNames(Node *dir);
+    bool layout(QList<Node *> &order, quint32 &usedClusters);
+    QByteArray directoryData(Node *dir);
+    void appendDirEntry(QByteArray &data, const Node *n);
+    QByteArray bootSectors(quint32 freeClusters, quint32 nextFree);
+    bool writeFats(BlockWriter &writer, const QList<Node *> &order, qint64 &offset);
+
+    QByteArray _label;
+    quint32 _sectors, _hiddenSectors;
+    Geometry _geometry;
+    quint32 _clusterSize;
+    Node *_root;
+    QList<Node *> _nodes;
+    qint64 _dataBytes, _memoryLimit;
+};
+
+#endif // FATBUILDER_H
@@ -0,0 +1,283 @@
+#include "filesystemprober.h"
+#include "util.h"
+#include <QFile>
+#include <QStringList>
+#include <QDebug>
+#include <string.h>
+
+/* File system superblock prober
+ *
+ * Maintained by Raspberry Pi
+ *
+ * See LICENSE.txt for license details
+ *
+ */
+
+static quint16 le16(const char *p)
+{
+    const uchar *u = (const uchar *) p;
+    return u[0] | (u[1] << 8);
+}
+
+static quint32 le32(const char *p)
+{
+    return le16(p) | (quint32(le16(p+2)) << 16);
+}
+
+static quint64 le64(const char *p)
+{
+    return le32(p) | (quint64(le32(p+4)) << 32);
+}
+
+static QByteArray readAt(QFile &f, qint64 offset, qint64 len)
+{
+    if (!f.seek(offset))
+        return QByteArray();
+
+    QByteArray data = f.read(len);
+    if (data.size() != len)
+        data.clear();
+
+    return data;
+}
+
+/* Labels are padded with spaces or NUL characters */
+static QByteArray trimLabel(const char *p, int len)
+{
+    QByteArray label(p, qstrnlen(p, len));
+
+    while (label.endsWith(' '))
+        label.chop(1);
+
+    return label;
+}
+
+static QByteArray formatUuid(const char *p)
+{
+    QByteArray hex = QByteArray(p, 16).toHex();
+
+    return hex.mid(0, 8)+"-"+hex.mid(8, 4)+"-"+hex.mid(12, 4)+"-"+hex.mid(16, 4)+"-"+hex.mid(20);
+}
+
+static bool probeExt(QFile &f, FilesystemProber::Info &info)
+{
+    QByteArray sb = readAt(f, 1024, 1024);
+    if (sb.isEmpty() || le16(sb.constData()+0x38) != 0xEF53)
+        return false;
+
+    const char *s = sb.constData();
+    quint32 compat = le32(s+0x5C), incompat = le32(s+0x60), roCompat = le32(s+0x64);
+
+    /* extents, 64bit, flex_bg / huge_file, gdt_csum, dir_nlink, extra_isize */
+    if ((incompat & (0x40 | 0x80 | 0x200)) || (roCompat & (0x08 | 0x10 | 0x20 | 0x40)))
+        info.type = "ext4";
+    else if (compat & 0x04)
+        info.type = "ext3";
+    else
+        info.type = "ext2";
+    info.uuid  = formatUuid(s+0x68);
+    info.label = trimLabel(s+0x78, 16);
+
+    return true;
+}
+
+static bool probeSwap(QFile &f, FilesystemProber::Info &info)
+{
+    QByteArray page = readAt(f, 0, 4096);
+    if (page.isEmpty() || memcmp(page.constData()+4096-10, "SWAPSPACE2", 10) != 0)
+        return false;
+
+    info.type  = "swap";
+    info.uuid  = formatUuid(page.constData()+1024+12);
+    info.label = trimLabel(page.constData()+1024+28, 16);
+
+    return true;
+}
+
+static bool probeNtfs(QFile &f, FilesystemProber::Info &info)
+{
+    QByteArray boot = readAt(f, 0, 512);
+    if (boot.isEmpty() || memcmp(boot.constData()+3, "NTFS    ", 8) != 0)
+        return false;
+
+    const char *b = boot.constData();
+    quint32 bytesPerSector = le16(b+0x0B), sectorsPerCluster = (uchar) b[0x0D];
+    qint64 clusterSize = bytesPerSector * sectorsPerCluster;
+    signed char clustersPerRecord = b[0x40];
+    qint64 recordSize = clustersPerRecord > 0 ? clustersPerRecord * clusterSize : qint64(1) << -clustersPerRecord;
+
+    info.type = "ntfs";
+    info.uuid = QByteArray::number(le64(b+0x48), 16).toUpper().rightJustified(16, '0');
+
+    if (!clusterSize || recordSize < 512 || recordSize > 65536)
+        return true;
+
+    /* The label is the $VOLUME_NAME attribute of MFT record 3 ($Volume) */
+    QByteArray record = readAt(f, le64(b+0x30) * clusterSize + 3 * recordSize, recordSize);
+    if (record.isEmpty() || !record.startsWith("FILE"))
+        return true;
+
+    /* Undo the update sequence fixups at the end of each 512 byte block */
+    char *r = record.data();
+    int usaOffset = le16(r+4), usaCount = le16(r+6);
+    for (int i = 1; i < usaCount && usaOffset+i*2+2 <= recordSize && i*512 <= recordSize; i++)
+        memcpy(r + i*512 - 2, r + usaOffset + i*2, 2);
+
+    int offset = le16(r+0x14);
+    while (offset + 0x18 <= recordSize)
+    {
+        quint32 type = le32(r+offset), len = le32(r+offset+4);
+        if (type == 0xFFFFFFFF || len < 0x18 || offset + len > recordSize)
+            break;
+
+        /* Resident $VOLUME_NAME attribute, UTF-16 */
+        if (type == 0x60 && !r[offset+8])
+        {
+            quint32 valueLen = le32(r+offset+0x10), valueOffset = le16(r+offset+0x14);
+            if (valueOffset + valueLen <= len)
+            {
+                QString label = QString::fromUtf16((const ushort *) (r+offset+valueOffset), valueLen/2);
+                info.label = label.toUtf8();
+            }
+            break;
+        }
+        offset += len;
+    }
+
+    return true;
+}
+
+static bool probeFat(QFile &f, FilesystemProber::Info &info)
+{
+    QByteArray boot = readAt(f, 0, 512);
+    if (boot.isEmpty() || (uchar) boot.at(510) != 0x55 || (uchar) boot.at(511) != 0xAA)
+        return false;
+
+    const char *b = boot.constData();
+    quint32 bytesPerSector = le16(b+0x0B), sectorsPerCluster = (uchar) b[0x0D];
+    quint32 reserved = le16(b+0x0E), fats = (uchar) b[0x10], rootEntries = le16(b+0x11);
+    quint32 fatSize16 = le16(b+0x16);
+    bool fat32 = !fatSize16 && memcmp(b+0x52, "FAT32", 5) == 0;
+
+    if (!fat32 && memcmp(b+0x36, "FAT", 3) != 0)
+        return false;
+    if (bytesPerSector < 512 || bytesPerSector > 4096 || (bytesPerSector & (bytesPerSector-1)) || !sectorsPerCluster)
+        return false;
+
+    const char *ext = fat32 ? b+0x43 : b+0x27;
+    info.type  = "vfat";
+    info.uuid  = QByteArray::number(le16(ext+2), 16).toUpper().rightJustified(4, '0')+"-"
+               + QByteArray::number(le16(ext), 16).toUpper().rightJustified(4, '0');
+    info.label = trimLabel(ext+4, 11);
+
+    /* A volume label entry in the root directory takes precedence */
+    qint64 rootSector;
+    qint64 rootSize;
+    if (fat32)
+    {
+        rootSector = reserved + fats * le32(b+0x24) + qint64(le32(b+0x2C) - 2) * sectorsPerCluster;
+        rootSize = sectorsPerCluster * bytesPerSector;
+    }
+    else
+    {
+        rootSector = reserved + fats * fatSize16;
+        rootSize = rootEntries * 32;
+    }
+
+    QByteArray root = readAt(f, rootSector * bytesPerSector, qMin(rootSize, (qint64) 65536));
+    for (int i = 0; i + 32 <= root.size(); i += 32)
+    {
+        const char *entry = root.constData()+i;
+        uchar attr = entry[11];
+
+        if (!entry[0])
+            break;
+        if ((uchar) entry[0] == 0xE5 || attr == 0x0F)
+            continue;
+        if (attr & 0x08)
+        {
+            info.label = trimLabel(entry, 11);
+            break;
+        }
+    }
+    if (info.label == "NO NAME")
+        info.label.clear();
+
+    return true;
+}
+
+FilesystemProber::FilesystemProber()
+    : _scanned(false)
+{
+}
+
+FilesystemProber::Info FilesystemProber::probe(const QString &device)
+{
+    Info info;
+    QFile f(device);
+
+    if (f.open(f.ReadOnly))
+    {
+        if (!probeExt(f, info) && !probeSwap(f, info) && !probeNtfs(f, info))
+            probeFat(f, info);
+    }
+
+    return info;
+}
+
+/* Probe all block devices the kernel knows about */
+void FilesystemProber::scan()
+{
+    QList<QByteArray> lines = getFileContents("/proc/partitions").split('\n');
+
+    /* Skip the header line */
+    for (int i = 1; i < lines.size(); i++)
+    {
+        QList<QByteArray> fields = lines.at(i).simplified().split(' ');
+        if (fields.size() == 4)
+        {
+            QString device = "/dev/"+fields.at(3);
+            _cache.insert(device, probe(device));
+        }
+    }
+    _scanned = true;
+}
+
+FilesystemProber::Info FilesystemProber::info(const QString &device)
+{
+    if (!_cache.contains(device))
+        _cache.insert(device, probe(device));
+
+    return _cache.value(device);
+}
+
+QByteArray FilesystemProber::label(const QString &device)
+{
+    return info(device).label;
+}
+
+QByteArray FilesystemProber::uuid(const QString &device)
+{
+    return info(device).uuid;
+}
+
+bool FilesystemProber::isLabelInUse(const QByteArray &label, const QSet<QString> &ignore)
+{
+    if (label.isEmpty())
+        return false;
+    if (!_scanned)
+        scan();
+
+    for (QMap<QString,Info>::const_iterator it = _cache.constBegin(); it != _cache.constEnd(); ++it)
+    {
+        if (it.value().label == label && !ignore.contains(it.key()))
+            return true;
+    }
+
+    return false;
+}
+
+void FilesystemProber::invalidate(const QString &device)
+{
+    _cache.insert(device, probe(device));
+}
@@ -0,0 +1,51 @@
+#ifndef FILESYSTEMPROBER_H
+#define FILESYSTEMPROBER_H
+
+/* File system superblock prober
+ *
+ * Reads the label and UUID of FAT, ext2/3/4, NTFS and swap file
+ * systems straight from the device, in the same format blkid reports
+ * them, and caches the result for all block devices in the system.
+ * Label lookups are then simple memory lookups instead of findfs runs.
+ *
+ * Maintained by Raspberry Pi
+ *
+ * See LICENSE.txt for license details
+ *
+ */
+
+#include <QString>
+#include <QByteArray>
+#include <QMap>
+#include <QSet>
+
+class FilesystemProber
+{
+public:
+    struct Info
+    {
+        QByteArray type, label, uuid;
+    };
+
+    FilesystemProber();
+
+    /* Read the superblock of a single device, bypassing the cache */
+    static Info probe(const QString &device);
+
+    /* Cached information. Devices not seen before are probed first */
+    Info info(const QString &device);
+    QByteArray label(const QString &device);
+    QByteArray uuid(const QString &device);
+    /* Equivalent of findfs LABEL=... over all block devices, but those in ignore */
+    bool isLabelInUse(const QByteArray &label, const QSet<QString> &ignore = QSet<QString>());
+    /* Re-read a device after a file system was created on it */
+    void invalidate(const QString &device);
+
+protected:
+    void scan();
+
+    bool _scanned;
+    QMap<QString,Info> _cache;
+};
+
+#endif // FILESYSTEMPROBER_H
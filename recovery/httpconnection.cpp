@@ -0,0 +1,594 @@
+#include "httpconnection.h"
+#include <QMutexLocker>
+#include <QStringList>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+
+/* Minimal blocking HTTP/1.1 client
+ *
+ * Maintained by Raspberry Pi
+ *
+ * See LICENSE.txt for license details
+ *
+ */
+
+/* Longest status or header line accepted */
+#define HTTP_MAX_LINE   16384
+
+static bool splitUrl(const QString &url, QByteArray &host, int &port, QByteArray &path)
+{
+    QByteArray u = url.toUtf8();
+
+    if (u.toLower().startsWith("http://"))
+        u = u.mid(7);
+    else if (u.contains("://"))
+        return false;
+
+    int fragment = u.indexOf('#');
+    if (fragment != -1)
+        u.truncate(fragment);
+    u.replace(' ', "%20");
+
+    int slash = u.indexOf('/');
+    QByteArray authority = (slash == -1) ? u : u.left(slash);
+    path = (slash == -1) ? QByteArray("/") : u.mid(slash);
+
+    /* user:password@ is not supported, and left out */
+    int at = authority.lastIndexOf('@');
+    if (at != -1)
+        authority = authority.mid(at+1);
+
+    port = 80;
+    int colon = authority.lastIndexOf(':');
+    if (colon != -1 && colon > authority.lastIndexOf(']'))
+    {
+        port = authority.mid(colon+1).toInt();
+        authority.truncate(colon);
+    }
+    if (authority.startsWith('[') && authority.endsWith(']'))
+        authority = authority.mid(1, authority.size()-2);
+    host = authority;
+
+    return !host.isEmpty() && port > 0 && port < 65536;
+}
+
+/* Target of a redirect, relative to url */
+static QString resolveUrl(const QString &url, const QByteArray &location)
+{
+    if (location.contains("://"))
+        return location;
+    if (location.startsWith("//"))
+        return "http:"+location;
+
+    int hostEnd = url.indexOf('/', url.indexOf("://")+3);
+    if (hostEnd == -1)
+        hostEnd = url.size();
+
+    if (location.startsWith('/'))
+        return url.left(hostEnd)+location;
+
+    int query = url.indexOf('?');
+    QString base = (query == -1) ? url : url.left(query);
+    int dir = base.lastIndexOf('/');
+    return (dir < hostEnd) ? url.left(hostEnd)+"/"+location : base.left(dir+1)+location;
+}
+
+HttpConnection::HttpConnection()
+    : _fd(-1), _port(0), _keepAlive(false), _bufferPos(0), _status(0), _bodyOffset(0), _fileSize(-1),
+      _chunked(false), _chunkEnd(false), _bodyDone(true), _remaining(0)
+{
+}
+
+HttpConnection::~HttpConnection()
+{
+    close();
+}
+
+bool HttpConnection::fail(const QString &msg)
+{
+    _error = msg;
+    return false;
+}
+
+QString HttpConnection::errorString() const
+{
+    return _error;
+}
+
+int HttpConnection::status() const
+{
+    return _status;
+}
+
+QByteArray HttpConnection::header(const QByteArray &name) const
+{
+    return _headers.value(name);
+}
+
+/* Weak ETags cannot be used with If-Range */
+QByteArray HttpConnection::validator() const
+{
+    QByteArray etag = header("etag");
+
+    if (!etag.isEmpty() && !etag.startsWith("W/"))
+        return etag;
+    return header("last-modified");
+}
+
+qint64 HttpConnection::bodyOffset() const
+{
+    return _bodyOffset;
+}
+
+qint64 HttpConnection::fileSize() const
+{
+    return _fileSize;
+}
+
+QString HttpConnection::url() const
+{
+    return _url;
+}
+
+void HttpConnection::close()
+{
+    QMutexLocker lock(&_fdMutex);
+
+    if (_fd != -1)
+        ::close(_fd);
+    _fd = -1;
+    _buffer.clear();
+    _bufferPos = 0;
+}
+
+void HttpConnection::abort()
+{
+    QMutexLocker lock(&_fdMutex);
+
+    if (_fd != -1)
+        ::shutdown(_fd, SHUT_RDWR);
+}
+
+bool HttpConnection::connectTo(const QByteArray &host, int port)
+{
+    if (_fd != -1 && _keepAlive && host == _host && port == _port)
+        return true;
+    close();
+
+    struct addrinfo hints, *addresses;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    int ret = getaddrinfo(host.constData(), QByteArray::number(port).constData(), &hints, &addresses);
+    if (ret != 0)
+        return fail("Cannot resolve "+host+": "+gai_strerror(ret));
+
+    int fd = -1, err = 0;
+    for (struct addrinfo *a = addresses; a; a = a->ai_next)
+    {
+        fd = ::socket(a->ai_family, a->ai_socktype | SOCK_CLOEXEC, a->ai_protocol);
+        if (fd == -1)
+        {
+            err = errno;
+            continue;
+        }
+        if (::connect(fd, a->ai_addr, a->ai_addrlen) == 0)
+            break;
+        err = errno;
+        ::close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(addresses);
+
+    if (fd == -1)
+        return fail("Cannot connect to "+host+": "+strerror(err));
+
+    /* A stalled transfer fails, and is retried by the caller */
+    struct timeval tv;
+    tv.tv_sec  = HTTP_TIMEOUT;
+    tv.tv_usec = 0;
+    ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    _fdMutex.lock();
+    _fd = fd;
+    _fdMutex.unlock();
+    _host = host;
+    _port = port;
+    _keepAlive = true;
+
+    return true;
+}
+
+bool HttpConnection::sendAll(const QByteArray &data)
+{
+    const char *p = data.constData();
+    qint64 len = data.size();
+
+    while (len)
+    {
+        /* A connection closed by the server must not raise SIGPIPE */
+        ssize_t n = ::send(_fd, p, len, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return fail("Error sending request to "+_host+": "+strerror(errno));
+        }
+        p   += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+qint64 HttpConnection::receive(char *buf, qint64 len)
+{
+    forever
+    {
+        ssize_t n = ::recv(_fd, buf, len, 0);
+        if (n >= 0)
+            return n;
+        if (errno == EINTR)
+            continue;
+
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            fail("Timeout reading from "+_host);
+        else
+            fail("Error reading from "+_host+": "+strerror(errno));
+        return -1;
+    }
+}
+
+bool HttpConnection::readLine(QByteArray &line)
+{
+    int eol;
+
+    while ((eol = _buffer.indexOf('\n', _bufferPos)) == -1)
+    {
+        if (_buffer.size() - _bufferPos > HTTP_MAX_LINE)
+            return fail("Invalid response from "+_host);
+
+        _buffer.remove(0, _bufferPos);
+        _bufferPos = 0;
+
+        int old = _buffer.size();
+        _buffer.resize(old + 4096);
+        qint64 n = receive(_buffer.data()+old, 4096);
+        _buffer.resize(old + qMax(n, qint64(0)));
+
+        if (n == 0)
+            return fail("Connection closed by "+_host);
+        if (n < 0)
+            return false;
+    }
+
+    line = _buffer.mid(_bufferPos, eol-_bufferPos);
+    if (line.endsWith('\r'))
+        line.chop(1);
+    _bufferPos = eol+1;
+
+    return true;
+}
+
+bool HttpConnection::get(const QString &url, qint64 start, qint64 end, const QByteArray &ifRange)
+{
+    QString current = url;
+
+    for (int redirects = 0; ; redirects++)
+    {
+        if (!request(current, start, end, ifRange))
+            return false;
+
+        QByteArray location = header("location");
+        if (_status < 300 || _status >= 400 || _status == 304 || location.isEmpty())
+            return true;
+
+        /* A redirect that cannot be followed is left to the caller as the response */
+        QString target = resolveUrl(current, location);
+        if (redirects == HTTP_MAX_REDIRECTS || !target.toLower().startsWith("http://"))
+            return true;
+
+        skipBody();
+        current = target;
+    }
+}
+
+bool HttpConnection::request(const QString &url, qint64 start, qint64 end, const QByteArray &ifRange)
+{
+    QByteArray host, path;
+    int port;
+
+    if (!splitUrl(url, host, port, path))
+        return fail("Unsupported URL "+url);
+
+    QByteArray hostHeader = host.contains(':') ? "["+host+"]" : host;
+    if (port != 80)
+        hostHeader += ":"+QByteArray::number(port);
+
+    /* A proxy gets the whole URL */
+    QByteArray connectHost = host, target = path;
+    int connectPort = port;
+    QByteArray proxy = qgetenv("http_proxy"), proxyHost, proxyPath;
+    int proxyPort;
+    if (!proxy.isEmpty() && splitUrl(proxy, proxyHost, proxyPort, proxyPath))
+    {
+        connectHost = proxyHost;
+        connectPort = proxyPort;
+        target = "http://"+hostHeader+path;
+    }
+
+    QByteArray req = "GET "+target+" HTTP/1.1\r\n";
+    req += "Host: "+hostHeader+"\r\n";
+    req += "User-Agent: NOOBS\r\n";
+    req += "Accept-Encoding: identity\r\n";
+    if (start > 0 || end != -1)
+        req += "Range: bytes="+QByteArray::number(start)+"-"+(end == -1 ? QByteArray() : QByteArray::number(end-1))+"\r\n";
+    if (!ifRange.isEmpty())
+        req += "If-Range: "+ifRange+"\r\n";
+    req += "\r\n";
+
+    /* The rest of the previous response is in the way */
+    if (!_bodyDone)
+        skipBody();
+
+    /* The server may have closed a kept connection in the meantime, that is retried once */
+    for (int attempt = 0; attempt < 2; attempt++)
+    {
+        bool reused = (_fd != -1 && _keepAlive && connectHost == _host && connectPort == _port);
+
+        if (!connectTo(connectHost, connectPort))
+            return false;
+        if (sendAll(req) && readResponse())
+        {
+            _url = url;
+            _error.clear();
+            return true;
+        }
+
+        close();
+        if (!reused)
+            return false;
+    }
+
+    return false;
+}
+
+bool HttpConnection::readResponse()
+{
+    QByteArray line;
+    bool http10;
+
+    /* 1xx responses are followed by the real one */
+    do
+    {
+        if (!readLine(line))
+            return false;
+        if (!line.startsWith("HTTP/1.") || line.size() < 12)
+            return fail("Invalid response from "+_host);
+
+        http10  = line.startsWith("HTTP/1.0");
+        _status = line.mid(9, 3).toInt();
+        _headers.clear();
+
+        forever
+        {
+            if (!readLine(line))
+                return false;
+            if (line.isEmpty())
+                break;
+
+            int colon = line.indexOf(':');
+            if (colon > 0)
+                _headers.insert(line.left(colon).trimmed().toLower(), line.mid(colon+1).trimmed());
+        }
+    } while (_status >= 100 && _status < 200);
+
+    QByteArray connection = header("connection").toLower();
+    _keepAlive = http10 ? connection.contains("keep-alive") : !connection.contains("close");
+    _chunked   = header("transfer-encoding").toLower().contains("chunked");
+    _chunkEnd  = false;
+    _bodyDone  = false;
+    _bodyOffset = 0;
+    _fileSize  = -1;
+
+    bool haveLength = !_chunked && !header("content-length").isEmpty();
+    qint64 length = header("content-length").toLongLong();
+
+    if (_status == 206)
+    {
+        /* Content-Range: bytes first-last/size, where size may be * */
+        QByteArray range = header("content-range");
+        int dash = range.indexOf('-'), slash = range.indexOf('/');
+        if (!range.startsWith("bytes ") || dash == -1 || slash < dash)
+            return fail("Invalid Content-Range from "+_host);
+
+        _bodyOffset = range.mid(6, dash-6).trimmed().toLongLong();
+        QByteArray size = range.mid(slash+1).trimmed();
+        _fileSize = (size == "*") ? -1 : size.toLongLong();
+    }
+    else if (_status == 200 && haveLength)
+    {
+        _fileSize = length;
+    }
+
+    if (_status == 204 || _status == 304)
+    {
+        _remaining = 0;
+        _bodyDone = true;
+    }
+    else if (_chunked)
+    {
+        _remaining = 0;
+    }
+    else if (haveLength)
+    {
+        _remaining = length;
+        _bodyDone = (length == 0);
+    }
+    else
+    {
+        /* The body ends when the server closes the connection */
+        _remaining = -1;
+        _keepAlive = false;
+    }
+
+    return true;
+}
+
+qint64 HttpConnection::read(char *buf, qint64 len)
+{
+    if (_bodyDone)
+        return 0;
+    if (_fd == -1)
+    {
+        fail("Not connected");
+        return -1;
+    }
+
+    if (_chunked && _remaining == 0)
+    {
+        QByteArray line;
+
+        /* CRLF after the previous chunk, then the size of the next one */
+        if (_chunkEnd && !readLine(line))
+            return -1;
+        _chunkEnd = false;
+        if (!readLine(line))
+            return -1;
+
+        int extension = line.indexOf(';');
+        bool ok;
+        qint64 size = (extension == -1 ? line : line.left(extension)).trimmed().toLongLong(&ok, 16);
+        if (!ok || size < 0)
+        {
+            fail("Invalid chunked response from "+_host);
+            return -1;
+        }
+
+        if (size == 0)
+        {
+            /* Trailers */
+            do
+            {
+                if (!readLine(line))
+                    return -1;
+            } while (!line.isEmpty());
+
+            _bodyDone = true;
+            return 0;
+        }
+        _remaining = size;
+        _chunkEnd = true;
+    }
+
+    qint64 n = (_remaining == -1) ? len : qMin(len, _remaining);
+
+    if (_bufferPos < _buffer.size())
+    {
+        n = qMin(n, qint64(_buffer.size() - _bufferPos));
+        memcpy(buf, _buffer.constData()+_bufferPos, n);
+        _bufferPos += n;
+    }
+    else
+    {
+        /* Large reads go straight to the caller's buffer */
+        n = receive(buf, n);
+        if (n < 0)
+            return -1;
+        if (n == 0)
+        {
+            if (_remaining != -1)
+            {
+                fail("Connection closed by "+_host);
+                return -1;
+            }
+            close();
+            _bodyDone = true;
+            return 0;
+        }
+    }
+
+    if (_remaining != -1)
+    {
+        _remaining -= n;
+        if (_remaining == 0 && !_chunked)
+            _bodyDone = true;
+    }
+
+    return n;
+}
+
+bool HttpConnection::readFully(char *buf, qint64 len)
+{
+    while (len)
+    {
+        qint64 n = read(buf, len);
+        if (n < 0)
+            return false;
+        if (n == 0)
+            return fail("Response from "+_host+" is shorter than expected");
+        buf += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+bool HttpConnection::download(const QString &url, QByteArray &data, int tries)
+{
+    for (int attempt = 0; attempt < tries; attempt++)
+    {
+        if (!get(url))
+            continue;
+        if (_status != 200)
+        {
+            skipBody();
+            return fail(QString("Error downloading %1: server responded with status %2").arg(url).arg(_status));
+        }
+
+        if (_fileSize != -1)
+        {
+            data.resize(_fileSize);
+            if (readFully(data.data(), _fileSize))
+                return true;
+        }
+        else
+        {
+            char buf[16384];
+            qint64 n;
+
+            data.clear();
+            while ((n = read(buf, sizeof(buf))) > 0)
+                data.append(buf, n);
+            if (n == 0)
+                return true;
+        }
+        close();
+    }
+
+    return false;
+}
+
+/* Read the rest of a response that is of no interest, to keep the connection */
+void HttpConnection::skipBody()
+{
+    char buf[4096];
+    qint64 skipped = 0, n;
+
+    while (!_bodyDone && skipped < HTTP_DISCARD_LIMIT && (n = read(buf, sizeof(buf))) > 0)
+        skipped += n;
+
+    if (!_bodyDone)
+    {
+        close();
+        _bodyDone = true;
+    }
+}
@@ -0,0 +1,94 @@
+#ifndef HTTPCONNECTION_H
+#define HTTPCONNECTION_H
+
+/* Minimal blocking HTTP/1.1 client, for use on worker threads
+ *
+ * Keeps its connection open between requests (keep-alive) as long as
+ * they go to the same server, and follows redirects. Plain http only,
+ * like the rest of the downloads. The http_proxy environment variable
+ * is honoured, as wget does.
+ *
+ * Maintained by Raspberry Pi
+ *
+ * See LICENSE.txt for license details
+ *
+ */
+
+#include <QString>
+#include <QByteArray>
+#include <QHash>
+#include <QMutex>
+
+#define HTTP_MAX_REDIRECTS      5
+/* Seconds without progress before a connection is given up */
+#define HTTP_TIMEOUT            30
+/* Longest rest of a response that is read to keep the connection, rather than closing it */
+#define HTTP_DISCARD_LIMIT      (64 * 1024)
+/* Attempts of download(), like wget --tries */
+#define HTTP_DOWNLOAD_TRIES     3
+
+class HttpConnection
+{
+public:
+    HttpConnection();
+    ~HttpConnection();
+
+    /* Request bytes start to end-1 of url, or from start to the end of the file if end is -1.
+     * ifRange: ETag or Last-Modified the file must still have, or the whole file is sent.
+     * Returns false if no response was received. HTTP errors, and redirects that
+     * cannot be followed (too many, or to https), are responses as well */
+    bool get(const QString &url, qint64 start = 0, qint64 end = -1, const QByteArray &ifRange = QByteArray());
+    int status() const;
+    /* name in lower case */
+    QByteArray header(const QByteArray &name) const;
+    /* ETag, or Last-Modified if there is none, for use as ifRange */
+    QByteArray validator() const;
+    /* Offset of the body in the file, and the size of the file, -1 if unknown */
+    qint64 bodyOffset() const;
+    qint64 fileSize() const;
+    /* URL after redirects */
+    QString url() const;
+
+    /* Read the response body. Returns 0 at the end of the body, -1 on error */
+    qint64 read(char *buf, qint64 len);
+    bool readFully(char *buf, qint64 len);
+    /* GET the whole of a small file into data, trying up to tries times if no complete response
+     * is received. HTTP errors are final */
+    bool download(const QString &url, QByteArray &data, int tries = HTTP_DOWNLOAD_TRIES);
+    void close();
+    /* Make a read() blocked in another thread return */
+    void abort();
+    QString errorString() const;
+
+protected:
+    bool connectTo(const QByteArray &host, int port);
+    bool request(const QString &url, qint64 start, qint64 end, const QByteArray &ifRange);
+    bool readResponse();
+    qint64 receive(char *buf, qint64 len);
+    bool readLine(QByteArray &line);
+    bool sendAll(const QByteArray &data);
+    void skipBody();
+    bool fail(const QString &msg);
+
+    /* Protects _fd against abort() */
+    QMutex _fdMutex;
+    int _fd;
+    QByteArray _host;
+    int _port;
+    bool _keepAlive;
+    QString _url, _error;
+
+    /* Received data not consumed yet */
+    QByteArray _buffer;
+    int _bufferPos;
+
+    /* Current response */
+    int _status;
+    QHash<QByteArray,QByteArray> _headers;
+    qint64 _bodyOffset, _fileSize;
+    bool _chunked, _chunkEnd, _bodyDone;
+    /* Bytes left of the body or the current chunk, -1 if the body ends when the connection closes */
+    qint64 _remaining;
+};
+
+#endif // HTTPCONNECTION_H
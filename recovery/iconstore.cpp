@@ -0,0 +1,314 @@
+#include "iconstore.h"
+#include "util.h"
+#include <QFile>
+#include <QFileInfo>
+#include <QDateTime>
+#include <QPixmap>
+#include <QDebug>
+#include <string.h>
+
+/* Decoded OS icons, kept on the settings partition
+ *
+ * Maintained by Raspberry Pi
+ *
+ * See LICENSE.txt for license details
+ *
+ */
+
+/* Header: magic, version and icon count */
+#define ICON_STORE_HEADER_SIZE  (8 + 4 + 4)
+
+static inline quint32 le16(const char *p)
+{
+    const uchar *u = (const uchar *) p;
+    return u[0] | (u[1] << 8);
+}
+
+static inline quint32 le32(const char *p)
+{
+    const uchar *u = (const uchar *) p;
+    return u[0] | (u[1] << 8) | (u[2] << 16) | (quint32(u[3]) << 24);
+}
+
+static inline void appendLe16(QByteArray &a, quint32 v)
+{
+    a.append(char(v & 0xff));
+    a.append(char((v >> 8) & 0xff));
+}
+
+static inline void appendLe32(QByteArray &a, quint32 v)
+{
+    appendLe16(a, v & 0xffff);
+    appendLe16(a, v >> 16);
+}
+
+/* Reads a uint16 length followed by that many bytes */
+static bool readString(QFile &f, QByteArray &s)
+{
+    QByteArray len = f.read(2);
+    if (len.size() != 2)
+        return false;
+
+    s = f.read(le16(len.constData()));
+    return s.size() == int(le16(len.constData()));
+}
+
+IconStore::IconStore(const QString &filename)
+    : _filename(filename), _loaded(false), _dirty(false)
+{
+}
+
+/* Read the index. A damaged store is started over */
+void IconStore::load()
+{
+    if (_loaded)
+        return;
+    _loaded = true;
+
+    QFile f(_filename);
+    if (!f.open(QIODevice::ReadOnly))
+        return;
+
+    QByteArray header = f.read(ICON_STORE_HEADER_SIZE);
+    if (header.size() != ICON_STORE_HEADER_SIZE || !header.startsWith(ICON_STORE_MAGIC)
+            || le32(header.constData()+8) != ICON_STORE_VERSION)
+    {
+        qDebug() << "Ignoring icon store" << _filename << "of unknown format";
+        _dirty = true;
+        return;
+    }
+
+    quint32 count = le32(header.constData()+12);
+    for (quint32 i = 0; i < count; i++)
+    {
+        QByteArray source, stamp, dims;
+        Entry e;
+
+        if (!readString(f, source) || !readString(f, stamp) || (dims = f.read(8)).size() != 8)
+        {
+            qDebug() << "Icon store" << _filename << "is truncated";
+            _entries.clear();
+            _dirty = true;
+            return;
+        }
+
+        e.stamp  = stamp;
+        e.size   = QSize(le16(dims.constData()), le16(dims.constData()+2));
+        e.offset = le32(dims.constData()+4);
+        _entries.insert(QString::fromUtf8(source), e);
+    }
+}
+
+QByteArray IconStore::fileStamp(const QString &path)
+{
+    QFileInfo fi(path);
+    return QByteArray::number(fi.lastModified().toTime_t())+":"+QByteArray::number(fi.size());
+}
+
+bool IconStore::addFile(const QString &path)
+{
+    if (!QFile::exists(path))
+        return false;
+
+    load();
+    QByteArray stamp = fileStamp(path);
+    if (_entries.contains(path) && _entries.value(path).stamp == stamp)
+        return true;
+
+    QImage image(path);
+    if (image.isNull())
+    {
+        qDebug() << "Icon file" << path << "corrupt";
+        return false;
+    }
+
+    return add(path, stamp, image);
+}
+
+bool IconStore::addData(const QString &url, const QByteArray &data, const QByteArray &etag)
+{
+    QImage image;
+
+    load();
+    if (!image.loadFromData(data))
+    {
+        qDebug() << "Icon" << url << "corrupt";
+        return false;
+    }
+
+    return add(url, etag, image);
+}
+
+bool IconStore::add(const QString &source, const QByteArray &stamp, QImage image)
+{
+    if (image.width() > ICON_STORE_SIZE || image.height() > ICON_STORE_SIZE)
+        image = image.scaled(ICON_STORE_SIZE, ICON_STORE_SIZE, Qt::KeepAspectRatio, Qt::SmoothTransformation);
+
+    Entry e;
+    e.stamp  = stamp;
+    e.size   = image.size();
+    e.offset = 0;
+    e.image  = image.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+
+    _entries.insert(source, e);
+    _icons.remove(source);
+    _dirty = true;
+
+    return true;
+}
+
+bool IconStore::contains(const QString &source)
+{
+    load();
+    return _entries.contains(source);
+}
+
+QByteArray IconStore::etag(const QString &url)
+{
+    load();
+    return _entries.value(url).stamp;
+}
+
+QSize IconStore::size(const QString &source)
+{
+    load();
+    return _entries.value(source).size;
+}
+
+QImage IconStore::pixels(Entry &e)
+{
+    if (!e.image.isNull())
+        return e.image;
+
+    QFile f(_filename);
+    qint64 len = qint64(e.size.width()) * e.size.height() * 4;
+    QImage image(e.size, QImage::Format_ARGB32_Premultiplied);
+
+    if (image.isNull() || !f.open(QIODevice::ReadOnly) || !f.seek(e.offset)
+            || f.read((char *) image.bits(), len) != len)
+    {
+        qDebug() << "Error reading icon pixels from" << _filename;
+        return QImage();
+    }
+
+    e.image = image;
+    return image;
+}
+
+QIcon IconStore::icon(const QString &source)
+{
+    load();
+
+    QHash<QString,QIcon>::const_iterator it = _icons.constFind(source);
+    if (it != _icons.constEnd())
+        return it.value();
+
+    QIcon icon;
+    QHash<QString,Entry>::iterator e = _entries.find(source);
+    if (e != _entries.end())
+    {
+        QImage image = pixels(e.value());
+        if (!image.isNull())
+            icon = QIcon(QPixmap::fromImage(image));
+    }
+    _icons.insert(source, icon);
+
+    return icon;
+}
+
+void IconStore::retainUrls(const QSet<QString> &urls)
+{
+    load();
+
+    QHash<QString,Entry>::iterator it = _entries.begin();
+    while (it != _entries.end())
+    {
+        if (!it.key().startsWith('/') && !urls.contains(it.key()))
+        {
+            it = _entries.erase(it);
+            _dirty = true;
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
+
+bool IconStore::isModified()
+{
+    load();
+
+    QHash<QString,Entry>::iterator it = _entries.begin();
+    while (it != _entries.end())
+    {
+        if (it.key().startsWith('/') && !QFile::exists(it.key()))
+        {
+            it = _entries.erase(it);
+            _dirty = true;
+        }
+        else
+        {
+            ++it;
+        }
+    }
+
+    return _dirty;
+}
+
+bool IconStore::save()
+{
+    if (!isModified())
+        return true;
+
+    /* Read the pixels of all icons before the old store is replaced */
+    QList<QString> sources;
+    QList<QImage> images;
+    quint32 offset = ICON_STORE_HEADER_SIZE;
+    foreach (const QString &source, _entries.keys())
+    {
+        QImage image = pixels(_entries[source]);
+        if (image.isNull())
+        {
+            _entries.remove(source);
+            continue;
+        }
+
+        sources.append(source);
+        images.append(image);
+        offset += 2 + source.toUtf8().size() + 2 + _entries.value(source).stamp.size() + 8;
+    }
+
+    QByteArray index(ICON_STORE_MAGIC), data;
+    appendLe32(index, ICON_STORE_VERSION);
+    appendLe32(index, sources.size());
+
+    for (int i = 0; i < sources.size(); i++)
+    {
+        Entry &e = _entries[sources.at(i)];
+        const QImage &image = images.at(i);
+        QByteArray s = sources.at(i).toUtf8();
+        int len = image.width() * image.height() * 4;
+
+        appendLe16(index, s.size());
+        index.append(s);
+        appendLe16(index, e.stamp.size());
+        index.append(e.stamp);
+        appendLe16(index, image.width());
+        appendLe16(index, image.height());
+        appendLe32(index, offset);
+        data.append((const char *) image.bits(), len);
+
+        e.offset = offset;
+        offset  += len;
+    }
+
+    if (!writeFileAtomically(_filename, index+data))
+    {
+        qDebug() << "Error writing icon store" << _filename;
+        return false;
+    }
+
+    _dirty = false;
+    return true;
+}
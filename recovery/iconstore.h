@@ -0,0 +1,91 @@
+#ifndef ICONSTORE_H
+#define ICONSTORE_H
+
+/* Decoded OS icons, kept on the settings partition
+ *
+ * Decoding a PNG costs more on a Pi than reading its pixels, so icons
+ * are decoded once, scaled down to list size, and stored with their
+ * pixels as they are. Icons are stored by source: the path of an icon
+ * file, or the URL it was downloaded from. With every icon the store
+ * keeps the mtime and size of its file, so a changed icon file is
+ * decoded again, or the ETag of its download, which is sent along when
+ * the icon is downloaded again to check it is still current.
+ *
+ * The index is read on first use, and the pixels of an icon only when
+ * it is drawn. All numbers are little endian:
+ *
+ *   8 bytes   magic "NOOBSICO"
+ *   uint32    version, 1
+ *   uint32    number of icons
+ *   per icon: uint16 length of the source, source (UTF-8),
+ *             uint16 length of the stamp, stamp,
+ *             uint16 width, uint16 height,
+ *             uint32 offset of the pixels from the start of the file
+ *   pixels:   width * height ARGB32 (premultiplied) words per icon
+ *
+ * Maintained by Raspberry Pi
+ *
+ * See LICENSE.txt for license details
+ *
+ */
+
+#include <QString>
+#include <QByteArray>
+#include <QHash>
+#include <QSet>
+#include <QSize>
+#include <QImage>
+#include <QIcon>
+
+#define ICON_STORE_FILE     "/settings/icons.cache"
+#define ICON_STORE_MAGIC    "NOOBSICO"
+#define ICON_STORE_VERSION  1
+/* Icons are scaled down to fit this size */
+#define ICON_STORE_SIZE     40
+
+class IconStore
+{
+public:
+    explicit IconStore(const QString &filename = ICON_STORE_FILE);
+
+    /* Store the icon file at path, unless it is stored already with the current mtime and size.
+     * Returns false if there is no such file, or it is not an image */
+    bool addFile(const QString &path);
+    /* Store icon data downloaded from url. Returns false if it is not an image */
+    bool addData(const QString &url, const QByteArray &data, const QByteArray &etag = QByteArray());
+    bool contains(const QString &source);
+    /* ETag of a downloaded icon, empty if it had none */
+    QByteArray etag(const QString &url);
+    /* Size of an icon, without reading its pixels */
+    QSize size(const QString &source);
+    /* Pixels are read on first use */
+    QIcon icon(const QString &source);
+
+    /* Drop the downloaded icons of all URLs but those given */
+    void retainUrls(const QSet<QString> &urls);
+    /* Whether icons were added or dropped since the store was read. Icons of files that no longer exist are dropped */
+    bool isModified();
+    bool save();
+
+protected:
+    struct Entry
+    {
+        QByteArray stamp;
+        QSize size;
+        quint32 offset;
+        /* Null until the pixels are read, or if the icon was added since */
+        QImage image;
+    };
+
+    void load();
+    bool add(const QString &source, const QByteArray &stamp, QImage image);
+    QImage pixels(Entry &e);
+    static QByteArray fileStamp(const QString &path);
+
+    QString _filename;
+    bool _loaded, _dirty;
+    QHash<QString,Entry> _entries;
+    QHash<QString,QIcon> _icons;
+};
+
+#endif // ICONSTORE_H
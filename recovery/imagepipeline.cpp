@@ -0,0 +1,840 @@
+#include "imagepipeline.h"
+#include "ringbuffer.h"
+#include "decompressor.h"
+#include "chunkindex.h"
+#include "verifiedfile.h"
+#include "util.h"
+#include <QFile>
+#include <QBuffer>
+#include <QCryptographicHash>
+#include <QMutexLocker>
+#include <QSet>
+#include <QDebug>
+
+/* Download/decompress pipeline for OS images
+ *
+ * Maintained by Raspberry Pi
+ *
+ * See LICENSE.txt for license details
+ *
+ */
+
+PipelineStage::PipelineStage(ImagePipeline *pipeline)
+    : QThread(), _pipeline(pipeline)
+{
+}
+
+QString PipelineStage::errorString() const
+{
+    return _error;
+}
+
+/* Stops the other stages. Errors caused by ImagePipeline::abort() are not recorded */
+bool PipelineStage::fail(const QString &msg)
+{
+    if (!_pipeline->_aborted)
+    {
+        qDebug() << msg;
+        _error = msg;
+    }
+    if (_pipeline->_fetchBuffer)
+        _pipeline->_fetchBuffer->abort(msg);
+    _pipeline->_decodeBuffer->abort(msg);
+
+    return false;
+}
+
+FetchStage::FetchStage(ImagePipeline *pipeline)
+    : PipelineStage(pipeline), _download(NULL), _killed(false), _chunkIndex(0), _cachedBytes(0), _heldLength(0), _verifiedChunks(0)
+{
+}
+
+void FetchStage::kill()
+{
+    QMutexLocker lock(&_downloadMutex);
+    _killed = true;
+    if (_download)
+        _download->abort();
+    _conn.abort();
+}
+
+/* A download started after kill() is aborted straight away */
+void FetchStage::setDownload(SegmentedDownload *download)
+{
+    QMutexLocker lock(&_downloadMutex);
+
+    _download = download;
+    if (_download && _killed)
+        _download->abort();
+}
+
+qint64 FetchStage::cachedBytes() const
+{
+    return _cachedBytes;
+}
+
+void FetchStage::run()
+{
+    if (!_pipeline->_checksums.chunks.isEmpty())
+        _held.resize(_pipeline->_checksums.chunkSize);
+
+    if (_pipeline->_index)
+        runDelta();
+    else if (!_pipeline->_cache || !runCached())
+        runStream();
+}
+
+/* Download the complete file, the download takes care of resuming */
+void FetchStage::runStream()
+{
+    SegmentedDownload download(_pipeline->_url, 0, -1, _pipeline->_connections);
+    QByteArray buf(PIPELINE_CHUNK_SIZE, 0);
+    qint64 n = -1;
+
+    setDownload(&download);
+    if (download.open())
+    {
+        while ((n = download.read(buf.data(), buf.size())) > 0)
+        {
+            /* Aborted by a later stage, or corrupt */
+            if (!forward(buf.constData(), n))
+                break;
+        }
+    }
+    setDownload(NULL);
+
+    if (n > 0)
+        return;
+    if (n < 0)
+    {
+        fail(download.errorString());
+        return;
+    }
+
+    finishStream();
+}
+
+/* Download the chunks that are not cached as one stream of zstd frames, one after the other
+ * over a kept connection. The decoder checks them, and downloads the whole image instead if
+ * they are incomplete, so a chunk that fails is not retried */
+void FetchStage::runDelta()
+{
+    RingBuffer *out = _pipeline->_fetchBuffer;
+    const ChunkIndex *index = _pipeline->_index;
+    QByteArray buf(PIPELINE_CHUNK_SIZE, 0);
+
+    for (int i = 0; i < index->chunkCount(); i++)
+    {
+        if (_pipeline->_sources.at(i) != ImagePipeline::FromStore)
+            continue;
+
+        /* kill() only reaches the connection while it is open */
+        _downloadMutex.lock();
+        bool killed = _killed;
+        _downloadMutex.unlock();
+        if (killed)
+            return;
+
+        QString url = index->chunkUrl(i);
+        if (!_conn.get(url))
+        {
+            qDebug() << "Error downloading" << url << ":" << _conn.errorString();
+            break;
+        }
+        if (_conn.status() != 200)
+        {
+            qDebug() << "Error downloading" << url << ": server responded with status" << _conn.status();
+            break;
+        }
+
+        qint64 n;
+        while ((n = _conn.read(buf.data(), buf.size())) > 0)
+        {
+            /* Aborted by a later stage */
+            if (!out->writeBlock(buf.constData(), n))
+                return;
+        }
+        if (n < 0)
+        {
+            qDebug() << "Error downloading" << url << ":" << _conn.errorString();
+            break;
+        }
+    }
+
+    _conn.close();
+    out->closeWrite();
+}
+
+/* Size, ETag or Last-Modified, and range request support of a download, from a request of its first byte */
+static bool httpInfo(const QString &url, qint64 &size, QByteArray &validator, bool &ranges)
+{
+    HttpConnection conn;
+    bool ok = false;
+
+    for (int attempt = 0; !ok && attempt < HTTP_DOWNLOAD_TRIES; attempt++)
+        ok = conn.get(url, 0, 1);
+    if (!ok || (conn.status() != 200 && conn.status() != 206))
+        return false;
+
+    size      = conn.fileSize();
+    validator = conn.validator();
+    ranges    = (conn.status() == 206);
+
+    return true;
+}
+
+bool FetchStage::runCached()
+{
+    ChunkCache *cache = _pipeline->_cache;
+    const QString &url = _pipeline->_url;
+    qint64 size = 0;
+    QByteArray validator;
+    bool ranges = false;
+
+    bool online = httpInfo(url, size, validator, ranges);
+    CacheManifest cached;
+    bool haveManifest = cache->loadManifest(url, cached);
+
+    if (online && ranges && size > 0)
+    {
+        /* Chunks of an older version of the file are of no use */
+        if (haveManifest && cached.size == size && cached.validator == validator)
+            _manifest = cached;
+        else
+            _manifest = CacheManifest(url, size, validator);
+    }
+    else if (!online && haveManifest && cached.isComplete())
+    {
+        qDebug() << "Server not reachable, installing" << url << "from the download cache";
+        _manifest = cached;
+    }
+    else
+    {
+        if (online)
+            qDebug() << "Server does not support range requests, not caching" << url;
+        return false;
+    }
+
+    /* Every chunk listed in _manifest is pinned while the download is in progress */
+    foreach (const QByteArray &hash, _manifest.chunks)
+    {
+        if (!hash.isEmpty())
+            cache->pin(hash);
+    }
+
+    bool ok = fetchChunks();
+
+    foreach (const QByteArray &hash, _manifest.chunks)
+    {
+        if (!hash.isEmpty())
+            cache->unpin(hash);
+    }
+
+    if (ok)
+        finishStream();
+
+    return true;
+}
+
+/* Read the chunks in order, from the cache where possible, downloading runs of missing ones */
+bool FetchStage::fetchChunks()
+{
+    ChunkCache *cache = _pipeline->_cache;
+    int count = _manifest.chunkCount();
+    int i = 0;
+
+    while (i < count)
+    {
+        QByteArray hash = _manifest.chunks.at(i);
+
+        if (!hash.isEmpty())
+        {
+            QByteArray data;
+            if (cache->read(hash, data) && data.size() == _manifest.chunkLength(i))
+            {
+                if (!forward(data.constData(), data.size()))
+                    return false;
+                _cachedBytes += data.size();
+                i++;
+                continue;
+            }
+
+            cache->unpin(hash);
+            _manifest.chunks[i].clear();
+            cache->saveManifest(_manifest);
+        }
+
+        int j = i+1;
+        while (j < count && _manifest.chunks.at(j).isEmpty())
+            j++;
+
+        if (!downloadChunks(i, j))
+            return false;
+        i = j;
+    }
+
+    return true;
+}
+
+/* Download chunks first to last-1 as one range of the file */
+bool FetchStage::downloadChunks(int first, int last)
+{
+    const QString &url = _pipeline->_url;
+    qint64 pos = _manifest.chunkOffset(first);
+    qint64 end = (last == _manifest.chunkCount()) ? _manifest.size : _manifest.chunkOffset(last);
+    SegmentedDownload download(url, pos, end, _pipeline->_connections);
+    QByteArray buf(PIPELINE_CHUNK_SIZE, 0);
+    qint64 n = 0;
+    bool ok = true;
+
+    _chunkIndex = first;
+    _chunk.clear();
+
+    setDownload(&download);
+    if (download.open())
+    {
+        while (ok && pos < end && (n = download.read(buf.data(), buf.size())) > 0)
+        {
+            ok = received(buf.constData(), n);
+            pos += n;
+        }
+    }
+    setDownload(NULL);
+
+    if (pos == end)
+        return true;
+    /* received() failed already */
+    if (!ok)
+        return false;
+    if (n == 0 && download.errorString().isEmpty())
+        return fail(url+" is smaller than expected");
+    return fail(download.errorString());
+}
+
+/* Pass downloaded data on to the decoder, and store every chunk that is complete */
+bool FetchStage::received(const char *data, qint64 len)
+{
+    ChunkCache *cache = _pipeline->_cache;
+
+    if (!forward(data, len))
+        return false;
+
+    while (len)
+    {
+        int chunkLength = _manifest.chunkLength(_chunkIndex);
+        int n = qMin(len, qint64(chunkLength - _chunk.size()));
+
+        _chunk.append(data, n);
+        data += n;
+        len  -= n;
+
+        if (_chunk.size() == chunkLength)
+        {
+            /* A full cache only means this chunk is not cached */
+            QByteArray hash = cache->store(_chunk);
+            if (!hash.isEmpty())
+            {
+                cache->pin(hash);
+                _manifest.chunks[_chunkIndex] = hash;
+                cache->saveManifest(_manifest);
+            }
+            _chunkIndex++;
+            _chunk.clear();
+        }
+    }
+
+    return true;
+}
+
+/* Pass data of the image file on to the decoder, verifying it if checksums are known.
+ * The chunk checksums cover the whole file, so the file is only hashed as a whole without them */
+bool FetchStage::forward(const char *data, qint64 len)
+{
+    const ImageChecksums &sums = _pipeline->_checksums;
+
+    if (sums.chunks.isEmpty())
+    {
+        if (!sums.sha256.isEmpty())
+            _fileHash.addData(data, len);
+        return _pipeline->_fetchBuffer->writeBlock(data, len);
+    }
+
+    while (len)
+    {
+        int n = qMin(len, qint64(_held.size() - _heldLength));
+
+        memcpy(_held.data()+_heldLength, data, n);
+        _heldLength += n;
+        data += n;
+        len  -= n;
+
+        if (_heldLength == _held.size() && !releaseChunk())
+            return false;
+    }
+
+    return true;
+}
+
+/* Verify the chunk held back, and pass it on if it is intact */
+bool FetchStage::releaseChunk()
+{
+    const ImageChecksums &sums = _pipeline->_checksums;
+    qint64 offset = qint64(_verifiedChunks) * sums.chunkSize;
+    Sha256 hash;
+
+    if (_verifiedChunks == sums.chunks.size())
+        return mismatch(_pipeline->_url+" is larger than its checksums say");
+
+    hash.addData(_held.constData(), _heldLength);
+    if (hash.result().toHex() != sums.chunks.at(_verifiedChunks))
+        return mismatch(QString("Checksum mismatch in bytes %1 to %2 of %3").arg(offset).arg(offset+_heldLength).arg(_pipeline->_url));
+
+    _verifiedChunks++;
+    int n = _heldLength;
+    _heldLength = 0;
+
+    return _pipeline->_fetchBuffer->writeBlock(_held.constData(), n);
+}
+
+/* Verify what is left at the end of the file, and signal the end to the decoder */
+bool FetchStage::finishStream()
+{
+    const ImageChecksums &sums = _pipeline->_checksums;
+
+    if (!sums.chunks.isEmpty())
+    {
+        if (_heldLength && !releaseChunk())
+            return false;
+        if (_verifiedChunks != sums.chunks.size())
+            return mismatch(_pipeline->_url+" is smaller than its checksums say");
+    }
+    else if (!sums.sha256.isEmpty() && _fileHash.result().toHex() != sums.sha256)
+    {
+        return mismatch("Checksum mismatch of "+_pipeline->_url);
+    }
+
+    _pipeline->_fetchBuffer->closeWrite();
+    return true;
+}
+
+/* What is cached of a corrupt file is not used again */
+bool FetchStage::mismatch(const QString &msg)
+{
+    if (_pipeline->_cache)
+        _pipeline->_cache->removeManifest(_pipeline->_url);
+
+    return fail(msg);
+}
+
+DecodeStage::DecodeStage(ImagePipeline *pipeline)
+    : PipelineStage(pipeline), _compressedBytes(0), _reusedBytes(0), _fallback(NULL)
+{
+}
+
+void DecodeStage::abort()
+{
+    QMutexLocker lock(&_mutex);
+
+    if (_fallback)
+        _fallback->abort();
+    _conn.abort();
+}
+
+qint64 DecodeStage::compressedBytes() const
+{
+    return _compressedBytes;
+}
+
+/* Bytes of a delta download that did not have to be downloaded */
+qint64 DecodeStage::reusedBytes() const
+{
+    return _reusedBytes;
+}
+
+void DecodeStage::run()
+{
+    if (_pipeline->_index)
+    {
+        runDelta();
+        return;
+    }
+
+    RingBuffer *out = _pipeline->_decodeBuffer;
+    QIODevice *source = _pipeline->_fetchBuffer;
+    QFile file(_pipeline->_url);
+    /* Local images with checksums stay seekable, so xz and zstd can still be decompressed in parallel */
+    VerifiedFile verified(_pipeline->_url, _pipeline->_checksums);
+
+    if (!source)
+    {
+        source = _pipeline->_checksums.isEmpty() ? (QIODevice *) &file : &verified;
+        if (!source->open(QIODevice::ReadOnly))
+        {
+            fail("Error opening "+_pipeline->_url+": "+source->errorString());
+            return;
+        }
+    }
+
+    Decompressor *decompressor = Decompressor::create(_pipeline->_url, source, 0, _pipeline->_memoryLimit);
+    if (!decompressor)
+    {
+        fail("Unknown compression format file extension");
+        return;
+    }
+
+    QByteArray buf(PIPELINE_CHUNK_SIZE, 0);
+    qint64 n;
+    while ((n = readFromDevice(decompressor, buf.data(), buf.size())) > 0)
+    {
+        if (!out->writeBlock(buf.constData(), n))
+            break;
+    }
+    _compressedBytes = decompressor->compressedBytesRead();
+
+    if (n < 0)
+        fail(verified.isCorrupt() ? verified.errorString() : decompressor->errorString());
+    else if (n == 0 && source == &verified && !verified.finish())
+        fail(verified.errorString());
+    else if (n == 0)
+        out->closeWrite();
+
+    delete decompressor;
+}
+
+/* Assemble the image from the cached chunks and the downloaded ones, in index order */
+void DecodeStage::runDelta()
+{
+    const ChunkIndex *index = _pipeline->_index;
+    ChunkCache *cache = _pipeline->_cache;
+    RingBuffer *out = _pipeline->_decodeBuffer;
+    Decompressor *chunks = Decompressor::create("chunks.zst", _pipeline->_fetchBuffer);
+    /* Downloaded chunks that occur again, if they could not be stored in the cache */
+    QHash<QByteArray,QByteArray> repeats;
+    qint64 pos = 0;
+    bool ok = true;
+
+    for (int i = 0; ok && i < index->chunkCount(); i++)
+    {
+        const ChunkIndex::Chunk &c = index->chunk(i);
+        bool again = _pipeline->_lastUse.value(c.hash) > i;
+        QByteArray data;
+
+        if (_pipeline->_sources.at(i) == ImagePipeline::FromStore)
+        {
+            data.resize(c.length);
+            ok = readFullyFromDevice(chunks, data.data(), c.length)
+                    && QCryptographicHash::hash(data, QCryptographicHash::Sha1).toHex() == c.hash;
+            if (!ok)
+                break;
+
+            /* A full cache only means the chunk is not cached */
+            if (cache->store(data).isEmpty())
+            {
+                if (again)
+                    repeats.insert(c.hash, data);
+            }
+            else if (again)
+            {
+                cache->pin(c.hash);
+                _pipeline->_pinned.append(c.hash);
+            }
+        }
+        else if (repeats.contains(c.hash))
+        {
+            data = again ? repeats.value(c.hash) : repeats.take(c.hash);
+            _reusedBytes += c.length;
+        }
+        else if (cache->read(c.hash, data))
+        {
+            _reusedBytes += c.length;
+        }
+        else
+        {
+            /* Corrupt in the cache */
+            ok = downloadChunk(i, data);
+            if (!ok)
+                break;
+        }
+
+        if (!out->writeBlock(data.constData(), data.size()))
+        {
+            /* Aborted by a later stage */
+            delete chunks;
+            return;
+        }
+        pos += c.length;
+    }
+
+    if (ok)
+    {
+        _compressedBytes = chunks->compressedBytesRead();
+        delete chunks;
+        out->closeWrite();
+        return;
+    }
+
+    /* Stop downloading chunks before the decompressor goes away */
+    _pipeline->_fetchBuffer->abort("Delta download failed");
+    _pipeline->_fetch->kill();
+    delete chunks;
+    if (_pipeline->_aborted)
+        return;
+
+    qDebug() << "Delta download of" << _pipeline->_url << "failed at" << pos << "bytes, downloading the whole image";
+    runFallback(pos);
+}
+
+/* Download a single chunk, over the connection kept for them */
+bool DecodeStage::downloadChunk(int i, QByteArray &data)
+{
+    const ChunkIndex::Chunk &c = _pipeline->_index->chunk(i);
+    QByteArray compressed;
+
+    if (!_conn.download(_pipeline->_index->chunkUrl(i), compressed))
+    {
+        qDebug() << _conn.errorString();
+        return false;
+    }
+
+    QBuffer in(&compressed);
+    in.open(QIODevice::ReadOnly);
+    Decompressor *chunk = Decompressor::create("chunk.zst", &in);
+    data.resize(c.length);
+    bool ok = readFullyFromDevice(chunk, data.data(), c.length)
+            && QCryptographicHash::hash(data, QCryptographicHash::Sha1).toHex() == c.hash;
+    delete chunk;
+
+    return ok;
+}
+
+/* Download and decompress the whole image, and pass it on from skip bytes on */
+void DecodeStage::runFallback(qint64 skip)
+{
+    RingBuffer *out = _pipeline->_decodeBuffer;
+    /* Takes the share of the chunk decompressor, which is done with it */
+    ImagePipeline fallback(_pipeline->_url, _pipeline->_cache, NULL, _pipeline->_memoryLimit / 2);
+    fallback.setChecksums(_pipeline->_checksums);
+    fallback.setConnections(_pipeline->_connections);
+
+    _mutex.lock();
+    _fallback = &fallback;
+    _mutex.unlock();
+    /* Aborted before _fallback was set */
+    if (_pipeline->_aborted)
+        fallback.abort();
+
+    fallback.start();
+
+    QIODevice *in = fallback.output();
+    QByteArray buf(PIPELINE_CHUNK_SIZE, 0);
+    qint64 n;
+    while ((n = readFromDevice(in, buf.data(), buf.size())) > 0)
+    {
+        qint64 discard = qMin(skip, n);
+        skip -= discard;
+
+        if (n > discard && !out->writeBlock(buf.constData()+discard, n-discard))
+            break;
+    }
+    if (n > 0)
+        fallback.abort();
+
+    bool ok = fallback.finish();
+
+    _mutex.lock();
+    _fallback = NULL;
+    _mutex.unlock();
+
+    if (n > 0)
+        return;
+    if (!ok)
+    {
+        fail(fallback.errorString());
+        return;
+    }
+    if (skip)
+    {
+        fail("Image is smaller than its chunk index");
+        return;
+    }
+
+    _compressedBytes = fallback.compressedBytes();
+    out->closeWrite();
+}
+
+ImagePipeline::ImagePipeline(const QString &url, ChunkCache *cache, const ChunkIndex *index, qint64 memoryLimit)
+    : _url(url), _cache(cache), _memoryLimit(memoryLimit ? memoryLimit : availableMemory()),
+      _connections(DOWNLOAD_DEFAULT_CONNECTIONS), _index(NULL), _fetchBuffer(NULL), _fetch(NULL), _aborted(0)
+{
+    _bufferSize = qBound((qint64) PIPELINE_MIN_BUFFER_SIZE,
+                         _memoryLimit / PIPELINE_MEMORY_DIVISOR / 2,
+                         (qint64) PIPELINE_MAX_BUFFER_SIZE);
+
+    if (url.startsWith("http:"))
+    {
+        _fetchBuffer = new RingBuffer(_bufferSize);
+        _fetch = new FetchStage(this);
+
+        /* Chunks found locally are only of use if they can be kept in the cache */
+        if (cache && index)
+        {
+            _index = index;
+            planDelta();
+        }
+    }
+    _decodeBuffer = new RingBuffer(_bufferSize);
+    _decode = new DecodeStage(this);
+}
+
+ImagePipeline::~ImagePipeline()
+{
+    if ((_fetch && _fetch->isRunning()) || _decode->isRunning())
+    {
+        abort();
+        finish();
+    }
+
+    foreach (const QByteArray &hash, _pinned)
+        _cache->unpin(hash);
+
+    delete _fetch;
+    delete _decode;
+    delete _fetchBuffer;
+    delete _decodeBuffer;
+}
+
+/* Decide for every chunk whether it is read from the cache or downloaded.
+ * Chunks that occur more than once are only downloaded the first time */
+void ImagePipeline::planDelta()
+{
+    QSet<QByteArray> seen;
+    qint64 cached = 0;
+
+    _sources.resize(_index->chunkCount());
+    for (int i = 0; i < _index->chunkCount(); i++)
+    {
+        const ChunkIndex::Chunk &c = _index->chunk(i);
+
+        _lastUse[c.hash] = i;
+        if (seen.contains(c.hash))
+        {
+            _sources[i] = Repeated;
+        }
+        else if (_cache->contains(c.hash))
+        {
+            /* Not evicted by the chunks stored during the download */
+            _cache->pin(c.hash);
+            _pinned.append(c.hash);
+            _sources[i] = FromCache;
+            cached += c.length;
+        }
+        else
+        {
+            _sources[i] = FromStore;
+        }
+        seen.insert(c.hash);
+    }
+
+    qDebug() << "Delta download of" << _url << ":" << cached << "of" << _index->size() << "bytes are cached";
+}
+
+/* A delta download is verified against its chunk index instead,
+ * the checksums only apply if it falls back to downloading the whole file */
+void ImagePipeline::setChecksums(const ImageChecksums &sums)
+{
+    _checksums = sums;
+}
+
+void ImagePipeline::setConnections(int connections)
+{
+    _connections = qMax(connections, 1);
+}
+
+void ImagePipeline::start()
+{
+    qDebug() << "Using" << (_fetch ? 2 : 1) << "ring buffers of" << _bufferSize/1024 << "KB";
+
+    if (_fetch)
+        _fetch->start();
+    _decode->start();
+}
+
+QIODevice *ImagePipeline::output()
+{
+    return _decodeBuffer;
+}
+
+void ImagePipeline::abort()
+{
+    _aborted = 1;
+    if (_fetchBuffer)
+        _fetchBuffer->abort("Aborted");
+    _decodeBuffer->abort("Aborted");
+    if (_fetch)
+        _fetch->kill();
+    _decode->abort();
+}
+
+bool ImagePipeline::finish()
+{
+    if (_fetch)
+        _fetch->wait();
+    _decode->wait();
+
+    /* The earliest stage that failed has the most informative message */
+    if (_fetch && !_fetch->errorString().isEmpty())
+        _error = _fetch->errorString();
+    else
+        _error = _decode->errorString();
+
+    qDebug() << statistics();
+
+    return _error.isEmpty();
+}
+
+QString ImagePipeline::errorString() const
+{
+    return _error;
+}
+
+RingBuffer *ImagePipeline::fetchBuffer() const
+{
+    return _fetchBuffer;
+}
+
+RingBuffer *ImagePipeline::decodeBuffer() const
+{
+    return _decodeBuffer;
+}
+
+qint64 ImagePipeline::compressedBytes() const
+{
+    return _decode->compressedBytes();
+}
+
+/* Time each stage spent waiting shows which resource limits the install speed */
+QString ImagePipeline::statistics() const
+{
+    QString s;
+
+    if (_index)
+        s += QString("delta: %1 of %2 bytes reused. ").arg(_decode->reusedBytes()).arg(_index->size());
+    if (_fetchBuffer)
+    {
+        s += QString("fetch: %1 bytes, %2 from download cache, waited %3 s for decoder. ")
+                .arg(_fetchBuffer->totalBytes())
+                .arg(_fetch->cachedBytes())
+                .arg(_fetchBuffer->producerWaitMsecs()/1000.0);
+        s += QString("decode: waited %1 s for data, ").arg(_fetchBuffer->consumerWaitMsecs()/1000.0);
+    }
+    else
+    {
+        s += QString("decode: ");
+    }
+    s += QString("%1 bytes, waited %2 s for writer. ")
+            .arg(_decodeBuffer->totalBytes())
+            .arg(_decodeBuffer->producerWaitMsecs()/1000.0);
+    s += QString("write: waited %1 s for data").arg(_decodeBuffer->consumerWaitMsecs()/1000.0);
+
+    return s;
+}
@@ -0,0 +1,197 @@
+#ifndef IMAGEPIPELINE_H
+#define IMAGEPIPELINE_H
+
+/* Download/decompress pipeline for OS images
+ *
+ * Runs the stages of an install concurrently:
+ *
+ * - fetch thread: downloads the compressed image (network installs
+ *   only) into a ring buffer, over several connections at once if the
+ *   server supports range requests. With a download cache, chunks
+ *   that are cached already are read from the cache instead.
+ *   If the SHA-256 of the image file is known, it is verified here as
+ *   the data goes by, so hashing overlaps with decompression. With
+ *   checksums of its chunks, every chunk is held back until it is
+ *   verified, so corrupt data never reaches the SD card
+ * - decode thread: decompresses into a second ring buffer. Local images
+ *   are read here, through a VerifiedFile if they have checksums
+ * - the thread calling output() writes the data to the SD card
+ *
+ * With a chunk index of the image as well, the image is assembled from
+ * its content-defined chunks instead. Chunks that are cached are read
+ * from the cache, and only the others are downloaded from the chunk
+ * store. If that fails half-way, the whole image is downloaded after
+ * all, and passed on from where the chunks left off.
+ *
+ * The ring buffers and the decompressor are sized from the memory limit
+ * of the pipeline, so a network stall does not immediately stall SD card
+ * writes and vice versa, while pipelines running side by side stay
+ * within their share of the memory.
+ *
+ * Maintained by Raspberry Pi
+ *
+ * See LICENSE.txt for license details
+ *
+ */
+
+#include "chunkcache.h"
+#include "sha256.h"
+#include "segmenteddownload.h"
+#include "httpconnection.h"
+#include <QThread>
+#include <QString>
+#include <QVector>
+#include <QHash>
+#include <QMutex>
+#include <QAtomicInt>
+
+class QIODevice;
+class RingBuffer;
+class Decompressor;
+class ChunkIndex;
+
+/* Fraction of the memory limit used for the ring buffers. The decompressor uses half of it */
+#define PIPELINE_MEMORY_DIVISOR     4
+#define PIPELINE_MIN_BUFFER_SIZE    (1 * 1024 * 1024)
+#define PIPELINE_MAX_BUFFER_SIZE    (64 * 1024 * 1024)
+#define PIPELINE_CHUNK_SIZE         (256 * 1024)
+
+class ImagePipeline;
+
+class PipelineStage : public QThread
+{
+public:
+    PipelineStage(ImagePipeline *pipeline);
+    QString errorString() const;
+
+protected:
+    bool fail(const QString &msg);
+    ImagePipeline *_pipeline;
+    QString _error;
+};
+
+class FetchStage : public PipelineStage
+{
+public:
+    FetchStage(ImagePipeline *pipeline);
+    void kill();
+    qint64 cachedBytes() const;
+
+protected:
+    virtual void run();
+    void runStream();
+    void runDelta();
+    /* Returns false if the download cannot be cached, and should be streamed instead */
+    bool runCached();
+    bool fetchChunks();
+    bool downloadChunks(int first, int last);
+    bool received(const char *data, qint64 len);
+    void setDownload(SegmentedDownload *download);
+
+    /* Download in progress, for kill() */
+    QMutex _downloadMutex;
+    SegmentedDownload *_download;
+    bool _killed;
+    /* Chunks of a delta download */
+    HttpConnection _conn;
+
+    /* Checksum verification */
+    bool forward(const char *data, qint64 len);
+    bool releaseChunk();
+    bool finishStream();
+    bool mismatch(const QString &msg);
+    Sha256 _fileHash;
+    QByteArray _held;
+    int _heldLength, _verifiedChunks;
+
+    /* Download cache only */
+    CacheManifest _manifest;
+    int _chunkIndex;
+    QByteArray _chunk;
+    qint64 _cachedBytes;
+};
+
+class DecodeStage : public PipelineStage
+{
+public:
+    DecodeStage(ImagePipeline *pipeline);
+    void abort();
+    qint64 compressedBytes() const;
+    qint64 reusedBytes() const;
+
+protected:
+    virtual void run();
+    void runDelta();
+    bool downloadChunk(int i, QByteArray &data);
+    void runFallback(qint64 skip);
+    qint64 _compressedBytes, _reusedBytes;
+    /* Chunks that are corrupt in the cache */
+    HttpConnection _conn;
+
+    /* Pipeline downloading the whole image after a delta download failed */
+    QMutex _mutex;
+    ImagePipeline *_fallback;
+};
+
+class ImagePipeline
+{
+public:
+    /* Downloads are cached in 'cache', if one is given.
+     * With a chunk index as well, only the chunks that are not cached are downloaded.
+     * memoryLimit: bytes the buffers and the decompressor may use, 0 for the available memory */
+    explicit ImagePipeline(const QString &url, ChunkCache *cache = NULL, const ChunkIndex *index = NULL, qint64 memoryLimit = 0);
+    virtual ~ImagePipeline();
+
+    /* Verify the image file against sums. Call before start() */
+    void setChecksums(const ImageChecksums &sums);
+    /* Number of connections used to download the image. Call before start() */
+    void setConnections(int connections);
+
+    /* Start the fetch and decode threads */
+    void start();
+    /* Decompressed image data. Read from the thread that called start() */
+    QIODevice *output();
+    /* Stop all stages, e.g. because writing the data failed */
+    void abort();
+    /* Wait for the stages to end. Returns false if fetching or decompressing failed */
+    bool finish();
+    QString errorString() const;
+
+    /* Occupancy counters */
+    RingBuffer *fetchBuffer() const;
+    RingBuffer *decodeBuffer() const;
+    qint64 compressedBytes() const;
+    QString statistics() const;
+
+protected:
+    void planDelta();
+
+    QString _url;
+    ChunkCache *_cache;
+    ImageChecksums _checksums;
+    qint64 _memoryLimit, _bufferSize;
+    int _connections;
+
+    /* Delta downloads only: where every chunk of the index comes from */
+    enum ChunkSource
+    {
+        FromCache, FromStore, Repeated
+    };
+    const ChunkIndex *_index;
+    QVector<ChunkSource> _sources;
+    /* Last chunk with a given hash */
+    QHash<QByteArray,int> _lastUse;
+    QList<QByteArray> _pinned;
+
+    RingBuffer *_fetchBuffer, *_decodeBuffer;
+    FetchStage *_fetch;
+    DecodeStage *_decode;
+    QAtomicInt _aborted;
+    QString _error;
+
+    friend class PipelineStage;
+    friend class FetchStage;
+    friend class DecodeStage;
+};
+
+#endif // IMAGEPIPELINE_H
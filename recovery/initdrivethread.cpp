@@ -10,6 +10,7 @@
 #include "initdrivethread.h"
 #include "mbr.h"
 #include "util.h"
+#include "mountmanager.h"
 #include <QProcess>
 #include <QFile>
 #include <QDir>
@@ -366,12 +367,12 @@ int InitDriveThread::sizeofBootFilesInKB()
 
 bool InitDriveThread::mountSystemPartition()
 {
-    return QProcess::execute("mount /dev/mmcblk0p1 /mnt") == 0 || QProcess::execute("mount /dev/mmcblk0 /mnt") == 0;
+    return MountManager::mount("/dev/mmcblk0p1", "/mnt") || MountManager::mount("/dev/mmcblk0", "/mnt");
 }
 
 bool InitDriveThread::umountSystemPartition()
 {
-    return QProcess::execute("umount /mnt") == 0;
+    return MountManager::umount("/mnt");
 }
 
 bool InitDriveThread::formatBootPartition()
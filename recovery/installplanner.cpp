@@ -0,0 +1,351 @@
+#include "installplanner.h"
+#include "config.h"
+#include "json.h"
+#include "util.h"
+#include "fatbuilder.h"
+#include <QCoreApplication>
+#include <QFile>
+#include <QSettings>
+#include <QVariant>
+#include <QDebug>
+
+/* Install planner
+ *
+ * Maintained by Raspberry Pi
+ *
+ * See LICENSE.txt for license details
+ *
+ */
+
+/* Messages keep the translation context they had in MultiImageWriteThread */
+#define TR(s) QCoreApplication::translate("MultiImageWriteThread", s)
+
+InstallPlan::InstallPlan()
+    : estimatedBytes(0)
+{
+}
+
+int InstallPlan::estimatedSeconds() const
+{
+    return estimatedBytes / INSTALL_ESTIMATED_WRITE_SPEED;
+}
+
+QString InstallPlan::describe() const
+{
+    QString s;
+
+    foreach (const PlannedImage &image, images)
+    {
+        foreach (const PlannedPartition &p, image.partitions)
+        {
+            s += QString("%1: %2 %3 %4 MB at sector %5, %6 MB from %7%8%9\n")
+                    .arg(image.flavour, QString(p.device), QString(p.fstype))
+                    .arg(p.size/2048).arg(p.start).arg(p.estimatedBytes/1048576)
+                    .arg(p.emptyFs ? QString("(empty)") : p.source, p.inMemory ? QString(", built in memory") : QString(),
+                         p.chunkIndex.isEmpty() ? QString() : QString(", delta download"));
+        }
+    }
+    if (!cacheDevice.isEmpty())
+        s += QString("Download cache: %1\n").arg(QString(cacheDevice));
+    s += QString("Total: %1 MB, estimated %2 minutes").arg(estimatedBytes/1048576).arg((estimatedSeconds()+59)/60);
+
+    return s;
+}
+
+InstallPlanner::InstallPlanner()
+    : _extraSpacePerPartition(0), _inMemoryFat(false), _memoryLimit(0), _inMemoryLimit(0)
+{
+}
+
+QString InstallPlanner::errorString() const
+{
+    return _error;
+}
+
+void InstallPlanner::setMemoryLimit(qint64 bytes)
+{
+    _memoryLimit = bytes;
+}
+
+bool InstallPlanner::fail(const QString &msg)
+{
+    qDebug() << msg;
+    _error = msg;
+    return false;
+}
+
+bool InstallPlanner::plan(const QMultiMap<QString,QString> &images, InstallPlan &plan)
+{
+    /* Calculate space requirements */
+    int totalnominalsize = 0, numparts = 0, numexpandparts = 0;
+    int win10Fat = 0, win10Ntfs = 0;
+    bool RiscOSworkaround = false;
+    int startSector = getFileContents("/sys/class/block/mmcblk0p4/start").trimmed().toULongLong() + SETTINGS_PARTITION_SIZE + EBR_PARTITION_OFFSET;
+    int availableMB = (sizeofSDCardInBlocks() - startSector)/2048;
+
+    foreach (QString folder, images.keys())
+    {
+        QVariantList partitions = Json::loadFromFile(folder+"/partitions.json").toMap().value("partitions").toList();
+        if (partitions.isEmpty())
+            return fail(TR("partitions.json invalid"));
+
+        foreach (QVariant pv, partitions)
+        {
+            QVariantMap partition = pv.toMap();
+            numparts++;
+            if ( partition.value("want_maximised").toBool() )
+                numexpandparts++;
+            totalnominalsize += partition.value("partition_size_nominal").toInt();
+
+            if (nameMatchesWinIoT(folder))
+            {
+                /* Windows IoT partitions cannot be an extended partition.
+                   Reserve space after the extended partition */
+                int partitionSize = partition.value("partition_size_nominal").toInt() * 2048;
+                if (partition.value("filesystem_type").toString() == "NTFS" ||
+                    partition.value("filesystem_type").toString() == "ntfs")
+                {
+                    if (win10Ntfs != 0)
+                        return fail(TR("WinIoT cannot have more than 1 NTFS partition."));
+
+                    win10Ntfs = partitionSize;
+                }
+                if (partition.value("filesystem_type").toString() == "FAT" ||
+                    partition.value("filesystem_type").toString() == "fat")
+                {
+                    if (win10Fat != 0)
+                        return fail(TR("WinIoT cannot have more than 1 FAT partition."));
+
+                    win10Fat = partitionSize;
+                }
+            }
+        }
+
+        if (nameMatchesRiscOS(folder))
+        {
+            /* Check the riscos_offset in os.json matches what we're expecting.
+               In theory we shouldn't hit either of these errors because the invalid RISC_OS
+               should have been filtered out already (not added to OS-list) in mainwindow.cpp */
+            QVariantMap vos = Json::loadFromFile(folder+"/os.json", QStringList() << RISCOS_OFFSET_KEY);
+            if (vos.contains(RISCOS_OFFSET_KEY))
+            {
+                int riscos_offset = vos.value(RISCOS_OFFSET_KEY).toInt();
+                if (riscos_offset != RISCOS_OFFSET)
+                    return fail(TR("RISCOS cannot be installed. RISCOS offset value mismatch."));
+            }
+            else
+            {
+                return fail(TR("RISCOS cannot be installed. RISCOS offset value missing."));
+            }
+            if (startSector > RISCOS_SECTOR_OFFSET - EBR_PARTITION_OFFSET)
+                return fail(TR("RISCOS cannot be installed. Size of recovery partition too large."));
+
+            totalnominalsize += (RISCOS_SECTOR_OFFSET - startSector)/2048;
+            RiscOSworkaround = true;
+        }
+    }
+
+    /* 4 MB overhead per partition (logical partition table) */
+    totalnominalsize += (numparts * 4);
+
+    /* The download cache is left out if the images need the space */
+    QSettings settings("/settings/noobs.conf", QSettings::IniFormat);
+    int cacheMB = settings.value("download_cache_size", 0).toInt();
+    if (cacheMB > 0 && totalnominalsize + cacheMB + 4 > availableMB)
+    {
+        qDebug() << "Not enough space for a download cache of" << cacheMB << "MB";
+        cacheMB = 0;
+    }
+    if (cacheMB > 0)
+        availableMB -= cacheMB + 4;
+
+    if (numexpandparts)
+    {
+        /* Extra spare space available for partitions that want to be expanded */
+        _extraSpacePerPartition = (availableMB-totalnominalsize)/numexpandparts;
+    }
+
+    if (totalnominalsize > availableMB)
+    {
+        return fail(TR("Not enough disk space. Need %1 MB, got %2 MB").arg(QString::number(totalnominalsize), QString::number(availableMB)));
+    }
+
+    /* RiscOS has to be installed first, as it must start at a fixed offset */
+    for (QMultiMap<QString,QString>::const_iterator iter = images.constBegin(); iter != images.constEnd(); iter++)
+    {
+        PlannedImage image;
+        image.folder = iter.key();
+        image.flavour = iter.value();
+
+        if (RiscOSworkaround && nameMatchesRiscOS(iter.key()))
+        {
+            plan.images.prepend(image);
+            RiscOSworkaround = false;
+        }
+        else
+        {
+            plan.images.append(image);
+        }
+    }
+
+    /* Partition table: settings partition, Windows IoT primaries, and the logical partitions of all images */
+    if (!plan.table.load())
+        return fail(plan.table.errorString());
+
+    plan.table.clearLogical();
+    plan.table.addLogical(SETTINGS_PARTITION_SIZE, 0x83, plan.table.extendedStart() + EBR_PARTITION_OFFSET);
+    plan.table.removePrimary(2);
+    plan.table.removePrimary(3);
+
+    if (win10Fat || win10Ntfs)
+    {
+// BUGBUG
+        int startOfRecoveryPartition = getFileContents("/sys/class/block/mmcblk0p1/start").trimmed().toInt();
+        int sizeOfRecoveryPartition = getFileContents("/sys/class/block/mmcblk0p1/size").trimmed().toInt();
+        startSector = startOfRecoveryPartition + sizeOfRecoveryPartition;
+        // Align on 4 MiB boundary
+        startSector += 8192-(startSector % 8192);
+// BUGBUG
+
+        /* Reserve the space between recovery partition and extended partition */
+        plan.table.setPrimary(2, startSector, win10Fat, 0x0c);
+        plan.table.setPrimary(3, startSector + win10Fat, win10Ntfs, 0x07);
+    }
+
+    /* Boot partitions assembled in memory may use up to a quarter of the memory of their install step.
+     * The rest is left for the FAT structures and for downloading and decompressing the tarball */
+    _inMemoryFat   = settings.value("inmemory_fat", true).toBool();
+    _inMemoryLimit = (_memoryLimit ? _memoryLimit : availableMemory()) / 4;
+
+    plan.estimatedBytes = 0;
+    for (int i = 0; i < plan.images.size(); i++)
+    {
+        if (!addPartitions(plan, plan.images[i]))
+            return false;
+
+        foreach (const PlannedPartition &p, plan.images.at(i).partitions)
+            plan.estimatedBytes += p.estimatedBytes;
+    }
+
+    if (cacheMB > 0)
+    {
+        /* At the very end of the card, so it stays in place whatever OSes are installed,
+         * and keeps its contents from one install to the next */
+        quint32 cacheSectors = cacheMB * 2048;
+        quint32 cacheStart = ((plan.table.extendedStart() + plan.table.extendedSize() - cacheSectors) / 8192) * 8192;
+        int nr = plan.table.addLogical(cacheSectors, 0x83, cacheStart);
+
+        if (nr == -1)
+            qDebug() << "Cannot add download cache partition:" << plan.table.errorString();
+        else
+            plan.cacheDevice = QFile::encodeName(plan.table.partitionDevice(nr));
+    }
+
+    return true;
+}
+
+bool InstallPlanner::addPartitions(InstallPlan &plan, PlannedImage &image)
+{
+    const QString &folder = image.folder;
+    QVariantList partitions = Json::loadFromFile(folder+"/partitions.json").toMap().value("partitions").toList();
+
+    foreach (QVariant pv, partitions)
+    {
+        QVariantMap partition = pv.toMap();
+        PlannedPartition p;
+
+        p.fstype      = partition.value("filesystem_type").toByteArray();
+        p.mkfsOptions = partition.value("mkfs_options").toByteArray();
+        p.label       = partition.value("label").toByteArray();
+        p.source      = partition.value("tarball").toString();
+        p.emptyFs     = partition.value("empty_fs", false).toBool();
+        p.chunkIndex  = partition.value("chunk_index").toString();
+        p.chunkStore  = partition.value("chunk_store").toString();
+        p.checksums.sha256 = partition.value("sha256").toByteArray().toLower();
+        p.checksums.chunkSize = partition.value("sha256_chunk_size", IMAGE_CHECKSUM_CHUNK_SIZE).toInt();
+        foreach (const QVariant &sum, partition.value("sha256_chunks").toList())
+            p.checksums.chunks.append(sum.toByteArray().toLower());
+
+        if (!p.emptyFs && p.source.isEmpty())
+        {
+            /* If no tarball URL is specified, we expect the tarball to reside in the folder and be named <label.tar.xz> */
+            if (p.fstype == "raw" || p.fstype == "ntfs" || p.fstype == "NTFS")
+                p.source = folder+"/"+p.label+".xz";
+            else
+                p.source = folder+"/"+p.label+".tar.xz";
+
+            if (!QFile::exists(p.source))
+                return fail(TR("File '%1' does not exist").arg(p.source));
+        }
+        if (p.label.size() > 15)
+            p.label.clear();
+        /* Only downloads can be fetched in chunks */
+        if (!p.source.startsWith("http"))
+            p.chunkIndex.clear();
+
+        if (p.checksums.chunkSize <= 0)
+            return fail(TR("Invalid sha256_chunk_size"));
+
+        int partsizeMB = partition.value("partition_size_nominal").toInt();
+        if (!partsizeMB)
+            return fail(TR("Nominal partition size not specified or zero"));
+
+        /* Uncompressed data, plus file system meta data overhead */
+        p.estimatedBytes = qint64(partition.value("uncompressed_tarball_size").toInt()) * 1048576;
+        if (p.fstype == "ext4")
+            p.estimatedBytes += qint64(partsizeMB) * 1048576 / 100;
+
+        if ( partition.value("want_maximised").toBool() )
+            partsizeMB += _extraSpacePerPartition;
+
+        quint32 fixedStart = 0;
+
+        if (p.fstype == "FAT" || p.fstype == "fat")
+            p.type = 0x0c; /* FAT32 LBA */
+        else if (p.fstype == "swap")
+            p.type = 0x82;
+        else if (p.fstype == "NTFS" || p.fstype == "ntfs")
+            p.type = 0x07; /* NTFS */
+        else
+            p.type = 0x83; /* Linux native */
+
+        if (nameMatchesRiscOS(folder) && (p.fstype == "FAT" || p.fstype == "fat"))
+        {
+            /* Let Risc OS start at known offset */
+            fixedStart = RISCOS_SECTOR_OFFSET;
+        }
+
+        if (nameMatchesWinIoT(folder) && (p.fstype == "FAT" || p.fstype == "fat"))
+        {
+            /* Windows IoT uses primary partition 2, not extended partitions */
+            p.number = 2;
+        }
+        else if (nameMatchesWinIoT(folder) && (p.fstype == "NTFS" || p.fstype == "ntfs"))
+        {
+            /* Windows IoT uses primary partition 3, not extended partitions */
+            p.number = 3;
+        }
+        else
+        {
+            p.number = plan.table.addLogical(partsizeMB * 2048, p.type, fixedStart);
+            if (p.number == -1)
+                return fail(TR("Error creating partition entry")+"\n"+plan.table.errorString());
+        }
+
+        PartitionTable::Partition entry = p.number < 5 ? plan.table.primary(p.number) : plan.table.logical(p.number);
+        p.start  = entry.start;
+        p.size   = entry.size;
+        p.device = QFile::encodeName(plan.table.partitionDevice(p.number));
+
+        /* The first FAT partition of an OS, normally its boot partition, is assembled in memory
+         * and written in one go if it is small enough. Special mkfs options are left to mkfs.fat */
+        p.inMemory = _inMemoryFat && image.partitions.isEmpty() && (p.fstype == "FAT" || p.fstype == "fat") && !p.emptyFs
+                && (p.mkfsOptions.isEmpty() || p.mkfsOptions.simplified() == "-F 32")
+                && !nameMatchesRiscOS(folder) && !nameMatchesWinIoT(folder)
+                && p.estimatedBytes > 0 && p.estimatedBytes < _inMemoryLimit && FatBuilder::canBuild(p.size);
+
+        image.partitions.append(p);
+    }
+
+    return true;
+}
@@ -0,0 +1,94 @@
+#ifndef INSTALLPLANNER_H
+#define INSTALLPLANNER_H
+
+/* Install planner
+ *
+ * Computes the complete layout of the SD card for the selected
+ * images before anything is written: the partition table, and for
+ * every partition its location, file system, source and the number
+ * of bytes that are expected to be written to it.
+ *
+ * MultiImageWriteThread then executes the plan. As nothing is
+ * written while planning, the plan can also be shown as a dry run.
+ *
+ * Maintained by Raspberry Pi
+ *
+ * See LICENSE.txt for license details
+ *
+ */
+
+#include "partitiontable.h"
+#include "sha256.h"
+#include <QString>
+#include <QByteArray>
+#include <QList>
+#include <QMultiMap>
+
+/* Write speed used for the time estimate, in bytes per second.
+ * Conservative figure for a class 10 card */
+#define INSTALL_ESTIMATED_WRITE_SPEED  (6 * 1024 * 1024)
+
+/* File system label of the download cache partition */
+#define CACHE_PARTITION_LABEL  "CACHE"
+
+struct PlannedPartition
+{
+    QByteArray device;          /* e.g. /dev/mmcblk0p6 */
+    int number;
+    quint32 start, size;        /* In sectors */
+    uchar type;                 /* MBR partition type */
+    QByteArray fstype, label, mkfsOptions;
+    QString source;             /* Tarball or raw image, local path or URL */
+    /* Content-defined chunk index of the source and the store with its chunks, for delta downloads */
+    QString chunkIndex, chunkStore;
+    /* SHA-256 of the source file, and of its chunks */
+    ImageChecksums checksums;
+    bool emptyFs;
+    /* FAT file system assembled in memory and written in one pass, instead of mkfs and extracting to it */
+    bool inMemory;
+    qint64 estimatedBytes;
+};
+
+struct PlannedImage
+{
+    QString folder, flavour;
+    QList<PlannedPartition> partitions;
+};
+
+struct InstallPlan
+{
+    /* In installation order */
+    QList<PlannedImage> images;
+    PartitionTable table;
+    qint64 estimatedBytes;
+    /* Download cache partition at the end of the card, empty if there is none */
+    QByteArray cacheDevice;
+
+    InstallPlan();
+    int estimatedSeconds() const;
+    /* Human readable overview, one line per partition */
+    QString describe() const;
+};
+
+class InstallPlanner
+{
+public:
+    InstallPlanner();
+
+    /* images: key folder, value flavour */
+    bool plan(const QMultiMap<QString,QString> &images, InstallPlan &plan);
+    QString errorString() const;
+    /* Memory a single install step may use, 0 for the available memory. Call before plan() */
+    void setMemoryLimit(qint64 bytes);
+
+protected:
+    bool addPartitions(InstallPlan &plan, PlannedImage &image);
+    bool fail(const QString &msg);
+
+    int _extraSpacePerPartition;
+    bool _inMemoryFat;
+    qint64 _memoryLimit, _inMemoryLimit;
+    QString _error;
+};
+
+#endif // INSTALLPLANNER_H
@@ -1,12 +1,10 @@
 #include "json.h"
-#include <qjson/parser.h>
-#include <qjson/serializer.h>
+#include "jsonstream.h"
 #include <QDebug>
 #include <QFile>
+#include <QBuffer>
 
 /* Json helper class
- *
- * Outsources the hard work to QJson
  *
  * Initial author: Floris Bos
  * Maintained by Raspberry Pi
@@ -15,11 +13,62 @@
  *
  */
 
+QVariant Json::parseData(const QByteArray &json, const QStringList *fields, bool *ok)
+{
+    JsonReader r(json);
+    QVariant result;
+
+    if (fields && r.next() == JsonReader::BeginObject)
+    {
+        QList<QByteArray> names;
+        foreach (const QString &field, *fields)
+            names.append(field.toUtf8());
+
+        QVariantMap m;
+        while (r.next() == JsonReader::Name)
+        {
+            int i = 0;
+            while (i < names.size() && !r.nameIs(names.at(i)))
+                i++;
+
+            if (i < names.size())
+            {
+                r.next();
+                m.insert(fields->at(i), r.value());
+            }
+            else
+            {
+                r.skipValue();
+            }
+        }
+        result = m;
+    }
+    else if (fields)
+    {
+        /* Not an object, none of the fields */
+        r.skip();
+        result = QVariantMap();
+    }
+    else
+    {
+        r.next();
+        result = r.value();
+    }
+
+    *ok = !r.hasError() && r.next() == JsonReader::End;
+    if (!*ok)
+    {
+        qDebug() << "Json syntax error at offset" << r.errorOffset();
+        return QVariant();
+    }
+
+    return result;
+}
+
 QVariant Json::parse(const QByteArray &json)
 {
-    QJson::Parser parser;
     bool ok;
-    QVariant result = parser.parse (json, &ok);
+    QVariant result = parseData(json, NULL, &ok);
 
     if (!ok)
     {
@@ -30,10 +79,23 @@ QVariant Json::parse(const QByteArray &json)
     return result;
 }
 
-QVariant Json::loadFromFile(const QString &filename)
+QVariantMap Json::parse(const QByteArray &json, const QStringList &fields)
+{
+    bool ok;
+    QVariant result = parseData(json, &fields, &ok);
+
+    if (!ok)
+    {
+        qDebug() << "Error parsing json";
+        qDebug() << "Json input:" << json;
+    }
+
+    return result.toMap();
+}
+
+QVariant Json::load(const QString &filename, const QStringList *fields)
 {
     QFile f(filename);
-    QJson::Parser parser;
     bool ok;
 
     if (!f.open(f.ReadOnly))
@@ -42,8 +104,15 @@ QVariant Json::loadFromFile(const QString &filename)
         return QVariant();
     }
 
+    /* Parse the file in place if it can be mapped. Files of sysfs and the like cannot */
+    qint64 size = f.size();
+    uchar *map = size > 0 ? f.map(0, size) : NULL;
+    QByteArray data = map ? QByteArray::fromRawData((const char *) map, size) : f.readAll();
 
-    QVariant result = parser.parse (&f, &ok);
+    QVariant result = parseData(data, fields, &ok);
+    data.clear();
+    if (map)
+        f.unmap(map);
     f.close();
 
     if (!ok)
@@ -54,35 +123,43 @@ QVariant Json::loadFromFile(const QString &filename)
     return result;
 }
 
-QByteArray Json::serialize(const QVariant &json)
+QVariant Json::loadFromFile(const QString &filename)
 {
-    QJson::Serializer serializer;
-    bool ok;
+    return load(filename, NULL);
+}
 
-    serializer.setIndentMode(QJson::IndentFull);
-    QByteArray result = serializer.serialize(json, &ok);
+QVariantMap Json::loadFromFile(const QString &filename, const QStringList &fields)
+{
+    return load(filename, &fields).toMap();
+}
 
-    if (!ok)
+QByteArray Json::serialize(const QVariant &json)
+{
+    QBuffer buf;
+    buf.open(QIODevice::WriteOnly);
+
+    JsonWriter writer(&buf);
+    if (!writer.write(json) || !writer.flush())
     {
         qDebug() << "Error serializing json";
     }
 
-    return result;
+    return buf.data();
 }
 
+/* Written as it is serialized, through the writer's buffer */
 void Json::saveToFile(const QString &filename, const QVariant &json)
 {
     QFile f(filename);
-    QJson::Serializer serializer;
-    bool ok;
 
     if (!f.open(f.WriteOnly))
     {
         qDebug() << "Error opening file for writing: " << filename;
         return;
     }
-    serializer.setIndentMode(QJson::IndentFull);
-    serializer.serialize(json, &f, &ok);
+
+    JsonWriter writer(&f);
+    bool ok = writer.write(json) && writer.flush();
     f.close();
 
     if (!ok)
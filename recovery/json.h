@@ -3,7 +3,8 @@
 
 /* Json helper class
  *
- * Outsources the hard work to QJson
+ * Parses and writes JSON with JsonReader and JsonWriter (jsonstream.h).
+ * Files are mapped into memory rather than read, when possible.
  *
  * Initial author: Floris Bos
  * Maintained by Raspberry Pi
@@ -13,14 +14,22 @@
  */
 
 #include <QVariant>
+#include <QStringList>
 
 class Json
 {
 public:
     static QVariant parse(const QByteArray &json);
+    /* Only the given members of the top-level object. Others are skipped without converting them */
+    static QVariantMap parse(const QByteArray &json, const QStringList &fields);
     static QByteArray serialize(const QVariant &json);
     static QVariant loadFromFile(const QString &filename);
+    static QVariantMap loadFromFile(const QString &filename, const QStringList &fields);
     static void saveToFile(const QString &filename, const QVariant &json);
+
+protected:
+    static QVariant parseData(const QByteArray &json, const QStringList *fields, bool *ok);
+    static QVariant load(const QString &filename, const QStringList *fields);
 };
 
 #endif // JSON_H
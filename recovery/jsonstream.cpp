@@ -0,0 +1,613 @@
+#include "jsonstream.h"
+#include <QIODevice>
+#include <qnumeric.h>
+#include <string.h>
+
+/* Streaming JSON reader and writer
+ *
+ * Maintained by Raspberry Pi
+ *
+ * See LICENSE.txt for license details
+ *
+ */
+
+/* Objects and arrays nested deeper are rejected, value() recurses per level */
+#define JSON_MAX_DEPTH  512
+
+JsonReader::JsonReader(const char *data, int len)
+    : _p(data), _end(data+len), _begin(data), _tokenStart(data), _tokenLen(0), _escaped(false),
+      _token(Null), _afterName(false), _needComma(false), _done(false)
+{
+}
+
+/* Shares data rather than copying it */
+JsonReader::JsonReader(const QByteArray &data)
+    : _data(data), _p(data.constData()), _end(data.constData()+data.size()), _begin(data.constData()),
+      _tokenStart(data.constData()), _tokenLen(0), _escaped(false),
+      _token(Null), _afterName(false), _needComma(false), _done(false)
+{
+}
+
+JsonReader::Token JsonReader::token() const
+{
+    return _token;
+}
+
+bool JsonReader::hasError() const
+{
+    return _token == Error;
+}
+
+int JsonReader::errorOffset() const
+{
+    return _p - _begin;
+}
+
+JsonReader::Token JsonReader::error()
+{
+    _token = Error;
+    return Error;
+}
+
+JsonReader::Token JsonReader::setToken(Token t, const char *start)
+{
+    _token = t;
+    _tokenStart = start;
+    _tokenLen = _p - start;
+    return t;
+}
+
+void JsonReader::skipSpace()
+{
+    while (_p < _end && (*_p == ' ' || *_p == '\n' || *_p == '\r' || *_p == '\t'))
+        _p++;
+}
+
+JsonReader::Token JsonReader::next()
+{
+    if (_token == End || _token == Error)
+        return _token;
+
+    skipSpace();
+    if (_afterName)
+    {
+        _afterName = false;
+        if (_p == _end || *_p != ':')
+            return error();
+        _p++;
+        skipSpace();
+        return readValue();
+    }
+    if (_done)
+        return _p == _end ? setToken(End, _p) : error();
+    if (_stack.isEmpty())
+        return readValue();
+
+    char open = _stack.at(_stack.size()-1);
+    if (_p < _end && *_p == (open == '{' ? '}' : ']'))
+    {
+        _stack.chop(1);
+        _needComma = true;
+        _done = _stack.isEmpty();
+        _p++;
+        return setToken(open == '{' ? EndObject : EndArray, _p-1);
+    }
+    if (_needComma)
+    {
+        if (_p == _end || *_p != ',')
+            return error();
+        _p++;
+        skipSpace();
+    }
+    if (open == '[')
+        return readValue();
+
+    if (_p == _end || *_p != '"' || readValue() != String)
+        return error();
+    _needComma = false;
+    _done = false;
+    _afterName = true;
+    _token = Name;
+    return Name;
+}
+
+JsonReader::Token JsonReader::readValue()
+{
+    if (_p == _end)
+        return error();
+
+    const char *start = _p;
+    Token t;
+
+    switch (*_p)
+    {
+    case '{':
+    case '[':
+        _stack.append(*_p++);
+        _needComma = false;
+        if (_stack.size() > JSON_MAX_DEPTH)
+            return error();
+        return setToken(*start == '{' ? BeginObject : BeginArray, start);
+
+    case '"':
+        /* The span is the string between the quotes, escapes are resolved by string() */
+        _escaped = false;
+        for (_p++; _p < _end && *_p != '"'; _p++)
+        {
+            if (*_p == '\\')
+            {
+                _escaped = true;
+                if (++_p == _end)
+                    break;
+            }
+            else if (uchar(*_p) < 0x20)
+            {
+                return error();
+            }
+        }
+        if (_p == _end)
+            return error();
+        _token = t = String;
+        _tokenStart = start+1;
+        _tokenLen = _p - _tokenStart;
+        _p++;
+        break;
+
+    case 't':
+    case 'f':
+    case 'n':
+    {
+        static const char *literals[] = { "true", "false", "null" };
+        const char *literal = literals[*_p == 't' ? 0 : *_p == 'f' ? 1 : 2];
+        int len = strlen(literal);
+
+        if (_end - _p < len || memcmp(_p, literal, len) != 0)
+            return error();
+        _p += len;
+        setToken(*start == 'n' ? Null : Bool, start);
+        t = _token;
+        break;
+    }
+
+    default:
+    {
+        /* -, integer part, optional fraction and exponent, each with at least one digit */
+        if (*_p == '-')
+            _p++;
+        const char *digits = _p;
+        while (_p < _end && *_p >= '0' && *_p <= '9')
+            _p++;
+        if (_p == digits)
+            return error();
+        if (_p < _end && *_p == '.')
+        {
+            digits = ++_p;
+            while (_p < _end && *_p >= '0' && *_p <= '9')
+                _p++;
+            if (_p == digits)
+                return error();
+        }
+        if (_p < _end && (*_p == 'e' || *_p == 'E'))
+        {
+            _p++;
+            if (_p < _end && (*_p == '+' || *_p == '-'))
+                _p++;
+            digits = _p;
+            while (_p < _end && *_p >= '0' && *_p <= '9')
+                _p++;
+            if (_p == digits)
+                return error();
+        }
+        t = setToken(Number, start);
+        break;
+    }
+    }
+
+    _needComma = true;
+    _done = _stack.isEmpty();
+    return t;
+}
+
+bool JsonReader::compareName(const char *name, int len) const
+{
+    if (_token != Name)
+        return false;
+    if (!_escaped)
+        return _tokenLen == len && memcmp(_tokenStart, name, len) == 0;
+
+    return string().toUtf8() == QByteArray::fromRawData(name, len);
+}
+
+bool JsonReader::nameIs(const char *name) const
+{
+    return compareName(name, strlen(name));
+}
+
+bool JsonReader::nameIs(const QByteArray &name) const
+{
+    return compareName(name.constData(), name.size());
+}
+
+static int hexValue(const char *p)
+{
+    int v = 0;
+
+    for (int i = 0; i < 4; i++)
+    {
+        char c = p[i];
+        v <<= 4;
+        if (c >= '0' && c <= '9')
+            v |= c - '0';
+        else if (c >= 'a' && c <= 'f')
+            v |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F')
+            v |= c - 'A' + 10;
+        else
+            return -1;
+    }
+
+    return v;
+}
+
+static void appendUtf8(QByteArray &a, uint c)
+{
+    if (c < 0x80)
+    {
+        a.append(char(c));
+    }
+    else if (c < 0x800)
+    {
+        a.append(char(0xc0 | (c >> 6)));
+        a.append(char(0x80 | (c & 0x3f)));
+    }
+    else if (c < 0x10000)
+    {
+        a.append(char(0xe0 | (c >> 12)));
+        a.append(char(0x80 | ((c >> 6) & 0x3f)));
+        a.append(char(0x80 | (c & 0x3f)));
+    }
+    else
+    {
+        a.append(char(0xf0 | (c >> 18)));
+        a.append(char(0x80 | ((c >> 12) & 0x3f)));
+        a.append(char(0x80 | ((c >> 6) & 0x3f)));
+        a.append(char(0x80 | (c & 0x3f)));
+    }
+}
+
+QString JsonReader::string() const
+{
+    if (_token != Name && _token != String)
+        return QString();
+    if (!_escaped)
+        return QString::fromUtf8(_tokenStart, _tokenLen);
+
+    QByteArray utf8;
+    const char *p = _tokenStart, *end = _tokenStart+_tokenLen;
+    utf8.reserve(_tokenLen);
+
+    while (p < end)
+    {
+        const char *run = p;
+        while (p < end && *p != '\\')
+            p++;
+        utf8.append(run, p - run);
+        if (p == end)
+            break;
+
+        /* The reader made sure that an escape is not the last character */
+        char c = p[1];
+        p += 2;
+        switch (c)
+        {
+        case 'b': utf8.append('\b'); break;
+        case 'f': utf8.append('\f'); break;
+        case 'n': utf8.append('\n'); break;
+        case 'r': utf8.append('\r'); break;
+        case 't': utf8.append('\t'); break;
+        case 'u':
+        {
+            int u = (end - p >= 4) ? hexValue(p) : -1;
+            if (u < 0)
+            {
+                utf8.append('u');
+                break;
+            }
+            p += 4;
+
+            /* UTF-16 surrogate pair */
+            if (u >= 0xd800 && u < 0xdc00 && end - p >= 6 && p[0] == '\\' && p[1] == 'u')
+            {
+                int low = hexValue(p+2);
+                if (low >= 0xdc00 && low < 0xe000)
+                {
+                    u = 0x10000 + ((u - 0xd800) << 10) + (low - 0xdc00);
+                    p += 6;
+                }
+            }
+            if (u >= 0xd800 && u < 0xe000)
+                u = 0xfffd;
+            appendUtf8(utf8, u);
+            break;
+        }
+        default:
+            utf8.append(c);
+        }
+    }
+
+    return QString::fromUtf8(utf8.constData(), utf8.size());
+}
+
+QVariant JsonReader::scalar() const
+{
+    switch (_token)
+    {
+    case String:
+        return string();
+    case Bool:
+        return QVariant(*_tokenStart == 't');
+    case Number:
+    {
+        QByteArray n(_tokenStart, _tokenLen);
+        bool ok;
+
+        if (!memchr(_tokenStart, '.', _tokenLen) && !memchr(_tokenStart, 'e', _tokenLen) && !memchr(_tokenStart, 'E', _tokenLen))
+        {
+            if (n.startsWith('-'))
+            {
+                qlonglong v = n.toLongLong(&ok);
+                if (ok)
+                    return QVariant(v);
+            }
+            else
+            {
+                qulonglong v = n.toULongLong(&ok);
+                if (ok)
+                    return QVariant(v);
+            }
+        }
+        return QVariant(n.toDouble());
+    }
+    default:
+        return QVariant();
+    }
+}
+
+QVariant JsonReader::value()
+{
+    switch (_token)
+    {
+    case BeginObject:
+    {
+        QVariantMap m;
+        while (next() == Name)
+        {
+            QString key = string();
+            next();
+            m.insert(key, value());
+        }
+        return _token == EndObject ? QVariant(m) : QVariant();
+    }
+    case BeginArray:
+    {
+        QVariantList l;
+        while (next() != EndArray && _token != Error)
+            l.append(value());
+        return _token == EndArray ? QVariant(l) : QVariant();
+    }
+    default:
+        return scalar();
+    }
+}
+
+bool JsonReader::skip()
+{
+    if (_token == BeginObject || _token == BeginArray)
+    {
+        int depth = _stack.size();
+        while (_stack.size() >= depth)
+        {
+            if (next() == Error)
+                return false;
+        }
+    }
+
+    return _token != Error;
+}
+
+bool JsonReader::skipValue()
+{
+    if (next() == Error)
+        return false;
+
+    return skip();
+}
+
+JsonWriter::JsonWriter(QIODevice *out)
+    : _out(out), _len(0), _ok(true)
+{
+}
+
+JsonWriter::~JsonWriter()
+{
+    flush();
+}
+
+bool JsonWriter::flush()
+{
+    if (_len)
+    {
+        if (_out->write(_buf, _len) != _len)
+            _ok = false;
+        _len = 0;
+    }
+
+    return _ok;
+}
+
+void JsonWriter::append(const char *s, int len)
+{
+    if (_len + len > JSON_WRITE_BUFFER)
+    {
+        flush();
+        if (len > JSON_WRITE_BUFFER)
+        {
+            if (_out->write(s, len) != len)
+                _ok = false;
+            return;
+        }
+    }
+    memcpy(_buf+_len, s, len);
+    _len += len;
+}
+
+void JsonWriter::append(const QByteArray &s)
+{
+    append(s.constData(), s.size());
+}
+
+void JsonWriter::newline(int indent)
+{
+    static const char spaces[] = "\n                ";
+
+    append(spaces, 1);
+    for (indent *= 2; indent > 0; indent -= 16)
+        append(spaces+1, qMin(indent, 16));
+}
+
+bool JsonWriter::write(const QVariant &v)
+{
+    writeValue(v, 0);
+    append("\n", 1);
+
+    return _ok;
+}
+
+void JsonWriter::writeValue(const QVariant &v, int indent)
+{
+    switch (v.type())
+    {
+    case QVariant::Invalid:
+        append("null", 4);
+        break;
+
+    case QVariant::Bool:
+        if (v.toBool())
+            append("true", 4);
+        else
+            append("false", 5);
+        break;
+
+    case QVariant::Int:
+    case QVariant::LongLong:
+        append(QByteArray::number(v.toLongLong()));
+        break;
+
+    case QVariant::UInt:
+    case QVariant::ULongLong:
+        append(QByteArray::number(v.toULongLong()));
+        break;
+
+    case QVariant::Double:
+    {
+        double d = v.toDouble();
+        if (qIsFinite(d))
+            append(QByteArray::number(d, 'g', 15));
+        else
+            append("null", 4);
+        break;
+    }
+
+    case QVariant::Map:
+    {
+        const QVariantMap m = v.toMap();
+        if (m.isEmpty())
+        {
+            append("{}", 2);
+            break;
+        }
+
+        append("{", 1);
+        for (QVariantMap::const_iterator i = m.constBegin(); i != m.constEnd(); ++i)
+        {
+            if (i != m.constBegin())
+                append(",", 1);
+            newline(indent+1);
+            writeString(i.key());
+            append(" : ", 3);
+            writeValue(i.value(), indent+1);
+        }
+        newline(indent);
+        append("}", 1);
+        break;
+    }
+
+    case QVariant::List:
+    case QVariant::StringList:
+    {
+        const QVariantList l = v.toList();
+        if (l.isEmpty())
+        {
+            append("[]", 2);
+            break;
+        }
+
+        append("[", 1);
+        for (int i = 0; i < l.size(); i++)
+        {
+            if (i)
+                append(",", 1);
+            newline(indent+1);
+            writeValue(l.at(i), indent+1);
+        }
+        newline(indent);
+        append("]", 1);
+        break;
+    }
+
+    default:
+        writeString(v.toString());
+    }
+}
+
+void JsonWriter::writeString(const QString &s)
+{
+    static const char hex[] = "0123456789abcdef";
+    const QByteArray utf8 = s.toUtf8();
+    const char *p = utf8.constData(), *end = p+utf8.size();
+
+    append("\"", 1);
+    while (p < end)
+    {
+        const char *run = p;
+        while (p < end && uchar(*p) >= 0x20 && *p != '"' && *p != '\\')
+            p++;
+        append(run, p - run);
+        if (p == end)
+            break;
+
+        char esc[6] = { '\\', *p, 0, 0, 0, 0 };
+        int len = 2;
+        switch (*p)
+        {
+        case '\b': esc[1] = 'b'; break;
+        case '\f': esc[1] = 'f'; break;
+        case '\n': esc[1] = 'n'; break;
+        case '\r': esc[1] = 'r'; break;
+        case '\t': esc[1] = 't'; break;
+        case '"':
+        case '\\':
+            break;
+        default:
+            esc[1] = 'u';
+            esc[2] = '0';
+            esc[3] = '0';
+            esc[4] = hex[(*p >> 4) & 0xf];
+            esc[5] = hex[*p & 0xf];
+            len = 6;
+        }
+        append(esc, len);
+        p++;
+    }
+    append("\"", 1);
+}
@@ -0,0 +1,127 @@
+#ifndef JSONSTREAM_H
+#define JSONSTREAM_H
+
+/* Streaming JSON reader and writer
+ *
+ * JsonReader is a pull parser: it walks the input token by token, and
+ * only converts what the caller asks for. Names and strings are handed
+ * out as spans of the input, so skipped members cost no allocations,
+ * and names can be compared without converting them to QString. The
+ * input is not copied, it must stay valid while the reader is used.
+ *
+ *   JsonReader r(data);
+ *   if (r.next() == JsonReader::BeginObject)
+ *   {
+ *       while (r.next() == JsonReader::Name)
+ *       {
+ *           if (r.nameIs("release_date"))
+ *           {
+ *               r.next();
+ *               date = r.string();
+ *           }
+ *           else
+ *           {
+ *               r.skipValue();
+ *           }
+ *       }
+ *   }
+ *
+ * JsonWriter writes a QVariant to a QIODevice through a small buffer,
+ * instead of building the whole document in memory first.
+ *
+ * Maintained by Raspberry Pi
+ *
+ * See LICENSE.txt for license details
+ *
+ */
+
+#include <QByteArray>
+#include <QString>
+#include <QVariant>
+
+class QIODevice;
+
+/* Buffer size of JsonWriter */
+#define JSON_WRITE_BUFFER  4096
+
+class JsonReader
+{
+public:
+    enum Token
+    {
+        BeginObject, EndObject, BeginArray, EndArray,
+        Name, String, Number, Bool, Null,
+        End, Error
+    };
+
+    JsonReader(const char *data, int len);
+    explicit JsonReader(const QByteArray &data);
+
+    /* Advance to the next token. After a Name follows the token of its value */
+    Token next();
+    Token token() const;
+
+    /* Whether the current Name is name (UTF-8) */
+    bool nameIs(const char *name) const;
+    bool nameIs(const QByteArray &name) const;
+    /* Current Name or String, unescaped */
+    QString string() const;
+    /* Current String, Number, Bool or Null as a QVariant. Numbers are converted
+     * to qulonglong, qlonglong if negative, or double if fractional or too large */
+    QVariant scalar() const;
+
+    /* Convert the value at the current token, including what is nested in it.
+     * Leaves the reader at the last token of the value */
+    QVariant value();
+    /* Skip what is nested in the current token, if it begins an object or array */
+    bool skip();
+    /* Advance to the value of the current Name, and skip it */
+    bool skipValue();
+
+    bool hasError() const;
+    /* Offset in the input of the error */
+    int errorOffset() const;
+
+protected:
+    Token readValue();
+    Token setToken(Token t, const char *start);
+    Token error();
+    void skipSpace();
+    bool compareName(const char *name, int len) const;
+
+    QByteArray _data;
+    const char *_p, *_end, *_begin;
+    /* Span of the current token */
+    const char *_tokenStart;
+    int _tokenLen;
+    bool _escaped;
+    Token _token;
+    /* '{' or '[' per open container */
+    QByteArray _stack;
+    bool _afterName, _needComma, _done;
+};
+
+class JsonWriter
+{
+public:
+    explicit JsonWriter(QIODevice *out);
+    ~JsonWriter();
+
+    bool write(const QVariant &v);
+    /* Write out what is buffered. Returns false if any write failed */
+    bool flush();
+
+protected:
+    void writeValue(const QVariant &v, int indent);
+    void writeString(const QString &s);
+    void append(const char *s, int len);
+    void append(const QByteArray &s);
+    void newline(int indent);
+
+    QIODevice *_out;
+    char _buf[JSON_WRITE_BUFFER];
+    int _len;
+    bool _ok;
+};
+
+#endif // JSONSTREAM_H
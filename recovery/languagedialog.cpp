@@ -10,6 +10,7 @@
 #include "languagedialog.h"
 #include "ui_languagedialog.h"
 #include "config.h"
+#include "mountmanager.h"
 #include <QIcon>
 #include <QDebug>
 #include <QFile>
@@ -19,7 +20,6 @@
 #include <QKeyEvent>
 #include <QWSServer>
 #include <QKbdDriverFactory>
-#include <QProcess>
 #include <QSettings>
 
 /* Extra strings for lupdate to detect and hand over to translator to translate */
@@ -51,7 +51,7 @@ LanguageDialog::LanguageDialog(const QString &defaultLang, const QString &defaul
     qDebug() << "Default language is " << defaultLang;
     qDebug() << "Default keyboard layout is " << defaultKeyboard;
 
-    QProcess::execute("mount -o ro -t ext4 " SETTINGS_PARTITION " /settings");
+    MountManager::mountSettings();
     QSettings settings("/settings/noobs.conf", QSettings::IniFormat, this);
     QString savedLang = settings.value("language", defaultLang).toString();
     QString savedKeyLayout = settings.value("keyboard_layout", defaultKeyboard).toString();
@@ -124,11 +124,10 @@ void LanguageDialog::changeKeyboardLayout(const QString &langcode)
 #endif
 
         // Save new language choice to INI files
-        QProcess::execute("mount -o remount, rw /settings");
+        SettingsWriteLocker lock;
         QSettings settings("/settings/noobs.conf", QSettings::IniFormat, this);
         settings.setValue("keyboard_layout", langcode);
         settings.sync();
-        QProcess::execute("mount -o remount, ro /settings");
 }
 
 void LanguageDialog::changeLanguage(const QString &langcode)
@@ -202,11 +201,10 @@ void LanguageDialog::changeLanguage(const QString &langcode)
     _currentLang = langcode;
 
     // Save new language choice to INI file
-    QProcess::execute("mount -o remount,rw /settings");
+    SettingsWriteLocker lock;
     QSettings settings("/settings/noobs.conf", QSettings::IniFormat, this);
     settings.setValue("language", langcode);
     settings.sync();
-    QProcess::execute("mount -o remount,ro /settings");
 
 }
 
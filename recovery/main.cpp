@@ -7,6 +7,8 @@
 #include "json.h"
 #include "util.h"
 #include "bootselectiondialog.h"
+#include "mountmanager.h"
+#include "oscatalog.h"
 #include <stdio.h>
 #include <unistd.h>
 #include <sys/reboot.h>
@@ -34,11 +36,11 @@
  *
  */
 
-void reboot_to_extended(const QString &defaultPartition, bool setDisplayMode)
+void reboot_to_extended(const QString &defaultPartition, bool setDisplayMode, OsCatalog *catalog)
 {
     // Unmount any open file systems
-    QProcess::execute("umount -r /mnt");
-    QProcess::execute("umount -r /settings");
+    MountManager::umount("/mnt", true);
+    MountManager::umount("/settings", true);
 
     // Check if more than one OS is installed, if so show boot selection dialog
     if (QFile::exists("/dev/mmcblk0p8") ||
@@ -48,7 +50,7 @@ void reboot_to_extended(const QString &defaultPartition, bool setDisplayMode)
         QWSServer::setBackground(Qt::white);
         QWSServer::setCursorVisible(true);
 #endif
-        BootSelectionDialog bsd(defaultPartition);
+        BootSelectionDialog bsd(defaultPartition, catalog);
         if (setDisplayMode)
             bsd.setDisplayMode();
         bsd.exec();
@@ -79,6 +81,8 @@ int main(int argc, char *argv[])
     QApplication a(argc, argv);
     RightButtonFilter rbf;
     GpioInput gpio(gpioChannel);
+    /* OSes on the SD card, installed and downloaded, shared by the installer and the boot menu */
+    OsCatalog catalog;
 
     bool runinstaller = false;
     bool gpio_trigger = false;
@@ -89,6 +93,7 @@ int main(int argc, char *argv[])
     QString defaultKeyboard = "gb";
     QString defaultDisplay = "0";
     QString defaultPartition = "800";
+    bool dryrun = false;
 
     // Process command-line arguments
     for (int i=1; i<argc; i++)
@@ -129,6 +134,9 @@ int main(int argc, char *argv[])
             if (argc > i+1)
                 defaultPartition = argv[i+1];
         }
+        // Only show the install plan, do not write to the SD card
+        else if (strcmp(argv[i], "-dryrun") == 0)
+            dryrun = true;
     }
 
     // Intercept right mouse clicks sent to the title bar
@@ -175,7 +183,7 @@ int main(int argc, char *argv[])
     if (bailout)
     {
         splash->hide();
-        reboot_to_extended(defaultPartition, true);
+        reboot_to_extended(defaultPartition, true, &catalog);
     }
 
 #ifdef Q_WS_QWS
@@ -183,7 +191,8 @@ int main(int argc, char *argv[])
 #endif
 
     // Main window in the middle of screen
-    MainWindow mw(defaultDisplay, splash);
+    MainWindow mw(defaultDisplay, splash, &catalog);
+    mw.setDryRun(dryrun);
     mw.setGeometry(QStyle::alignedRect(Qt::LeftToRight, Qt::AlignCenter, mw.size(), a.desktop()->availableGeometry()));
     mw.show();
 
@@ -195,7 +204,7 @@ int main(int argc, char *argv[])
 #endif
 
     a.exec();
-    reboot_to_extended(defaultPartition, false);
+    reboot_to_extended(defaultPartition, false, &catalog);
 
     return 0;
 }
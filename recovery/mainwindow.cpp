@@ -9,6 +9,13 @@
 #include "json.h"
 #include "util.h"
 #include "twoiconsdelegate.h"
+#include "mountmanager.h"
+#include "metadownloader.h"
+#include "oslistcache.h"
+#include "iconstore.h"
+#include "catalogindex.h"
+#include "oscatalog.h"
+#include "oslistmodel.h"
 #include <QMessageBox>
 #include <QProgressDialog>
 #include <QMap>
@@ -26,8 +33,6 @@
 #include <QDesktopWidget>
 #include <QSettings>
 #include <QtNetwork/QNetworkAccessManager>
-#include <QtNetwork/QNetworkRequest>
-#include <QtNetwork/QNetworkReply>
 #include <QtNetwork/QNetworkDiskCache>
 
 #include <unistd.h>
@@ -50,23 +55,18 @@
  *
  */
 
-/* To keep track of where the different OSes get 'installed' from */
-#define SOURCE_SDCARD "sdcard"
-#define SOURCE_NETWORK "network"
-#define SOURCE_INSTALLED_OS "installed_os"
-
 /* Flag to keep track wheter or not we already repartitioned. */
 bool MainWindow::_partInited = false;
 
 /* Flag to keep track of current display mode. */
 int MainWindow::_currentMode = 0;
 
-MainWindow::MainWindow(const QString &defaultDisplay, QSplashScreen *splash, QWidget *parent) :
+MainWindow::MainWindow(const QString &defaultDisplay, QSplashScreen *splash, OsCatalog *catalog, QWidget *parent) :
     QMainWindow(parent),
     ui(new Ui::MainWindow),
     _qpd(NULL), _kcpos(0), _defaultDisplay(defaultDisplay),
     _silent(false), _allowSilent(false), _splash(splash), _settings(NULL),
-    _activatedEth(false), _numInstalledOS(0), _netaccess(NULL), _displayModeBox(NULL)
+    _activatedEth(false), _settingsRW(false), _dryRun(false), _numInstalledOS(0), _netaccess(NULL), _downloader(NULL), _listCache(NULL), _icons(new IconStore), _catalog(NULL), _osCatalog(catalog), _model(new OsListModel(catalog, _icons, this)), _imageWriteThread(NULL), _displayModeBox(NULL)
 {
     ui->setupUi(this);
     setWindowFlags(Qt::Window | Qt::CustomizeWindowHint | Qt::WindowTitleHint);
@@ -74,9 +74,12 @@ MainWindow::MainWindow(const QString &defaultDisplay, QSplashScreen *splash, QWi
     update_window_title();
     _kc << 0x01000013 << 0x01000013 << 0x01000015 << 0x01000015 << 0x01000012
         << 0x01000014 << 0x01000012 << 0x01000014 << 0x42 << 0x41;
-    ui->list->setItemDelegate(new TwoIconsDelegate(this));
+    ui->list->setItemDelegate(new TwoIconsDelegate(this, _icons));
+    ui->list->setModel(_model);
     ui->list->installEventFilter(this);
     ui->advToolBar->setVisible(false);
+    connect(_model, SIGNAL(checkedChanged()), this, SLOT(updateNeeded()));
+    connect(ui->list->selectionModel(), SIGNAL(currentChanged(QModelIndex,QModelIndex)), this, SLOT(currentOsChanged()));
 
     QRect s = QApplication::desktop()->screenGeometry();
     if (s.height() < 500)
@@ -126,10 +129,19 @@ MainWindow::MainWindow(const QString &defaultDisplay, QSplashScreen *splash, QWi
 
 MainWindow::~MainWindow()
 {
-    QProcess::execute("umount /mnt");
+    MountManager::umount("/mnt");
+    delete _listCache;
+    delete _icons;
+    delete _catalog;
     delete ui;
 }
 
+/* Only show what would be installed where, without writing to the SD card */
+void MainWindow::setDryRun(bool dryRun)
+{
+    _dryRun = dryRun;
+}
+
 /* Mount FAT partition, discover which images we have, and fill in the list */
 void MainWindow::populate()
 {
@@ -152,27 +164,28 @@ void MainWindow::populate()
     if (QFile::exists(SETTINGS_PARTITION))
     {
         /* Try mounting read-only first, if fails try read-write as it may recover from journal */
-        if (QProcess::execute("mount -o remount,ro /settings")!=0
-            && QProcess::execute("mount -o remount,rw /settings")!=0)
+        if (!MountManager::remount("/settings", true)
+            && !MountManager::remount("/settings", false))
         {
             if (QMessageBox::question(this,
                                       tr("Error mounting settings partition"),
                                       tr("Persistent settings partition seems corrupt. Reformat?"),
                                       QMessageBox::Yes, QMessageBox::No) == QMessageBox::Yes)
             {
-                QProcess::execute("umount /settings");
+                MountManager::umount("/settings");
                 if (QProcess::execute("/usr/sbin/mkfs.ext4 " SETTINGS_PARTITION) != 0
-                    || QProcess::execute("mount " SETTINGS_PARTITION " /settings") != 0)
+                    || !MountManager::mountSettings())
                 {
                     QMessageBox::critical(this, tr("Reformat failed"), tr("SD card might be damaged"), QMessageBox::Close);
                 }
 
+                SettingsWriteLocker lock;
                 rebuildInstalledList();
-                QProcess::execute("mount -o remount,ro " SETTINGS_PARTITION);
             }
         }
 
         _settings = new QSettings("/settings/noobs.conf", QSettings::IniFormat, this);
+        _listCache = new OsListCache;
 
         /* Restore saved display mode */
         qDebug() << "Default display mode is " << _defaultDisplay;
@@ -181,140 +194,104 @@ void MainWindow::populate()
         {
             displayMode(mode, true);
         }
-        QProcess::execute("mount -o remount,rw /settings");
+        SettingsWriteLocker lock;
         _settings->setValue("display_mode", _defaultDisplay);
         _settings->sync();
-        QProcess::execute("mount -o remount,ro /settings");
 
     }
 
-    QProcess::execute("mount -o ro -t vfat /dev/mmcblk0p1 /mnt");
+    MountManager::mount("/dev/mmcblk0p1", "/mnt", "vfat", true);
 
     // Fill in list of images
     repopulate();
+    saveIcons();
     _availableMB = (sizeofSDCardInBlocks() - SETTINGS_PARTITION_SIZE - EBR_PARTITION_OFFSET - getFileContents("/sys/class/block/mmcblk0p4/start").trimmed().toULongLong())/2048;
     updateNeeded();
 
-    if (ui->list->count() != 0)
+    if (_model->rowCount() != 0)
     {
-        QList<QListWidgetItem *> l = ui->list->findItems(RECOMMENDED_IMAGE, Qt::MatchExactly);
+        QModelIndex recommended = _model->indexOf(RECOMMENDED_IMAGE);
 
-        if (!l.isEmpty())
+        if (recommended.isValid())
         {
-            ui->list->setCurrentItem(l.first());
+            ui->list->setCurrentIndex(recommended);
         }
         else
         {
-            ui->list->setCurrentRow(0);
+            ui->list->setCurrentIndex(_model->index(0));
         }
 
-        if (_allowSilent && !QFile::exists(FAT_PARTITION_OF_IMAGE) && ui->list->count() == 1)
+        if (_allowSilent && !QFile::exists(FAT_PARTITION_OF_IMAGE) && _model->rowCount() == 1)
         {
             // No OS installed, perform silent installation
             qDebug() << "Performing silent installation";
             _silent = true;
-            ui->list->item(0)->setCheckState(Qt::Checked);
+            _model->setData(_model->index(0), Qt::Checked, Qt::CheckStateRole);
             on_actionWrite_image_to_disk_triggered();
         }
     }
 
+    /* Show the OSes of the last list downloaded, instead of waiting for the network */
+    if (!_silent && loadCachedList() && !ui->list->currentIndex().isValid())
+    {
+        ui->list->setCurrentIndex(_model->index(0));
+    }
+
     bool osInstalled = QFile::exists(FAT_PARTITION_OF_IMAGE);
     ui->actionCancel->setEnabled(osInstalled);
 }
 
+bool MainWindow::loadCachedList()
+{
+    if (!_listCache)
+        return false;
+
+    QVariant json = _listCache->list(DEFAULT_REPO_SERVER);
+    if (json.isNull())
+        return false;
+
+    qDebug() << "Showing cached OS list";
+    processJson(json);
+    updateNeeded();
+
+    return true;
+}
+
+/* Keep /settings read-write from now on, e.g. for the download cache */
 void MainWindow::remountSettingsRW()
 {
-    QProcess::execute("mount -o remount,rw /settings");
+    /* Tried again next time if the remount failed */
+    if (!_settingsRW)
+        _settingsRW = MountManager::acquireSettingsRW();
 }
 
 void MainWindow::repopulate()
 {
-    QMap<QString,QVariantMap> images = listImages();
-    ui->list->clear();
+    /* The model lists them in name order, rather than in the order the catalog adds them */
+    _osCatalog->blockSignals(true);
+    listImages();
+    _osCatalog->blockSignals(false);
+
+    _model->populate();
     bool haveicons = false;
     QSize currentsize = ui->list->iconSize();
-    QIcon localIcon(":/icons/hdd.png");
-    QIcon internetIcon(":/icons/download.png");
-    _numInstalledOS = 0;
+    _numInstalledOS = _osCatalog->installed().size();
 
-    foreach (QVariant v, images.values())
+    for (int i=0; i< _model->rowCount(); i++)
     {
-        QVariantMap m = v.toMap();
-        QString flavour = m.value("name").toString();
-        QString description = m.value("description").toString();
-        QString folder  = m.value("folder").toString();
-        QString iconFilename = m.value("icon").toString();
-        bool installed = m.value("installed").toBool();
-        bool recommended = m.value("recommended").toBool();
-
-        if (!iconFilename.isEmpty() && !iconFilename.contains('/'))
-            iconFilename = folder+"/"+iconFilename;
-        if (!QFile::exists(iconFilename))
-        {
-            iconFilename = folder+"/"+flavour+".png";
-            iconFilename.replace(' ', '_');
-        }
-
-        QString friendlyname = flavour;
-        if (recommended)
-            friendlyname += " ["+tr("RECOMMENDED")+"]";
-        if (installed)
-        {
-            friendlyname += " ["+tr("INSTALLED")+"]";
-            _numInstalledOS++;
-        }
-        if (!description.isEmpty())
-            friendlyname += "\n"+description;
-
-        QIcon icon;
-        if (QFile::exists(iconFilename))
-        {
-            icon = QIcon(iconFilename);
-            QList<QSize> avs = icon.availableSizes();
-            if (avs.isEmpty())
-            {
-                /* Icon file corrupt */
-                icon = QIcon();
-            }
-            else
-            {
-                QSize iconsize = avs.first();
-                haveicons = true;
+        QString iconFilename = _model->index(i).data(IconSourceRole).toString();
+        if (iconFilename.isEmpty())
+            continue;
 
-                if (iconsize.width() > currentsize.width() || iconsize.height() > currentsize.height())
-                {
-                    /* Make all icons as large as the largest icon we have */
-                    currentsize = QSize(qMax(iconsize.width(), currentsize.width()),qMax(iconsize.height(), currentsize.height()));
-                    ui->list->setIconSize(currentsize);
-                }
-            }
-        }
-        QListWidgetItem *item = new QListWidgetItem(icon, friendlyname);
-        item->setData(Qt::UserRole, m);
-        if (installed)
-        {
-            item->setData(Qt::BackgroundColorRole, INSTALLED_OS_BACKGROUND_COLOR);
-            item->setCheckState(Qt::Checked);
-        }
-        else
-            item->setCheckState(Qt::Unchecked);
+        QSize iconsize = _icons->size(iconFilename);
+        haveicons = true;
 
-        if (m["source"] == SOURCE_INSTALLED_OS)
+        if (iconsize.width() > currentsize.width() || iconsize.height() > currentsize.height())
         {
-            item->setData(SecondIconRole, QIcon());
+            /* Make all icons as large as the largest icon we have */
+            currentsize = QSize(qMax(iconsize.width(), currentsize.width()),qMax(iconsize.height(), currentsize.height()));
+            ui->list->setIconSize(currentsize);
         }
-        else
-        {
-            if (folder.startsWith("/mnt"))
-                item->setData(SecondIconRole, localIcon);
-            else
-                item->setData(SecondIconRole, internetIcon);
-        }
-
-        if (recommended)
-            ui->list->insertItem(0, item);
-        else
-            ui->list->addItem(item);
     }
 
     if (haveicons)
@@ -322,209 +299,86 @@ void MainWindow::repopulate()
         /* Giving items without icon a dummy icon to make them have equal height and text alignment */
         QPixmap dummyicon = QPixmap(currentsize.width(), currentsize.height());
         dummyicon.fill();
-
-        for (int i=0; i< ui->list->count(); i++)
-        {
-            if (ui->list->item(i)->icon().isNull())
-            {
-                ui->list->item(i)->setIcon(dummyicon);
-            }
-        }
+        _model->setDummyIcon(dummyicon);
     }
 }
 
-/* Whether this OS should be displayed in the list of installable OSes */
-bool canInstallOs(const QString& name, const QVariantMap& values)
+/* Fill in the SD card and installed layers of the catalog */
+void MainWindow::listImages()
 {
-    /* Can't simply pull "name" from "values" because in some JSON files it's "os_name" and in others it's "name" */
-
-    /* If it's not bootable, it isn't really an OS, so is always installable */
-    if (!canBootOs(name, values))
-    {
-        return true;
-    }
+    QList<OsRecord> images;
 
-    /* RISC_OS needs a matching riscos_offset */
-    if (nameMatchesRiscOS(name))
-    {
-        if (!values.contains(RISCOS_OFFSET_KEY) || (values.value(RISCOS_OFFSET_KEY).toInt() != RISCOS_OFFSET))
-        {
-            return false;
-        }
-    }
-
-    return true;
-}
-
-/* Whether this OS is supported */
-bool isSupportedOs(const QString& name, const QVariantMap& values)
-{
-    /* Can't simply pull "name" from "values" because in some JSON files it's "os_name" and in others it's "name" */
-
-    /* If it's not bootable, it isn't really an OS, so is always supported */
-    if (!canBootOs(name, values))
-    {
-        return true;
-    }
-
-    uint board_revision = readBoardRevision();
-    if (values.find("supported_revisions") != values.end())
-    {
-        /* Check the supported revisions list */
-        QStringList revisions = values.value("supported_revisions").toString().remove(" ").split(",");
-        for (int i=0; i < revisions.size(); i++)
-        {
-            bool ok;
-            uint rev = revisions.at(i).toUInt(&ok, 10);
-            if (ok)
-            {
-                if ((rev & 0xffff) == (board_revision & 0xffff))
-                {
-                    return true;
-                }
-            }
-        }
-        return false;
-    }
-    else if (values.find("supported_hex_revisions") != values.end())
+    /* Local image folders, read from the catalog index unless their JSON files changed */
+    if (!_catalog)
     {
-        /* Check the supported revisions list */
-        QStringList revisions = values.value("supported_hex_revisions").toString().remove(" ").split(",");
-        for (int i=0; i < revisions.size(); i++)
-        {
-            bool ok;
-            uint rev = revisions.at(i).toUInt(&ok, 16);
-            if (ok)
-            {
-                if ((rev & 0xffff) == (board_revision & 0xffff))
-                {
-                    return true;
-                }
-            }
-        }
-        return false;
+        _catalog = new CatalogIndex;
+        _catalog->load(CATALOG_INDEX_FILE);
+        _catalog->load(CATALOG_INDEX_BUILTIN);
     }
-    else
-    {
-        /* Check the feature_level flag */
-        if (board_revision < 64) /* overflow otherwise */
-        {
-            quint64 featurelevel = values.value("feature_level", 58364).toULongLong();
-            quint64 mask = (quint64)1 << board_revision;
-            if ((featurelevel & mask) != mask)
-            {
-                return false;
-            }
-        }
-        else
-        {
-            return false;
-        }
-    }
-
-    return true;
-}
-
-QMap<QString, QVariantMap> MainWindow::listImages()
-{
-    QMap<QString,QVariantMap> images;
 
-    /* Local image folders */
     QDir dir("/mnt/os", "", QDir::Name, QDir::Dirs | QDir::NoDotAndDotDot);
     QStringList list = dir.entryList();
 
     foreach (QString image,list)
     {
-        QString imagefolder = "/mnt/os/"+image;
-        if (!QFile::exists(imagefolder+"/os.json"))
+        const CatalogFolder *folder = _catalog->folder(image);
+        if (!folder || !canInstallOs(folder->osName, folder->osInfo()))
             continue;
-        QVariantMap osv = Json::loadFromFile(imagefolder+"/os.json").toMap();
-        osv["source"] = SOURCE_SDCARD;
 
-        QString basename = osv.value("name").toString();
-        if (canInstallOs(basename, osv))
-        {
-            if (QFile::exists(imagefolder+"/flavours.json"))
-            {
-                QVariantMap v = Json::loadFromFile(imagefolder+"/flavours.json").toMap();
-                QVariantList fl = v.value("flavours").toList();
+        foreach (const CatalogEntry &e, folder->entries)
+            images.append(_osCatalog->record(e.toMap("/mnt/os/"+image), OsRecord::Sdcard));
+    }
 
-                foreach (QVariant f, fl)
-                {
-                    QVariantMap fm  = f.toMap();
-                    if (fm.contains("name"))
-                    {
-                        QString name = fm.value("name").toString();
-                        if (name == RECOMMENDED_IMAGE)
-                            fm["recommended"] = true;
-                        fm["folder"] = imagefolder;
-                        fm["release_date"] = osv.value("release_date");
-                        fm["source"] = osv.value("source");
-                        images[name] = fm;
-                    }
-                }
-            }
-            else
-            {
-                QString name = basename;
-                if (name == RECOMMENDED_IMAGE)
-                    osv["recommended"] = true;
-                osv["folder"] = imagefolder;
-                images[name] = osv;
-            }
-        }
+    _catalog->retainFolders(list);
+    if (_settings && _catalog->isModified())
+    {
+        SettingsWriteLocker lock;
+        _catalog->save(CATALOG_INDEX_FILE);
     }
 
     /* Also add information about files already installed */
+    QList<OsRecord> installed;
     if (_settings)
-    {
-        QVariantList i = Json::loadFromFile("/settings/installed_os.json").toList();
-        foreach (QVariant v, i)
-        {
-            QVariantMap m = v.toMap();
-            QString name = m.value("name").toString();
-            if (images.contains(name))
-            {
-                images[name]["partitions"] = m["partitions"];
-            }
-            else
-            {
-                images[name] = m;
-                if (name == RECOMMENDED_IMAGE)
-                    images[name]["recommended"] = true;
-                images[name]["source"] = SOURCE_INSTALLED_OS;
-            }
-            images[name]["installed"] = true;
-        }
-    }
+        installed = _osCatalog->loadInstalled();
 
-    for (QMap<QString,QVariantMap>::iterator i = images.begin(); i != images.end(); i++)
+    for (QList<OsRecord>::iterator i = installed.begin(); i != installed.end(); i++)
     {
-        if (!i.value().contains("nominal_size"))
+        if (!i->nominalSize)
         {
             /* Calculate nominal_size based on information inside partitions.json */
-            int nominal_size = 0;
-            QVariantMap pv = Json::loadFromFile(i.value().value("folder").toString()+"/partitions.json").toMap();
+            QVariantMap pv = Json::loadFromFile(i->folder+"/partitions.json").toMap();
             QVariantList pvl = pv.value("partitions").toList();
 
             foreach (QVariant v, pvl)
             {
                 QVariantMap pv = v.toMap();
-                nominal_size += pv.value("partition_size_nominal").toInt();
-                nominal_size += 1; /* Overhead per partition for EBR */
+                i->nominalSize += pv.value("partition_size_nominal").toInt();
+                i->nominalSize += 1; /* Overhead per partition for EBR */
             }
-
-            i.value().insert("nominal_size", nominal_size);
         }
     }
 
-    return images;
+    _osCatalog->setSdcard(images);
+    _osCatalog->setInstalled(installed);
 }
 
 void MainWindow::on_actionWrite_image_to_disk_triggered()
 {
     remountSettingsRW();
 
+    /* OSes from the cached list can be selected before the network is up */
+    foreach (const OsRecord &r, _model->checked())
+    {
+        if (!r.isLocal() && !_downloader)
+        {
+            QMessageBox::critical(this,
+                                  tr("No network access"),
+                                  tr("Wired network access is required to install the selected Operating System(s). Please insert a network cable into the network port."),
+                                  QMessageBox::Close);
+            return;
+        }
+    }
+
     if (_silent || QMessageBox::warning(this,
                                         tr("Confirm"),
                                         tr("Warning: this will install the selected Operating System(s). All existing data on the SD card will be overwritten, including any OSes that are already installed."),
@@ -533,15 +387,13 @@ void MainWindow::on_actionWrite_image_to_disk_triggered()
         /* See if any of the OSes are unsupported */
         bool allSupported = true;
         QString unsupportedOses;
-        QList<QListWidgetItem *> selected = selectedItems();
-        foreach (QListWidgetItem *item, selected)
+        QList<OsRecord> selected = _model->checked();
+        foreach (const OsRecord &r, selected)
         {
-            QVariantMap entry = item->data(Qt::UserRole).toMap();
-            QString name = entry.value("name").toString();
-            if (!isSupportedOs(name, entry))
+            if (!r.is(OsRecord::Supported))
             {
                 allSupported = false;
-                unsupportedOses += "\n" + name;
+                unsupportedOses += "\n" + r.name;
             }
         }
         if (_silent || allSupported || QMessageBox::warning(this,
@@ -550,36 +402,49 @@ void MainWindow::on_actionWrite_image_to_disk_triggered()
                                         QMessageBox::Yes, QMessageBox::No) == QMessageBox::Yes)
         {
             setEnabled(false);
-            _numMetaFilesToDownload = 0;
+            _imageWriteThread = NULL;
+            _installMetaDownloads.clear();
+            _configMetaDownloads.clear();
 
-            QList<QListWidgetItem *> selected = selectedItems();
-            foreach (QListWidgetItem *item, selected)
+            foreach (const OsRecord &r, selected)
             {
-                QVariantMap entry = item->data(Qt::UserRole).toMap();
-
-                if (!entry.contains("folder"))
+                if (!r.isLocal())
                 {
                     QDir d;
-                    QString folder = "/settings/os/"+entry.value("name").toString();
+                    QString folder = "/settings/os/"+r.name;
                     folder.replace(' ', '_');
                     if (!d.exists(folder))
                         d.mkpath(folder);
 
-                    downloadMetaFile(entry.value("os_info").toString(), folder+"/os.json");
-                    downloadMetaFile(entry.value("partitions_info").toString(), folder+"/partitions.json");
+                    /* The install can start once every OS has the files the install plan is made from,
+                     * and the slides shown during the install. The others are needed to configure the OS */
+                    MetaDownloadGroup *install = new MetaDownloadGroup(this);
+                    install->add(_downloader->get(r.osInfo, folder+"/os.json"));
+                    install->add(_downloader->get(r.partitionsInfo, folder+"/partitions.json"));
+
+                    if (!r.marketingInfo.isEmpty())
+                        install->add(_downloader->get(r.marketingInfo, folder+"/marketing.tar"));
+
+                    connect(install, SIGNAL(finished()), this, SLOT(installMetaFilesComplete()));
+                    _installMetaDownloads.insert(install, folder);
+
+                    if (!r.partitionSetup.isEmpty() || !r.icon.isEmpty())
+                    {
+                        MetaDownloadGroup *config = new MetaDownloadGroup(this);
 
-                    if (entry.contains("marketing_info"))
-                        downloadMetaFile(entry.value("marketing_info").toString(), folder+"/marketing.tar");
+                        if (!r.partitionSetup.isEmpty())
+                            config->add(_downloader->get(r.partitionSetup, folder+"/partition_setup.sh"));
 
-                    if (entry.contains("partition_setup"))
-                        downloadMetaFile(entry.value("partition_setup").toString(), folder+"/partition_setup.sh");
+                        if (!r.icon.isEmpty())
+                            config->add(_downloader->get(r.icon, folder+"/icon.png"));
 
-                    if (entry.contains("icon"))
-                        downloadMetaFile(entry.value("icon").toString(), folder+"/icon.png");
+                        connect(config, SIGNAL(finished()), this, SLOT(configMetaFilesComplete()));
+                        _configMetaDownloads.insert(config, folder);
+                    }
                 }
             }
 
-            if (_numMetaFilesToDownload == 0)
+            if (_installMetaDownloads.isEmpty())
             {
                 /* All OSes selected are local */
                 startImageWrite();
@@ -602,11 +467,12 @@ void MainWindow::on_actionCancel_triggered()
 void MainWindow::onCompleted()
 {
     _qpd->hide();
-    QProcess::execute("mount -o remount,rw /settings");
-    QSettings settings("/settings/noobs.conf", QSettings::IniFormat, this);
-    settings.setValue("default_partition_to_boot", "800");
-    settings.sync();
-    QProcess::execute("mount -o remount,ro /settings");
+    {
+        SettingsWriteLocker lock;
+        QSettings settings("/settings/noobs.conf", QSettings::IniFormat, this);
+        settings.setValue("default_partition_to_boot", "800");
+        settings.sync();
+    }
 
     if (!_silent)
         QMessageBox::information(this,
@@ -617,6 +483,16 @@ void MainWindow::onCompleted()
     close();
 }
 
+void MainWindow::onDryRunCompleted(const QString &plan)
+{
+    _qpd->hide();
+    QMessageBox::information(this, tr("Dry run"), plan, QMessageBox::Ok);
+    _qpd->deleteLater();
+    _qpd = NULL;
+    show();
+    setEnabled(true);
+}
+
 void MainWindow::onError(const QString &msg)
 {
     _qpd->hide();
@@ -631,10 +507,9 @@ void MainWindow::onQuery(const QString &msg, const QString &title, QMessageBox::
     setEnabled(true);
 }
 
-void MainWindow::on_list_currentRowChanged()
+void MainWindow::currentOsChanged()
 {
-    QListWidgetItem *item = ui->list->currentItem();
-    ui->actionEdit_config->setEnabled(item && item->data(Qt::UserRole).toMap().contains("partitions"));
+    ui->actionEdit_config->setEnabled(!_model->record(ui->list->currentIndex()).partitions.isEmpty());
 }
 
 void MainWindow::update_window_title()
@@ -837,14 +712,10 @@ void MainWindow::on_actionEdit_config_triggered()
 {
     /* If no installed OS is selected, default to first extended partition */
     QString partition = FAT_PARTITION_OF_IMAGE;
-    QListWidgetItem *item = ui->list->currentItem();
+    QStringList l = _model->record(ui->list->currentIndex()).partitions;
 
-    if (item && item->data(Qt::UserRole).toMap().contains("partitions"))
-    {
-        QVariantList l = item->data(Qt::UserRole).toMap().value("partitions").toList();
-        if (!l.isEmpty())
-            partition = l.first().toString();
-    }
+    if (!l.isEmpty())
+        partition = l.first();
 
     ConfEditDialog d(partition);
     d.exec();
@@ -884,11 +755,11 @@ void MainWindow::on_list_doubleClicked(const QModelIndex &index)
 {
     if (index.isValid())
     {
-        QListWidgetItem *item = ui->list->currentItem();
-        if (item->checkState() == Qt::Unchecked)
-            item->setCheckState(Qt::Checked);
+        QModelIndex current = ui->list->currentIndex();
+        if (current.data(Qt::CheckStateRole).toInt() == Qt::Unchecked)
+            _model->setData(current, Qt::Checked, Qt::CheckStateRole);
         else
-            item->setCheckState(Qt::Unchecked);
+            _model->setData(current, Qt::Unchecked, Qt::CheckStateRole);
     }
 }
 
@@ -938,6 +809,7 @@ void MainWindow::ifupFinished(int)
             _cache->setCacheDirectory("/settings/cache");
             _cache->setMaximumCacheSize(8 * 1024 * 1024);
             _netaccess->setCache(_cache);
+            _downloader = new MetaDownloader(_netaccess, this);
 
             downloadList(DEFAULT_REPO_SERVER);
         }
@@ -948,10 +820,16 @@ void MainWindow::ifupFinished(int)
     p->deleteLater();
 }
 
+/* If the list is cached, the server only sends it if it changed */
 void MainWindow::downloadList(const QString &urlstring)
 {
-    QNetworkReply *reply = _netaccess->get(QNetworkRequest(QUrl(urlstring)));
-    connect(reply, SIGNAL(finished()), this, SLOT(downloadListRedirectCheck()));
+    MetaDownload *download;
+
+    if (_listCache)
+        download = _downloader->revalidate(urlstring, _listCache->etag(urlstring), _listCache->lastModified(urlstring));
+    else
+        download = _downloader->get(urlstring);
+    connect(download, SIGNAL(finished()), this, SLOT(downloadListComplete()));
 }
 
 void MainWindow::rebuildInstalledList()
@@ -971,7 +849,7 @@ void MainWindow::rebuildInstalledList()
 
         QString part = "/dev/mmcblk0p"+QString::number(i);
 
-        if (QFile::exists(part) && QProcess::execute("mount -t vfat "+part+" /mnt2") == 0)
+        if (QFile::exists(part) && MountManager::mount(part, "/mnt2", "vfat"))
         {
             qDebug() << "Scanning" << part;
             if (QFile::exists("/mnt2/os_config.json"))
@@ -990,7 +868,7 @@ void MainWindow::rebuildInstalledList()
                     installedlist.append(osinfo);
                 }
             }
-            QProcess::execute("umount /mnt2");
+            MountManager::umount("/mnt2");
         }
     }
 
@@ -1002,20 +880,44 @@ void MainWindow::rebuildInstalledList()
 
 void MainWindow::downloadListComplete()
 {
-    QNetworkReply *reply = qobject_cast<QNetworkReply *>(sender());
-    int httpstatuscode = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+    MetaDownload *download = qobject_cast<MetaDownload *>(sender());
 
-    if (reply->error() != reply->NoError || httpstatuscode < 200 || httpstatuscode > 399)
+    if (!download->errorString().isEmpty())
     {
-        _qpd->hide();
+        if (_qpd)
+            _qpd->hide();
         QMessageBox::critical(this, tr("Download error"), tr("Error downloading distribution list from Internet"), QMessageBox::Close);
     }
+    else if (download->isNotModified())
+    {
+        /* Shown already, unless it was not loaded at startup. Downloads the icons not cached yet */
+        qDebug() << "Cached OS list is current";
+        processJson(_listCache->list(download->url()));
+    }
     else
     {
-        processJson(Json::parse( reply->readAll() ));
+        QVariant json = Json::parse( download->data() );
+
+        if (!json.isNull() && _listCache)
+        {
+            SettingsWriteLocker lock;
+            _listCache->save(download->url(), download->data(), download->etag(), download->lastModified());
+        }
+        processJson(json);
+
+        if (!json.isNull())
+        {
+            /* Icons of OSes no longer in the list */
+            QSet<QString> iconurls;
+            foreach (const OsRecord &r, _osCatalog->values())
+                iconurls.insert(r.icon);
+
+            _icons->retainUrls(iconurls);
+            saveIcons();
+        }
     }
 
-    reply->deleteLater();
+    download->deleteLater();
 }
 
 void MainWindow::processJson(QVariant json)
@@ -1026,56 +928,56 @@ void MainWindow::processJson(QVariant json)
         return;
     }
 
-    QSet<QString> iconurls;
-    QVariantList list = json.toMap().value("os_list").toList();
+    /* The catalog adds the OSes new to the list, and removes those of an earlier list,
+     * e.g. the cached one, that this list no longer has */
+    _osCatalog->setNetwork(_osCatalog->parseOsList(json));
+    updateNeeded();
 
-    foreach (QVariant osv, list)
+    /* Download the icons not stored of the OSes listed with the details of this list.
+     * Stored icons with an ETag are revalidated once per boot, and keep showing meanwhile */
+    QSet<QString> missingicons, storedicons;
+    foreach (const OsRecord &r, _osCatalog->values())
     {
-        QVariantMap  os = osv.toMap();
+        if (r.source != OsRecord::Network || r.icon.isEmpty())
+            continue;
 
-        QString basename = os.value("os_name").toString();
-        if (canInstallOs(basename, os))
+        if (_icons->contains(r.icon))
         {
-            if (os.contains("flavours"))
-            {
-                QVariantList flavours = os.value("flavours").toList();
-
-                foreach (QVariant flv, flavours)
-                {
-                    QVariantMap flavour = flv.toMap();
-                    QVariantMap item = os;
-                    QString name        = flavour.value("name").toString();
-                    QString description = flavour.value("description").toString();
-                    QString iconurl     = flavour.value("icon").toString();
-
-                    item.insert("name", name);
-                    item.insert("description", description);
-                    item.insert("icon", iconurl);
-                    item.insert("feature_level", flavour.value("feature_level"));
-                    item.insert("source", SOURCE_NETWORK);
-
-                    processJsonOs(name, item, iconurls);
-                }
-            }
-            if (os.contains("description"))
-            {
-                QString name = basename;
-                os["name"] = name;
-                os["source"] = SOURCE_NETWORK;
-                processJsonOs(name, os, iconurls);
-            }
+            ui->list->setIconSize(QSize(ICON_STORE_SIZE,ICON_STORE_SIZE));
+            if (!_revalidatedIcons.contains(r.icon) && !_icons->etag(r.icon).isEmpty())
+                storedicons.insert(r.icon);
+        }
+        else
+        {
+            missingicons.insert(r.icon);
         }
     }
 
-    /* Download icons */
-    _numIconsToDownload = iconurls.count();
+    if (!storedicons.isEmpty() && _downloader)
+    {
+        MetaDownloadGroup *icons = new MetaDownloadGroup(this);
+
+        foreach (QString iconurl, storedicons)
+        {
+            MetaDownload *download = _downloader->revalidate(iconurl, _icons->etag(iconurl), QByteArray());
+            connect(download, SIGNAL(finished()), this, SLOT(downloadIconComplete()));
+            icons->add(download);
+            _revalidatedIcons.insert(iconurl);
+        }
+        connect(icons, SIGNAL(finished()), this, SLOT(revalidateIconsComplete()));
+    }
 
-    if (_numIconsToDownload)
+    if (!missingicons.isEmpty() && _downloader)
     {
-        foreach (QString iconurl, iconurls)
+        MetaDownloadGroup *icons = new MetaDownloadGroup(this);
+
+        foreach (QString iconurl, missingicons)
         {
-            downloadIcon(iconurl, iconurl);
+            MetaDownload *download = _downloader->get(iconurl);
+            connect(download, SIGNAL(finished()), this, SLOT(downloadIconComplete()));
+            icons->add(download);
         }
+        connect(icons, SIGNAL(finished()), this, SLOT(downloadIconsComplete()));
     }
     else
     {
@@ -1087,133 +989,62 @@ void MainWindow::processJson(QVariant json)
     }
 }
 
-void MainWindow::processJsonOs(const QString &name, QVariantMap &new_details, QSet<QString> &iconurls)
+void MainWindow::downloadIconComplete()
 {
-    QIcon internetIcon(":/icons/download.png");
+    MetaDownload *download = qobject_cast<MetaDownload *>(sender());
+    QString originalurl = download->url();
 
-    QListWidgetItem *witem = findItem(name);
-    if (witem)
+    if (!download->errorString().isEmpty())
     {
-        QVariantMap existing_details = witem->data(Qt::UserRole).toMap();
-
-        if ((existing_details["release_date"].toString() < new_details["release_date"].toString()) || (existing_details["source"].toString() == SOURCE_INSTALLED_OS))
-        {
-            /* Local version is older (or unavailable). Replace info with newer Internet version */
-            new_details.insert("installed", existing_details.value("installed", false));
-            if (existing_details.contains("partitions"))
-            {
-                new_details["partitions"] = existing_details["partitions"];
-            }
-            witem->setData(Qt::UserRole, new_details);
-            witem->setData(SecondIconRole, internetIcon);
-            ui->list->update();
-        }
-
+        //QMessageBox::critical(this, tr("Download error"), tr("Error downloading icon '%1'").arg(originalurl), QMessageBox::Close);
+        qDebug() << "Error downloading icon" << originalurl;
     }
-    else
+    else if (download->isNotModified())
     {
-        /* It's a new OS, so add it to the list */
-        QString iconurl = new_details.value("icon").toString();
-        QString description = new_details.value("description").toString();
-
-        if (!iconurl.isEmpty())
-            iconurls.insert(iconurl);
-
-        bool recommended = (name == RECOMMENDED_IMAGE);
-
-        QString friendlyname = name;
-        if (recommended)
-            friendlyname += " ["+tr("RECOMMENDED")+"]";
-        if (!description.isEmpty())
-            friendlyname += "\n"+description;
-
-        witem = new QListWidgetItem(friendlyname);
-        witem->setCheckState(Qt::Unchecked);
-        witem->setData(Qt::UserRole, new_details);
-        witem->setData(SecondIconRole, internetIcon);
-
-        if (recommended)
-            ui->list->insertItem(0, witem);
-        else
-            ui->list->addItem(witem);
+        /* The stored icon is current */
+    }
+    else if (_icons->addData(originalurl, download->data(), download->etag()))
+    {
+        showListIcon(originalurl);
     }
 }
 
-void MainWindow::downloadIcon(const QString &urlstring, const QString &originalurl)
+void MainWindow::showListIcon(const QString &url)
 {
-    QUrl url(urlstring);
-    QNetworkRequest request(url);
-    request.setAttribute(QNetworkRequest::User, originalurl);
-    QNetworkReply *reply = _netaccess->get(request);
-    connect(reply, SIGNAL(finished()), this, SLOT(downloadIconRedirectCheck()));
+    ui->list->setIconSize(QSize(ICON_STORE_SIZE,ICON_STORE_SIZE));
+    _model->iconStored(url);
+    /* The source is the same if a newer icon replaced the stored one */
+    ui->list->viewport()->update();
 }
 
-QListWidgetItem *MainWindow::findItem(const QVariant &name)
+/* Keep decoded icons for the next boot */
+void MainWindow::saveIcons()
 {
-    for (int i=0; i<ui->list->count(); i++)
+    if (_icons->isModified())
     {
-        QListWidgetItem *item = ui->list->item(i);
-        QVariantMap m = item->data(Qt::UserRole).toMap();
-        if (m.value("name").toString() == name.toString())
-        {
-            return item;
-        }
+        SettingsWriteLocker lock;
+        _icons->save();
     }
-    return NULL;
 }
 
-void MainWindow::downloadIconComplete()
+void MainWindow::downloadIconsComplete()
 {
-    QNetworkReply *reply = qobject_cast<QNetworkReply *>(sender());
-    QString url = reply->url().toString();
-    QString originalurl = reply->request().attribute(QNetworkRequest::User).toString();
-    int httpstatuscode = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
-
-    if (reply->error() != reply->NoError || httpstatuscode < 200 || httpstatuscode > 399)
-    {
-        //QMessageBox::critical(this, tr("Download error"), tr("Error downloading icon '%1'").arg(reply->url().toString()), QMessageBox::Close);
-        qDebug() << "Error downloading icon" << url;
-    }
-    else
-    {
-        QPixmap pix;
-        pix.loadFromData(reply->readAll());
-        QIcon icon(pix);
+    sender()->deleteLater();
+    saveIcons();
 
-        for (int i=0; i<ui->list->count(); i++)
-        {
-            QVariantMap m = ui->list->item(i)->data(Qt::UserRole).toMap();
-            ui->list->setIconSize(QSize(40,40));
-            if (m.value("icon") == originalurl)
-            {
-                ui->list->item(i)->setIcon(icon);
-            }
-        }
-    }
-    if (--_numIconsToDownload == 0 && _qpd)
+    if (_qpd)
     {
         _qpd->hide();
         _qpd->deleteLater();
         _qpd = NULL;
     }
-
-    reply->deleteLater();
 }
 
-QList<QListWidgetItem *> MainWindow::selectedItems()
+/* Unlike downloadIconsComplete(), the progress dialog does not wait for these */
+void MainWindow::revalidateIconsComplete()
 {
-    QList<QListWidgetItem *> selected;
-
-    for (int i=0; i < ui->list->count(); i++)
-    {
-        QListWidgetItem *item = ui->list->item(i);
-        if (item->checkState())
-        {
-            selected.append(item);
-        }
-    }
-
-    return selected;
+    sender()->deleteLater();
+    saveIcons();
 }
 
 void MainWindow::updateNeeded()
@@ -1223,14 +1054,11 @@ void MainWindow::updateNeeded()
     bool bold = false;
 
     _neededMB = 0;
-    QList<QListWidgetItem *> selected = selectedItems();
-
-    foreach (QListWidgetItem *item, selected)
+    foreach (const OsRecord &r, _model->checked())
     {
-        QVariantMap entry = item->data(Qt::UserRole).toMap();
-        _neededMB += entry.value("nominal_size").toInt();
+        _neededMB += r.nominalSize;
 
-        if (nameMatchesRiscOS(entry.value("name").toString()))
+        if (nameMatchesRiscOS(r.name))
         {
             /* RiscOS needs to start at a predetermined sector, calculate the extra space needed for that */
             int startSector = getFileContents("/sys/class/block/mmcblk0p4/start").trimmed().toULongLong();
@@ -1268,137 +1096,87 @@ void MainWindow::updateNeeded()
     ui->neededLabel->setFont(font);
 }
 
-void MainWindow::on_list_itemChanged(QListWidgetItem *)
+void MainWindow::installMetaFilesComplete()
 {
-    updateNeeded();
-}
-
-void MainWindow::downloadMetaFile(const QString &urlstring, const QString &saveAs)
-{
-    qDebug() << "Downloading" << urlstring << "to" << saveAs;
-    _numMetaFilesToDownload++;
-    QUrl url(urlstring);
-    QNetworkRequest request(url);
-    request.setAttribute(QNetworkRequest::User, saveAs);
-    QNetworkReply *reply = _netaccess->get(request);
-    connect(reply, SIGNAL(finished()), this, SLOT(downloadMetaRedirectCheck()));
-}
+    MetaDownloadGroup *group = qobject_cast<MetaDownloadGroup *>(sender());
+    group->deleteLater();
 
-void MainWindow::downloadListRedirectCheck()
-{
-    QNetworkReply *reply = qobject_cast<QNetworkReply *>(sender());
-    int httpstatuscode = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
-    QString redirectionurl = reply->attribute(QNetworkRequest::RedirectionTargetAttribute).toString();
+    /* Belongs to an install that was cancelled already */
+    if (!_installMetaDownloads.remove(group))
+        return;
 
-    if (httpstatuscode > 300 && httpstatuscode < 400)
+    if (!group->errorString().isEmpty())
     {
-        qDebug() << "Redirection - Re-trying download from" << redirectionurl;
-        _numMetaFilesToDownload--;
-        downloadList(redirectionurl);
+        metaDownloadFailed(group->errorString());
+        return;
     }
-    else
-        downloadListComplete();
-}
-
-void MainWindow::downloadIconRedirectCheck()
-{
-    QNetworkReply *reply = qobject_cast<QNetworkReply *>(sender());
-    int httpstatuscode = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
-    QString redirectionurl = reply->attribute(QNetworkRequest::RedirectionTargetAttribute).toString();
-    QString originalurl = reply->request().attribute(QNetworkRequest::User).toString();;
 
-    if (httpstatuscode > 300 && httpstatuscode < 400)
+    if (_installMetaDownloads.isEmpty())
     {
-        qDebug() << "Redirection - Re-trying download from" << redirectionurl;
-        _numMetaFilesToDownload--;
-        downloadIcon(redirectionurl, originalurl);
+        if (_qpd)
+        {
+            _qpd->hide();
+            _qpd->deleteLater();
+            _qpd = NULL;
+        }
+        startImageWrite();
     }
-    else
-        downloadIconComplete();
 }
 
-void MainWindow::downloadMetaRedirectCheck()
+void MainWindow::configMetaFilesComplete()
 {
-    QNetworkReply *reply = qobject_cast<QNetworkReply *>(sender());
-    int httpstatuscode = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
-    QString redirectionurl = reply->attribute(QNetworkRequest::RedirectionTargetAttribute).toString();
-    QString saveAs = reply->request().attribute(QNetworkRequest::User).toString();
+    MetaDownloadGroup *group = qobject_cast<MetaDownloadGroup *>(sender());
+    group->deleteLater();
 
-    if (httpstatuscode > 300 && httpstatuscode < 400)
-    {
-        qDebug() << "Redirection - Re-trying download from" << redirectionurl;
-        _numMetaFilesToDownload--;
-        downloadMetaFile(redirectionurl, saveAs);
-    }
-    else
-        downloadMetaComplete();
+    if (!_configMetaDownloads.contains(group))
+        return;
+    QString folder = _configMetaDownloads.take(group);
+
+    if (_imageWriteThread)
+        _imageWriteThread->metaFilesDownloaded(folder, group->errorString());
+    else if (!group->errorString().isEmpty())
+        metaDownloadFailed(group->errorString());
 }
 
-void MainWindow::downloadMetaComplete()
+/* Cancel an install that has not started yet */
+void MainWindow::metaDownloadFailed(const QString &error)
 {
-    QNetworkReply *reply = qobject_cast<QNetworkReply *>(sender());
-    int httpstatuscode = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+    /* Downloads still in progress are ignored when they finish */
+    _installMetaDownloads.clear();
+    _configMetaDownloads.clear();
 
-    if (reply->error() != reply->NoError || httpstatuscode < 200 || httpstatuscode > 399)
-    {
-        if (_qpd)
-        {
-            _qpd->hide();
-            _qpd->deleteLater();
-            _qpd = NULL;
-        }
-        QMessageBox::critical(this, tr("Download error"), tr("Error downloading meta file")+"\n"+reply->url().toString(), QMessageBox::Close);
-        setEnabled(true);
-    }
-    else
-    {
-        QString saveAs = reply->request().attribute(QNetworkRequest::User).toString();
-        QFile f(saveAs);
-        f.open(f.WriteOnly);
-        if (f.write(reply->readAll()) == -1)
-        {
-            QMessageBox::critical(this, tr("Download error"), tr("Error writing downloaded file to SD card. SD card or file system may be damaged."), QMessageBox::Close);
-            setEnabled(true);
-        }
-        else
-        {
-            _numMetaFilesToDownload--;
-        }
-        f.close();
-    }
-
-    if (_numMetaFilesToDownload == 0)
+    if (_qpd)
     {
-        if (_qpd)
-        {
-            _qpd->hide();
-            _qpd->deleteLater();
-            _qpd = NULL;
-        }
-        startImageWrite();
+        _qpd->hide();
+        _qpd->deleteLater();
+        _qpd = NULL;
     }
+    QMessageBox::critical(this, tr("Download error"), tr("Error downloading meta file")+"\n"+error, QMessageBox::Close);
+    setEnabled(true);
 }
 
 void MainWindow::startImageWrite()
 {
-    /* All meta files downloaded, extract slides tarball, and launch image writer thread */
-    MultiImageWriteThread *imageWriteThread = new MultiImageWriteThread();
+    /* Meta files needed for the install downloaded, extract slides tarball, and launch image writer thread */
+    MultiImageWriteThread *imageWriteThread = new MultiImageWriteThread(_osCatalog);
+    imageWriteThread->setDryRun(_dryRun);
+    _imageWriteThread = imageWriteThread;
+
+    foreach (const QString &folder, _configMetaDownloads)
+        imageWriteThread->setMetaFilesPending(folder);
     QString folder, slidesFolder;
     QStringList slidesFolders;
 
-    QList<QListWidgetItem *> selected = selectedItems();
-    foreach (QListWidgetItem *item, selected)
+    foreach (const OsRecord &r, _model->checked())
     {
-        QVariantMap entry = item->data(Qt::UserRole).toMap();
-
-        if (entry.contains("folder"))
+        if (r.isLocal())
         {
             /* Local image */
-            folder = entry.value("folder").toString();
+            folder = r.folder;
         }
         else
         {
-            folder = "/settings/os/"+entry.value("name").toString();
+            folder = "/settings/os/"+r.name;
             folder.replace(' ', '_');
 
             QString marketingTar = folder+"/marketing.tar";
@@ -1413,8 +1191,7 @@ void MainWindow::startImageWrite()
             QVariantMap json = Json::loadFromFile(folder+"/partitions.json").toMap();
             QVariantList partitions = json["partitions"].toList();
             int i=0;
-            QStringList tarballs = entry.value("tarballs").toStringList();
-            foreach (QString tarball, tarballs)
+            foreach (QString tarball, r.tarballs)
             {
                 QVariantMap partition = partitions[i].toMap();
                 partition.insert("tarball", tarball);
@@ -1435,7 +1212,7 @@ void MainWindow::startImageWrite()
         {
             slidesFolder = folder+"/slides_vga";
         }
-        imageWriteThread->addImage(folder, entry.value("name").toString());
+        imageWriteThread->addImage(folder, r.name);
         if (!slidesFolder.isEmpty())
             slidesFolders.append(slidesFolder);
     }
@@ -1446,6 +1223,7 @@ void MainWindow::startImageWrite()
     _qpd = new ProgressSlideshowDialog(slidesFolders, "", 20, this);
     connect(imageWriteThread, SIGNAL(parsedImagesize(qint64)), _qpd, SLOT(setMaximum(qint64)));
     connect(imageWriteThread, SIGNAL(completed()), this, SLOT(onCompleted()));
+    connect(imageWriteThread, SIGNAL(dryRunCompleted(QString)), this, SLOT(onDryRunCompleted(QString)));
     connect(imageWriteThread, SIGNAL(error(QString)), this, SLOT(onError(QString)));
     connect(imageWriteThread, SIGNAL(statusUpdate(QString)), _qpd, SLOT(setLabelText(QString)));
     connect(imageWriteThread, SIGNAL(runningMKFS()), _qpd, SLOT(pauseIOaccounting()), Qt::BlockingQueuedConnection);
@@ -1467,7 +1245,7 @@ void MainWindow::hideDialogIfNoNetwork()
             _qpd->deleteLater();
             _qpd = NULL;
 
-            if (ui->list->count() == 0)
+            if (_model->rowCount() == 0)
             {
                 /* No local images either */
                 QMessageBox::critical(this,
@@ -15,23 +15,33 @@
 #include <QModelIndex>
 #include <QSplashScreen>
 #include <QMessageBox>
+#include <QHash>
+#include <QSet>
 
 namespace Ui {
 class MainWindow;
 }
 class QProgressDialog;
 class QSettings;
-class QListWidgetItem;
 class QNetworkAccessManager;
 class QMessageBox;
+class MetaDownloader;
+class MetaDownloadGroup;
+class MultiImageWriteThread;
+class OsListCache;
+class IconStore;
+class CatalogIndex;
+class OsCatalog;
+class OsListModel;
 
 class MainWindow : public QMainWindow
 {
     Q_OBJECT
 
 public:
-    explicit MainWindow(const QString &defaultDisplay, QSplashScreen *splash, QWidget *parent = 0);
+    explicit MainWindow(const QString &defaultDisplay, QSplashScreen *splash, OsCatalog *catalog, QWidget *parent = 0);
     ~MainWindow();
+    void setDryRun(bool dryRun);
 
 protected:
     Ui::MainWindow *ui;
@@ -44,13 +54,27 @@ protected:
     static int _currentMode;
     QSplashScreen *_splash;
     QSettings *_settings;
-    bool _activatedEth;
+    bool _activatedEth, _settingsRW, _dryRun;
     int _numInstalledOS;
     QNetworkAccessManager *_netaccess;
-    int _neededMB, _availableMB, _numMetaFilesToDownload, _numIconsToDownload;
+    MetaDownloader *_downloader;
+    /* Last OS list downloaded, NULL without a settings partition */
+    OsListCache *_listCache;
+    IconStore *_icons;
+    /* Stored icons revalidated since boot, to do so once even if several lists are processed */
+    QSet<QString> _revalidatedIcons;
+    CatalogIndex *_catalog;
+    /* Shared with the image writer and the boot menu. The list has a row per OS it has */
+    OsCatalog *_osCatalog;
+    OsListModel *_model;
+    int _neededMB, _availableMB;
+    /* Per OS folder: os.json, partitions.json and slides, needed before the install can start,
+     * and the files only needed to configure the OS once it is written */
+    QHash<MetaDownloadGroup *,QString> _installMetaDownloads, _configMetaDownloads;
+    MultiImageWriteThread *_imageWriteThread;
     QMessageBox *_displayModeBox;
 
-    QMap<QString,QVariantMap> listImages();
+    void listImages();
     virtual void changeEvent(QEvent * event);
     virtual bool eventFilter(QObject *obj, QEvent *event);
     void inputSequence();
@@ -61,13 +85,12 @@ protected:
     QStringList getFlavours(const QString &folder);
     void rebuildInstalledList();
     void remountSettingsRW();
-    QListWidgetItem *findItem(const QVariant &name);
-    QList<QListWidgetItem *> selectedItems();
-    void updateNeeded();
-    void downloadMetaFile(const QString &url, const QString &saveAs);
-    void downloadIcon(const QString &urlstring, const QString &originalurl);
     void downloadList(const QString &urlstring);
     void startImageWrite();
+    void metaDownloadFailed(const QString &error);
+    bool loadCachedList();
+    void showListIcon(const QString &url);
+    void saveIcons();
 
 protected slots:
     void populate();
@@ -75,16 +98,19 @@ protected slots:
     void startNetworking();
     void ifupFinished(int exitCode);
     void downloadListComplete();
+    /* Add the OSes of an OS list to the list, and remove those it no longer has */
     void processJson(QVariant json);
-    void processJsonOs(const QString &name, QVariantMap &details, QSet<QString> &iconurls);
+    void updateNeeded();
+    void currentOsChanged();
     /* Events from ImageWriterThread */
     void onError(const QString &msg);
     void onCompleted();
+    void onDryRunCompleted(const QString &plan);
     void downloadIconComplete();
-    void downloadMetaRedirectCheck();
-    void downloadIconRedirectCheck();
-    void downloadListRedirectCheck();
-    void downloadMetaComplete();
+    void downloadIconsComplete();
+    void revalidateIconsComplete();
+    void installMetaFilesComplete();
+    void configMetaFilesComplete();
     void onQuery(const QString &msg, const QString &title, QMessageBox::StandardButton* answer);
     void hideDialogIfNoNetwork();
 
@@ -92,12 +118,10 @@ private slots:
     /* UI events */
     void on_actionWrite_image_to_disk_triggered();
     void on_actionCancel_triggered();
-    void on_list_currentRowChanged();
     void on_actionAdvanced_triggered(bool checked);
     void on_actionEdit_config_triggered();
     void on_actionBrowser_triggered();
     void on_list_doubleClicked(const QModelIndex &index);
-    void on_list_itemChanged(QListWidgetItem *item);
 
 signals:
     void networkUp();
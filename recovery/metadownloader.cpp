@@ -0,0 +1,268 @@
+#include "metadownloader.h"
+#include <QFile>
+#include <QUrl>
+#include <QTimer>
+#include <QDebug>
+#include <QtNetwork/QNetworkAccessManager>
+#include <QtNetwork/QNetworkRequest>
+#include <QtNetwork/QNetworkReply>
+
+/* Downloads of the OS list, icons and OS meta files
+ *
+ * Maintained by Raspberry Pi
+ *
+ * See LICENSE.txt for license details
+ *
+ */
+
+MetaDownload::MetaDownload(const QString &url, const QString &saveAs, QObject *parent)
+    : QObject(parent), _url(url), _currentUrl(url), _saveAs(saveAs), _redirects(0), _retries(0), _finished(false), _notModified(false)
+{
+}
+
+QString MetaDownload::url() const
+{
+    return _url;
+}
+
+QString MetaDownload::saveAs() const
+{
+    return _saveAs;
+}
+
+QByteArray MetaDownload::data() const
+{
+    return _data;
+}
+
+bool MetaDownload::isFinished() const
+{
+    return _finished;
+}
+
+QString MetaDownload::errorString() const
+{
+    return _error;
+}
+
+bool MetaDownload::isNotModified() const
+{
+    return _notModified;
+}
+
+QByteArray MetaDownload::etag() const
+{
+    return _etag;
+}
+
+QByteArray MetaDownload::lastModified() const
+{
+    return _lastModified;
+}
+
+MetaDownloadGroup::MetaDownloadGroup(QObject *parent)
+    : QObject(parent), _pending(0)
+{
+}
+
+void MetaDownloadGroup::add(MetaDownload *download)
+{
+    download->setParent(this);
+    _pending++;
+    connect(download, SIGNAL(finished()), this, SLOT(downloadFinished()));
+}
+
+bool MetaDownloadGroup::isFinished() const
+{
+    return _pending == 0;
+}
+
+QString MetaDownloadGroup::errorString() const
+{
+    return _error;
+}
+
+void MetaDownloadGroup::downloadFinished()
+{
+    MetaDownload *download = qobject_cast<MetaDownload *>(sender());
+
+    if (_error.isEmpty())
+        _error = download->errorString();
+    if (--_pending == 0)
+        emit finished();
+}
+
+MetaDownloader::MetaDownloader(QNetworkAccessManager *netaccess, QObject *parent)
+    : QObject(parent), _netaccess(netaccess)
+{
+    _clock.start();
+}
+
+MetaDownload *MetaDownloader::get(const QString &url, const QString &saveAs)
+{
+    MetaDownload *download = new MetaDownload(url, saveAs, this);
+
+    qDebug() << "Downloading" << url << (saveAs.isEmpty() ? QString() : "to "+saveAs);
+    enqueue(download);
+
+    return download;
+}
+
+MetaDownload *MetaDownloader::revalidate(const QString &url, const QByteArray &etag, const QByteArray &lastModified)
+{
+    MetaDownload *download = new MetaDownload(url, QString(), this);
+    download->_ifNoneMatch = etag;
+    download->_ifModifiedSince = lastModified;
+
+    qDebug() << "Revalidating" << url << etag << lastModified;
+    enqueue(download);
+
+    return download;
+}
+
+/* Send the request now, or once a request to the same host has finished */
+void MetaDownloader::enqueue(MetaDownload *download)
+{
+    download->_host = QUrl(download->_currentUrl).host();
+
+    if (_active.value(download->_host) < META_MAX_REQUESTS_PER_HOST)
+    {
+        _active[download->_host]++;
+        send(download);
+    }
+    else
+    {
+        _queued[download->_host].append(download);
+    }
+}
+
+void MetaDownloader::send(MetaDownload *download)
+{
+    QNetworkRequest request(QUrl(download->_currentUrl));
+    request.setAttribute(QNetworkRequest::User, qVariantFromValue((QObject *) download));
+
+    if (!download->_ifNoneMatch.isEmpty() || !download->_ifModifiedSince.isEmpty())
+    {
+        /* The network cache would answer a 304 with its own copy */
+        request.setAttribute(QNetworkRequest::CacheLoadControlAttribute, QNetworkRequest::AlwaysNetwork);
+        request.setAttribute(QNetworkRequest::CacheSaveControlAttribute, false);
+        if (!download->_ifNoneMatch.isEmpty())
+            request.setRawHeader("If-None-Match", download->_ifNoneMatch);
+        if (!download->_ifModifiedSince.isEmpty())
+            request.setRawHeader("If-Modified-Since", download->_ifModifiedSince);
+    }
+
+    QNetworkReply *reply = _netaccess->get(request);
+    connect(reply, SIGNAL(finished()), this, SLOT(replyFinished()));
+}
+
+void MetaDownloader::sendQueued(const QString &host)
+{
+    QList<MetaDownload *> &queue = _queued[host];
+
+    while (!queue.isEmpty() && _active.value(host) < META_MAX_REQUESTS_PER_HOST)
+    {
+        _active[host]++;
+        send(queue.takeFirst());
+    }
+    if (queue.isEmpty())
+        _queued.remove(host);
+}
+
+void MetaDownloader::replyFinished()
+{
+    QNetworkReply *reply = qobject_cast<QNetworkReply *>(sender());
+    MetaDownload *download = qobject_cast<MetaDownload *>(reply->request().attribute(QNetworkRequest::User).value<QObject *>());
+    int httpstatuscode = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+    QUrl redirectionurl = reply->attribute(QNetworkRequest::RedirectionTargetAttribute).toUrl();
+    QNetworkReply::NetworkError error = reply->error();
+
+    reply->deleteLater();
+    if (--_active[download->_host] == 0)
+        _active.remove(download->_host);
+    sendQueued(download->_host);
+
+    if (httpstatuscode > 300 && httpstatuscode < 400 && redirectionurl.isValid())
+    {
+        if (++download->_redirects > META_MAX_REDIRECTS)
+        {
+            finish(download, "Too many redirects downloading "+download->_url);
+            return;
+        }
+
+        download->_currentUrl = reply->url().resolved(redirectionurl).toString();
+        qDebug() << "Redirection - Re-trying download from" << download->_currentUrl;
+        enqueue(download);
+    }
+    else if (error == QNetworkReply::NoError && httpstatuscode >= 200 && httpstatuscode < 300)
+    {
+        download->_data = reply->readAll();
+        download->_etag = reply->rawHeader("ETag");
+        download->_lastModified = reply->rawHeader("Last-Modified");
+        finish(download);
+    }
+    else if (httpstatuscode == 304 && (!download->_ifNoneMatch.isEmpty() || !download->_ifModifiedSince.isEmpty()))
+    {
+        download->_notModified = true;
+        finish(download);
+    }
+    else if (httpstatuscode >= 500 || (httpstatuscode == 0 && error > QNetworkReply::NoError && error < QNetworkReply::ContentAccessDenied))
+    {
+        /* Server and network errors (including those of proxies) may go away */
+        retry(download, httpstatuscode ? "HTTP status "+QString::number(httpstatuscode) : reply->errorString());
+    }
+    else
+    {
+        finish(download, "Error downloading "+download->_url+": "
+               +(httpstatuscode ? "HTTP status "+QString::number(httpstatuscode) : reply->errorString()));
+    }
+}
+
+void MetaDownloader::retry(MetaDownload *download, const QString &reason)
+{
+    if (download->_retries == META_MAX_RETRIES)
+    {
+        finish(download, "Error downloading "+download->_url+": "+reason);
+        return;
+    }
+
+    int delay = META_RETRY_DELAY << download->_retries++;
+    qDebug() << "Download of" << download->_currentUrl << "failed:" << reason << "- retrying in" << delay << "ms";
+    _retries.insert(_clock.elapsed()+delay, download);
+    QTimer::singleShot(delay, this, SLOT(retryDue()));
+}
+
+void MetaDownloader::retryDue()
+{
+    int now = _clock.elapsed();
+
+    while (!_retries.isEmpty() && _retries.begin().key() <= now)
+    {
+        MetaDownload *download = _retries.begin().value();
+        _retries.erase(_retries.begin());
+        enqueue(download);
+    }
+
+    /* In case the timer fired a little early */
+    if (!_retries.isEmpty())
+        QTimer::singleShot(qMax(_retries.begin().key() - now, 1), this, SLOT(retryDue()));
+}
+
+void MetaDownloader::finish(MetaDownload *download, const QString &error)
+{
+    download->_error = error;
+
+    if (error.isEmpty() && !download->_saveAs.isEmpty())
+    {
+        QFile f(download->_saveAs);
+        if (!f.open(QIODevice::WriteOnly) || f.write(download->_data) != download->_data.size())
+            download->_error = "Error writing "+download->_saveAs+" to SD card. SD card or file system may be damaged.";
+        f.close();
+        download->_data.clear();
+    }
+
+    if (!download->_error.isEmpty())
+        qDebug() << download->_error;
+    download->_finished = true;
+    emit download->finished();
+}
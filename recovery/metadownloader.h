@@ -0,0 +1,134 @@
+#ifndef METADOWNLOADER_H
+#define METADOWNLOADER_H
+
+/* Downloads of the OS list, icons and OS meta files
+ *
+ * All requests go through one MetaDownloader, which limits the number
+ * of requests in flight per host and queues the others. Redirects are
+ * followed, and network errors and server errors (5xx) are retried
+ * with increasing delays. Other HTTP errors are final.
+ *
+ * A download can be made conditional on the validators of a copy the
+ * caller has already, in which case the server may answer that the
+ * copy is still current instead of sending the data again.
+ *
+ * A MetaDownloadGroup collects the downloads of one OS, and signals
+ * once all of them have finished, so work on that OS can go ahead
+ * without waiting for the files of the others.
+ *
+ * Maintained by Raspberry Pi
+ *
+ * See LICENSE.txt for license details
+ *
+ */
+
+#include <QObject>
+#include <QString>
+#include <QByteArray>
+#include <QHash>
+#include <QList>
+#include <QMultiMap>
+#include <QTime>
+
+#define META_MAX_REQUESTS_PER_HOST  4
+#define META_MAX_REDIRECTS          5
+#define META_MAX_RETRIES            3
+/* Delay before the first retry in ms, doubled for every further one */
+#define META_RETRY_DELAY            1000
+
+class QNetworkAccessManager;
+class QNetworkReply;
+
+class MetaDownload : public QObject
+{
+    Q_OBJECT
+public:
+    /* URL as requested, before redirects */
+    QString url() const;
+    /* File the data is saved to, empty if it is kept in memory */
+    QString saveAs() const;
+    QByteArray data() const;
+    bool isFinished() const;
+    /* Empty if the download succeeded */
+    QString errorString() const;
+    /* Conditional downloads only: the copy of the caller is current, there is no data */
+    bool isNotModified() const;
+    /* Validators sent by the server, empty if it sent none */
+    QByteArray etag() const;
+    QByteArray lastModified() const;
+
+signals:
+    void finished();
+
+protected:
+    MetaDownload(const QString &url, const QString &saveAs, QObject *parent);
+
+    QString _url, _currentUrl, _saveAs, _host;
+    QByteArray _data;
+    int _redirects, _retries;
+    bool _finished, _notModified;
+    QString _error;
+    /* Validators of the copy of the caller, and of the response */
+    QByteArray _ifNoneMatch, _ifModifiedSince;
+    QByteArray _etag, _lastModified;
+
+    friend class MetaDownloader;
+};
+
+class MetaDownloadGroup : public QObject
+{
+    Q_OBJECT
+public:
+    explicit MetaDownloadGroup(QObject *parent = 0);
+    /* The group takes ownership of the download, which must not have finished yet */
+    void add(MetaDownload *download);
+    bool isFinished() const;
+    /* Error of the first download that failed, empty if none did */
+    QString errorString() const;
+
+signals:
+    /* All downloads of the group have finished, successfully or not */
+    void finished();
+
+protected slots:
+    void downloadFinished();
+
+protected:
+    int _pending;
+    QString _error;
+};
+
+class MetaDownloader : public QObject
+{
+    Q_OBJECT
+public:
+    explicit MetaDownloader(QNetworkAccessManager *netaccess, QObject *parent = 0);
+
+    /* Download url, and save it to saveAs if given.
+     * The download is owned by the downloader, until it is added to a group */
+    MetaDownload *get(const QString &url, const QString &saveAs = QString());
+    /* Download url unless it still matches the ETag or Last-Modified given.
+     * Bypasses the network cache, the caller keeps the copy */
+    MetaDownload *revalidate(const QString &url, const QByteArray &etag, const QByteArray &lastModified);
+
+protected slots:
+    void replyFinished();
+    void retryDue();
+
+protected:
+    void enqueue(MetaDownload *download);
+    void send(MetaDownload *download);
+    void sendQueued(const QString &host);
+    void retry(MetaDownload *download, const QString &reason);
+    void finish(MetaDownload *download, const QString &error = QString());
+
+    QNetworkAccessManager *_netaccess;
+    /* Per host: requests in flight, and requests waiting for one of those to finish */
+    QHash<QString,int> _active;
+    QHash<QString,QList<MetaDownload *> > _queued;
+    /* Downloads waiting to be retried, by due time */
+    QMultiMap<int,MetaDownload *> _retries;
+    QTime _clock;
+};
+
+#endif // METADOWNLOADER_H
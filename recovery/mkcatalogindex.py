@@ -0,0 +1,145 @@
+#!/usr/bin/env python
+#
+# Generates catalog.idx for the OS folders in a NOOBS os directory,
+# in the format described in catalogindex.h.
+#
+# Usage: mkcatalogindex.py <os directory>
+#
+# The mtimes are written as 0, the folders are recognised by the SHA-1
+# of their JSON files once they are copied to the SD card.
+#
+# Maintained by Raspberry Pi
+#
+# See LICENSE.txt for license details
+#
+
+import hashlib
+import io
+import json
+import numbers
+import os
+import struct
+import sys
+
+MAGIC = b"NOOBSCAT"
+VERSION = 1
+JSON_FILES = ("os.json", "flavours.json", "partitions.json")
+RISCOS_OFFSET_KEY = "riscos_offset"
+
+
+# Conversions as done by QVariant on the values read by the recovery
+
+def to_string(v):
+    if isinstance(v, bool):
+        return "true" if v else "false"
+    if isinstance(v, numbers.Number):
+        return str(v)
+    if isinstance(v, str) or (sys.version_info[0] < 3 and isinstance(v, unicode)):
+        return v
+    return ""
+
+
+def to_bool(v, default):
+    if v is None:
+        return default
+    if isinstance(v, bool) or isinstance(v, numbers.Number):
+        return bool(v)
+    s = to_string(v)
+    return s not in ("", "0") and s.lower() != "false"
+
+
+def to_int(v):
+    if isinstance(v, bool):
+        return int(v)
+    if isinstance(v, numbers.Number):
+        return int(v)
+    try:
+        return int(to_string(v).strip())
+    except ValueError:
+        return 0
+
+
+def load_json(path):
+    if not os.path.exists(path):
+        return {}
+    with io.open(path, encoding="utf-8") as f:
+        return json.load(f)
+
+
+def pack_string(s):
+    b = s.encode("utf-8")[:0xffff]
+    return struct.pack("<H", len(b)) + b
+
+
+def folder_hash(folder):
+    h = hashlib.sha1()
+    for name in JSON_FILES:
+        path = os.path.join(folder, name)
+        if os.path.exists(path):
+            with open(path, "rb") as f:
+                data = f.read()
+            h.update(struct.pack("<I", len(data)))
+            h.update(data)
+        else:
+            h.update(struct.pack("<I", 0xffffffff))
+    return h.digest()
+
+
+def pack_folder(osdir, name):
+    folder = os.path.join(osdir, name)
+    osv = load_json(os.path.join(folder, "os.json"))
+
+    nominal_size = 0
+    for p in load_json(os.path.join(folder, "partitions.json")).get("partitions", []):
+        nominal_size += to_int(p.get("partition_size_nominal")) + 1
+
+    if os.path.exists(os.path.join(folder, "flavours.json")):
+        entries = []
+        for fm in load_json(os.path.join(folder, "flavours.json")).get("flavours", []):
+            if "name" in fm:
+                fm = dict(fm)
+                fm["release_date"] = osv.get("release_date")
+                entries.append(fm)
+    else:
+        entries = [osv]
+
+    data = pack_string(name)
+    data += struct.pack("<IIII", 0, 0, 0, 0)
+    data += folder_hash(folder)
+    data += pack_string(to_string(osv.get("name")))
+    flags = (1 if to_bool(osv.get("bootable"), True) else 0) | (2 if RISCOS_OFFSET_KEY in osv else 0)
+    data += struct.pack("<Bi", flags, to_int(osv.get(RISCOS_OFFSET_KEY)))
+
+    data += struct.pack("<I", len(entries))
+    for e in entries:
+        for key in ("name", "description", "icon", "release_date",
+                    "supported_revisions", "supported_hex_revisions"):
+            data += pack_string(to_string(e.get(key)))
+        flags = (1 if to_bool(e.get("bootable"), True) else 0) | (2 if "feature_level" in e else 0) \
+            | (4 if "supported_revisions" in e else 0) | (8 if "supported_hex_revisions" in e else 0)
+        size = to_int(e["nominal_size"]) if "nominal_size" in e else nominal_size
+        data += struct.pack("<BQI", flags, to_int(e.get("feature_level")) & 0xffffffffffffffff, size & 0xffffffff)
+
+    return data
+
+
+def main():
+    if len(sys.argv) != 2:
+        sys.stderr.write("Usage: %s <os directory>\n" % sys.argv[0])
+        return 1
+
+    osdir = sys.argv[1]
+    folders = sorted(n for n in os.listdir(osdir)
+                     if os.path.exists(os.path.join(osdir, n, "os.json")))
+
+    data = MAGIC + struct.pack("<II", VERSION, len(folders))
+    for name in folders:
+        data += pack_folder(osdir, name)
+
+    with open(os.path.join(osdir, "catalog.idx"), "wb") as f:
+        f.write(data)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,122 @@
+#include "mountmanager.h"
+#include "config.h"
+#include "util.h"
+#include <QFile>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QList>
+#include <QDebug>
+#include <sys/mount.h>
+#include <errno.h>
+#include <string.h>
+
+/* Mount and unmount file systems with mount(2)/umount2(2)
+ *
+ * Maintained by Raspberry Pi
+ *
+ * See LICENSE.txt for license details
+ *
+ */
+
+static QMutex settingsMutex;
+static int settingsHolders = 0;
+
+/* Block device file systems the kernel supports */
+static QList<QByteArray> kernelFilesystems()
+{
+    QList<QByteArray> types;
+
+    foreach (QByteArray line, getFileContents("/proc/filesystems").split('\n'))
+    {
+        if (!line.isEmpty() && !line.startsWith("nodev"))
+            types.append(line.trimmed());
+    }
+
+    return types;
+}
+
+bool MountManager::mount(const QString &device, const QString &mountpoint, const QByteArray &fstype, bool readOnly)
+{
+    QByteArray dev = QFile::encodeName(device), dir = QFile::encodeName(mountpoint);
+    unsigned long flags = readOnly ? MS_RDONLY : 0;
+    QList<QByteArray> types;
+
+    if (fstype.isEmpty())
+        types = kernelFilesystems();
+    else
+        types.append(fstype);
+
+    foreach (QByteArray type, types)
+    {
+        if (::mount(dev.constData(), dir.constData(), type.constData(), flags, NULL) == 0)
+            return true;
+    }
+
+    qDebug() << "Error mounting" << device << "on" << mountpoint << ":" << strerror(errno);
+    return false;
+}
+
+bool MountManager::umount(const QString &mountpoint, bool readOnlyIfBusy)
+{
+    if (::umount2(QFile::encodeName(mountpoint).constData(), 0) == 0)
+        return true;
+
+    if (errno == EBUSY && readOnlyIfBusy)
+        return remount(mountpoint, true);
+
+    qDebug() << "Error unmounting" << mountpoint << ":" << strerror(errno);
+    return false;
+}
+
+bool MountManager::remount(const QString &mountpoint, bool readOnly)
+{
+    unsigned long flags = MS_REMOUNT | (readOnly ? MS_RDONLY : 0);
+
+    if (::mount("", QFile::encodeName(mountpoint).constData(), "", flags, NULL) == 0)
+        return true;
+
+    qDebug() << "Error remounting" << mountpoint << (readOnly ? "read-only:" : "read-write:") << strerror(errno);
+    return false;
+}
+
+bool MountManager::mountSettings()
+{
+    QMutexLocker lock(&settingsMutex);
+
+    return mount(SETTINGS_PARTITION, "/settings", "ext4", settingsHolders == 0);
+}
+
+bool MountManager::acquireSettingsRW()
+{
+    QMutexLocker lock(&settingsMutex);
+
+    if (settingsHolders == 0 && !remount("/settings", false))
+        return false;
+
+    settingsHolders++;
+    return true;
+}
+
+void MountManager::releaseSettingsRW()
+{
+    QMutexLocker lock(&settingsMutex);
+
+    if (--settingsHolders == 0)
+        remount("/settings", true);
+}
+
+SettingsWriteLocker::SettingsWriteLocker()
+{
+    _acquired = MountManager::acquireSettingsRW();
+}
+
+SettingsWriteLocker::~SettingsWriteLocker()
+{
+    if (_acquired)
+        MountManager::releaseSettingsRW();
+}
+
+bool SettingsWriteLocker::isWritable() const
+{
+    return _acquired;
+}
@@ -0,0 +1,51 @@
+#ifndef MOUNTMANAGER_H
+#define MOUNTMANAGER_H
+
+/* Mount and unmount file systems with mount(2)/umount2(2)
+ * instead of spawning the mount command
+ *
+ * Also keeps track of who needs the settings partition read-write.
+ * /settings is remounted read-write when the first holder acquires
+ * it, and read-only again when the last one releases it, so nested
+ * or overlapping writers share a single read-write window. Writers
+ * that follow each other each remount it.
+ *
+ * Maintained by Raspberry Pi
+ *
+ * See LICENSE.txt for license details
+ *
+ */
+
+#include <QString>
+#include <QByteArray>
+
+class MountManager
+{
+public:
+    /* Tries all file systems listed in /proc/filesystems if no type is given */
+    static bool mount(const QString &device, const QString &mountpoint, const QByteArray &fstype = "", bool readOnly = false);
+    /* With readOnlyIfBusy set, a busy file system is remounted read-only instead (like umount -r) */
+    static bool umount(const QString &mountpoint, bool readOnlyIfBusy = false);
+    static bool remount(const QString &mountpoint, bool readOnly);
+
+    /* Mount the settings partition, read-write only if anyone holds it */
+    static bool mountSettings();
+    /* Returns false if /settings could not be remounted read-write, which must not be released then */
+    static bool acquireSettingsRW();
+    static void releaseSettingsRW();
+};
+
+/* Keeps /settings read-write for the lifetime of the object */
+class SettingsWriteLocker
+{
+public:
+    SettingsWriteLocker();
+    ~SettingsWriteLocker();
+    /* False if /settings could not be remounted read-write */
+    bool isWritable() const;
+
+protected:
+    bool _acquired;
+};
+
+#endif // MOUNTMANAGER_H
@@ -2,7 +2,18 @@
 #include "config.h"
 #include "json.h"
 #include "util.h"
-#include "mbr.h"
+#include "decompressor.h"
+#include "tarextractor.h"
+#include "ext4builder.h"
+#include "fatbuilder.h"
+#include "imagepipeline.h"
+#include "rawimagewriter.h"
+#include "installplanner.h"
+#include "mountmanager.h"
+#include "taskgraph.h"
+#include "chunkcache.h"
+#include "chunkindex.h"
+#include "writeverifier.h"
 #include <QDir>
 #include <QFile>
 #include <QDebug>
@@ -10,12 +21,13 @@
 #include <QProcessEnvironment>
 #include <QSettings>
 #include <QTime>
+#include <QSet>
+#include <QMutexLocker>
 #include <unistd.h>
-#include <linux/fs.h>
-#include <sys/ioctl.h>
+#include <fcntl.h>
 
-MultiImageWriteThread::MultiImageWriteThread(QObject *parent) :
-    QThread(parent), _extraSpacePerPartition(0), _part(6)
+MultiImageWriteThread::MultiImageWriteThread(OsCatalog *catalog, QObject *parent) :
+    QThread(parent), _dryRun(false), _failed(false), _mkfsRunning(0), _cache(NULL), _seeder(NULL), _catalog(catalog)
 {
     QDir dir;
 
@@ -28,383 +40,643 @@ void MultiImageWriteThread::addImage(const QString &folder, const QString &flavo
     _images.insert(folder, flavour);
 }
 
-void MultiImageWriteThread::run()
+void MultiImageWriteThread::setMetaFilesPending(const QString &folder)
+{
+    QMutexLocker lock(&_mutex);
+    _pendingMetaFiles.insert(folder);
+}
+
+void MultiImageWriteThread::metaFilesDownloaded(const QString &folder, const QString &error)
 {
-    /* Calculate space requirements */
-    int totalnominalsize = 0, totaluncompressedsize = 0, numparts = 0, numexpandparts = 0, numext4expandparts = 0;
-    int win10Fat = 0, win10Ntfs = 0;
-    bool RiscOSworkaround = false;
-    int startSector = getFileContents("/sys/class/block/mmcblk0p4/start").trimmed().toULongLong() + SETTINGS_PARTITION_SIZE + EBR_PARTITION_OFFSET;
-    int availableMB = (sizeofSDCardInBlocks() - startSector)/2048;
+    QMutexLocker lock(&_mutex);
 
-    foreach (QString folder, _images.keys())
+    _pendingMetaFiles.remove(folder);
+    if (!error.isEmpty())
+        _metaFileErrors.insert(folder, error);
+    _metaFilesDownloaded.wakeAll();
+}
+
+/* Only compute the install plan and report it, without touching the SD card */
+void MultiImageWriteThread::setDryRun(bool dryRun)
+{
+    _dryRun = dryRun;
+}
+
+/* One step of the install, executed on a worker thread of the task graph */
+class InstallStep : public TaskGraph::Task
+{
+public:
+    typedef bool (MultiImageWriteThread::*Function)(const InstallStep &step);
+
+    InstallStep(MultiImageWriteThread *thread, Function function, InstallPlan *plan, int image = -1, int partition = -1)
+        : _thread(thread), _function(function), _plan(plan), _image(image), _partition(partition)
     {
-        QVariantList partitions = Json::loadFromFile(folder+"/partitions.json").toMap().value("partitions").toList();
-        if (partitions.isEmpty())
-        {
-            emit error(tr("partitions.json invalid"));
-            return;
-        }
+    }
 
-        foreach (QVariant pv, partitions)
-        {
-            QVariantMap partition = pv.toMap();
-            numparts++;
-            if ( partition.value("want_maximised").toBool() )
-                numexpandparts++;
-            totalnominalsize += partition.value("partition_size_nominal").toInt();
-            totaluncompressedsize += partition.value("uncompressed_tarball_size").toInt();
-            if (partition.value("filesystem_type").toString() == "ext4")
-            {
-                totaluncompressedsize += /*0.035*/ 0.01 * totalnominalsize; /* overhead for file system meta data */
-                if (partition.value("want_maximised").toBool())
-                {
-                    numext4expandparts++;
-                }
-            }
+    virtual bool run()
+    {
+        return (_thread->*_function)(*this);
+    }
 
-            if (nameMatchesWinIoT(folder))
-            {
-                /* Windows IoT partitions cannot be an extended partition.
-                   Reserve space after the extended partition */
-                int partitionSize = partition.value("partition_size_nominal").toInt() * 2048;
-                if (partition.value("filesystem_type").toString() == "NTFS" ||
-                    partition.value("filesystem_type").toString() == "ntfs")
-                {
-                    if (win10Ntfs != 0)
-                    {
-                        emit error(tr("WinIoT cannot have more than 1 NTFS partition."));
-                        return;
-                    }
+    InstallPlan &plan() const
+    {
+        return *_plan;
+    }
 
-                    win10Ntfs = partitionSize;
-                }
-                if (partition.value("filesystem_type").toString() == "FAT" ||
-                    partition.value("filesystem_type").toString() == "fat")
-                {
-                    if (win10Fat != 0)
-                    {
-                        emit error(tr("WinIoT cannot have more than 1 FAT partition."));
-                        return;
-                    }
+    const PlannedImage &image() const
+    {
+        return _plan->images.at(_image);
+    }
 
-                    win10Fat = partitionSize;
-                }
-            }
-        }
+    const PlannedPartition &partition() const
+    {
+        return image().partitions.at(_partition);
+    }
+
+protected:
+    MultiImageWriteThread *_thread;
+    Function _function;
+    InstallPlan *_plan;
+    int _image, _partition;
+};
+
+void MultiImageWriteThread::run()
+{
+    QSettings settings("/settings/noobs.conf", QSettings::IniFormat);
+    int workers = qMax(settings.value("install_workers", INSTALL_DEFAULT_WORKERS).toInt(), 1);
+    qint64 memory = availableMemory();
+
+    /* Work out the complete layout before anything is written.
+     * Up to one step per worker shares the memory, in-memory boot partitions are sized for that */
+    InstallPlanner planner;
+    planner.setMemoryLimit(memory / workers);
+    InstallPlan plan;
+    if (!planner.plan(_images, plan))
+    {
+        reportError(planner.errorString());
+        return;
+    }
+    qDebug() << "Install plan:" << plan.describe();
 
-        if (nameMatchesRiscOS(folder))
+    emit parsedImagesize(plan.estimatedBytes);
+
+    if (_dryRun)
+    {
+        emit dryRunCompleted(plan.describe());
+        return;
+    }
+
+    bool delta = false;
+    foreach (const PlannedImage &image, plan.images)
+    {
+        foreach (const PlannedPartition &p, image.partitions)
+            delta = delta || !p.chunkIndex.isEmpty();
+    }
+    /* Chunks found locally are kept in the download cache until they are needed */
+    delta = delta && !plan.cacheDevice.isEmpty();
+    if (delta)
+        findSeedPartitions(plan);
+
+    /* What our own writers put on the card is read back before the partition is configured.
+     * Data written by the kernel (mkfs, extracting to a mounted file system) is not recorded */
+    QString verifyMode = settings.value("verify_writes", "sampled").toString();
+    bool verify = (verifyMode != "off");
+
+    /* Partition table first, then per partition the file system and its contents,
+     * and finally per OS the configuration and setup script.
+     * Partitions are independent of each other, and are formatted and filled at the same time.
+     * The configuration steps share /mnt2 and installed_os.json, and run one after another.
+     * For delta downloads, the chunks on the old partitions are saved before any of them is overwritten */
+    TaskGraph graph;
+    TaskGraph::Task *table = graph.add(new InstallStep(this, &MultiImageWriteThread::writePartitionTable, &plan));
+    TaskGraph::Task *previousConfigure = NULL;
+    /* Steps writing an image, which need memory for the download and decompression buffers */
+    QList<TaskGraph::Task *> writers;
+
+    if (delta)
+    {
+        TaskGraph::Task *seed = graph.add(new InstallStep(this, &MultiImageWriteThread::prepareDelta, &plan));
+        seed->dependsOn(table);
+        /* Nothing is written to the partitions before that */
+        table = seed;
+    }
+
+    for (int i = 0; i < plan.images.size(); i++)
+    {
+        TaskGraph::Task *configure = graph.add(new InstallStep(this, &MultiImageWriteThread::configureImage, &plan, i));
+        if (previousConfigure)
+            configure->dependsOn(previousConfigure);
+        previousConfigure = configure;
+
+        for (int j = 0; j < plan.images.at(i).partitions.size(); j++)
         {
-            /* Check the riscos_offset in os.json matches what we're expecting.
-               In theory we shouldn't hit either of these errors because the invalid RISC_OS
-               should have been filtered out already (not added to OS-list) in mainwindow.cpp */
-            QVariantMap vos = Json::loadFromFile(folder+"/os.json").toMap();
-            if (vos.contains(RISCOS_OFFSET_KEY))
+            const PlannedPartition &p = plan.images.at(i).partitions.at(j);
+            TaskGraph::Task *format = graph.add(new InstallStep(this, &MultiImageWriteThread::formatPartition, &plan, i, j));
+            format->dependsOn(table);
+
+            TaskGraph::Task *written = format;
+
+            if (!p.emptyFs && p.fstype != "raw" && p.fstype != "NTFS" && p.fstype != "ntfs")
             {
-                int riscos_offset = vos.value(RISCOS_OFFSET_KEY).toInt();
-                if (riscos_offset != RISCOS_OFFSET)
-                {
-                    emit error(tr("RISCOS cannot be installed. RISCOS offset value mismatch."));
-                    return;
-                }
+                written = graph.add(new InstallStep(this, &MultiImageWriteThread::extractPartition, &plan, i, j));
+                written->dependsOn(format);
+                writers.append(written);
             }
-            else
+            else if (!p.emptyFs)
             {
-                emit error(tr("RISCOS cannot be installed. RISCOS offset value missing."));
-                return;
+                writers.append(format);
             }
-            if (startSector > RISCOS_SECTOR_OFFSET - EBR_PARTITION_OFFSET)
+            if (verify && !p.emptyFs)
             {
-                emit error(tr("RISCOS cannot be installed. Size of recovery partition too large."));
-                return;
+                _verifiers.insert(p.device, new WriteVerifier(verifyMode == "full" ? WriteVerifier::VerifyFull : WriteVerifier::VerifySampled));
+                TaskGraph::Task *check = graph.add(new InstallStep(this, &MultiImageWriteThread::verifyPartition, &plan, i, j));
+                check->dependsOn(written);
+                written = check;
             }
-
-            totalnominalsize += (RISCOS_SECTOR_OFFSET - startSector)/2048;
-            RiscOSworkaround = true;
+            configure->dependsOn(written);
         }
     }
 
-    /* 4 MB overhead per partition (logical partition table) */
-    totalnominalsize += (numparts * 4);
+    /* The writers split the memory between them, and wait for each other if there are more writers than workers.
+     * Every writer sizes its buffers, decompressor and in-memory file system from its share */
+    graph.setMemoryBudget(memory);
+    foreach (TaskGraph::Task *writer, writers)
+        writer->setMemory(memory / qMin(workers, writers.size()));
 
-    if (numexpandparts)
+    QTime t1;
+    t1.start();
+    bool ok = graph.run(workers);
+    closeCache();
+    qDeleteAll(_chunkIndexes);
+    _chunkIndexes.clear();
+    qDeleteAll(_verifiers);
+    _verifiers.clear();
+
+    if (!ok)
     {
-        /* Extra spare space available for partitions that want to be expanded */
-        _extraSpacePerPartition = (availableMB-totalnominalsize)/numexpandparts;
-        /* Ext4 file system meta data overhead */
-        //totaluncompressedsize += 0.035 * _extraSpacePerPartition * numext4expandparts;
+        /* Failing steps have reported the reason already */
+        reportError(tr("Error installing operating systems"));
+        return;
     }
+    qDebug() << "Installed all operating systems in" << (t1.elapsed()/1000.0) << "seconds using" << workers << "workers";
+
+    emit completed();
+}
 
-    emit parsedImagesize(qint64(totaluncompressedsize)*1024*1024);
+/* Only the first error is shown to the user. Later ones are usually a consequence of it */
+void MultiImageWriteThread::reportError(const QString &msg)
+{
+    QMutexLocker lock(&_mutex);
 
-    if (totalnominalsize > availableMB)
+    qDebug() << msg;
+    if (!_failed)
     {
-        emit error(tr("Not enough disk space. Need %1 MB, got %2 MB").arg(QString::number(totalnominalsize), QString::number(availableMB)));
-        return;
+        _failed = true;
+        emit error(msg);
     }
+}
 
-    emit statusUpdate(tr("Clearing existing EBR"));
-    clearEBR();
-
-    emit statusUpdate(tr("Removing partions 2 and 3"));
-
-    if (!sfdisk(3, 0, 0, "0") ||
-        !sfdisk(2, 0, 0, "0"))
-        return;
+/* The IO accounting of the progress dialog is paused as long as any mkfs is running */
+void MultiImageWriteThread::beginMkfs()
+{
+    QMutexLocker lock(&_mkfsMutex);
 
-    if (win10Fat || win10Ntfs)
-    {
-        emit statusUpdate(tr("Reallocating space for Windows IoT"));
+    if (_mkfsRunning++ == 0)
+        emit runningMKFS();
+}
 
-//        if (!reduceExtendedPartition(win10Fat + win10Ntfs))
-//            return;
+void MultiImageWriteThread::endMkfs()
+{
+    QMutexLocker lock(&_mkfsMutex);
 
-// BUGBUG
-        int startOfRecoveryPartition = getFileContents("/sys/class/block/mmcblk0p1/start").trimmed().toInt();
-        int sizeOfRecoveryPartition = getFileContents("/sys/class/block/mmcblk0p1/size").trimmed().toInt();
-        startSector = startOfRecoveryPartition + sizeOfRecoveryPartition;
-        // Align on 4 MiB boundary
-        startSector += 8192-(startSector % 8192);
-// BUGBUG
+    if (--_mkfsRunning == 0)
+        emit finishedMKFS();
+}
 
-        /* Reserve the space between recovery partition and extended partition */
-/*
-        if (!sfdisk(3, startSector - win10Fat - win10Ntfs, win10Fat, "c") ||
-            !sfdisk(4, startSector - win10Ntfs, win10Ntfs, "7"))
-            return;
-*/
-        if (!sfdisk(2, startSector, win10Fat, "c") ||
-            !sfdisk(3, startSector + win10Fat, win10Ntfs, "7"))
-            return;
+void MultiImageWriteThread::assignLabels(InstallPlan &plan)
+{
+    QSet<QByteArray> assigned;
+    /* The file systems still on the partitions about to be formatted, e.g. of an earlier install
+     * of the same OS, do not keep their labels */
+    QSet<QString> formatted;
+    foreach (const PlannedImage &image, plan.images)
+    {
+        foreach (const PlannedPartition &p, image.partitions)
+            formatted.insert(p.device);
     }
 
-    /* Install RiscOS first */
-    if (RiscOSworkaround)
+    for (int i = 0; i < plan.images.size(); i++)
     {
-        for (QMultiMap<QString,QString>::const_iterator iter = _images.constBegin(); iter != _images.constEnd(); iter++)
+        QList<PlannedPartition> &partitions = plan.images[i].partitions;
+
+        for (int j = 0; j < partitions.size(); j++)
         {
-            if (nameMatchesRiscOS(iter.key()))
-            {
-                if (!processImage(iter.key(), iter.value()))
-                    return;
+            QByteArray &label = partitions[j].label;
 
-                _images.remove(iter.key());
-                break;
+            /* Labels have to be unique on the card. Over-long labels have already been dropped by the planner */
+            if (!isLabelAvailable(label, formatted) || assigned.contains(label))
+            {
+                for (int k=0; k<10; k++)
+                {
+                    if (isLabelAvailable(label+QByteArray::number(k), formatted) && !assigned.contains(label+QByteArray::number(k)))
+                    {
+                        label = label+QByteArray::number(k);
+                        break;
+                    }
+                }
             }
+            if (!label.isEmpty())
+                assigned.insert(label);
         }
     }
+}
+
+bool MultiImageWriteThread::writePartitionTable(const InstallStep &step)
+{
+    PartitionTable &table = step.plan().table;
 
-    /* Process each image */
-    /* At this point no more calls to sfdisk can be done due to it complaining
-       about invalid extended partitions created by addPartitionImage */
+    emit statusUpdate(tr("Writing partition table"));
+    /* Unmount everything before modifying partition table */
+    MountManager::umount("/mnt", true);
+    MountManager::umount("/settings", true);
+    bool ok = table.commit();
+    MountManager::mount("/dev/mmcblk0p1", "/mnt", "vfat", true);
+    MountManager::mountSettings();
 
-    for (QMultiMap<QString,QString>::const_iterator iter = _images.constBegin(); iter != _images.constEnd(); iter++)
+    if (!ok)
     {
-        if (!processImage(iter.key(), iter.value()))
-            return;
+        reportError(tr("Error writing partition table")+"\n"+table.errorString());
+        return false;
     }
 
-    emit statusUpdate(tr("Finish writing (sync)"));
-    sync();
-    emit completed();
+    /* Labels of all new file systems are decided before any partition is formatted,
+     * as partitions are formatted concurrently */
+    assignLabels(step.plan());
+
+    if (!step.plan().cacheDevice.isEmpty())
+        openCache(step.plan().cacheDevice);
+
+    return true;
 }
 
-bool MultiImageWriteThread::processImage(const QString &folder, const QString &flavour)
+/* The cache partition keeps its contents from one install to the next.
+ * It is only formatted if it does not hold the cache file system yet.
+ * Installing works the same without a cache, so errors are not fatal */
+void MultiImageWriteThread::openCache(const QByteArray &device)
 {
-    QString os_name = (folder.split("/")).at(3);
-
-    qDebug() << "Processing OS:" << os_name;
+    QDir dir;
+    if (!dir.exists("/cache"))
+        dir.mkdir("/cache");
 
-    int startSector = getFileContents("/sys/class/block/mmcblk0p4/start").trimmed().toULongLong();
+    FilesystemProber::Info info = FilesystemProber::probe(device);
+    bool mounted = info.type == "ext4" && info.label == CACHE_PARTITION_LABEL
+            && MountManager::mount(device, "/cache", "ext4");
 
-    if (nameMatchesWinIoT(folder))
+    if (!mounted)
     {
-        startSector = getFileContents("/sys/class/block/mmcblk0p2/start").trimmed().toULongLong();
+        emit statusUpdate(tr("Creating download cache"));
+        qDebug() << "Creating download cache on" << device;
+
+        if (QProcess::execute(QString("/usr/sbin/mkfs.ext4 -q -m 0 -L " CACHE_PARTITION_LABEL " ")+device) != 0
+                || !MountManager::mount(device, "/cache", "ext4"))
+        {
+            qDebug() << "Error creating download cache on" << device << "- installing without it";
+            return;
+        }
     }
 
-    QVariantList partitions = Json::loadFromFile(folder+"/partitions.json").toMap().value("partitions").toList();
-    QVariantList vpartitions;
-    foreach (QVariant pv, partitions)
+    _cache = new ChunkCache("/cache");
+    if (!_cache->open())
     {
-        QVariantMap partition = pv.toMap();
+        qDebug() << _cache->errorString() << "- installing without download cache";
+        closeCache();
+    }
+}
+
+void MultiImageWriteThread::closeCache()
+{
+    if (!_cache)
+        return;
+
+    delete _seeder;
+    _seeder = NULL;
+    delete _cache;
+    _cache = NULL;
+    MountManager::umount("/cache");
+}
 
-        QByteArray fstype   = partition.value("filesystem_type").toByteArray();
-        QByteArray mkfsopt  = partition.value("mkfs_options").toByteArray();
-        QByteArray label = partition.value("label").toByteArray();
-        QString tarball  = partition.value("tarball").toString();
-        bool emptyfs     = partition.value("empty_fs", false).toBool();
+/* The partitions of an OS that is reinstalled hold most of the chunks of its new release.
+ * Where they are is looked up before the partition table is rewritten */
+void MultiImageWriteThread::findSeedPartitions(const InstallPlan &plan)
+{
+    QList<OsRecord> installed = _catalog->installed();
 
-        if (!emptyfs && tarball.isEmpty())
+    foreach (const PlannedImage &image, plan.images)
+    {
+        foreach (const OsRecord &r, installed)
         {
-            /* If no tarball URL is specified, we expect the tarball to reside in the folder and be named <label.tar.xz> */
-            if (fstype == "raw" || fstype == "ntfs" || fstype == "NTFS")
-                tarball = folder+"/"+label+".xz";
-            else
-                tarball = folder+"/"+label+".tar.xz";
+            if (r.name != image.flavour)
+                continue;
 
-            if (!QFile::exists(tarball))
+            /* The partitions of both releases are listed in partitions.json order */
+            const QStringList &old = r.partitions;
+            for (int i = 0; i < image.partitions.size() && i < old.size(); i++)
             {
-                emit error(tr("File '%1' does not exist").arg(tarball));
-                return false;
+                const PlannedPartition &p = image.partitions.at(i);
+                QString name = old.at(i).section('/', -1);
+                qint64 start = getFileContents("/sys/class/block/"+name+"/start").trimmed().toLongLong();
+                qint64 size  = getFileContents("/sys/class/block/"+name+"/size").trimmed().toLongLong();
+
+                if (!p.chunkIndex.isEmpty() && size > 0)
+                    _seedPartitions.insert(p.device, qMakePair(start, size));
             }
         }
-        if (label.size() > 15)
-        {
-            label.clear();
-        }
-        else if (!isLabelAvailable(label))
+    }
+}
+
+/* Download the chunk indexes, and copy the chunks that are on the old partitions into the cache.
+ * Without a chunk index the whole image is downloaded, so errors are not fatal */
+bool MultiImageWriteThread::prepareDelta(const InstallStep &step)
+{
+    if (!_cache)
+        return true;
+
+    QSettings settings("/settings/noobs.conf", QSettings::IniFormat);
+    bool seed = settings.value("seed_from_partitions", true).toBool();
+    _seeder = new ChunkSeeder(_cache);
+
+    foreach (const PlannedImage &image, step.plan().images)
+    {
+        foreach (const PlannedPartition &p, image.partitions)
         {
-            for (int i=0; i<10; i++)
+            if (p.chunkIndex.isEmpty())
+                continue;
+
+            ChunkIndex *index = new ChunkIndex;
+            if (!index->load(p.chunkIndex, p.chunkStore))
             {
-                if (isLabelAvailable(label+QByteArray::number(i)))
-                {
-                    label = label+QByteArray::number(i);
-                    break;
-                }
+                qDebug() << index->errorString() << "- downloading the whole image";
+                delete index;
+                continue;
             }
+            _chunkIndexes.insert(p.device, index);
+            _seeder->want(*index);
         }
+    }
 
-        int partsizeMB = partition.value("partition_size_nominal").toInt();
-        if (!partsizeMB)
+    foreach (const PlannedImage &image, step.plan().images)
+    {
+        QString os_name = (image.folder.split("/")).at(3);
+
+        foreach (const PlannedPartition &p, image.partitions)
         {
-            emit error(tr("Nominal partition size not specified or zero"));
-            return false;
+            const ChunkIndex *index = _chunkIndexes.value(p.device);
+            if (!seed || !index || !_seedPartitions.contains(p.device) || !_seeder->wantedCount())
+                continue;
+
+            emit statusUpdate(tr("%1: Looking for data to reuse on the installed partitions").arg(os_name));
+
+            QPair<qint64,qint64> old = _seedPartitions.value(p.device);
+            qint64 length = qMin(old.second * 512, SEED_SCAN_FACTOR * index->size());
+            QTime t1;
+            t1.start();
+            qint64 found = _seeder->scan("/dev/mmcblk0", old.first * 512, length, *index);
+
+            qDebug() << "Found" << found << "bytes of" << p.source << "in" << length << "bytes of the old partition in"
+                     << (t1.elapsed()/1000.0) << "seconds";
         }
+    }
+    qDebug() << _seeder->wantedCount() << "chunks have to be downloaded";
 
-        if ( partition.value("want_maximised").toBool() )
-            partsizeMB += _extraSpacePerPartition;
+    return true;
+}
 
-        QByteArray partdevice = "/dev/mmcblk0p"+QByteArray::number(_part);
-        int partsizeSectors = partsizeMB * 2048;
-        int parttype;
-        int specialOffset = 0;
+/* Create the file system, or write the raw image */
+bool MultiImageWriteThread::formatPartition(const InstallStep &step)
+{
+    const PlannedPartition &p = step.partition();
+    QString os_name = (step.image().folder.split("/")).at(3);
 
-        if (fstype == "FAT" || fstype == "fat")
-            parttype = 0x0c; /* FAT32 LBA */
-        else if (fstype == "swap")
-            parttype = 0x82;
-        else if (fstype == "NTFS" || fstype == "ntfs")
-            parttype = 0x07; /* NTFS */
-        else
-            parttype = 0x83; /* Linux native */
+    if (p.fstype == "raw" || p.fstype == "NTFS" || p.fstype == "ntfs")
+    {
+        emit statusUpdate(tr("%1: Writing OS image %2").arg(os_name, p.source));
 
-        if (nameMatchesRiscOS(folder) && (fstype == "FAT" || fstype == "fat"))
-        {
-            /* Let Risc OS start at known offset */
-            specialOffset = RISCOS_SECTOR_OFFSET - startSector - EBR_PARTITION_OFFSET;
-        }
+        return p.emptyFs || dd(p, step.memory());
+    }
 
-        emit statusUpdate(tr("%1: Creating partition entry").arg(os_name));
-        if (nameMatchesWinIoT(folder) && (fstype == "FAT" || fstype == "fat"))
-        {
-            /* Windows IoT uses primary partition 2, not extended partitions */
-            partdevice = "/dev/mmcblk0p2";
-            _part--;
-// can't call sfdisk here because it complains about extended partitions created
-// by addPartitionEntry
-//             if (!sfdisk(3, startSector, partsizeSectors, QByteArray::number(parttype, 16)))
-//                return false;
-
-            startSector += partsizeSectors;
-        }
-        else if (nameMatchesWinIoT(folder) && (fstype == "NTFS" || fstype == "ntfs"))
-        {
-            /* Windows IoT uses primary partition 3, not extended partitions */
-            partdevice = "/dev/mmcblk0p3";
-            _part--;
+    /* Created along with its contents by buildBootPartition() */
+    if (p.inMemory)
+        return true;
 
-// can't call sfdisk here because it complains about extended partitions created
-// by addPartitionEntry
-//            if (!sfdisk(4, startSector, partsizeSectors, QByteArray::number(parttype, 16)))
-//                return false;
+    beginMkfs();
+    emit statusUpdate(tr("%1: Creating filesystem (%2)").arg(os_name, QString(p.fstype)));
+    bool ok = mkfs(p.device, p.fstype, p.label, p.mkfsOptions);
+    endMkfs();
 
-            startSector += partsizeSectors;
-        }
-        else
+    return ok;
+}
+
+/* Fill the new file system with the contents of the tarball.
+ * Every partition has its own mount point, as several can be extracted at the same time */
+bool MultiImageWriteThread::extractPartition(const InstallStep &step)
+{
+    const PlannedPartition &p = step.partition();
+    QString os_name = (step.image().folder.split("/")).at(3);
+    QString mountpoint = "/mnt2_p"+QString::number(p.number);
+
+    QString status;
+    if (p.source.startsWith("http"))
+        status = tr("%1: Downloading and extracting filesystem %2").arg(os_name, p.source);
+    else
+        status = tr("%1: Extracting filesystem %2").arg(os_name, p.source);
+
+    if (p.inMemory)
+    {
+        emit statusUpdate(status);
+        return buildBootPartition(step);
+    }
+
+    /* A freshly created ext4 file system is filled in userspace, which saves
+     * the small scattered metadata and journal writes of the kernel driver */
+    QSettings settings("/settings/noobs.conf", QSettings::IniFormat);
+    if (p.fstype == "ext4" && settings.value("userspace_ext4", true).toBool())
+    {
+        Ext4Builder builder(p.device);
+        if (builder.open())
         {
-            if (!addPartitionEntry(partsizeSectors, parttype, specialOffset))
-                return false;
+            builder.setVerifier(_verifiers.value(p.device));
+            emit statusUpdate(status);
+            qDebug() << "Populating" << p.device << "in userspace";
+            return untar(p, builder, step.memory());
         }
+        qDebug() << "Cannot populate" << p.device << "in userspace:" << builder.errorString() << "- mounting it instead";
+    }
 
-        if (fstype == "raw" || fstype == "NTFS" || fstype == "ntfs")
-        {
-            emit statusUpdate(tr("%1: Writing OS image %2").arg(os_name, tarball));
+    QDir dir;
+    if (!dir.exists(mountpoint))
+        dir.mkdir(mountpoint);
 
-            if (!emptyfs && !dd(tarball, partdevice))
-                return false;
-        }
-        else
-        {
-            emit runningMKFS();
-            emit statusUpdate(tr("%1: Creating filesystem (%2)").arg(os_name, QString(fstype)));
-            if (!mkfs(partdevice, fstype, label, mkfsopt))
-                return false;
-            emit finishedMKFS();
+    emit statusUpdate(tr("%1: Mounting file system").arg(os_name));
+    if (!MountManager::mount(p.device, mountpoint))
+    {
+        reportError(tr("%1: Error mounting file system").arg(os_name));
+        return false;
+    }
 
-            if (!emptyfs)
-            {
-                emit statusUpdate(tr("%1: Mounting file system").arg(os_name));
-                if (QProcess::execute("mount "+partdevice+" /mnt2") != 0)
-                {
-                    emit error(tr("%1: Error mounting file system").arg(os_name));
-                    return false;
-                }
+    emit statusUpdate(status);
+    qDebug() << "Extracting to" << mountpoint;
 
-                if (tarball.startsWith("http"))
-                    emit statusUpdate(tr("%1: Downloading and extracting filesystem %2").arg(os_name, tarball));
-                else
-                    emit statusUpdate(tr("%1: Extracting filesystem %2").arg(os_name, tarball));
+    TarExtractor tar(mountpoint);
+    bool result = untar(p, tar, step.memory());
 
-                bool result = untar(tarball);
+    if (!MountManager::umount(mountpoint))
+    {
+        reportError(tr("%1: Error unmounting file system").arg(os_name));
+        return false;
+    }
 
-                if (QProcess::execute("umount /mnt2") !=0)
-                {
-                    emit error(tr("%1: Error unmounting file system").arg(os_name));
-                    return false;
-                }
+    return result;
+}
 
-                if (!result)
-                    return false;
-            }
-        }
+/* Assemble the boot partition in memory, together with the os_config.json and
+ * config.txt additions configureImage() would otherwise make, and write it in one pass */
+bool MultiImageWriteThread::buildBootPartition(const InstallStep &step)
+{
+    const PlannedPartition &p = step.partition();
+    QString os_name = (step.image().folder.split("/")).at(3);
+
+    qDebug() << "Assembling" << p.device << "in memory";
+
+    /* Half of the memory of the step holds the file system, the other half downloads and decompresses it */
+    FatBuilder builder(p.label, p.size, p.start, step.memory() / 2);
+    if (!untar(p, builder, step.memory() / 2))
+        return false;
+
+    if (!builder.addFile("os_config.json", Json::serialize(osConfig(step.image())))
+            || !builder.addFile("config.txt", configTxtAdditions(), true))
+    {
+        reportError(tr("%1: Error creating os_config.json").arg(os_name)+"\n"+builder.errorString());
+        return false;
+    }
 
-        vpartitions.append(partdevice);
-        _part++;
+    if (builder.exists("partition_setup.sh"))
+    {
+        QMutexLocker lock(&_mutex);
+        _bootSetupScripts.insert(p.device);
     }
 
-    QString firstPartition = vpartitions.at(0).toString();
-    emit statusUpdate(tr("%1: Mounting FAT partition %2").arg(os_name, firstPartition));
-    if (QProcess::execute("mount "+firstPartition+" /mnt2") != 0)
+    emit statusUpdate(tr("%1: Writing FAT partition %2").arg(os_name, QString(p.device)));
+
+    QSettings settings("/settings/noobs.conf", QSettings::IniFormat);
+    int queueDepth = settings.value("write_queue_depth", BLOCKWRITER_DEFAULT_QUEUE_DEPTH).toInt();
+    int chunkSize  = settings.value("write_chunk_size", BLOCKWRITER_DEFAULT_CHUNK_SIZE/1024).toInt() * 1024;
+
+    if (!builder.writeTo(p.device, queueDepth, chunkSize, _verifiers.value(p.device)))
     {
-        emit error(tr("%1: Error mounting file system %2").arg(os_name, firstPartition));
+        reportError(tr("%1: Error writing FAT partition %2").arg(os_name, QString(p.device))+"\n"+builder.errorString());
         return false;
     }
 
-    emit statusUpdate(tr("%1: Creating os_config.json").arg(os_name));
+    return true;
+}
 
-    QString description = getDescription(folder, flavour);
+/* Contents of os_config.json */
+QVariantMap MultiImageWriteThread::osConfig(const PlannedImage &image)
+{
     QSettings settings("/settings/noobs.conf", QSettings::IniFormat);
-    int videomode = settings.value("display_mode", 0).toInt();
-    QString language = settings.value("language", "en").toString();
-    QString keyboard = settings.value("keyboard_layout", "gb").toString();
+    QVariantMap vos = Json::loadFromFile(image.folder+"/os.json", QStringList() << "release_date");
+    QVariantList vpartitions;
 
-    QVariantMap vos = Json::loadFromFile(folder+"/os.json").toMap();
-    QVariant releasedate = vos.value("release_date");
+    foreach (const PlannedPartition &p, image.partitions)
+        vpartitions.append(p.device);
 
     QVariantMap qm;
-    qm.insert("flavour", flavour);
-    qm.insert("release_date", releasedate);
-    qm.insert("imagefolder", folder);
-    qm.insert("description", description);
-    qm.insert("videomode", videomode);
+    qm.insert("flavour", image.flavour);
+    qm.insert("release_date", vos.value("release_date"));
+    qm.insert("imagefolder", image.folder);
+    qm.insert("description", getDescription(image.folder, image.flavour));
+    qm.insert("videomode", settings.value("display_mode", 0).toInt());
     qm.insert("partitions", vpartitions);
-    qm.insert("language", language);
-    qm.insert("keyboard", keyboard);
+    qm.insert("language", settings.value("language", "en").toString());
+    qm.insert("keyboard", settings.value("keyboard_layout", "gb").toString());
+
+    return qm;
+}
+
+bool MultiImageWriteThread::waitForMetaFiles(const QString &folder, const QString &os_name)
+{
+    QMutexLocker lock(&_mutex);
+
+    if (_pendingMetaFiles.contains(folder))
+    {
+        emit statusUpdate(tr("%1: Waiting for the download of the OS meta files").arg(os_name));
+        while (_pendingMetaFiles.contains(folder))
+            _metaFilesDownloaded.wait(&_mutex);
+    }
+
+    if (_metaFileErrors.contains(folder))
+    {
+        QString error = _metaFileErrors.value(folder);
+        lock.unlock();
+        reportError(tr("Error downloading meta file")+"\n"+error);
+        return false;
+    }
+
+    return true;
+}
+
+/* Write os_config.json and config.txt, run the partition setup script and register the OS */
+bool MultiImageWriteThread::configureImage(const InstallStep &step)
+{
+    const QString &folder = step.image().folder, &flavour = step.image().flavour;
+    QString os_name = (folder.split("/")).at(3);
 
-    Json::saveToFile("/mnt2/os_config.json", qm);
+    if (!waitForMetaFiles(folder, os_name))
+        return false;
 
-    emit statusUpdate(tr("%1: Saving display mode to config.txt").arg(os_name));
-    patchConfigTxt();
+    qDebug() << "Configuring OS:" << os_name;
+
+    QVariantList vpartitions;
+    foreach (const PlannedPartition &p, step.image().partitions)
+    {
+        /* Pick up the label of the new file system */
+        _probe.invalidate(p.device);
+        vpartitions.append(p.device);
+    }
+
+    QVariantMap vos = Json::loadFromFile(folder+"/os.json", QStringList() << "release_date" << "bootable");
+    QVariant releasedate = vos.value("release_date");
+    QString description = getDescription(folder, flavour);
+
+    /* A boot partition assembled in memory has os_config.json and config.txt already,
+     * it is only mounted if there is a setup script, which expects it to be */
+    const PlannedPartition &boot = step.image().partitions.first();
+    bool mount = !boot.inMemory || QFile::exists(folder+"/partition_setup.sh");
+    if (!mount)
+    {
+        QMutexLocker lock(&_mutex);
+        mount = _bootSetupScripts.contains(boot.device);
+    }
+
+    QString firstPartition = vpartitions.at(0).toString();
+    if (mount)
+    {
+        emit statusUpdate(tr("%1: Mounting FAT partition %2").arg(os_name, firstPartition));
+        if (!MountManager::mount(firstPartition, "/mnt2"))
+        {
+            reportError(tr("%1: Error mounting file system %2").arg(os_name, firstPartition));
+            return false;
+        }
+    }
+
+    if (!boot.inMemory)
+    {
+        emit statusUpdate(tr("%1: Creating os_config.json").arg(os_name));
+        Json::saveToFile("/mnt2/os_config.json", osConfig(step.image()));
+
+        emit statusUpdate(tr("%1: Saving display mode to config.txt").arg(os_name));
+        patchConfigTxt();
+    }
 
     /* Partition setup script can either reside in the image folder
      * or inside the boot partition tarball */
@@ -431,8 +703,8 @@ bool MultiImageWriteThread::processImage(const QString &folder, const QString &f
         {
             QString part  = vpartitions.at(i).toString();
             QString nr    = QString::number(pcount);
-            QString uuid  = getUUID(part);
-            QString label = getLabel(part);
+            QString uuid  = _probe.uuid(part);
+            QString label = _probe.label(part);
             QString id;
             if (!label.isEmpty())
                 id = "LABEL="+label;
@@ -457,15 +729,33 @@ bool MultiImageWriteThread::processImage(const QString &folder, const QString &f
 
         if (proc.exitCode() != 0)
         {
-            emit error(tr("%1: Error executing partition setup script").arg(os_name)+"\n"+proc.readAll());
+            reportError(tr("%1: Error executing partition setup script").arg(os_name)+"\n"+proc.readAll());
             return false;
         }
+
+        /* The script may have relabeled file systems */
+        foreach (QVariant pv, vpartitions)
+            _probe.invalidate(pv.toString());
     }
 
-    emit statusUpdate(tr("%1: Unmounting FAT partition").arg(os_name));
-    if (QProcess::execute("umount /mnt2") != 0)
+    if (mount)
     {
-        emit error(tr("%1: Error unmounting").arg(os_name));
+        emit statusUpdate(tr("%1: Unmounting FAT partition").arg(os_name));
+        if (!MountManager::umount("/mnt2"))
+        {
+            reportError(tr("%1: Error unmounting").arg(os_name));
+        }
+    }
+
+    /* Flush what mkfs and the setup script wrote to the partitions that are not mounted.
+     * Raw images have already been synced by RawImageWriter */
+    foreach (QVariant pv, vpartitions)
+    {
+        if (!flushDevice(pv.toString()))
+        {
+            reportError(tr("%1: Error syncing partition %2").arg(os_name, pv.toString()));
+            return false;
+        }
     }
 
     /* Save information about installed operating systems in installed_os.json */
@@ -483,186 +773,31 @@ bool MultiImageWriteThread::processImage(const QString &folder, const QString &f
         ventry["icon"] = iconfilename;
     else if (QFile::exists(folder+"/icon.png"))
         ventry["icon"] = folder+"/icon.png";
-    installed_os.append(ventry);
-
-    QProcess::execute("mount -o remount,rw /settings");
-    Json::saveToFile("/settings/installed_os.json", installed_os);
-    QProcess::execute("mount -o remount,ro /settings");
+    _installed.append(_catalog->record(ventry, OsRecord::InstalledOs));
+    _catalog->setInstalled(_installed);
 
-    return true;
-}
-
-bool MultiImageWriteThread::reduceExtendedPartition(int size)
-{
-    int startOfExtended = getFileContents("/sys/class/block/mmcblk0p4/start").trimmed().toULongLong();
-    int sizeOfExtended = sizeofSDCardInBlocks() - startOfExtended;
-
-    if (size + SETTINGS_PARTITION_SIZE + EBR_PARTITION_OFFSET> sizeOfExtended)
+    SettingsWriteLocker lock;
+    if (!lock.isWritable())
     {
-        emit error(tr("Error reallocating extended partition - partition too large"));
+        reportError(tr("Error remounting settings partition read-write, the installed OS cannot be recorded"));
         return false;
     }
-
-    /* Let sfdisk update the extended partition */
-    if (!sfdisk(2, startOfExtended, sizeOfExtended - size, "X"))
-        return false;
+    _catalog->saveInstalled();
 
     return true;
 }
 
-bool MultiImageWriteThread::sfdisk(int part, int start, int size, const QByteArray &type)
+/* Write out the cached blocks of a single device, instead of a global sync() */
+bool MultiImageWriteThread::flushDevice(const QString &device)
 {
-    /* Unmount everything before modifying partition table */
-    QProcess::execute("umount -r /mnt");
-    QProcess::execute("umount -r /settings");
-
-    QString cmd = QString("/sbin/sfdisk -uS /dev/mmcblk0 -N") + QString::number(part);
-    QByteArray partition = QByteArray::number(start)+","+QByteArray::number(size)+","+type+"\n";                                       
-    
-    QProcess proc;
-    proc.setProcessChannelMode(proc.MergedChannels);
-    proc.start(cmd);
-    proc.write(partition);
-    proc.closeWriteChannel();
-    proc.waitForFinished(-1);
-    if (proc.exitCode() != 0)
-    {
-        emit error(tr("Error creating partition %1").arg(QString::number(part))+"\n"+proc.readAll());
+    int fd = ::open(QFile::encodeName(device).constData(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
         return false;
-    }
-    qDebug() << "sfdisk done, output:" << proc.readAll();
-    
-    QProcess::execute("/usr/sbin/partprobe");
-    QThread::msleep(500);
-
-    /* Remount */
-    QProcess::execute("mount -o ro -t vfat /dev/mmcblk0p1 /mnt");
-    QProcess::execute("mount -o ro -t ext4 " SETTINGS_PARTITION " /settings");
-
-    return true;
-}
-
-void MultiImageWriteThread::clearEBR()
-{
-    /* Unmount everything before modifying partition table */
-    QProcess::execute("umount -r /mnt");
-    QProcess::execute("umount -r /settings");
-
-    mbr_table ebr;
-    int startOfExtended = getFileContents("/sys/class/block/mmcblk0p4/start").trimmed().toULongLong();
-
-    /* Write out extended partition table with single settings partition */
-    memset(&ebr, 0, sizeof ebr);
-    ebr.part[0].starting_sector = EBR_PARTITION_OFFSET;
-    ebr.part[0].nr_of_sectors = SETTINGS_PARTITION_SIZE;
-    ebr.part[0].id = 0x83;
-    ebr.signature[0] = 0x55;
-    ebr.signature[1] = 0xAA;
-    QFile f("/dev/mmcblk0");
-    f.open(f.ReadWrite);
-    f.seek(qint64(startOfExtended)*512);
-    f.write((char *) &ebr, sizeof(ebr));
-    // Tell Linux to re-read the partition table
-    f.flush();
-    ioctl(f.handle(), BLKRRPART);
-    f.close();
-    QThread::msleep(500);
-
-    /* Remount */
-    QProcess::execute("mount -o ro -t vfat /dev/mmcblk0p1 /mnt");
-    QProcess::execute("mount -t ext4 " SETTINGS_PARTITION " /settings");
-}
-
-bool MultiImageWriteThread::addPartitionEntry(int sizeInSectors, int type, int specialOffset)
-{
-    /* Unmount everything before modifying partition table */
-    QProcess::execute("umount -r /mnt");
-    QProcess::execute("umount -r /settings");
-
-    unsigned int startOfExtended = getFileContents("/sys/class/block/mmcblk0p4/start").trimmed().toULongLong();
-    unsigned int offsetInSectors = 0;
-    mbr_table ebr;
-    QFile f("/dev/mmcblk0");
-    if (!f.open(f.ReadWrite))
-    {
-        emit error(tr("Error opening /dev/mmcblk0 for writing"));
-        return false;
-    }
-
-    /* Find last EBR */
-    do
-    {
-        f.seek(qint64(startOfExtended+offsetInSectors)*512);
-        f.read((char *) &ebr, sizeof(ebr));
-
-        if (ebr.part[1].starting_sector)
-        {
-            if (ebr.part[1].starting_sector > offsetInSectors)
-            {
-                offsetInSectors = ebr.part[1].starting_sector;
-            }
-            else
-            {
-                emit error(tr("Internal error in partitioning"));
-                return false;
-            }
-        }
-    } while (ebr.part[1].starting_sector != 0);
-
-    if (ebr.part[0].starting_sector)
-    {
-        /* Add reference to new EBR to old last EBR */
-        ebr.part[1].starting_sector = offsetInSectors + ebr.part[0].starting_sector + ebr.part[0].nr_of_sectors;
-        ebr.part[1].nr_of_sectors = sizeInSectors + EBR_PARTITION_OFFSET;
-        ebr.part[1].id = 0x0F;
-
-        if (specialOffset)
-        {
-            if (ebr.part[1].starting_sector > specialOffset)
-            {
-                emit error(tr("Internal error in RiscOS partitioning"));
-                return false;
-            }
-            ebr.part[1].starting_sector = specialOffset;
-        }
-
-        f.seek(qint64(startOfExtended+offsetInSectors)*512);
-        f.write((char *) &ebr, sizeof(ebr));
-        offsetInSectors = ebr.part[1].starting_sector;
-        qDebug() << "add tail";
-    }
-
-    memset(&ebr, 0, sizeof ebr);
-    ebr.signature[0] = 0x55;
-    ebr.signature[1] = 0xAA;
-
-    if (specialOffset)
-    {
-        ebr.part[0].starting_sector = EBR_PARTITION_OFFSET + specialOffset - offsetInSectors;
-    }
-    else
-    {
-        ebr.part[0].starting_sector = ((((startOfExtended + offsetInSectors + EBR_PARTITION_OFFSET) + 6144) / 8192) * 8192) - (startOfExtended + offsetInSectors);
-    }
-
-    ebr.part[0].nr_of_sectors = sizeInSectors;
-    ebr.part[0].id = type;
-    f.seek(qint64(startOfExtended+offsetInSectors)*512);
-    f.write((char *) &ebr, sizeof(ebr));
-    f.flush();
-    /* Tell Linux to re-read the partition table */
-    ioctl(f.handle(), BLKRRPART);
-    f.close();
-
-    /* Call partprobe just in case. BLKRRPART should be enough though */
-    QProcess::execute("/usr/sbin/partprobe");
-    QThread::msleep(500);
 
-    /* Remount */
-    QProcess::execute("mount -o ro -t vfat /dev/mmcblk0p1 /mnt");
-    QProcess::execute("mount -t ext4 " SETTINGS_PARTITION " /settings");
+    bool ok = (::fsync(fd) == 0);
+    ::close(fd);
 
-    return true;
+    return ok;
 }
 
 bool MultiImageWriteThread::mkfs(const QByteArray &device, const QByteArray &fstype, const QByteArray &label, const QByteArray &mkfsopt)
@@ -700,203 +835,194 @@ bool MultiImageWriteThread::mkfs(const QByteArray &device, const QByteArray &fst
 
     if (p.exitCode() != 0)
     {
-        emit error(tr("Error creating file system")+"\n"+p.readAll());
+        reportError(tr("Error creating file system")+"\n"+p.readAll());
         return false;
     }
 
     return true;
 }
 
-bool MultiImageWriteThread::isLabelAvailable(const QByteArray &label)
+/* Read back what was written to the partition, before configuring the OS changes it */
+bool MultiImageWriteThread::verifyPartition(const InstallStep &step)
 {
-    return (QProcess::execute("/sbin/findfs LABEL="+label) != 0);
+    const PlannedPartition &p = step.partition();
+    QString os_name = (step.image().folder.split("/")).at(3);
+    WriteVerifier *verifier = _verifiers.value(p.device);
+
+    /* Written by the kernel */
+    if (!verifier->recordedBytes())
+        return true;
+
+    emit statusUpdate(tr("%1: Verifying partition %2").arg(os_name, QString(p.device)));
+    if (!verifier->verify(p.device))
+    {
+        reportError(tr("%1: The data read back from the SD card differs from what was written. The card may be faulty or counterfeit.").arg(os_name)
+                    +"\n"+verifier->errorString());
+        return false;
+    }
+
+    return true;
 }
 
-bool MultiImageWriteThread::untar(const QString &tarball)
+bool MultiImageWriteThread::isLabelAvailable(const QByteArray &label, const QSet<QString> &formatted)
 {
-    QString cmd = "sh -o pipefail -c \"";
+    return !_probe.isLabelInUse(label, formatted);
+}
 
-    if (tarball.startsWith("http:"))
-        cmd += "wget --no-verbose --tries=inf -O- "+tarball+" | ";
+bool MultiImageWriteThread::untar(const PlannedPartition &p, TarExtractor &tar, qint64 memoryLimit)
+{
+    const QString &tarball = p.source;
 
-    if (tarball.endsWith(".gz"))
-    {
-        cmd += "gzip -dc";
-    }
-    else if (tarball.endsWith(".xz"))
+    if (!Decompressor::isSupported(tarball))
     {
-        cmd += "xz -dc";
-    }
-    else if (tarball.endsWith(".bz2"))
-    {
-        cmd += "bzip2 -dc";
-    }
-    else if (tarball.endsWith(".lzo"))
-    {
-        cmd += "lzop -dc";
-    }
-    else if (tarball.endsWith(".zip"))
-    {
-        /* Note: the image must be the only file inside the .zip */
-        cmd += "unzip -p";
-    }
-    else
-    {
-        emit error(tr("Unknown compression format file extension. Expecting .lzo, .gz, .xz, .bz2 or .zip\n%1").arg(tarball));
+        reportError(tr("Unknown compression format file extension. Expecting .lzo, .gz, .xz, .bz2, .zip, .zst or .lz4\n%1").arg(tarball));
         return false;
     }
-    if (!tarball.startsWith("http:"))
-    {
-
-        cmd += " "+tarball;
-    }
-    cmd += " | tar x -C /mnt2 ";
-    cmd += "\"";
 
     QTime t1;
     t1.start();
-    qDebug() << "Executing:" << cmd;
+    qDebug() << "Extracting" << tarball;
 
-    QProcess p;
-    p.setProcessChannelMode(p.MergedChannels);
-    p.start(cmd);
-    p.closeWriteChannel();
-    p.waitForFinished(-1);
+    QSettings settings("/settings/noobs.conf", QSettings::IniFormat);
+    ImagePipeline pipeline(tarball, _cache, _chunkIndexes.value(p.device), memoryLimit);
+    pipeline.setChecksums(p.checksums);
+    pipeline.setConnections(settings.value("download_connections", DOWNLOAD_DEFAULT_CONNECTIONS).toInt());
+    pipeline.start();
+
+    bool result = tar.extract(pipeline.output());
+    QString msg = tar.errorString();
+    if (!result)
+        pipeline.abort();
+
+    /* If downloading or decompressing failed, that error is more informative */
+    if (!pipeline.finish())
+    {
+        result = false;
+        msg = pipeline.errorString();
+    }
 
-    if (p.exitCode() != 0)
+    if (!result)
     {
-        QByteArray msg = p.readAll();
         qDebug() << msg;
-        emit error(tr("Error downloading or extracting tarball")+"\n"+msg);
+        reportError(tr("Error downloading or extracting tarball")+"\n"+msg);
         return false;
     }
-    qDebug() << "finished writing filesystem in" << (t1.elapsed()/1000.0) << "seconds";
+
+    qDebug() << "finished writing filesystem in" << (t1.elapsed()/1000.0) << "seconds."
+             << tar.entriesExtracted() << "entries," << pipeline.compressedBytes() << "bytes compressed,"
+             << tar.bytesProcessed() << "bytes uncompressed";
 
     return true;
 }
 
-bool MultiImageWriteThread::dd(const QString &imagePath, const QString &device)
+bool MultiImageWriteThread::dd(const PlannedPartition &p, qint64 memoryLimit)
 {
-    QString cmd = "sh -o pipefail -c \"";
-
-    if (imagePath.startsWith("http:"))
-        cmd += "wget --no-verbose --tries=inf -O- "+imagePath+" | ";
+    const QString &imagePath = p.source;
+    QString device = p.device;
 
-    if (imagePath.endsWith(".gz"))
+    if (!Decompressor::isSupported(imagePath))
     {
-        cmd += "gzip -dc";
-    }
-    else if (imagePath.endsWith(".xz"))
-    {
-        cmd += "xz -dc";
-    }
-    else if (imagePath.endsWith(".bz2"))
-    {
-        cmd += "bzip2 -dc";
-    }
-    else if (imagePath.endsWith(".lzo"))
-    {
-        cmd += "lzop -dc";
-    }
-    else if (imagePath.endsWith(".zip"))
-    {
-        /* Note: the image must be the only file inside the .zip */
-        cmd += "unzip -p";
-    }
-    else
-    {
-        emit error(tr("Unknown compression format file extension. Expecting .lzo, .gz, .xz, .bz2 or .zip\n%1 %2").arg(imagePath,device));
+        reportError(tr("Unknown compression format file extension. Expecting .lzo, .gz, .xz, .bz2, .zip, .zst or .lz4\n%1 %2").arg(imagePath,device));
         return false;
     }
 
-    if (!imagePath.startsWith("http:"))
-        cmd += " "+imagePath;
-
-    cmd += " | dd of="+device+" conv=fsync obs=4M\"";
-
     QTime t1;
     t1.start();
-    qDebug() << "Executing:" << cmd;
+    qDebug() << "Writing" << imagePath << "to" << device;
 
-    QProcess p;
-    p.setProcessChannelMode(p.MergedChannels);
-    p.start(cmd);
-    p.closeWriteChannel();
-    p.waitForFinished(-1);
+    /* Number of asynchronous writes in flight and their size can be tuned for slow or fast cards */
+    QSettings settings("/settings/noobs.conf", QSettings::IniFormat);
+    int queueDepth = settings.value("write_queue_depth", BLOCKWRITER_DEFAULT_QUEUE_DEPTH).toInt();
+    int chunkSize  = settings.value("write_chunk_size", BLOCKWRITER_DEFAULT_CHUNK_SIZE/1024).toInt() * 1024;
 
-    if (p.exitCode() != 0)
+    RawImageWriter out(queueDepth, chunkSize);
+    if (!out.open(device))
     {
-        emit error(tr("Error downloading or writing OS to SD card")+"\n"+p.readAll());
+        reportError(tr("Error downloading or writing OS to SD card")+"\n"+out.errorString());
         return false;
     }
-    qDebug() << "finished writing filesystem in" << (t1.elapsed()/1000.0) << "seconds";
-
-    return true;
-}
+    out.setVerifier(_verifiers.value(p.device));
 
-void MultiImageWriteThread::patchConfigTxt()
-{
+    ImagePipeline pipeline(imagePath, _cache, _chunkIndexes.value(p.device), memoryLimit);
+    pipeline.setChecksums(p.checksums);
+    pipeline.setConnections(settings.value("download_connections", DOWNLOAD_DEFAULT_CONNECTIONS).toInt());
+    pipeline.start();
 
-        QSettings settings("/settings/noobs.conf", QSettings::IniFormat);
-        int videomode = settings.value("display_mode", 0).toInt();
+    QIODevice *in = pipeline.output();
+    QByteArray buf(IMAGE_WRITE_BLOCK_SIZE, 0);
+    QString msg;
+    qint64 n;
 
-        QByteArray dispOptions;
-
-        switch (videomode)
+    while ((n = readFromDevice(in, buf.data(), buf.size())) > 0)
+    {
+        if (!out.write(buf.constData(), n))
         {
-        case 0: /* HDMI PREFERRED */
-            dispOptions = "hdmi_force_hotplug=1\r\nconfig_hdmi_boost=4\r\noverscan_left=24\r\noverscan_right=24\r\noverscan_top=16\r\noverscan_bottom=16\r\ndisable_overscan=0\r\n";
-            break;
-        case 1: /* HDMI VGA */
-            dispOptions = "hdmi_ignore_edid=0xa5000080\r\nhdmi_force_hotplug=1\r\nconfig_hdmi_boost=4\r\nhdmi_group=2\r\nhdmi_mode=4\r\n";
-            break;
-        case 2: /* PAL */
-            dispOptions = "hdmi_ignore_hotplug=1\r\nsdtv_mode=2\r\n";
-            break;
-        case 3: /* NTSC */
-            dispOptions = "hdmi_ignore_hotplug=1\r\nsdtv_mode=0\r\n";
+            msg = out.errorString();
             break;
         }
+    }
+    if (n < 0)
+        msg = in->errorString();
+    if (!out.close() && msg.isEmpty())
+        msg = out.errorString();
 
+    if (!msg.isEmpty())
+        pipeline.abort();
+    if (!pipeline.finish())
+        msg = pipeline.errorString();
 
-        QFile f("/mnt2/config.txt");
-        f.open(f.Append);
-        f.write("\r\n# NOOBS Auto-generated Settings:\r\n"+dispOptions);
-        f.close();
+    if (!msg.isEmpty())
+    {
+        qDebug() << msg;
+        reportError(tr("Error downloading or writing OS to SD card")+"\n"+msg);
+        return false;
+    }
+    qDebug() << "finished writing filesystem in" << (t1.elapsed()/1000.0) << "seconds."
+             << out.bytesWritten() << "bytes written," << out.bytesSkipped() << "bytes of zero blocks skipped";
 
+    return true;
 }
 
-QByteArray MultiImageWriteThread::getLabel(const QString part)
+/* Display settings appended to config.txt */
+QByteArray MultiImageWriteThread::configTxtAdditions()
 {
-    QByteArray result;
-    QProcess p;
-    p.start("/sbin/blkid -s LABEL -o value "+part);
-    p.waitForFinished();
+    QSettings settings("/settings/noobs.conf", QSettings::IniFormat);
+    int videomode = settings.value("display_mode", 0).toInt();
 
-    if (p.exitCode() == 0)
-        result = p.readAll().trimmed();
+    QByteArray dispOptions;
 
-    return result;
+    switch (videomode)
+    {
+    case 0: /* HDMI PREFERRED */
+        dispOptions = "hdmi_force_hotplug=1\r\nconfig_hdmi_boost=4\r\noverscan_left=24\r\noverscan_right=24\r\noverscan_top=16\r\noverscan_bottom=16\r\ndisable_overscan=0\r\n";
+        break;
+    case 1: /* HDMI VGA */
+        dispOptions = "hdmi_ignore_edid=0xa5000080\r\nhdmi_force_hotplug=1\r\nconfig_hdmi_boost=4\r\nhdmi_group=2\r\nhdmi_mode=4\r\n";
+        break;
+    case 2: /* PAL */
+        dispOptions = "hdmi_ignore_hotplug=1\r\nsdtv_mode=2\r\n";
+        break;
+    case 3: /* NTSC */
+        dispOptions = "hdmi_ignore_hotplug=1\r\nsdtv_mode=0\r\n";
+        break;
+    }
+
+    return "\r\n# NOOBS Auto-generated Settings:\r\n"+dispOptions;
 }
 
-QByteArray MultiImageWriteThread::getUUID(const QString part)
+void MultiImageWriteThread::patchConfigTxt()
 {
-    QByteArray result;
-    QProcess p;
-    p.start("/sbin/blkid -s UUID -o value "+part);
-    p.waitForFinished();
-
-    if (p.exitCode() == 0)
-        result = p.readAll().trimmed();
-
-    return result;
+    QFile f("/mnt2/config.txt");
+    f.open(f.Append);
+    f.write(configTxtAdditions());
+    f.close();
 }
 
 QString MultiImageWriteThread::getDescription(const QString &folder, const QString &flavour)
 {
     if (QFile::exists(folder+"/flavours.json"))
     {
-        QVariantMap v = Json::loadFromFile(folder+"/flavours.json").toMap();
+        QVariantMap v = Json::loadFromFile(folder+"/flavours.json", QStringList() << "flavours");
         QVariantList fl = v.value("flavours").toList();
 
         foreach (QVariant f, fl)
@@ -910,7 +1036,7 @@ QString MultiImageWriteThread::getDescription(const QString &folder, const QStri
     }
     else if (QFile::exists(folder+"/os.json"))
     {
-        QVariantMap v = Json::loadFromFile(folder+"/os.json").toMap();
+        QVariantMap v = Json::loadFromFile(folder+"/os.json", QStringList() << "description");
         return v.value("description").toString();
     }
 
@@ -6,40 +6,106 @@
 #include <QStringList>
 #include <QMultiMap>
 #include <QVariantList>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QSet>
+#include <QHash>
+#include <QPair>
+#include "filesystemprober.h"
+#include "oscatalog.h"
+
+/* Size of the writes done when copying raw images to a partition */
+#define IMAGE_WRITE_BLOCK_SIZE  (4 * 1024 * 1024)
+
+/* Number of install steps (mkfs, extraction, writing raw images) that run at the same time */
+#define INSTALL_DEFAULT_WORKERS 2
+
+struct InstallPlan;
+struct PlannedImage;
+struct PlannedPartition;
+class InstallStep;
+class TarExtractor;
+class ChunkCache;
+class ChunkIndex;
+class ChunkSeeder;
+class WriteVerifier;
 
 class MultiImageWriteThread : public QThread
 {
     Q_OBJECT
 public:
-    explicit MultiImageWriteThread(QObject *parent = 0);
+    explicit MultiImageWriteThread(OsCatalog *catalog, QObject *parent = 0);
     void addImage(const QString &folder, const QString &flavour);
+    void setDryRun(bool dryRun);
+    /* Files of the image in folder that are only needed to configure it are still being downloaded.
+     * Its configuration waits for metaFilesDownloaded(), the rest of the install goes ahead */
+    void setMetaFilesPending(const QString &folder);
+    /* Called from the GUI thread, error is empty if all downloads succeeded */
+    void metaFilesDownloaded(const QString &folder, const QString &error);
 
 protected:
     virtual void run();
-    void clearEBR();
-    bool processImage(const QString &folder, const QString &flavour);
-    bool reduceExtendedPartition(int sizeInSectors);
-    bool addPartitionEntry(int sizeInSectors, int type, int specialOffset = 0);
-    bool sfdisk(int part, int start, int size, const QByteArray &type);
+    void assignLabels(InstallPlan &plan);
+    bool writePartitionTable(const InstallStep &step);
+    void openCache(const QByteArray &device);
+    void closeCache();
+    void findSeedPartitions(const InstallPlan &plan);
+    bool prepareDelta(const InstallStep &step);
+    bool formatPartition(const InstallStep &step);
+    bool extractPartition(const InstallStep &step);
+    bool buildBootPartition(const InstallStep &step);
+    bool verifyPartition(const InstallStep &step);
+    bool configureImage(const InstallStep &step);
+    bool waitForMetaFiles(const QString &folder, const QString &os_name);
+    void reportError(const QString &msg);
+    void beginMkfs();
+    void endMkfs();
     bool mkfs(const QByteArray &device, const QByteArray &fstype = "ext4", const QByteArray &label = "", const QByteArray &mkfsopt = "");
-    bool dd(const QString &imagePath, const QString &device);
-    bool untar(const QString &tarball);
-    bool isLabelAvailable(const QByteArray &label);
-    QByteArray getLabel(const QString part);
-    QByteArray getUUID(const QString part);
+    bool dd(const PlannedPartition &p, qint64 memoryLimit);
+    bool flushDevice(const QString &device);
+    bool untar(const PlannedPartition &p, TarExtractor &tar, qint64 memoryLimit);
+    bool isLabelAvailable(const QByteArray &label, const QSet<QString> &formatted);
+    QVariantMap osConfig(const PlannedImage &image);
+    QByteArray configTxtAdditions();
     void patchConfigTxt();
     QString getDescription(const QString &folder, const QString &flavour);
 
     /* key: folder, value: flavour */
     QMultiMap<QString,QString> _images;
-    int _extraSpacePerPartition, _sectorOffset, _part;
-    QVariantList installed_os;
+    bool _dryRun;
+    /* Protects _failed, _bootSetupScripts and the meta file downloads, which are shared by the install steps */
+    QMutex _mutex;
+    bool _failed;
+    /* Protects _mkfsRunning. runningMKFS() and finishedMKFS() block until the GUI thread handles them,
+     * so they are emitted under this lock, which the GUI thread never takes, instead of _mutex */
+    QMutex _mkfsMutex;
+    int _mkfsRunning;
+    /* Boot partitions built in memory that have a partition_setup.sh */
+    QSet<QByteArray> _bootSetupScripts;
+    /* Images whose meta files are still being downloaded, and the errors of those that failed */
+    QSet<QString> _pendingMetaFiles;
+    QHash<QString,QString> _metaFileErrors;
+    QWaitCondition _metaFilesDownloaded;
+    /* Download cache, NULL if there is no cache partition */
+    ChunkCache *_cache;
+    /* Delta downloads. key: device of the new partition */
+    QHash<QByteArray,ChunkIndex *> _chunkIndexes;
+    ChunkSeeder *_seeder;
+    /* Start and size in sectors of the partition the new one replaces, recorded before the partition table changes */
+    QHash<QByteArray,QPair<qint64,qint64> > _seedPartitions;
+    /* Read-back verification. key: device of the partition */
+    QHash<QByteArray,WriteVerifier *> _verifiers;
+    OsCatalog *_catalog;
+    /* OSes written so far, the installed layer of the catalog once the install is done */
+    QList<OsRecord> _installed;
+    FilesystemProber _probe;
     
 signals:
     void error(const QString &msg);
     void statusUpdate(const QString &msg);
     void parsedImagesize(qint64 size);
     void completed();
+    void dryRunCompleted(const QString &plan);
     void runningMKFS();
     void finishedMKFS();
 
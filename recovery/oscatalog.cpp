@@ -0,0 +1,347 @@
+#include "oscatalog.h"
+#include "config.h"
+#include "json.h"
+#include "util.h"
+#include <QFile>
+#include <QMutexLocker>
+#include <QDebug>
+
+/* Catalog of the OSes that can be installed or booted
+ *
+ * Maintained by Raspberry Pi
+ *
+ * See LICENSE.txt for license details
+ *
+ */
+
+OsRecord::OsRecord()
+    : source(Sdcard), flags(0), nominalSize(0)
+{
+}
+
+bool OsRecord::is(Flag f) const
+{
+    return flags & f;
+}
+
+bool OsRecord::isLocal() const
+{
+    return !folder.isEmpty();
+}
+
+bool OsRecord::operator==(const OsRecord &other) const
+{
+    return name == other.name && description == other.description && folder == other.folder
+        && icon == other.icon && releaseDate == other.releaseDate && source == other.source
+        && flags == other.flags && nominalSize == other.nominalSize && partitions == other.partitions
+        && osInfo == other.osInfo && partitionsInfo == other.partitionsInfo
+        && marketingInfo == other.marketingInfo && partitionSetup == other.partitionSetup
+        && tarballs == other.tarballs;
+}
+
+OsCatalog::Entry::Entry()
+    : present(0)
+{
+}
+
+OsCatalog::OsCatalog(QObject *parent)
+    : QObject(parent)
+{
+}
+
+/* Strings are shared with the records that have the same value. Caller holds the mutex */
+QString OsCatalog::intern(const QString &s)
+{
+    if (s.isEmpty())
+        return QString();
+
+    QSet<QString>::const_iterator it = _strings.constFind(s);
+    if (it != _strings.constEnd())
+        return *it;
+
+    _strings.insert(s);
+    return s;
+}
+
+OsRecord OsCatalog::record(const QVariantMap &m, OsRecord::Source source)
+{
+    QMutexLocker lock(&_mutex);
+    OsRecord r;
+
+    r.source      = source;
+    r.name        = intern(m.value("name").toString());
+    r.description = intern(m.value("description").toString());
+    r.folder      = intern(m.value("folder").toString());
+    r.releaseDate = intern(m.value("release_date").toString());
+    r.nominalSize = m.value("nominal_size").toInt();
+
+    /* Icons of local OSes are files, relative to the folder, or named after the flavour */
+    QString icon = m.value("icon").toString();
+    if (source != OsRecord::Network && !r.folder.isEmpty())
+    {
+        if (!icon.isEmpty() && !icon.contains('/'))
+            icon = r.folder+"/"+icon;
+        if (!QFile::exists(icon))
+        {
+            icon = r.folder+"/"+r.name+".png";
+            icon.replace(' ', '_');
+        }
+    }
+    r.icon = intern(icon);
+
+    if (source == OsRecord::Network)
+    {
+        r.osInfo         = m.value("os_info").toString();
+        r.partitionsInfo = m.value("partitions_info").toString();
+        r.marketingInfo  = m.value("marketing_info").toString();
+        r.partitionSetup = m.value("partition_setup").toString();
+        r.tarballs       = m.value("tarballs").toStringList();
+    }
+    else
+    {
+        r.partitions     = m.value("partitions").toStringList();
+    }
+
+    if (m.value("bootable", true).toBool())
+        r.flags |= OsRecord::Bootable;
+    if (canBootOs(r.name, m))
+        r.flags |= OsRecord::CanBoot;
+    if (isSupportedOs(r.name, m))
+        r.flags |= OsRecord::Supported;
+    if (r.name == RECOMMENDED_IMAGE)
+        r.flags |= OsRecord::Recommended;
+    if (source == OsRecord::InstalledOs)
+        r.flags |= OsRecord::Installed;
+
+    return r;
+}
+
+QList<OsRecord> OsCatalog::parseOsList(const QVariant &json)
+{
+    QList<OsRecord> records;
+    const QVariantList list = json.toMap().value("os_list").toList();
+
+    foreach (const QVariant &osv, list)
+    {
+        QVariantMap os = osv.toMap();
+
+        QString basename = os.value("os_name").toString();
+        if (!canInstallOs(basename, os))
+            continue;
+
+        if (os.contains("flavours"))
+        {
+            /* Taken out, so the maps of the flavours do not carry all of them */
+            const QVariantList flavours = os.take("flavours").toList();
+
+            foreach (const QVariant &flv, flavours)
+            {
+                const QVariantMap flavour = flv.toMap();
+                QVariantMap item = os;
+
+                item.insert("name", flavour.value("name"));
+                item.insert("description", flavour.value("description"));
+                item.insert("icon", flavour.value("icon"));
+                item.insert("feature_level", flavour.value("feature_level"));
+                records.append(record(item, OsRecord::Network));
+            }
+        }
+        if (os.contains("description"))
+        {
+            os["name"] = basename;
+            records.append(record(os, OsRecord::Network));
+        }
+    }
+
+    return records;
+}
+
+QList<OsRecord> OsCatalog::loadInstalled(const QString &filename)
+{
+    QList<OsRecord> records;
+
+    if (!QFile::exists(filename))
+        return records;
+
+    foreach (const QVariant &v, Json::loadFromFile(filename).toList())
+        records.append(record(v.toMap(), OsRecord::InstalledOs));
+
+    return records;
+}
+
+void OsCatalog::saveInstalled(const QString &filename)
+{
+    QVariantList list;
+
+    foreach (const OsRecord &r, installed())
+    {
+        QVariantMap m;
+        m.insert("name", r.name);
+        m.insert("description", r.description);
+        m.insert("folder", r.folder);
+        m.insert("release_date", r.releaseDate);
+        m.insert("partitions", r.partitions);
+        if (!r.is(OsRecord::Bootable))
+            m.insert("bootable", false);
+        if (!r.icon.isEmpty() && QFile::exists(r.icon))
+            m.insert("icon", r.icon);
+        list.append(m);
+    }
+
+    Json::saveToFile(filename, list);
+}
+
+void OsCatalog::setSdcard(const QList<OsRecord> &records)
+{
+    setLayer(SdcardLayer, records);
+}
+
+void OsCatalog::setInstalled(const QList<OsRecord> &records)
+{
+    {
+        QMutexLocker lock(&_mutex);
+        _installed = records;
+    }
+    setLayer(InstalledLayer, records);
+}
+
+void OsCatalog::setNetwork(const QList<OsRecord> &records)
+{
+    setLayer(NetworkLayer, records);
+}
+
+void OsCatalog::setLayer(Layer layer, const QList<OsRecord> &records)
+{
+    QStringList addedNames, changedNames, removedNames;
+    quint32 bit = 1 << layer;
+
+    {
+        QMutexLocker lock(&_mutex);
+        QSet<QString> names;
+
+        foreach (const OsRecord &r, records)
+        {
+            names.insert(r.name);
+
+            QHash<QString,Entry>::iterator it = _entries.find(r.name);
+            bool isNew = (it == _entries.end());
+            if (isNew)
+                it = _entries.insert(r.name, Entry());
+
+            it.value().layers[layer] = r;
+            it.value().present |= bit;
+            if (merge(it.value()) || isNew)
+                (isNew ? addedNames : changedNames).append(r.name);
+        }
+
+        /* OSes this source no longer has */
+        QHash<QString,Entry>::iterator it = _entries.begin();
+        while (it != _entries.end())
+        {
+            Entry &e = it.value();
+            if (!(e.present & bit) || names.contains(it.key()))
+            {
+                ++it;
+                continue;
+            }
+
+            e.present &= ~bit;
+            e.layers[layer] = OsRecord();
+            if (!e.present)
+            {
+                removedNames.append(it.key());
+                it = _entries.erase(it);
+                continue;
+            }
+            if (merge(e))
+                changedNames.append(it.key());
+            ++it;
+        }
+    }
+
+    foreach (const QString &name, removedNames)
+        emit removed(name);
+    foreach (const QString &name, addedNames)
+        emit added(name);
+    foreach (const QString &name, changedNames)
+        emit changed(name);
+}
+
+/* The SD card version with the partitions of its install, or the installed one.
+ * The downloaded one if it is newer. Returns whether the merged record changed */
+bool OsCatalog::merge(Entry &e)
+{
+    OsRecord m;
+    bool local = e.present & ((1 << SdcardLayer) | (1 << InstalledLayer));
+
+    if (e.present & (1 << SdcardLayer))
+    {
+        m = e.layers[SdcardLayer];
+        if (e.present & (1 << InstalledLayer))
+        {
+            m.flags |= OsRecord::Installed;
+            m.partitions = e.layers[InstalledLayer].partitions;
+        }
+    }
+    else if (e.present & (1 << InstalledLayer))
+    {
+        m = e.layers[InstalledLayer];
+    }
+
+    if (e.present & (1 << NetworkLayer))
+    {
+        const OsRecord &n = e.layers[NetworkLayer];
+
+        if (!local)
+        {
+            m = n;
+        }
+        else if (m.source == OsRecord::InstalledOs || m.releaseDate < n.releaseDate)
+        {
+            OsRecord r = n;
+            r.flags |= m.flags & OsRecord::Installed;
+            r.partitions = m.partitions;
+            m = r;
+        }
+    }
+
+    if (m == e.merged)
+        return false;
+
+    e.merged = m;
+    return true;
+}
+
+bool OsCatalog::contains(const QString &name) const
+{
+    QMutexLocker lock(&_mutex);
+    return _entries.contains(name);
+}
+
+OsRecord OsCatalog::value(const QString &name) const
+{
+    QMutexLocker lock(&_mutex);
+
+    QHash<QString,Entry>::const_iterator it = _entries.constFind(name);
+    if (it == _entries.constEnd())
+        return OsRecord();
+
+    return it.value().merged;
+}
+
+QList<OsRecord> OsCatalog::values() const
+{
+    QMutexLocker lock(&_mutex);
+    QList<OsRecord> l;
+
+    for (QHash<QString,Entry>::const_iterator it = _entries.constBegin(); it != _entries.constEnd(); ++it)
+        l.append(it.value().merged);
+
+    return l;
+}
+
+QList<OsRecord> OsCatalog::installed() const
+{
+    QMutexLocker lock(&_mutex);
+    return _installed;
+}
@@ -0,0 +1,132 @@
+#ifndef OSCATALOG_H
+#define OSCATALOG_H
+
+/* Catalog of the OSes that can be installed or booted
+ *
+ * An OS is known from up to three sources: its folder on the SD card,
+ * installed_os.json on the settings partition, and the OS list
+ * downloaded. Each source is a layer of typed records, which the catalog
+ * merges into the record of the OS as it is listed: the SD card version
+ * with the partitions of its install, unless the downloaded list has a
+ * newer release. Replacing a layer only merges the OSes in it, and tells
+ * which OSes were added, changed or removed.
+ *
+ * Strings that repeat between layers are stored once. Whether an OS can
+ * boot and runs on this board is worked out when its record is made,
+ * rather than from the JSON every time it is asked.
+ *
+ * MainWindow, MultiImageWriteThread and BootSelectionDialog share a
+ * catalog, which is guarded by a mutex.
+ *
+ * Maintained by Raspberry Pi
+ *
+ * See LICENSE.txt for license details
+ *
+ */
+
+#include <QObject>
+#include <QString>
+#include <QStringList>
+#include <QHash>
+#include <QSet>
+#include <QList>
+#include <QMutex>
+#include <QVariant>
+
+#define INSTALLED_OS_FILE  "/settings/installed_os.json"
+
+struct OsRecord
+{
+    enum Source
+    {
+        Sdcard, InstalledOs, Network
+    };
+
+    enum Flag
+    {
+        /* bootable in os.json, true if it is not set */
+        Bootable    = 1,
+        /* Bootable and not a data partition, see canBootOs() */
+        CanBoot     = 2,
+        /* Runs on the revision of this board, see isSupportedOs() */
+        Supported   = 4,
+        Recommended = 8,
+        Installed   = 16
+    };
+
+    QString name, description, folder, icon, releaseDate;
+    Source source;
+    quint32 flags;
+    int nominalSize;
+    /* Devices of the partitions, if installed */
+    QStringList partitions;
+    /* Network only: URLs of the meta files, and of the tarball of each partition */
+    QString osInfo, partitionsInfo, marketingInfo, partitionSetup;
+    QStringList tarballs;
+
+    OsRecord();
+    bool is(Flag f) const;
+    /* Has a folder with its meta files, that do not need to be downloaded */
+    bool isLocal() const;
+    bool operator==(const OsRecord &other) const;
+};
+
+class OsCatalog : public QObject
+{
+    Q_OBJECT
+public:
+    explicit OsCatalog(QObject *parent = 0);
+
+    /* Record of an entry of os.json, flavours.json, installed_os.json or the OS list */
+    OsRecord record(const QVariantMap &m, OsRecord::Source source);
+    /* A record per flavour of the OSes in an OS list that can be installed */
+    QList<OsRecord> parseOsList(const QVariant &json);
+    /* Records of installed_os.json, empty if there is none */
+    QList<OsRecord> loadInstalled(const QString &filename = INSTALLED_OS_FILE);
+    /* Write the installed layer to installed_os.json */
+    void saveInstalled(const QString &filename = INSTALLED_OS_FILE);
+
+    /* Replace the records of a source. OSes it no longer has are dropped from the layer */
+    void setSdcard(const QList<OsRecord> &records);
+    void setInstalled(const QList<OsRecord> &records);
+    void setNetwork(const QList<OsRecord> &records);
+
+    bool contains(const QString &name) const;
+    /* Merged record, a default one if the name is unknown */
+    OsRecord value(const QString &name) const;
+    QList<OsRecord> values() const;
+    /* The installed layer, in the order of installed_os.json */
+    QList<OsRecord> installed() const;
+
+signals:
+    void added(const QString &name);
+    void changed(const QString &name);
+    void removed(const QString &name);
+
+protected:
+    enum Layer
+    {
+        SdcardLayer, InstalledLayer, NetworkLayer, LayerCount
+    };
+
+    struct Entry
+    {
+        OsRecord layers[LayerCount];
+        /* Bit per layer that has the OS */
+        quint32 present;
+        OsRecord merged;
+
+        Entry();
+    };
+
+    void setLayer(Layer layer, const QList<OsRecord> &records);
+    bool merge(Entry &e);
+    QString intern(const QString &s);
+
+    mutable QMutex _mutex;
+    QHash<QString,Entry> _entries;
+    QList<OsRecord> _installed;
+    QSet<QString> _strings;
+};
+
+#endif // OSCATALOG_H
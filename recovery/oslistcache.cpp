@@ -0,0 +1,68 @@
+#include "oslistcache.h"
+#include "json.h"
+#include "util.h"
+#include <QFile>
+#include <QDir>
+#include <QDebug>
+
+/* Last OS list downloaded, kept on the settings partition
+ *
+ * Maintained by Raspberry Pi
+ *
+ * See LICENSE.txt for license details
+ *
+ */
+
+OsListCache::OsListCache(const QString &dir)
+    : _dir(dir)
+{
+}
+
+/* URL and validators of the list saved, empty if the list was saved for another URL */
+QVariantMap OsListCache::info(const QString &url) const
+{
+    QVariantMap m = Json::loadFromFile(_dir+"/os_list_info.json").toMap();
+
+    if (m.value("url").toString() != url || !QFile::exists(_dir+"/os_list.json"))
+        return QVariantMap();
+    return m;
+}
+
+QVariant OsListCache::list(const QString &url) const
+{
+    if (info(url).isEmpty())
+        return QVariant();
+
+    return Json::loadFromFile(_dir+"/os_list.json");
+}
+
+QByteArray OsListCache::etag(const QString &url) const
+{
+    return info(url).value("etag").toByteArray();
+}
+
+QByteArray OsListCache::lastModified(const QString &url) const
+{
+    return info(url).value("last_modified").toByteArray();
+}
+
+/* The list goes first, so validators are never saved with a list they do not belong to */
+bool OsListCache::save(const QString &url, const QByteArray &data, const QByteArray &etag, const QByteArray &lastModified)
+{
+    QVariantMap m;
+    m.insert("url", url);
+    m.insert("etag", QString(etag));
+    m.insert("last_modified", QString(lastModified));
+
+    QDir dir;
+    QFile::remove(_dir+"/os_list_info.json");
+    if (!dir.mkpath(_dir)
+        || !writeFileAtomically(_dir+"/os_list.json", data)
+        || !writeFileAtomically(_dir+"/os_list_info.json", Json::serialize(m)))
+    {
+        qDebug() << "Error saving OS list to" << _dir;
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,43 @@
+#ifndef OSLISTCACHE_H
+#define OSLISTCACHE_H
+
+/* Last OS list downloaded, kept on the settings partition
+ *
+ * The list is shown straight away at the next boot, while the network
+ * is still coming up. It is saved as the server sent it, together with
+ * its ETag and Last-Modified, so the list can be revalidated with a
+ * conditional request, which costs a single round trip if it did not
+ * change. Its icons are kept in the IconStore.
+ *
+ * Maintained by Raspberry Pi
+ *
+ * See LICENSE.txt for license details
+ *
+ */
+
+#include <QString>
+#include <QByteArray>
+#include <QVariant>
+
+#define OS_LIST_CACHE_DIR  "/settings/os_list"
+
+class OsListCache
+{
+public:
+    explicit OsListCache(const QString &dir = OS_LIST_CACHE_DIR);
+
+    /* Parsed list saved last for url, null if there is none */
+    QVariant list(const QString &url) const;
+    /* Validators of the list saved for url, empty if there is none */
+    QByteArray etag(const QString &url) const;
+    QByteArray lastModified(const QString &url) const;
+    /* Replace the list with data, as downloaded from url */
+    bool save(const QString &url, const QByteArray &data, const QByteArray &etag, const QByteArray &lastModified);
+
+protected:
+    QVariantMap info(const QString &url) const;
+
+    QString _dir;
+};
+
+#endif // OSLISTCACHE_H
@@ -0,0 +1,251 @@
+#include "oslistmodel.h"
+#include "iconstore.h"
+#include "twoiconsdelegate.h"
+#include "config.h"
+#include <QCoreApplication>
+#include <QColor>
+#include <QMap>
+
+/* Model of the OS list of the main window
+ *
+ * Maintained by Raspberry Pi
+ *
+ * See LICENSE.txt for license details
+ *
+ */
+
+OsListModel::OsListModel(OsCatalog *catalog, IconStore *icons, QObject *parent)
+    : QAbstractListModel(parent), _catalog(catalog), _icons(icons),
+      _localIcon(":/icons/hdd.png"), _internetIcon(":/icons/download.png")
+{
+    connect(_catalog, SIGNAL(added(QString)), this, SLOT(osAdded(QString)));
+    connect(_catalog, SIGNAL(changed(QString)), this, SLOT(osChanged(QString)));
+    connect(_catalog, SIGNAL(removed(QString)), this, SLOT(osRemoved(QString)));
+}
+
+int OsListModel::rowCount(const QModelIndex &parent) const
+{
+    return parent.isValid() ? 0 : _rows.size();
+}
+
+QVariant OsListModel::data(const QModelIndex &index, int role) const
+{
+    if (!index.isValid() || index.row() >= _rows.size())
+        return QVariant();
+
+    const Row &row = _rows.at(index.row());
+
+    switch (role)
+    {
+    case Qt::DisplayRole:
+        return row.text;
+    case Qt::CheckStateRole:
+        return row.checked ? Qt::Checked : Qt::Unchecked;
+    case Qt::BackgroundColorRole:
+        if (row.record.is(OsRecord::Installed))
+            return INSTALLED_OS_BACKGROUND_COLOR;
+        break;
+    case Qt::DecorationRole:
+        if (row.iconSource.isEmpty() && !_dummyIcon.isNull())
+            return _dummyIcon;
+        break;
+    case IconSourceRole:
+        if (!row.iconSource.isEmpty())
+            return row.iconSource;
+        break;
+    case SecondIconRole:
+        if (row.record.source == OsRecord::InstalledOs)
+            break;
+        else if (row.record.folder.startsWith("/mnt"))
+            return _localIcon;
+        else
+            return _internetIcon;
+    case Qt::UserRole:
+        return row.record.name;
+    }
+
+    return QVariant();
+}
+
+bool OsListModel::setData(const QModelIndex &index, const QVariant &value, int role)
+{
+    if (!index.isValid() || index.row() >= _rows.size() || role != Qt::CheckStateRole)
+        return false;
+
+    bool checked = (value.toInt() == Qt::Checked);
+    Row &row = _rows[index.row()];
+    if (row.checked != checked)
+    {
+        row.checked = checked;
+        emit dataChanged(index, index);
+        emit checkedChanged();
+    }
+
+    return true;
+}
+
+Qt::ItemFlags OsListModel::flags(const QModelIndex &index) const
+{
+    if (!index.isValid())
+        return 0;
+
+    return Qt::ItemIsSelectable | Qt::ItemIsEnabled | Qt::ItemIsUserCheckable;
+}
+
+void OsListModel::populate()
+{
+    QMap<QString,OsRecord> records;
+    foreach (const OsRecord &r, _catalog->values())
+        records.insert(r.name, r);
+
+    beginResetModel();
+    _rows.clear();
+    _index.clear();
+    _iconUsers.clear();
+
+    foreach (const OsRecord &r, records)
+    {
+        Row row;
+        row.checked = r.is(OsRecord::Installed);
+        update(row, r);
+
+        if (r.is(OsRecord::Recommended))
+            _rows.prepend(row);
+        else
+            _rows.append(row);
+    }
+    reindex(0);
+    endResetModel();
+}
+
+QModelIndex OsListModel::indexOf(const QString &name) const
+{
+    QHash<QString,int>::const_iterator it = _index.constFind(name);
+    if (it == _index.constEnd())
+        return QModelIndex();
+
+    return index(it.value());
+}
+
+OsRecord OsListModel::record(const QModelIndex &index) const
+{
+    if (!index.isValid() || index.row() >= _rows.size())
+        return OsRecord();
+
+    return _rows.at(index.row()).record;
+}
+
+QList<OsRecord> OsListModel::checked() const
+{
+    QList<OsRecord> l;
+
+    foreach (const Row &row, _rows)
+    {
+        if (row.checked)
+            l.append(row.record);
+    }
+
+    return l;
+}
+
+void OsListModel::setDummyIcon(const QPixmap &icon)
+{
+    _dummyIcon = icon;
+    if (!_rows.isEmpty())
+        emit dataChanged(index(0), index(_rows.size()-1));
+}
+
+void OsListModel::iconStored(const QString &source)
+{
+    foreach (const QString &name, _iconUsers.values(source))
+    {
+        int i = _index.value(name);
+        _rows[i].iconSource = source;
+        emit dataChanged(index(i), index(i));
+    }
+}
+
+/* Text and icon of a row for the record of its OS */
+void OsListModel::update(Row &row, const OsRecord &r)
+{
+    if (!row.record.icon.isEmpty())
+        _iconUsers.remove(row.record.icon, row.record.name);
+    if (!r.icon.isEmpty())
+        _iconUsers.insert(r.icon, r.name);
+    row.record = r;
+
+    row.text = r.name;
+    if (r.is(OsRecord::Recommended))
+        row.text += " ["+QCoreApplication::translate("MainWindow", "RECOMMENDED")+"]";
+    if (r.is(OsRecord::Installed))
+        row.text += " ["+QCoreApplication::translate("MainWindow", "INSTALLED")+"]";
+    if (!r.description.isEmpty())
+        row.text += "\n"+r.description;
+
+    /* Local icons are only decoded if the store does not have the current version.
+     * Until a downloaded icon is stored, the row keeps the one it has. The delegate draws it */
+    if (!r.icon.isEmpty())
+    {
+        if (r.isLocal() ? _icons->addFile(r.icon) : _icons->contains(r.icon))
+            row.iconSource = r.icon;
+    }
+}
+
+/* Add a row at the end, or at the top for the recommended OS */
+void OsListModel::addRow(const OsRecord &r)
+{
+    Row row;
+    row.checked = r.is(OsRecord::Installed);
+    update(row, r);
+
+    int i = r.is(OsRecord::Recommended) ? 0 : _rows.size();
+    beginInsertRows(QModelIndex(), i, i);
+    _rows.insert(i, row);
+    reindex(i);
+    endInsertRows();
+}
+
+void OsListModel::reindex(int from)
+{
+    for (int i = from; i < _rows.size(); i++)
+        _index.insert(_rows.at(i).record.name, i);
+}
+
+void OsListModel::osAdded(const QString &name)
+{
+    if (!_index.contains(name))
+        addRow(_catalog->value(name));
+}
+
+void OsListModel::osChanged(const QString &name)
+{
+    QHash<QString,int>::const_iterator it = _index.constFind(name);
+    if (it == _index.constEnd())
+        return;
+
+    int i = it.value();
+    update(_rows[i], _catalog->value(name));
+    emit dataChanged(index(i), index(i));
+}
+
+void OsListModel::osRemoved(const QString &name)
+{
+    QHash<QString,int>::iterator it = _index.find(name);
+    if (it == _index.end())
+        return;
+
+    int i = it.value();
+    bool checked = _rows.at(i).checked;
+    const QString &icon = _rows.at(i).record.icon;
+    if (!icon.isEmpty())
+        _iconUsers.remove(icon, name);
+    _index.erase(it);
+
+    beginRemoveRows(QModelIndex(), i, i);
+    _rows.removeAt(i);
+    reindex(i);
+    endRemoveRows();
+
+    if (checked)
+        emit checkedChanged();
+}
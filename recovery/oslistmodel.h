@@ -0,0 +1,83 @@
+#ifndef OSLISTMODEL_H
+#define OSLISTMODEL_H
+
+/* Model of the OS list of the main window
+ *
+ * Has a row per OS of the catalog, the recommended one at the top, and
+ * follows the changes of the catalog. Each row keeps a copy of its
+ * record and its text, so drawing the list does not lock the catalog
+ * or build strings. Rows are found through a hash by name, and by the
+ * icon they wait for, instead of scanning the list.
+ *
+ * Maintained by Raspberry Pi
+ *
+ * See LICENSE.txt for license details
+ *
+ */
+
+#include "oscatalog.h"
+#include <QAbstractListModel>
+#include <QHash>
+#include <QIcon>
+#include <QPixmap>
+
+class IconStore;
+
+class OsListModel : public QAbstractListModel
+{
+    Q_OBJECT
+public:
+    explicit OsListModel(OsCatalog *catalog, IconStore *icons, QObject *parent = 0);
+
+    virtual int rowCount(const QModelIndex &parent = QModelIndex()) const;
+    virtual QVariant data(const QModelIndex &index, int role = Qt::DisplayRole) const;
+    virtual bool setData(const QModelIndex &index, const QVariant &value, int role = Qt::EditRole);
+    virtual Qt::ItemFlags flags(const QModelIndex &index) const;
+
+    /* Rebuild the rows from the catalog, in name order. Installed OSes start checked */
+    void populate();
+    /* Row of an OS, invalid if it is not listed */
+    QModelIndex indexOf(const QString &name) const;
+    OsRecord record(const QModelIndex &index) const;
+    /* Records of the OSes checked, in list order */
+    QList<OsRecord> checked() const;
+    /* Shown by the rows without an icon, to give all rows the same height */
+    void setDummyIcon(const QPixmap &icon);
+    /* The icon store has the icon of source now */
+    void iconStored(const QString &source);
+
+signals:
+    /* An OS was checked or unchecked */
+    void checkedChanged();
+
+protected slots:
+    void osAdded(const QString &name);
+    void osChanged(const QString &name);
+    void osRemoved(const QString &name);
+
+protected:
+    struct Row
+    {
+        OsRecord record;
+        QString text;
+        /* Source in the icon store of the icon shown, empty until there is one */
+        QString iconSource;
+        bool checked;
+    };
+
+    void update(Row &row, const OsRecord &r);
+    void addRow(const OsRecord &r);
+    void reindex(int from);
+
+    OsCatalog *_catalog;
+    IconStore *_icons;
+    QList<Row> _rows;
+    /* key: name, value: row */
+    QHash<QString,int> _index;
+    /* key: icon of the record, value: name */
+    QMultiHash<QString,QString> _iconUsers;
+    QIcon _localIcon, _internetIcon;
+    QPixmap _dummyIcon;
+};
+
+#endif // OSLISTMODEL_H
@@ -0,0 +1,473 @@
+#include "parallelxzdecompressor.h"
+#include "util.h"
+#include "httpconnection.h"
+#include <QDebug>
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+
+/* Block-parallel .xz decompressor
+ *
+ * Maintained by Raspberry Pi
+ *
+ * See LICENSE.txt for license details
+ *
+ */
+
+/*
+ * Random access to the compressed file, only used to read the index
+ */
+class XzIndexSource
+{
+public:
+    XzIndexSource() : fileSize(0) {}
+    virtual ~XzIndexSource() {}
+    virtual bool readAt(qint64 offset, char *buf, qint64 len) = 0;
+    qint64 fileSize;
+};
+
+class LocalXzIndexSource : public XzIndexSource
+{
+public:
+    LocalXzIndexSource(QIODevice *dev) : _dev(dev)
+    {
+        fileSize = dev->size();
+    }
+
+    virtual bool readAt(qint64 offset, char *buf, qint64 len)
+    {
+        return _dev->seek(offset) && readFullyFromDevice(_dev, buf, len);
+    }
+
+protected:
+    QIODevice *_dev;
+};
+
+class HttpXzIndexSource : public XzIndexSource
+{
+public:
+    HttpXzIndexSource(const QString &url) : _url(url), _tailOffset(0)
+    {
+    }
+
+    /* Check that the server supports range requests, and fetch the tail of the file.
+     * All requests go over the same connection */
+    bool init()
+    {
+        char first;
+        if (!fetchRange(0, 1, &first))
+            return false;
+
+        /* Later requests go to the server the URL redirects to */
+        _url = _conn.url();
+        fileSize = _conn.fileSize();
+        if (fileSize <= 0)
+            return false;
+
+        _tailOffset = qMax(qint64(0), fileSize - XZ_INDEX_FETCH_SIZE);
+        _tail.resize(fileSize - _tailOffset);
+        return fetchRange(_tailOffset, _tail.size(), _tail.data());
+    }
+
+    virtual bool readAt(qint64 offset, char *buf, qint64 len)
+    {
+        if (offset >= _tailOffset && offset+len <= fileSize)
+        {
+            memcpy(buf, _tail.constData() + (offset - _tailOffset), len);
+            return true;
+        }
+
+        return fetchRange(offset, len, buf);
+    }
+
+protected:
+    QString _url;
+    HttpConnection _conn;
+    qint64 _tailOffset;
+    QByteArray _tail;
+
+    bool fetchRange(qint64 offset, qint64 len, char *buf)
+    {
+        return _conn.get(_url, offset, offset+len)
+                && _conn.status() == 206 && _conn.bodyOffset() == offset
+                && _conn.readFully(buf, len);
+    }
+};
+
+/* Read the indexes of all streams in the file, working backwards from the end */
+static lzma_index *readXzIndex(XzIndexSource *src)
+{
+    lzma_index *combined = NULL;
+    qint64 pos = src->fileSize;
+    char buf[LZMA_STREAM_HEADER_SIZE];
+
+    while (pos > 0)
+    {
+        /* Stream padding: multiple of 4 null bytes */
+        qint64 padding = 0;
+        forever
+        {
+            if (pos < 2*LZMA_STREAM_HEADER_SIZE || !src->readAt(pos-4, buf, 4))
+                goto error;
+            if (buf[0] || buf[1] || buf[2] || buf[3])
+                break;
+            pos -= 4;
+            padding += 4;
+        }
+
+        lzma_stream_flags footerFlags, headerFlags;
+        if (!src->readAt(pos-LZMA_STREAM_HEADER_SIZE, buf, LZMA_STREAM_HEADER_SIZE)
+                || lzma_stream_footer_decode(&footerFlags, (const uint8_t *) buf) != LZMA_OK)
+            goto error;
+
+        qint64 indexSize = footerFlags.backward_size;
+        qint64 indexPos  = pos - LZMA_STREAM_HEADER_SIZE - indexSize;
+        if (indexPos < LZMA_STREAM_HEADER_SIZE)
+            goto error;
+
+        QByteArray indexData(indexSize, 0);
+        if (!src->readAt(indexPos, indexData.data(), indexSize))
+            goto error;
+
+        lzma_index *idx = NULL;
+        uint64_t memlimit = UINT64_MAX;
+        size_t inpos = 0;
+        if (lzma_index_buffer_decode(&idx, &memlimit, NULL, (const uint8_t *) indexData.constData(), &inpos, indexSize) != LZMA_OK)
+            goto error;
+
+        qint64 streamStart = pos - (qint64) lzma_index_stream_size(idx);
+        if (streamStart < 0
+                || !src->readAt(streamStart, buf, LZMA_STREAM_HEADER_SIZE)
+                || lzma_stream_header_decode(&headerFlags, (const uint8_t *) buf) != LZMA_OK
+                || lzma_stream_flags_compare(&headerFlags, &footerFlags) != LZMA_OK
+                || lzma_index_stream_flags(idx, &footerFlags) != LZMA_OK
+                || lzma_index_stream_padding(idx, padding) != LZMA_OK
+                || (combined && lzma_index_cat(idx, combined, NULL) != LZMA_OK))
+        {
+            lzma_index_end(idx, NULL);
+            goto error;
+        }
+
+        combined = idx;
+        pos = streamStart;
+    }
+
+    return combined;
+
+error:
+    if (combined)
+        lzma_index_end(combined, NULL);
+    return NULL;
+}
+
+Decompressor *ParallelXzDecompressor::create(const QString &filename, QIODevice *source, QObject *parent, qint64 memoryLimit)
+{
+    int threads = QThread::idealThreadCount();
+    if (threads < 2)
+        return NULL;
+
+    XzIndexSource *src;
+    if (!source->isSequential())
+    {
+        src = new LocalXzIndexSource(source);
+    }
+    else if (filename.startsWith("http:"))
+    {
+        HttpXzIndexSource *http = new HttpXzIndexSource(filename);
+        if (!http->init())
+        {
+            qDebug() << "Unable to fetch xz index of" << filename << "using single-threaded decompression";
+            delete http;
+            return NULL;
+        }
+        src = http;
+    }
+    else
+    {
+        return NULL;
+    }
+
+    lzma_index *idx = readXzIndex(src);
+    delete src;
+    if (!source->isSequential())
+        source->seek(0);
+    if (!idx)
+    {
+        qDebug() << "Unable to read xz index of" << filename << "using single-threaded decompression";
+        return NULL;
+    }
+
+    QList<Block> blocks;
+    qint64 largestBlock = 0;
+    lzma_index_iter iter;
+    lzma_index_iter_init(&iter, idx);
+    while (!lzma_index_iter_next(&iter, LZMA_INDEX_ITER_NONEMPTY_BLOCK))
+    {
+        Block b;
+        b.offset = iter.block.compressed_file_offset;
+        b.size = iter.block.total_size;
+        b.unpaddedSize = iter.block.unpadded_size;
+        b.uncompressedSize = iter.block.uncompressed_size;
+        b.check = iter.stream.flags->check;
+        blocks.append(b);
+        largestBlock = qMax(largestBlock, b.size + b.uncompressedSize);
+    }
+    lzma_index_end(idx, NULL);
+
+    qint64 memoryBudget = (memoryLimit ? memoryLimit : availableMemory()) / XZ_PARALLEL_MEMORY_DIVISOR;
+    if (blocks.count() < 2)
+    {
+        qDebug() << filename << "consists of a single xz block, using single-threaded decompression";
+        return NULL;
+    }
+    if (largestBlock * 2 > memoryBudget || largestBlock > INT_MAX)
+    {
+        qDebug() << "xz blocks of" << filename << "too large to decompress in parallel";
+        return NULL;
+    }
+
+    qDebug() << "Decompressing" << blocks.count() << "xz blocks using" << threads << "threads";
+    return new ParallelXzDecompressor(source, blocks, threads, memoryBudget, parent);
+}
+
+ParallelXzDecompressor::ParallelXzDecompressor(QIODevice *source, const QList<Block> &blocks, int threads, qint64 memoryBudget, QObject *parent)
+    : Decompressor(source, parent), _blocks(blocks), _nextBlock(0), _inputPos(0), _stopping(false),
+      _current(NULL), _currentPos(0), _memoryUsed(0), _memoryBudget(memoryBudget),
+      _maxQueued(threads * XZ_PARALLEL_BLOCKS_PER_THREAD)
+{
+    for (int i = 0; i < threads; i++)
+    {
+        XzBlockWorker *worker = new XzBlockWorker(this);
+        worker->start();
+        _workers.append(worker);
+    }
+}
+
+ParallelXzDecompressor::~ParallelXzDecompressor()
+{
+    _mutex.lock();
+    _stopping = true;
+    _jobQueued.wakeAll();
+    _mutex.unlock();
+
+    foreach (XzBlockWorker *worker, _workers)
+    {
+        worker->wait();
+        delete worker;
+    }
+    foreach (Job *job, _queue)
+        freeJob(job);
+    if (_current)
+        freeJob(_current);
+}
+
+void ParallelXzDecompressor::freeJob(Job *job)
+{
+    for (int i = 0; job->filters[i].id != LZMA_VLI_UNKNOWN; i++)
+        free(job->filters[i].options);
+    delete job;
+}
+
+bool ParallelXzDecompressor::skipInput(qint64 len)
+{
+    while (len)
+    {
+        if (!fillInput())
+            return false;
+        if (!_inavail)
+        {
+            fail("Unexpected end of xz compressed data");
+            return false;
+        }
+
+        qint64 n = qMin(len, _inavail);
+        consumeInput(n);
+        len -= n;
+    }
+
+    return true;
+}
+
+/* Read compressed blocks and hand them to the workers, as long as the queue and memory budget allow */
+bool ParallelXzDecompressor::queueBlocks()
+{
+    while (_nextBlock < _blocks.count())
+    {
+        const Block &b = _blocks.at(_nextBlock);
+
+        _mutex.lock();
+        int queued = _queue.count();
+        _mutex.unlock();
+
+        if (queued >= _maxQueued)
+            break;
+        if ((queued || _current) && _memoryUsed + b.size + b.uncompressedSize > _memoryBudget)
+            break;
+
+        if (!skipInput(b.offset - _inputPos))
+            return false;
+
+        Job *job = new Job;
+        job->filters[0].id = LZMA_VLI_UNKNOWN;
+        job->started = job->done = job->failed = false;
+        job->in.resize(b.size);
+        if (!readInput(job->in.data(), b.size))
+        {
+            freeJob(job);
+            return false;
+        }
+        _inputPos = b.offset + b.size;
+
+        memset(&job->block, 0, sizeof(job->block));
+        job->block.version = 1;
+        job->block.check = b.check;
+        job->block.filters = job->filters;
+        job->block.header_size = lzma_block_header_size_decode((uint8_t) job->in.at(0));
+
+        /* On failure lzma_block_header_decode() frees the filter options itself */
+        if (job->block.header_size > (quint32) b.size
+                || lzma_block_header_decode(&job->block, NULL, (const uint8_t *) job->in.constData()) != LZMA_OK)
+        {
+            job->filters[0].id = LZMA_VLI_UNKNOWN;
+            freeJob(job);
+            fail("Invalid xz block header");
+            return false;
+        }
+        if (lzma_block_compressed_size(&job->block, b.unpaddedSize) != LZMA_OK)
+        {
+            freeJob(job);
+            fail("Invalid xz block header");
+            return false;
+        }
+
+        job->uncompressedSize = b.uncompressedSize;
+        job->cost = b.size + b.uncompressedSize + lzma_raw_decoder_memusage(job->filters);
+        _memoryUsed += job->cost;
+        _nextBlock++;
+
+        _mutex.lock();
+        _queue.append(job);
+        _jobQueued.wakeOne();
+        _mutex.unlock();
+    }
+
+    return true;
+}
+
+/* Runs on a worker thread */
+void ParallelXzDecompressor::decodeJob(Job *job)
+{
+    size_t inpos = job->block.header_size, outpos = 0;
+    qint64 outsize = job->uncompressedSize;
+    job->out.resize(outsize);
+
+    lzma_ret ret = lzma_block_buffer_decode(&job->block, NULL,
+                                            (const uint8_t *) job->in.constData(), &inpos, job->in.size(),
+                                            (uint8_t *) job->out.data(), &outpos, outsize);
+    if (ret != LZMA_OK || (qint64) outpos != outsize)
+    {
+        job->failed = true;
+        job->error = "Error decompressing xz data (code "+QString::number(ret)+")";
+    }
+
+    /* Compressed data is no longer needed */
+    job->in = QByteArray();
+}
+
+qint64 ParallelXzDecompressor::decompress(char *buf, qint64 maxlen)
+{
+    if (!_current || _currentPos == _current->out.size())
+    {
+        if (_current)
+        {
+            _memoryUsed -= _current->cost;
+            freeJob(_current);
+            _current = NULL;
+        }
+
+        if (!queueBlocks())
+            return -1;
+
+        _mutex.lock();
+        if (_queue.isEmpty())
+        {
+            _mutex.unlock();
+
+            /* Consume the index and stream footer, so the download can finish */
+            while (fillInput() && _inavail)
+                consumeInput(_inavail);
+            return _failed ? -1 : 0;
+        }
+        Job *job = _queue.first();
+        while (!job->done)
+            _jobDone.wait(&_mutex);
+        _queue.removeFirst();
+        _mutex.unlock();
+
+        if (job->failed)
+        {
+            fail(job->error);
+            _memoryUsed -= job->cost;
+            freeJob(job);
+            return -1;
+        }
+
+        _current = job;
+        _currentPos = 0;
+
+        /* Keep the workers busy while the output of this block is consumed */
+        if (!queueBlocks())
+            return -1;
+    }
+
+    qint64 n = qMin(maxlen, _current->out.size() - _currentPos);
+    memcpy(buf, _current->out.constData() + _currentPos, n);
+    _currentPos += n;
+
+    return n;
+}
+
+XzBlockWorker::XzBlockWorker(ParallelXzDecompressor *decompressor)
+    : QThread(), _decompressor(decompressor)
+{
+}
+
+void XzBlockWorker::run()
+{
+    ParallelXzDecompressor *d = _decompressor;
+
+    forever
+    {
+        ParallelXzDecompressor::Job *job = NULL;
+
+        d->_mutex.lock();
+        forever
+        {
+            if (d->_stopping)
+            {
+                d->_mutex.unlock();
+                return;
+            }
+            foreach (ParallelXzDecompressor::Job *j, d->_queue)
+            {
+                if (!j->started)
+                {
+                    job = j;
+                    break;
+                }
+            }
+            if (job)
+                break;
+            d->_jobQueued.wait(&d->_mutex);
+        }
+        job->started = true;
+        d->_mutex.unlock();
+
+        d->decodeJob(job);
+
+        d->_mutex.lock();
+        job->done = true;
+        d->_jobDone.wakeAll();
+        d->_mutex.unlock();
+    }
+}
@@ -0,0 +1,98 @@
+#ifndef PARALLELXZDECOMPRESSOR_H
+#define PARALLELXZDECOMPRESSOR_H
+
+/* Block-parallel .xz decompressor
+ *
+ * xz files created with multiple blocks (xz -T, pixz) record the
+ * size of every block in the index at the end of the file.
+ * The index is read up front (by seeking in local files, or with
+ * HTTP range requests for downloads), after which the compressed
+ * stream is still read sequentially, but split into blocks that
+ * are decoded on a pool of worker threads.
+ * Output is handed out in the original order.
+ *
+ * Maintained by Raspberry Pi
+ *
+ * See LICENSE.txt for license details
+ *
+ */
+
+#include "decompressor.h"
+#include <QList>
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <lzma.h>
+
+/* Number of blocks queued per worker thread */
+#define XZ_PARALLEL_BLOCKS_PER_THREAD   2
+/* Fraction of the memory limit that may be used for queued blocks */
+#define XZ_PARALLEL_MEMORY_DIVISOR      2
+/* Bytes fetched from the end of remote files to find the index */
+#define XZ_INDEX_FETCH_SIZE             (64 * 1024)
+
+class XzBlockWorker;
+
+class ParallelXzDecompressor : public Decompressor
+{
+public:
+    /* Returns NULL if the file has a single block, the index cannot be read,
+     * or there is only one CPU core. The caller should use the streaming
+     * decompressor in that case. memoryLimit is 0 for the available memory */
+    static Decompressor *create(const QString &filename, QIODevice *source, QObject *parent = 0, qint64 memoryLimit = 0);
+    virtual ~ParallelXzDecompressor();
+
+protected:
+    struct Block
+    {
+        qint64 offset, size, uncompressedSize, unpaddedSize;
+        lzma_check check;
+    };
+
+    struct Job
+    {
+        QByteArray in, out;
+        lzma_block block;
+        lzma_filter filters[LZMA_FILTERS_MAX+1];
+        qint64 uncompressedSize, cost;
+        bool started, done, failed;
+        QString error;
+    };
+
+    ParallelXzDecompressor(QIODevice *source, const QList<Block> &blocks, int threads, qint64 memoryBudget, QObject *parent);
+    virtual qint64 decompress(char *buf, qint64 maxlen);
+    bool queueBlocks();
+    bool skipInput(qint64 len);
+    void decodeJob(Job *job);
+    void freeJob(Job *job);
+
+    QList<Block> _blocks;
+    int _nextBlock;
+    qint64 _inputPos;
+    QList<XzBlockWorker *> _workers;
+
+    /* Shared with the workers, protected by _mutex */
+    QMutex _mutex;
+    QWaitCondition _jobQueued, _jobDone;
+    QList<Job *> _queue;
+    bool _stopping;
+
+    Job *_current;
+    qint64 _currentPos;
+    qint64 _memoryUsed, _memoryBudget;
+    int _maxQueued;
+
+    friend class XzBlockWorker;
+};
+
+class XzBlockWorker : public QThread
+{
+public:
+    explicit XzBlockWorker(ParallelXzDecompressor *decompressor);
+
+protected:
+    virtual void run();
+    ParallelXzDecompressor *_decompressor;
+};
+
+#endif // PARALLELXZDECOMPRESSOR_H
@@ -0,0 +1,468 @@
+#include "parallelzstddecompressor.h"
+#include "util.h"
+#include <QDebug>
+#include <string.h>
+
+/* Frame-parallel .zst decompressor
+ *
+ * Maintained by Raspberry Pi
+ *
+ * See LICENSE.txt for license details
+ *
+ */
+
+#define ZSTD_SKIPPABLE_MAGIC    0x184D2A50
+/* Magic, descriptor, window descriptor, dictionary id and content size */
+#define ZSTD_FRAME_HEADER_MAX   18
+#define ZSTD_MAX_BLOCK_SIZE     (128 * 1024)
+
+static inline quint32 le32(const char *p)
+{
+    const uchar *u = (const uchar *) p;
+    return u[0] | (u[1] << 8) | (u[2] << 16) | (quint32(u[3]) << 24);
+}
+
+/* Size of the frame header, from the frame header descriptor byte. Returns -1 if the reserved bit is set */
+static int frameHeaderSize(uchar fhd)
+{
+    static const int dictIdSizes[] = { 0, 1, 2, 4 };
+    static const int contentSizeSizes[] = { 0, 2, 4, 8 };
+    bool singleSegment = fhd & 0x20;
+    int fcsFlag = fhd >> 6;
+
+    if (fhd & 0x08)
+        return -1;
+
+    return 5 + (singleSegment ? 0 : 1) + dictIdSizes[fhd & 3]
+            + ((fcsFlag == 0 && singleSegment) ? 1 : contentSizeSizes[fcsFlag]);
+}
+
+/* Content size recorded in a complete frame header, -1 if unknown.
+ * Frames that need a dictionary are treated as unknown, the streaming decoder reports the error */
+static qint64 frameContentSize(const char *header, int size)
+{
+    uchar fhd = header[4];
+    int fcsFlag = fhd >> 6;
+    const char *p = header + size;
+
+    if (fhd & 3)
+        return -1;
+
+    switch (fcsFlag)
+    {
+    case 0:
+        return (fhd & 0x20) ? (uchar) p[-1] : -1;
+    case 1:
+        return ((uchar) p[-2] | ((uchar) p[-1] << 8)) + 256;
+    case 2:
+        return le32(p-4);
+    default:
+        qint64 v = le32(p-8) | (quint64(le32(p-4)) << 32);
+        return v < 0 ? -1 : v;
+    }
+}
+
+Decompressor *ParallelZstdDecompressor::create(const QString &filename, QIODevice *source, QObject *parent, qint64 memoryLimit)
+{
+    int threads = QThread::idealThreadCount();
+    if (threads < 2)
+        return NULL;
+
+    qint64 memoryBudget = (memoryLimit ? memoryLimit : availableMemory()) / ZSTD_PARALLEL_MEMORY_DIVISOR;
+
+    if (!source->isSequential())
+    {
+        /* A file holding one large frame gains nothing from the workers */
+        QByteArray header = source->peek(ZSTD_FRAME_HEADER_MAX);
+        if (header.size() >= 5 && le32(header.constData()) == ZSTD_MAGICNUMBER)
+        {
+            int size = frameHeaderSize(header.at(4));
+            qint64 contentSize = (size != -1 && header.size() >= size) ? frameContentSize(header.constData(), size) : -1;
+
+            if (contentSize < 0 || contentSize > ZSTD_PARALLEL_MAX_FRAME_SIZE || contentSize * 2 > memoryBudget)
+            {
+                qDebug() << filename << "does not consist of small zstd frames, using single-threaded decompression";
+                return NULL;
+            }
+        }
+    }
+
+    qDebug() << "Decompressing zstd frames of" << filename << "using" << threads << "threads";
+    return new ParallelZstdDecompressor(source, threads, memoryBudget, parent);
+}
+
+ParallelZstdDecompressor::ParallelZstdDecompressor(QIODevice *source, int threads, qint64 memoryBudget, QObject *parent)
+    : Decompressor(source, parent), _stopping(false), _pending(NULL), _streamQueued(false), _streamFinished(false),
+      _dstream(NULL), _current(NULL), _currentPos(0), _memoryUsed(0), _memoryBudget(memoryBudget),
+      _maxQueued(threads * ZSTD_PARALLEL_FRAMES_PER_THREAD)
+{
+    for (int i = 0; i < threads; i++)
+    {
+        ZstdFrameWorker *worker = new ZstdFrameWorker(this);
+        worker->start();
+        _workers.append(worker);
+    }
+}
+
+ParallelZstdDecompressor::~ParallelZstdDecompressor()
+{
+    _mutex.lock();
+    _stopping = true;
+    _jobQueued.wakeAll();
+    _mutex.unlock();
+
+    foreach (ZstdFrameWorker *worker, _workers)
+    {
+        worker->wait();
+        delete worker;
+    }
+    qDeleteAll(_queue);
+    delete _pending;
+    delete _current;
+    ZSTD_freeDStream(_dstream);
+}
+
+/* Read the header of the next frame, skipping skippable frames.
+ * Returns 1 if a frame header was read, 0 at end of input, -1 on error */
+int ParallelZstdDecompressor::readFrameHeader(Job *&job)
+{
+    char buf[ZSTD_FRAME_HEADER_MAX];
+
+    forever
+    {
+        if (!fillInput())
+            return -1;
+        if (!_inavail)
+            return 0;
+        if (!readInput(buf, 4))
+            return -1;
+
+        quint32 magic = le32(buf);
+        if ((magic & 0xFFFFFFF0) == ZSTD_SKIPPABLE_MAGIC)
+        {
+            if (!readInput(buf, 4))
+                return -1;
+            for (quint32 len = le32(buf); len; )
+            {
+                if (!fillInput())
+                    return -1;
+                if (!_inavail)
+                {
+                    fail("Unexpected end of zstd compressed data");
+                    return -1;
+                }
+                qint64 n = qMin((qint64) len, _inavail);
+                consumeInput(n);
+                len -= n;
+            }
+            continue;
+        }
+        if (magic != ZSTD_MAGICNUMBER)
+        {
+            fail("Not zstd compressed data");
+            return -1;
+        }
+
+        if (!readInput(buf+4, 1))
+            return -1;
+        int size = frameHeaderSize(buf[4]);
+        if (size == -1)
+        {
+            fail("Invalid zstd frame header");
+            return -1;
+        }
+        if (!readInput(buf+5, size-5))
+            return -1;
+
+        job = new Job;
+        job->in = QByteArray(buf, size);
+        job->contentSize = frameContentSize(buf, size);
+        job->streamed = job->contentSize < 0 || job->contentSize > ZSTD_PARALLEL_MAX_FRAME_SIZE
+                || job->contentSize * 2 > _memoryBudget;
+        /* A compressed frame is at most about the size of its content */
+        job->cost = job->streamed ? 0 : job->contentSize * 2;
+        job->started = job->done = job->failed = false;
+        return 1;
+    }
+}
+
+/* Read the blocks and checksum that follow the frame header */
+bool ParallelZstdDecompressor::readFrameBlocks(Job *job)
+{
+    bool checksum = job->in.at(4) & 0x04;
+    char h[4];
+
+    forever
+    {
+        if (!readInput(h, 3))
+            return false;
+        job->in.append(h, 3);
+
+        quint32 header = (uchar) h[0] | ((uchar) h[1] << 8) | ((uchar) h[2] << 16);
+        int type = (header >> 1) & 3;
+        int size = header >> 3;
+
+        /* Block types: raw, RLE (a single byte repeated), compressed, reserved */
+        if (type == 3 || size > ZSTD_MAX_BLOCK_SIZE)
+        {
+            fail("Invalid zstd block header");
+            return false;
+        }
+        if (type == 1)
+            size = 1;
+
+        int pos = job->in.size();
+        job->in.resize(pos + size);
+        if (!readInput(job->in.data() + pos, size))
+            return false;
+
+        if (header & 1)
+            break;
+    }
+
+    if (checksum)
+    {
+        if (!readInput(h, 4))
+            return false;
+    }
+
+    return true;
+}
+
+/* Read frames and hand them to the workers, as long as the queue and memory budget allow */
+bool ParallelZstdDecompressor::queueFrames()
+{
+    while (!_streamQueued)
+    {
+        if (!_pending)
+        {
+            int ret = readFrameHeader(_pending);
+            if (ret <= 0)
+                return ret == 0;
+        }
+        Job *job = _pending;
+
+        if (job->streamed)
+        {
+            /* Decoded on this thread when it reaches the head of the queue */
+            job->started = job->done = true;
+            _streamQueued = true;
+        }
+        else
+        {
+            _mutex.lock();
+            int queued = _queue.count();
+            _mutex.unlock();
+
+            if (queued >= _maxQueued)
+                break;
+            if ((queued || _current) && _memoryUsed + job->cost > _memoryBudget)
+                break;
+
+            if (!readFrameBlocks(job))
+                return false;
+            _memoryUsed += job->cost;
+        }
+        _pending = NULL;
+
+        _mutex.lock();
+        _queue.append(job);
+        _jobQueued.wakeOne();
+        _mutex.unlock();
+    }
+
+    return true;
+}
+
+/* Runs on a worker thread */
+void ParallelZstdDecompressor::decodeJob(Job *job, ZSTD_DCtx *dctx)
+{
+    job->out.resize(job->contentSize);
+
+    size_t ret = ZSTD_decompressDCtx(dctx, job->out.data(), job->contentSize, job->in.constData(), job->in.size());
+    if (ZSTD_isError(ret))
+    {
+        job->failed = true;
+        job->error = "Error decompressing zstd data: "+QString(ZSTD_getErrorName(ret));
+    }
+    else if ((qint64) ret != job->contentSize)
+    {
+        job->failed = true;
+        job->error = "Error decompressing zstd data: frame size does not match its header";
+    }
+
+    /* Compressed data is no longer needed */
+    job->in = QByteArray();
+}
+
+/* Decode the current frame as a stream, its header is in _current->in. Returns 0 once the frame is complete */
+qint64 ParallelZstdDecompressor::streamFrame(char *buf, qint64 maxlen)
+{
+    ZSTD_outBuffer out = { buf, (size_t) maxlen, 0 };
+
+    while (!out.pos && !_streamFinished)
+    {
+        bool header = _currentPos < _current->in.size();
+        ZSTD_inBuffer in;
+
+        if (header)
+        {
+            in.src = _current->in.constData() + _currentPos;
+            in.size = _current->in.size() - _currentPos;
+        }
+        else
+        {
+            if (!fillInput())
+                return -1;
+            if (!_inavail)
+                return fail("Unexpected end of zstd compressed data");
+            in.src = _inptr;
+            in.size = _inavail;
+        }
+        in.pos = 0;
+
+        size_t ret = ZSTD_decompressStream(_dstream, &out, &in);
+        if (header)
+            _currentPos += in.pos;
+        else
+            consumeInput(in.pos);
+
+        if (ZSTD_isError(ret))
+            return fail("Error decompressing zstd data: "+QString(ZSTD_getErrorName(ret)));
+        /* The decoder stops at the end of the frame, input after it belongs to the next one */
+        _streamFinished = (ret == 0);
+    }
+
+    return out.pos;
+}
+
+qint64 ParallelZstdDecompressor::decompress(char *buf, qint64 maxlen)
+{
+    forever
+    {
+        if (_current && _current->streamed)
+        {
+            qint64 n = streamFrame(buf, maxlen);
+            if (n)
+                return n;
+
+            /* Frames after the streamed one can be read now */
+            _streamQueued = false;
+            delete _current;
+            _current = NULL;
+        }
+        else if (_current && _currentPos < _current->out.size())
+        {
+            qint64 n = qMin(maxlen, _current->out.size() - _currentPos);
+            memcpy(buf, _current->out.constData() + _currentPos, n);
+            _currentPos += n;
+
+            return n;
+        }
+        else if (_current)
+        {
+            _memoryUsed -= _current->cost;
+            delete _current;
+            _current = NULL;
+        }
+
+        if (!queueFrames())
+            return -1;
+
+        _mutex.lock();
+        if (_queue.isEmpty())
+        {
+            _mutex.unlock();
+            return _failed ? -1 : 0;
+        }
+        Job *job = _queue.first();
+        while (!job->done)
+            _jobDone.wait(&_mutex);
+        _queue.removeFirst();
+        _mutex.unlock();
+
+        if (job->failed)
+        {
+            fail(job->error);
+            _memoryUsed -= job->cost;
+            delete job;
+            return -1;
+        }
+
+        _current = job;
+        _currentPos = 0;
+
+        if (job->streamed)
+        {
+            if (!_dstream)
+                _dstream = ZSTD_createDStream();
+            if (!_dstream || ZSTD_isError(ZSTD_initDStream(_dstream)))
+                return fail("Error initializing zstd decoder");
+            _streamFinished = false;
+        }
+        else if (!queueFrames())
+        {
+            /* Keep the workers busy while the output of this frame is consumed */
+            return -1;
+        }
+    }
+}
+
+ZstdFrameWorker::ZstdFrameWorker(ParallelZstdDecompressor *decompressor)
+    : QThread(), _decompressor(decompressor)
+{
+    _dctx = ZSTD_createDCtx();
+}
+
+ZstdFrameWorker::~ZstdFrameWorker()
+{
+    ZSTD_freeDCtx(_dctx);
+}
+
+void ZstdFrameWorker::run()
+{
+    ParallelZstdDecompressor *d = _decompressor;
+
+    forever
+    {
+        ParallelZstdDecompressor::Job *job = NULL;
+
+        d->_mutex.lock();
+        forever
+        {
+            if (d->_stopping)
+            {
+                d->_mutex.unlock();
+                return;
+            }
+            foreach (ParallelZstdDecompressor::Job *j, d->_queue)
+            {
+                if (!j->started)
+                {
+                    job = j;
+                    break;
+                }
+            }
+            if (job)
+                break;
+            d->_jobQueued.wait(&d->_mutex);
+        }
+        job->started = true;
+        d->_mutex.unlock();
+
+        if (_dctx)
+        {
+            d->decodeJob(job, _dctx);
+        }
+        else
+        {
+            job->failed = true;
+            job->error = "Error initializing zstd decoder";
+        }
+
+        d->_mutex.lock();
+        job->done = true;
+        d->_jobDone.wakeAll();
+        d->_mutex.unlock();
+    }
+}
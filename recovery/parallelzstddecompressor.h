@@ -0,0 +1,98 @@
+#ifndef PARALLELZSTDDECOMPRESSOR_H
+#define PARALLELZSTDDECOMPRESSOR_H
+
+/* Frame-parallel .zst decompressor
+ *
+ * zstd files made of multiple frames (zstd -B, pzstd, or simply
+ * concatenated .zst files) can be decoded frame by frame on a pool of
+ * worker threads. The compressed stream is still read sequentially:
+ * frame and block headers are parsed here to find where each frame
+ * ends, without needing an index. Frames that record their content
+ * size and are small enough are handed to the workers, other frames
+ * are decoded as a stream on the reading thread once the frames before
+ * them have been consumed. Output is handed out in the original order.
+ *
+ * Maintained by Raspberry Pi
+ *
+ * See LICENSE.txt for license details
+ *
+ */
+
+#include "decompressor.h"
+#include <QList>
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <zstd.h>
+
+/* Number of frames queued per worker thread */
+#define ZSTD_PARALLEL_FRAMES_PER_THREAD 2
+/* Fraction of the memory limit that may be used for queued frames */
+#define ZSTD_PARALLEL_MEMORY_DIVISOR    2
+/* Larger frames are decoded as a stream instead */
+#define ZSTD_PARALLEL_MAX_FRAME_SIZE    (64 * 1024 * 1024)
+
+class ZstdFrameWorker;
+
+class ParallelZstdDecompressor : public Decompressor
+{
+public:
+    /* Returns NULL if there is only one CPU core, or if the first frame of a local
+     * file cannot be decoded in parallel. The caller should use the streaming
+     * decompressor in that case. memoryLimit is 0 for the available memory */
+    static Decompressor *create(const QString &filename, QIODevice *source, QObject *parent = 0, qint64 memoryLimit = 0);
+    virtual ~ParallelZstdDecompressor();
+
+protected:
+    struct Job
+    {
+        /* Complete frame, or only its header for streamed frames */
+        QByteArray in, out;
+        qint64 contentSize, cost;
+        bool streamed, started, done, failed;
+        QString error;
+    };
+
+    ParallelZstdDecompressor(QIODevice *source, int threads, qint64 memoryBudget, QObject *parent);
+    virtual qint64 decompress(char *buf, qint64 maxlen);
+    int readFrameHeader(Job *&job);
+    bool readFrameBlocks(Job *job);
+    bool queueFrames();
+    qint64 streamFrame(char *buf, qint64 maxlen);
+    void decodeJob(Job *job, ZSTD_DCtx *dctx);
+
+    QList<ZstdFrameWorker *> _workers;
+
+    /* Shared with the workers, protected by _mutex */
+    QMutex _mutex;
+    QWaitCondition _jobQueued, _jobDone;
+    QList<Job *> _queue;
+    bool _stopping;
+
+    /* Frame whose header has been read, waiting for room in the queue */
+    Job *_pending;
+    /* A streamed frame has been queued, input may not be read past its header until it is decoded */
+    bool _streamQueued, _streamFinished;
+    ZSTD_DStream *_dstream;
+
+    Job *_current;
+    qint64 _currentPos;
+    qint64 _memoryUsed, _memoryBudget;
+    int _maxQueued;
+
+    friend class ZstdFrameWorker;
+};
+
+class ZstdFrameWorker : public QThread
+{
+public:
+    explicit ZstdFrameWorker(ParallelZstdDecompressor *decompressor);
+    virtual ~ZstdFrameWorker();
+
+protected:
+    virtual void run();
+    ParallelZstdDecompressor *_decompressor;
+    ZSTD_DCtx *_dctx;
+};
+
+#endif // PARALLELZSTDDECOMPRESSOR_H
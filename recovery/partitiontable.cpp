@@ -0,0 +1,278 @@
+#include "partitiontable.h"
+#include "config.h"
+#include <QFile>
+#include <QProcess>
+#include <QDebug>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+/* In-memory MBR/EBR partition table
+ *
+ * Maintained by Raspberry Pi
+ *
+ * See LICENSE.txt for license details
+ *
+ */
+
+/* Upper limit on the length of the EBR chain, protects against loops */
+#define PARTITIONTABLE_MAX_LOGICAL  128
+
+static bool isExtendedType(uchar type)
+{
+    return type == 0x05 || type == 0x0F || type == 0x85;
+}
+
+/* Fill in an entry, with the CHS fields marked as "use LBA" */
+static void setEntry(mbr_partition_entry &e, quint32 start, quint32 size, uchar type)
+{
+    memset(&e, 0, sizeof e);
+    if (!size)
+        return;
+
+    e.starting_sector = start;
+    e.nr_of_sectors = size;
+    e.id = type;
+    e.begin_hsc[0] = e.end_hsc[0] = (char) 0xFE;
+    e.begin_hsc[1] = e.end_hsc[1] = (char) 0xFF;
+    e.begin_hsc[2] = e.end_hsc[2] = (char) 0xFF;
+}
+
+PartitionTable::PartitionTable(const QString &device)
+    : _device(device)
+{
+    memset(&_mbr, 0, sizeof _mbr);
+}
+
+QString PartitionTable::errorString() const
+{
+    return _error;
+}
+
+bool PartitionTable::fail(const QString &msg)
+{
+    qDebug() << msg;
+    _error = msg;
+    return false;
+}
+
+int PartitionTable::extendedIndex() const
+{
+    for (int i = 0; i < 4; i++)
+    {
+        if (isExtendedType(_mbr.part[i].id) && _mbr.part[i].nr_of_sectors)
+            return i;
+    }
+    return -1;
+}
+
+quint32 PartitionTable::extendedStart() const
+{
+    int i = extendedIndex();
+    return i == -1 ? 0 : _mbr.part[i].starting_sector;
+}
+
+quint32 PartitionTable::extendedSize() const
+{
+    int i = extendedIndex();
+    return i == -1 ? 0 : _mbr.part[i].nr_of_sectors;
+}
+
+bool PartitionTable::load()
+{
+    QFile f(_device);
+    _logical.clear();
+
+    if (!f.open(f.ReadOnly))
+        return fail("Error opening "+_device+" for reading");
+    if (f.read((char *) &_mbr, sizeof _mbr) != sizeof _mbr
+            || _mbr.signature[0] != 0x55 || _mbr.signature[1] != 0xAA)
+    {
+        return fail("No valid partition table on "+_device);
+    }
+
+    quint32 ext = extendedStart();
+    if (!ext)
+        return true;
+
+    /* Walk the EBR chain once. An EBR without a partition ends the chain */
+    quint32 offset = 0;
+    while (_logical.size() < PARTITIONTABLE_MAX_LOGICAL)
+    {
+        mbr_table ebr;
+
+        if (!f.seek(qint64(ext+offset)*512) || f.read((char *) &ebr, sizeof ebr) != sizeof ebr)
+            return fail("Error reading extended boot record");
+        if (ebr.signature[0] != 0x55 || ebr.signature[1] != 0xAA || !ebr.part[0].starting_sector)
+            break;
+
+        Logical l;
+        l.ebr = offset;
+        l.p.start = ext + offset + ebr.part[0].starting_sector;
+        l.p.size = ebr.part[0].nr_of_sectors;
+        l.p.type = ebr.part[0].id;
+        _logical.append(l);
+
+        if (!ebr.part[1].starting_sector)
+            break;
+        if (ebr.part[1].starting_sector <= offset)
+            return fail("Internal error in partitioning");
+        offset = ebr.part[1].starting_sector;
+    }
+
+    return true;
+}
+
+PartitionTable::Partition PartitionTable::primary(int nr) const
+{
+    const mbr_partition_entry &e = _mbr.part[nr-1];
+    Partition p;
+    p.start = e.starting_sector;
+    p.size = e.nr_of_sectors;
+    p.type = e.id;
+
+    return p;
+}
+
+void PartitionTable::setPrimary(int nr, quint32 start, quint32 size, uchar type)
+{
+    setEntry(_mbr.part[nr-1], start, size, type);
+}
+
+void PartitionTable::removePrimary(int nr)
+{
+    setEntry(_mbr.part[nr-1], 0, 0, 0);
+}
+
+int PartitionTable::logicalCount() const
+{
+    return _logical.size();
+}
+
+PartitionTable::Partition PartitionTable::logical(int nr) const
+{
+    return _logical.at(nr-5).p;
+}
+
+void PartitionTable::clearLogical()
+{
+    _logical.clear();
+}
+
+int PartitionTable::addLogical(quint32 sizeInSectors, uchar type, quint32 fixedStart)
+{
+    quint32 ext = extendedStart();
+    if (!ext)
+    {
+        fail("No extended partition on "+_device);
+        return -1;
+    }
+
+    /* The EBR goes directly after the previous logical partition */
+    Logical l;
+    l.ebr = 0;
+    if (!_logical.isEmpty())
+        l.ebr = _logical.last().p.start + _logical.last().p.size - ext;
+
+    if (fixedStart)
+    {
+        if (fixedStart < ext + l.ebr + EBR_PARTITION_OFFSET)
+        {
+            fail("Partition at fixed offset overlaps the previous partition");
+            return -1;
+        }
+        l.ebr = fixedStart - EBR_PARTITION_OFFSET - ext;
+        l.p.start = fixedStart;
+    }
+    else
+    {
+        /* Align the partition itself on a 4 MiB boundary */
+        l.p.start = ((ext + l.ebr + EBR_PARTITION_OFFSET + 6144) / 8192) * 8192;
+    }
+    l.p.size = sizeInSectors;
+    l.p.type = type;
+
+    if (qint64(l.p.start) + l.p.size > qint64(ext) + extendedSize())
+    {
+        fail("Not enough space in extended partition");
+        return -1;
+    }
+
+    _logical.append(l);
+    return 4 + _logical.size();
+}
+
+QString PartitionTable::partitionDevice(int nr) const
+{
+    /* Disks with a name ending in a digit use a 'p' separator */
+    if (!_device.isEmpty() && _device.at(_device.length()-1).isDigit())
+        return _device+"p"+QString::number(nr);
+    else
+        return _device+QString::number(nr);
+}
+
+bool PartitionTable::commit()
+{
+    QFile f(_device);
+
+    if (!f.open(f.ReadWrite))
+        return fail("Error opening "+_device+" for writing");
+    if (f.write((char *) &_mbr, sizeof _mbr) != sizeof _mbr)
+        return fail("Error writing partition table");
+
+    quint32 ext = extendedStart();
+    if (ext)
+    {
+        /* All EBRs in chain order. An empty chain still needs a terminating EBR */
+        for (int i = 0; i < qMax(_logical.size(), 1); i++)
+        {
+            mbr_table ebr;
+            quint32 offset = 0;
+
+            memset(&ebr, 0, sizeof ebr);
+            ebr.signature[0] = 0x55;
+            ebr.signature[1] = 0xAA;
+
+            if (i < _logical.size())
+            {
+                const Logical &l = _logical.at(i);
+                offset = l.ebr;
+                setEntry(ebr.part[0], l.p.start - (ext + l.ebr), l.p.size, l.p.type);
+
+                if (i+1 < _logical.size())
+                {
+                    const Logical &next = _logical.at(i+1);
+                    setEntry(ebr.part[1], next.ebr, next.p.start + next.p.size - (ext + next.ebr), 0x0F);
+                }
+            }
+
+            if (!f.seek(qint64(ext+offset)*512) || f.write((char *) &ebr, sizeof ebr) != sizeof ebr)
+                return fail("Error writing extended boot record");
+        }
+    }
+
+    f.flush();
+    if (::fsync(f.handle()) != 0)
+        return fail("Error syncing partition table");
+
+    /* Tell Linux to re-read the partition table */
+    if (::ioctl(f.handle(), BLKRRPART) != 0)
+    {
+        qDebug() << "BLKRRPART failed, falling back to partprobe";
+        f.close();
+        QProcess::execute("/usr/sbin/partprobe");
+    }
+    f.close();
+
+    /* Device nodes are created asynchronously. Wait for the last one */
+    int last = _logical.isEmpty() ? 1 : 4 + _logical.size();
+    QString lastDevice = partitionDevice(last);
+    for (int i = 0; i < 100 && !QFile::exists(lastDevice); i++)
+        ::usleep(20000);
+    if (!QFile::exists(lastDevice))
+        return fail(lastDevice+" did not appear after writing partition table");
+
+    qDebug() << "Partition table written," << _logical.size() << "logical partitions";
+    return true;
+}
@@ -0,0 +1,72 @@
+#ifndef PARTITIONTABLE_H
+#define PARTITIONTABLE_H
+
+/* In-memory MBR/EBR partition table
+ *
+ * Loads the primary partition table and the chain of extended boot
+ * records once, lets the caller plan the complete layout in memory,
+ * and writes the MBR and all EBRs in a single pass with commit(),
+ * followed by a single partition table re-read.
+ *
+ * Logical partitions are numbered by Linux in chain order, starting at 5.
+ *
+ * Maintained by Raspberry Pi
+ *
+ * See LICENSE.txt for license details
+ *
+ */
+
+#include "mbr.h"
+#include <QString>
+#include <QList>
+
+class PartitionTable
+{
+public:
+    struct Partition
+    {
+        quint32 start, size;    /* Absolute, in sectors */
+        uchar type;
+    };
+
+    explicit PartitionTable(const QString &device = "/dev/mmcblk0");
+
+    bool load();
+    /* Write the MBR and the complete EBR chain, and let Linux re-read it once */
+    bool commit();
+    QString errorString() const;
+
+    /* Primary partitions, numbered 1 to 4 */
+    Partition primary(int nr) const;
+    void setPrimary(int nr, quint32 start, quint32 size, uchar type);
+    void removePrimary(int nr);
+    quint32 extendedStart() const;
+    quint32 extendedSize() const;
+
+    int logicalCount() const;
+    Partition logical(int nr) const;
+    void clearLogical();
+    /* Append a logical partition after the last one, or at a fixed start sector.
+     * Returns the partition number, or -1 if it does not fit */
+    int addLogical(quint32 sizeInSectors, uchar type, quint32 fixedStart = 0);
+
+    /* Device name of a partition, e.g. /dev/mmcblk0p5 */
+    QString partitionDevice(int nr) const;
+
+protected:
+    struct Logical
+    {
+        quint32 ebr;            /* EBR location, relative to the extended partition */
+        Partition p;
+    };
+
+    int extendedIndex() const;
+    bool fail(const QString &msg);
+
+    QString _device;
+    mbr_table _mbr;
+    QList<Logical> _logical;
+    QString _error;
+};
+
+#endif // PARTITIONTABLE_H
@@ -0,0 +1,292 @@
+#include "rawimagewriter.h"
+#include "util.h"
+#include <QFile>
+#include <QFileInfo>
+#include <QDebug>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#ifdef __ARM_NEON__
+#include <arm_neon.h>
+#endif
+
+/* Sparse-aware writer for raw partition images
+ *
+ * Maintained by Raspberry Pi
+ *
+ * See LICENSE.txt for license details
+ *
+ */
+
+typedef quint64 __attribute__((__may_alias__)) aliased_quint64;
+
+RawImageWriter::RawImageWriter(int queueDepth, int chunkSize)
+    : _writer(queueDepth, chunkSize), _isFile(false), _zeroMode(ZeroByWriting), _pos(0), _zeroStart(0), _zeroLen(0),
+      _bytesWritten(0), _bytesSkipped(0)
+{
+}
+
+RawImageWriter::~RawImageWriter()
+{
+}
+
+QString RawImageWriter::errorString() const
+{
+    return _error;
+}
+
+qint64 RawImageWriter::bytesWritten() const
+{
+    return _bytesWritten;
+}
+
+qint64 RawImageWriter::bytesSkipped() const
+{
+    return _bytesSkipped;
+}
+
+void RawImageWriter::setVerifier(WriteVerifier *verifier)
+{
+    _writer.setVerifier(verifier);
+}
+
+bool RawImageWriter::fail(const QString &msg)
+{
+    _error = msg;
+    return false;
+}
+
+bool RawImageWriter::isZero(const char *data, qint64 len)
+{
+    const uchar *p = (const uchar *) data;
+
+    /* Check byte by byte up to a 16 byte boundary.
+     * Blocks with data usually already fail here */
+    while (len && ((quintptr) p & 15))
+    {
+        if (*p)
+            return false;
+        p++;
+        len--;
+    }
+
+#ifdef __ARM_NEON__
+    while (len >= 64)
+    {
+        uint8x16_t v = vorrq_u8(vorrq_u8(vld1q_u8(p), vld1q_u8(p+16)),
+                                vorrq_u8(vld1q_u8(p+32), vld1q_u8(p+48)));
+        uint64x2_t v64 = vreinterpretq_u64_u8(v);
+        if (vgetq_lane_u64(v64, 0) | vgetq_lane_u64(v64, 1))
+            return false;
+        p   += 64;
+        len -= 64;
+    }
+#else
+    while (len >= 64)
+    {
+        const aliased_quint64 *w = (const aliased_quint64 *) p;
+        if (w[0] | w[1] | w[2] | w[3] | w[4] | w[5] | w[6] | w[7])
+            return false;
+        p   += 64;
+        len -= 64;
+    }
+#endif
+
+    while (len)
+    {
+        if (*p)
+            return false;
+        p++;
+        len--;
+    }
+
+    return true;
+}
+
+/* Discard the whole device, if that is guaranteed to leave it zero filled */
+bool RawImageWriter::discardDevice(const QString &device)
+{
+    /* Partitions do not have a queue directory of their own, use the one of the disk */
+    QString name = QFileInfo(device).fileName();
+    QString queue = "/sys/class/block/"+name+"/queue";
+    if (!QFile::exists(queue))
+        queue = "/sys/class/block/"+name+"/../queue";
+
+    if (getFileContents(queue+"/discard_zeroes_data").trimmed() != "1"
+            || getFileContents(queue+"/discard_max_bytes").trimmed().toULongLong() == 0)
+    {
+        return false;
+    }
+
+    uint64_t range[2] = { 0, 0 };
+    if (::ioctl(_writer.fd(), BLKGETSIZE64, &range[1]) != 0 || ::ioctl(_writer.fd(), BLKDISCARD, range) != 0)
+    {
+        qDebug() << "Discarding" << device << "failed:" << strerror(errno);
+        return false;
+    }
+
+    qDebug() << "Discarded" << device << "(" << range[1] << "bytes ), skipping zero blocks";
+    return true;
+}
+
+bool RawImageWriter::open(const QString &device)
+{
+    if (!_writer.open(device))
+        return fail(_writer.errorString());
+
+    struct stat st;
+    if (::fstat(_writer.fd(), &st) != 0)
+        return fail("Error opening "+device+": "+strerror(errno));
+
+    if (S_ISREG(st.st_mode))
+    {
+        _isFile = true;
+        _zeroMode = ZeroBySkipping;
+        if (::ftruncate(_writer.fd(), 0) != 0)
+            return fail("Error truncating "+device+": "+strerror(errno));
+    }
+    else if (S_ISBLK(st.st_mode) && discardDevice(device))
+    {
+        _zeroMode = ZeroBySkipping;
+    }
+    else
+    {
+        _zeroMode = ZeroByIoctl;
+    }
+
+    return true;
+}
+
+bool RawImageWriter::writeAt(qint64 offset, const char *data, qint64 len)
+{
+    if (!_writer.write(offset, data, len))
+        return fail(_writer.errorString());
+    _bytesWritten += len;
+
+    return true;
+}
+
+bool RawImageWriter::flushZeroRun()
+{
+    if (!_zeroLen)
+        return true;
+
+    if (_zeroMode == ZeroByIoctl && !(_zeroStart % 512) && !(_zeroLen % 512))
+    {
+        uint64_t range[2] = { (uint64_t) _zeroStart, (uint64_t) _zeroLen };
+        if (::ioctl(_writer.fd(), BLKZEROOUT, range) == 0)
+        {
+            _bytesSkipped += _zeroLen;
+            _zeroLen = 0;
+            return true;
+        }
+        if (errno != ENOTTY && errno != EOPNOTSUPP && errno != EINVAL)
+            return fail(QString("Error clearing SD card blocks: ")+strerror(errno));
+
+        qDebug() << "BLKZEROOUT not supported, writing zero blocks";
+        _zeroMode = ZeroByWriting;
+    }
+
+    if (_zeroMode == ZeroBySkipping)
+    {
+        _bytesSkipped += _zeroLen;
+    }
+    else
+    {
+        static const QByteArray zeroes(RAWWRITER_BLOCK_SIZE, 0);
+
+        while (_zeroLen)
+        {
+            qint64 n = qMin(_zeroLen, (qint64) zeroes.size());
+            if (!writeAt(_zeroStart, zeroes.constData(), n))
+                return false;
+            _zeroStart += n;
+            _zeroLen   -= n;
+        }
+    }
+    _zeroLen = 0;
+
+    return true;
+}
+
+/* Write consecutive data blocks with a single call, and collect runs of zero blocks */
+bool RawImageWriter::processBlocks(const char *data, qint64 len)
+{
+    const char *runData = NULL;
+    qint64 runOffset = 0, runLen = 0;
+
+    for (qint64 offset = 0; offset < len; offset += RAWWRITER_BLOCK_SIZE)
+    {
+        qint64 n = qMin((qint64) RAWWRITER_BLOCK_SIZE, len - offset);
+
+        if (isZero(data+offset, n))
+        {
+            if (runLen && !writeAt(runOffset, runData, runLen))
+                return false;
+            runLen = 0;
+            if (!_zeroLen)
+                _zeroStart = _pos;
+            _zeroLen += n;
+        }
+        else
+        {
+            if (!flushZeroRun())
+                return false;
+            if (!runLen)
+            {
+                runData = data+offset;
+                runOffset = _pos;
+            }
+            runLen += n;
+        }
+        _pos += n;
+    }
+
+    return !runLen || writeAt(runOffset, runData, runLen);
+}
+
+bool RawImageWriter::write(const char *data, qint64 len)
+{
+    /* Complete a partial block left over from the previous call first */
+    if (!_pending.isEmpty())
+    {
+        qint64 n = qMin(len, (qint64) (RAWWRITER_BLOCK_SIZE - _pending.size()));
+        _pending.append(data, n);
+        data += n;
+        len  -= n;
+
+        if (_pending.size() < RAWWRITER_BLOCK_SIZE)
+            return true;
+        if (!processBlocks(_pending.constData(), _pending.size()))
+            return false;
+        _pending.clear();
+    }
+
+    qint64 full = len - len % RAWWRITER_BLOCK_SIZE;
+    if (!processBlocks(data, full))
+        return false;
+    _pending.append(data+full, len-full);
+
+    return true;
+}
+
+bool RawImageWriter::close()
+{
+    bool ok = processBlocks(_pending.constData(), _pending.size()) && flushZeroRun();
+    _pending.clear();
+
+    /* Trailing zero blocks only exist as a hole at the end of a file */
+    if (ok && _isFile && ::ftruncate(_writer.fd(), _pos) != 0)
+        ok = fail(QString("Error setting file size: ")+strerror(errno));
+    if (ok && !_writer.flush())
+        ok = fail(_writer.errorString());
+    if (!_writer.close() && ok)
+        ok = fail(_writer.errorString());
+
+    return ok;
+}
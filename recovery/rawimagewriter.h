@@ -0,0 +1,75 @@
+#ifndef RAWIMAGEWRITER_H
+#define RAWIMAGEWRITER_H
+
+/* Sparse-aware writer for raw partition images
+ *
+ * Takes the decompressed image as a sequential stream and writes
+ * it to a block device (or file), without writing blocks that
+ * consist of zeroes only:
+ *
+ * - if the device guarantees that discarded sectors read back as
+ *   zero, the whole device is discarded once and zero blocks are
+ *   simply skipped
+ * - otherwise runs of zero blocks are cleared with BLKZEROOUT
+ * - regular files get holes
+ *
+ * The actual writes go through BlockWriter (asynchronous direct I/O).
+ *
+ * Maintained by Raspberry Pi
+ *
+ * See LICENSE.txt for license details
+ *
+ */
+
+#include <QString>
+#include <QByteArray>
+#include "blockwriter.h"
+
+/* Granularity of the zero block detection. Multiple of 512 */
+#define RAWWRITER_BLOCK_SIZE    (64 * 1024)
+
+class RawImageWriter
+{
+public:
+    RawImageWriter(int queueDepth = BLOCKWRITER_DEFAULT_QUEUE_DEPTH, int chunkSize = BLOCKWRITER_DEFAULT_CHUNK_SIZE);
+    virtual ~RawImageWriter();
+
+    bool open(const QString &device);
+    /* Append data to the image. Does not need to be block aligned */
+    bool write(const char *data, qint64 len);
+    /* Flush remaining data and sync the device. No global sync() is needed afterwards */
+    bool close();
+    QString errorString() const;
+    /* Record the blocks written for read-back verification. Skipped zero blocks are not verified */
+    void setVerifier(WriteVerifier *verifier);
+
+    /* Statistics */
+    qint64 bytesWritten() const;
+    qint64 bytesSkipped() const;
+
+    static bool isZero(const char *data, qint64 len);
+
+protected:
+    enum ZeroMode
+    {
+        ZeroBySkipping,     /* Device was discarded up front, or is a regular file */
+        ZeroByIoctl,        /* BLKZEROOUT */
+        ZeroByWriting
+    };
+
+    bool writeAt(qint64 offset, const char *data, qint64 len);
+    bool processBlocks(const char *data, qint64 len);
+    bool flushZeroRun();
+    bool discardDevice(const QString &device);
+    bool fail(const QString &msg);
+
+    BlockWriter _writer;
+    bool _isFile;
+    ZeroMode _zeroMode;
+    qint64 _pos, _zeroStart, _zeroLen;
+    QByteArray _pending;
+    qint64 _bytesWritten, _bytesSkipped;
+    QString _error;
+};
+
+#endif // RAWIMAGEWRITER_H
@@ -10,7 +10,7 @@ greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
 
 TARGET = recovery
 TEMPLATE = app
-LIBS += -lqjson
+LIBS += -llzma -lz -lbz2 -llzo2 -laio -lzstd -llz4
 
 system(sh updateqm.sh 2>/dev/null)
 
@@ -24,10 +24,39 @@ SOURCES += main.cpp\
     confeditdialog.cpp \
     rightbuttonfilter.cpp \
     json.cpp \
+    jsonstream.cpp \
     multiimagewritethread.cpp \
     util.cpp \
     twoiconsdelegate.cpp \
-    bootselectiondialog.cpp
+    bootselectiondialog.cpp \
+    decompressor.cpp \
+    parallelxzdecompressor.cpp \
+    parallelzstddecompressor.cpp \
+    tarextractor.cpp \
+    ringbuffer.cpp \
+    imagepipeline.cpp \
+    rawimagewriter.cpp \
+    blockwriter.cpp \
+    partitiontable.cpp \
+    mountmanager.cpp \
+    filesystemprober.cpp \
+    installplanner.cpp \
+    taskgraph.cpp \
+    ext4builder.cpp \
+    fatbuilder.cpp \
+    chunkcache.cpp \
+    chunkindex.cpp \
+    sha256.cpp \
+    writeverifier.cpp \
+    httpconnection.cpp \
+    segmenteddownload.cpp \
+    metadownloader.cpp \
+    oslistcache.cpp \
+    iconstore.cpp \
+    catalogindex.cpp \
+    oscatalog.cpp \
+    oslistmodel.cpp \
+    verifiedfile.cpp
 
 HEADERS  += mainwindow.h \
     languagedialog.h \
@@ -40,10 +69,39 @@ HEADERS  += mainwindow.h \
     confeditdialog.h \
     rightbuttonfilter.h \
     json.h \
+    jsonstream.h \
     multiimagewritethread.h \
     util.h \
     twoiconsdelegate.h \
-    bootselectiondialog.h
+    bootselectiondialog.h \
+    decompressor.h \
+    parallelxzdecompressor.h \
+    parallelzstddecompressor.h \
+    tarextractor.h \
+    ringbuffer.h \
+    imagepipeline.h \
+    rawimagewriter.h \
+    blockwriter.h \
+    partitiontable.h \
+    mountmanager.h \
+    filesystemprober.h \
+    installplanner.h \
+    taskgraph.h \
+    ext4builder.h \
+    fatbuilder.h \
+    chunkcache.h \
+    chunkindex.h \
+    sha256.h \
+    writeverifier.h \
+    httpconnection.h \
+    segmenteddownload.h \
+    metadownloader.h \
+    oslistcache.h \
+    iconstore.h \
+    catalogindex.h \
+    oscatalog.h \
+    oslistmodel.h \
+    verifiedfile.h
 
 FORMS    += mainwindow.ui \
     languagedialog.ui \
@@ -0,0 +1,154 @@
+#include "ringbuffer.h"
+#include <QMutexLocker>
+#include <QTime>
+#include <string.h>
+
+/* Bounded ring buffer connecting two threads
+ *
+ * Maintained by Raspberry Pi
+ *
+ * See LICENSE.txt for license details
+ *
+ */
+
+RingBuffer::RingBuffer(int capacity, QObject *parent)
+    : QIODevice(parent), _buf(capacity, 0), _head(0), _fill(0), _eof(false), _aborted(false),
+      _totalBytes(0), _producerWait(0), _consumerWait(0)
+{
+    open(QIODevice::ReadOnly | QIODevice::Unbuffered);
+}
+
+bool RingBuffer::writeBlock(const char *data, qint64 len)
+{
+    QMutexLocker lock(&_mutex);
+
+    while (len)
+    {
+        if (_fill == _buf.size() && !_aborted)
+        {
+            QTime t;
+            t.start();
+            while (_fill == _buf.size() && !_aborted)
+                _notFull.wait(&_mutex);
+            _producerWait += t.elapsed();
+        }
+        if (_aborted)
+            return false;
+
+        /* Copy into the free space up to the end of the buffer, wrap around next iteration */
+        int tail = (_head + _fill) % _buf.size();
+        int n = qMin(len, (qint64) qMin(_buf.size() - _fill, _buf.size() - tail));
+        memcpy(_buf.data() + tail, data, n);
+        _fill += n;
+        _totalBytes += n;
+        data += n;
+        len  -= n;
+        _notEmpty.wakeAll();
+    }
+
+    return true;
+}
+
+void RingBuffer::closeWrite()
+{
+    QMutexLocker lock(&_mutex);
+    _eof = true;
+    _notEmpty.wakeAll();
+}
+
+void RingBuffer::abort(const QString &error)
+{
+    QMutexLocker lock(&_mutex);
+    if (!_aborted)
+    {
+        _aborted = true;
+        _error = error;
+    }
+    _notEmpty.wakeAll();
+    _notFull.wakeAll();
+}
+
+bool RingBuffer::isAborted() const
+{
+    QMutexLocker lock(&_mutex);
+    return _aborted;
+}
+
+bool RingBuffer::isSequential() const
+{
+    return true;
+}
+
+bool RingBuffer::waitForReadyRead(int)
+{
+    /* read() already blocks until data is available */
+    return false;
+}
+
+qint64 RingBuffer::bytesAvailable() const
+{
+    QMutexLocker lock(&_mutex);
+    return _fill;
+}
+
+qint64 RingBuffer::readData(char *data, qint64 maxlen)
+{
+    QMutexLocker lock(&_mutex);
+
+    if (_fill == 0 && !_eof && !_aborted)
+    {
+        QTime t;
+        t.start();
+        while (_fill == 0 && !_eof && !_aborted)
+            _notEmpty.wait(&_mutex);
+        _consumerWait += t.elapsed();
+    }
+    if (_aborted)
+    {
+        setErrorString(_error);
+        return -1;
+    }
+
+    int n = qMin(maxlen, (qint64) qMin(_fill, _buf.size() - _head));
+    memcpy(data, _buf.constData() + _head, n);
+    _head = (_head + n) % _buf.size();
+    _fill -= n;
+    _notFull.wakeAll();
+
+    return n;
+}
+
+qint64 RingBuffer::writeData(const char *, qint64)
+{
+    /* Producers use writeBlock() */
+    return -1;
+}
+
+int RingBuffer::capacity() const
+{
+    return _buf.size();
+}
+
+int RingBuffer::fill() const
+{
+    QMutexLocker lock(&_mutex);
+    return _fill;
+}
+
+qint64 RingBuffer::totalBytes() const
+{
+    QMutexLocker lock(&_mutex);
+    return _totalBytes;
+}
+
+qint64 RingBuffer::producerWaitMsecs() const
+{
+    QMutexLocker lock(&_mutex);
+    return _producerWait;
+}
+
+qint64 RingBuffer::consumerWaitMsecs() const
+{
+    QMutexLocker lock(&_mutex);
+    return _consumerWait;
+}
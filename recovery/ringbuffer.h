@@ -0,0 +1,63 @@
+#ifndef RINGBUFFER_H
+#define RINGBUFFER_H
+
+/* Bounded ring buffer connecting two threads
+ *
+ * One producer thread adds data with writeBlock(), one consumer
+ * thread reads it through the (sequential, read-only) QIODevice
+ * interface. Both sides block when the buffer is full or empty,
+ * and the time each side spent blocked is recorded, so it can be
+ * seen which end of the buffer is the bottleneck.
+ *
+ * Maintained by Raspberry Pi
+ *
+ * See LICENSE.txt for license details
+ *
+ */
+
+#include <QIODevice>
+#include <QByteArray>
+#include <QMutex>
+#include <QWaitCondition>
+
+class RingBuffer : public QIODevice
+{
+public:
+    explicit RingBuffer(int capacity, QObject *parent = 0);
+
+    /* Producer side. Blocks until everything is queued.
+     * Returns false if the buffer was aborted */
+    bool writeBlock(const char *data, qint64 len);
+    /* Producer is done. The consumer gets end of stream once the buffer is drained */
+    void closeWrite();
+
+    /* Either side: stop the transfer. Pending and future reads return -1
+     * with 'error' as errorString(), writes return false */
+    void abort(const QString &error);
+    bool isAborted() const;
+
+    virtual bool isSequential() const;
+    virtual bool waitForReadyRead(int msecs);
+    virtual qint64 bytesAvailable() const;
+
+    /* Occupancy counters */
+    int capacity() const;
+    int fill() const;
+    qint64 totalBytes() const;
+    qint64 producerWaitMsecs() const;
+    qint64 consumerWaitMsecs() const;
+
+protected:
+    virtual qint64 readData(char *data, qint64 maxlen);
+    virtual qint64 writeData(const char *data, qint64 len);
+
+    mutable QMutex _mutex;
+    QWaitCondition _notEmpty, _notFull;
+    QByteArray _buf;
+    int _head, _fill;
+    bool _eof, _aborted;
+    QString _error;
+    qint64 _totalBytes, _producerWait, _consumerWait;
+};
+
+#endif // RINGBUFFER_H
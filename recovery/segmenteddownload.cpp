@@ -0,0 +1,409 @@
+#include "segmenteddownload.h"
+#include "httpconnection.h"
+#include <QThread>
+#include <QMutexLocker>
+#include <QDebug>
+#include <string.h>
+
+/* Download of a file over several HTTP connections at once
+ *
+ * Maintained by Raspberry Pi
+ *
+ * See LICENSE.txt for license details
+ *
+ */
+
+/* Fetches segments over its own connection, until there are none left */
+class SegmentWorker : public QThread
+{
+public:
+    /* first: segment already requested over conn, if any. Takes ownership of conn */
+    SegmentWorker(SegmentedDownload *download, HttpConnection *conn, SegmentedDownload::Segment *first)
+        : _download(download), _conn(conn), _first(first)
+    {
+    }
+
+    virtual ~SegmentWorker()
+    {
+        delete _conn;
+    }
+
+    HttpConnection *connection() const
+    {
+        return _conn;
+    }
+
+protected:
+    virtual void run();
+    bool fetch(SegmentedDownload::Segment *s, bool requested);
+
+    SegmentedDownload *_download;
+    HttpConnection *_conn;
+    SegmentedDownload::Segment *_first;
+};
+
+void SegmentWorker::run()
+{
+    SegmentedDownload::Segment *s = _first;
+    bool requested = (s != NULL);
+
+    if (!s)
+        s = _download->takeSegment();
+
+    while (s && fetch(s, requested))
+    {
+        requested = false;
+        s = _download->takeSegment();
+    }
+}
+
+/* The reader frees the segment as soon as it is complete, so only its data is touched until then */
+bool SegmentWorker::fetch(SegmentedDownload::Segment *s, bool requested)
+{
+    qint64 start = s->start;
+    int len = s->len, filled = 0;
+    char *data = s->data.data();
+    int delay = 1;
+
+    while (filled < len)
+    {
+        int r = requested ? 1 : _download->request(*_conn, start + filled, start + len);
+        requested = false;
+        if (r < 0)
+            return false;
+        if (r > 0 && _conn->status() != 206)
+            return _download->setError("Server stopped accepting range requests for "+_download->_url);
+
+        qint64 n;
+        while (r > 0 && filled < len && (n = _conn->read(data + filled, len - filled)) > 0)
+        {
+            filled += n;
+            _download->segmentProgress(s, n);
+            delay = 1;
+        }
+
+        if (filled == len || _download->isStopped())
+            break;
+
+        qDebug() << "Segment at" << start+filled << "of" << _download->_url << "interrupted:"
+                 << _conn->errorString() << "- resuming in" << delay << "s";
+        _conn->close();
+        if (!_download->backOff(delay))
+            return false;
+    }
+
+    return !_download->isStopped();
+}
+
+SegmentedDownload::SegmentedDownload(const QString &url, qint64 start, qint64 end, int connections)
+    : _url(url), _start(start), _end(end), _connections(qMax(connections, 1)), _segmented(false),
+      _stream(NULL), _pos(start), _streamPos(0),
+      _segmentCount(0), _nextToFetch(0), _nextToRead(0), _readPos(0), _aborted(false)
+{
+}
+
+SegmentedDownload::~SegmentedDownload()
+{
+    abort();
+
+    foreach (SegmentWorker *w, _workers)
+        w->wait();
+    qDeleteAll(_workers);
+    foreach (Segment *s, _segments)
+        delete s;
+    delete _stream;
+}
+
+QString SegmentedDownload::errorString() const
+{
+    if (_error.isEmpty() && _aborted)
+        return "Download of "+_url+" aborted";
+    return _error;
+}
+
+/* The first error stops the download */
+bool SegmentedDownload::setError(const QString &msg)
+{
+    QMutexLocker lock(&_mutex);
+
+    if (_error.isEmpty() && !_aborted)
+    {
+        qDebug() << msg;
+        _error = msg;
+    }
+    _dataReady.wakeAll();
+    _spaceFree.wakeAll();
+    _retryWait.wakeAll();
+
+    return false;
+}
+
+bool SegmentedDownload::isStopped()
+{
+    QMutexLocker lock(&_mutex);
+    return _aborted || !_error.isEmpty();
+}
+
+void SegmentedDownload::abort()
+{
+    QMutexLocker lock(&_mutex);
+
+    _aborted = true;
+    if (_stream)
+        _stream->abort();
+    foreach (SegmentWorker *w, _workers)
+        w->connection()->abort();
+
+    _dataReady.wakeAll();
+    _spaceFree.wakeAll();
+    _retryWait.wakeAll();
+}
+
+/* Wait before retrying, doubling the delay every time. Returns false if the download was stopped meanwhile */
+bool SegmentedDownload::backOff(int &delay)
+{
+    QMutexLocker lock(&_mutex);
+
+    if (!_aborted && _error.isEmpty())
+        _retryWait.wait(&_mutex, delay*1000);
+    delay = qMin(delay*2, DOWNLOAD_MAX_RETRY_DELAY);
+
+    return !_aborted && _error.isEmpty();
+}
+
+/* Returns 1 if the request got a usable response, 0 if it is worth retrying, and -1 if not */
+int SegmentedDownload::request(HttpConnection &conn, qint64 start, qint64 end)
+{
+    /* abort() only reaches connections that are open already */
+    if (isStopped())
+        return -1;
+    if (!conn.get(_url, start, end, _validator))
+        return 0;
+
+    int status = conn.status();
+    if (status >= 500)
+    {
+        qDebug() << "Server error" << status << "downloading" << _url;
+        return 0;
+    }
+    if (status != 200 && status != 206 && status != 416)
+    {
+        QString msg = QString("Error downloading %1: server responded with status %2").arg(_url).arg(status);
+        if (status >= 300 && status < 400)
+            msg += ", redirecting to "+conn.header("location");
+        setError(msg);
+        return -1;
+    }
+    if (status == 206 && conn.bodyOffset() != start)
+    {
+        setError("Invalid range response downloading "+_url);
+        return -1;
+    }
+
+    /* With If-Range, a changed file is sent from the start */
+    if (!_validator.isEmpty() && conn.validator() != _validator)
+    {
+        setError(_url+" changed on the server during the download");
+        return -1;
+    }
+
+    return 1;
+}
+
+bool SegmentedDownload::open()
+{
+    HttpConnection *conn = new HttpConnection;
+    qint64 firstEnd = _start + DOWNLOAD_SEGMENT_SIZE;
+    if (_end != -1)
+        firstEnd = qMin(firstEnd, _end);
+
+    _mutex.lock();
+    _stream = conn;
+    _mutex.unlock();
+
+    if (!_url.toLower().startsWith("http://"))
+        return setError("Unsupported URL "+_url);
+
+    int r, delay = 1;
+    while ((r = request(*conn, _start, firstEnd)) == 0)
+    {
+        qDebug() << "Cannot download" << _url << ":" << conn->errorString() << "- retrying in" << delay << "s";
+        if (!backOff(delay))
+            return false;
+    }
+    if (r < 0)
+        return false;
+
+    /* The other connections go to the server the URL redirects to straight away */
+    _url = conn->url();
+    _validator = conn->validator();
+
+    if (conn->status() == 416)
+    {
+        /* Nothing from start on */
+        _segmented = true;
+        return true;
+    }
+
+    if (conn->status() == 206 && conn->fileSize() != -1)
+    {
+        QMutexLocker lock(&_mutex);
+
+        _end = (_end == -1) ? conn->fileSize() : qMin(_end, conn->fileSize());
+        _segmentCount = (_end - _start + DOWNLOAD_SEGMENT_SIZE - 1) / DOWNLOAD_SEGMENT_SIZE;
+        _segmented = true;
+        _stream = NULL;
+        int workers = qMin(_connections, _segmentCount);
+        lock.unlock();
+
+        Segment *first = takeSegment();
+        if (!first)
+        {
+            delete conn;
+            return false;
+        }
+
+        qDebug() << "Downloading" << _end-_start << "bytes of" << _url << "in" << _segmentCount << "segments over" << workers << "connections";
+
+        lock.relock();
+        for (int i = 0; i < workers; i++)
+        {
+            SegmentWorker *w = new SegmentWorker(this, i ? new HttpConnection : conn, i ? NULL : first);
+            _workers.append(w);
+            w->start();
+        }
+
+        return true;
+    }
+
+    /* No range support, or the size of the file is unknown */
+    qDebug() << "Downloading" << _url << "as a single stream";
+    if (conn->status() == 206)
+    {
+        while ((r = request(*conn, _start, _end)) == 0)
+        {
+            if (!backOff(delay))
+                return false;
+        }
+        if (r < 0)
+            return false;
+    }
+    _streamPos = conn->bodyOffset();
+
+    return true;
+}
+
+qint64 SegmentedDownload::read(char *buf, qint64 len)
+{
+    if (!_segmented)
+        return readStream(buf, len);
+
+    QMutexLocker lock(&_mutex);
+
+    forever
+    {
+        if (_aborted || !_error.isEmpty())
+            return -1;
+        if (_nextToRead == _segmentCount)
+            return 0;
+
+        Segment *s = _segments.value(_nextToRead);
+        if (s && s->filled > _readPos)
+        {
+            qint64 n = qMin(len, qint64(s->filled - _readPos));
+            memcpy(buf, s->data.constData() + _readPos, n);
+            _readPos += n;
+
+            if (_readPos == s->len)
+            {
+                _segments.remove(_nextToRead);
+                delete s;
+                _nextToRead++;
+                _readPos = 0;
+                _spaceFree.wakeAll();
+            }
+            return n;
+        }
+
+        _dataReady.wait(&_mutex);
+    }
+}
+
+/* Single stream. A server that ignores ranges sends the file from the start after an interruption,
+ * what was passed on already is skipped */
+qint64 SegmentedDownload::readStream(char *buf, qint64 len)
+{
+    int delay = 1;
+
+    forever
+    {
+        if (isStopped())
+            return -1;
+        if (_end != -1 && _pos >= _end)
+            return 0;
+
+        qint64 n = _stream->read(buf, (_end == -1) ? len : qMin(len, _end - qMax(_pos, _streamPos)));
+        if (n > 0)
+        {
+            qint64 skip = qMin(n, _pos - _streamPos);
+            _streamPos += n;
+            if (skip == n)
+                continue;
+
+            memmove(buf, buf+skip, n-skip);
+            _pos += n-skip;
+            return n-skip;
+        }
+        if (n == 0)
+        {
+            if (_end != -1)
+                setError(_url+" is smaller than expected");
+            return (_end == -1) ? 0 : -1;
+        }
+
+        if (isStopped())
+            return -1;
+        qDebug() << "Download of" << _url << "interrupted at" << _pos << "bytes:" << _stream->errorString() << "- resuming in" << delay << "s";
+
+        int r;
+        do
+        {
+            _stream->close();
+            if (!backOff(delay))
+                return -1;
+        } while ((r = request(*_stream, _pos, _end)) == 0);
+        if (r < 0)
+            return -1;
+        _streamPos = _stream->bodyOffset();
+    }
+}
+
+SegmentedDownload::Segment *SegmentedDownload::takeSegment()
+{
+    QMutexLocker lock(&_mutex);
+
+    while (!_aborted && _error.isEmpty() && _nextToFetch < _segmentCount
+           && _nextToFetch >= _nextToRead + _connections * DOWNLOAD_WINDOW_FACTOR)
+    {
+        _spaceFree.wait(&_mutex);
+    }
+    if (_aborted || !_error.isEmpty() || _nextToFetch == _segmentCount)
+        return NULL;
+
+    Segment *s = new Segment;
+    s->start  = _start + qint64(_nextToFetch) * DOWNLOAD_SEGMENT_SIZE;
+    s->len    = qMin(qint64(DOWNLOAD_SEGMENT_SIZE), _end - s->start);
+    s->filled = 0;
+    s->data.resize(s->len);
+    _segments.insert(_nextToFetch++, s);
+
+    return s;
+}
+
+void SegmentedDownload::segmentProgress(Segment *segment, int len)
+{
+    QMutexLocker lock(&_mutex);
+
+    segment->filled += len;
+    _dataReady.wakeAll();
+}
@@ -0,0 +1,95 @@
+#ifndef SEGMENTEDDOWNLOAD_H
+#define SEGMENTEDDOWNLOAD_H
+
+/* Download of a file over several HTTP connections at once
+ *
+ * The file is split into segments, which worker threads fetch with
+ * range requests. Every worker keeps its connection open from one
+ * segment to the next. read() returns the data in order, as soon as it
+ * arrives. The workers stay at most DOWNLOAD_WINDOW_FACTOR segments per
+ * connection ahead of the reader, which bounds the memory used.
+ *
+ * The response to the first request tells whether the server supports
+ * range requests. If it does not, the file is downloaded as a single
+ * stream instead. Either way, interrupted transfers are resumed until
+ * the download is aborted. HTTP errors are final.
+ *
+ * Maintained by Raspberry Pi
+ *
+ * See LICENSE.txt for license details
+ *
+ */
+
+#include <QString>
+#include <QByteArray>
+#include <QHash>
+#include <QList>
+#include <QMutex>
+#include <QWaitCondition>
+
+#define DOWNLOAD_SEGMENT_SIZE           (1024 * 1024)
+#define DOWNLOAD_DEFAULT_CONNECTIONS    4
+#define DOWNLOAD_WINDOW_FACTOR          2
+/* Longest wait before an interrupted transfer is resumed, in seconds */
+#define DOWNLOAD_MAX_RETRY_DELAY        30
+
+class HttpConnection;
+class SegmentWorker;
+
+class SegmentedDownload
+{
+public:
+    /* Bytes start to end-1 of url, or from start to the end of the file if end is -1 */
+    SegmentedDownload(const QString &url, qint64 start = 0, qint64 end = -1, int connections = DOWNLOAD_DEFAULT_CONNECTIONS);
+    virtual ~SegmentedDownload();
+
+    /* Send the first request, and start the workers if the server supports ranges */
+    bool open();
+    /* Returns 0 at the end of the download, -1 on errors or when aborted */
+    qint64 read(char *buf, qint64 len);
+    /* Stop the download, from any thread */
+    void abort();
+    QString errorString() const;
+
+protected:
+    struct Segment
+    {
+        qint64 start;
+        int len, filled;
+        QByteArray data;
+    };
+
+    int request(HttpConnection &conn, qint64 start, qint64 end);
+    bool backOff(int &delay);
+    bool setError(const QString &msg);
+    qint64 readStream(char *buf, qint64 len);
+
+    /* Called by the workers */
+    Segment *takeSegment();
+    void segmentProgress(Segment *segment, int len);
+    bool isStopped();
+
+    QString _url;
+    qint64 _start, _end;
+    int _connections;
+    /* ETag or Last-Modified of the first response */
+    QByteArray _validator;
+    bool _segmented;
+
+    /* Single stream: connection, bytes passed on, and position of the connection in the file */
+    HttpConnection *_stream;
+    qint64 _pos, _streamPos;
+
+    /* Segmented, protected by _mutex */
+    QMutex _mutex;
+    QWaitCondition _dataReady, _spaceFree, _retryWait;
+    QList<SegmentWorker *> _workers;
+    QHash<int,Segment *> _segments;
+    int _segmentCount, _nextToFetch, _nextToRead, _readPos;
+    bool _aborted;
+    QString _error;
+
+    friend class SegmentWorker;
+};
+
+#endif // SEGMENTEDDOWNLOAD_H
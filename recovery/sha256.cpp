@@ -0,0 +1,160 @@
+#include "sha256.h"
+#include <string.h>
+
+/* SHA-256 (FIPS 180-4)
+ *
+ * Maintained by Raspberry Pi
+ *
+ * See LICENSE.txt for license details
+ *
+ */
+
+static const quint32 K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline quint32 ror(quint32 x, int n)
+{
+    return (x >> n) | (x << (32 - n));
+}
+
+static inline quint32 be32(const uchar *p)
+{
+    return (quint32(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/* One round, with the roles of the working variables rotated instead of the variables themselves */
+#define ROUND(a, b, c, d, e, f, g, h, i) \
+    do { \
+        quint32 t1 = h + (ror(e, 6) ^ ror(e, 11) ^ ror(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i]; \
+        quint32 t2 = (ror(a, 2) ^ ror(a, 13) ^ ror(a, 22)) + ((a & b) ^ (a & c) ^ (b & c)); \
+        d += t1; \
+        h = t1 + t2; \
+    } while (0)
+
+Sha256::Sha256()
+{
+    reset();
+}
+
+void Sha256::reset()
+{
+    static const quint32 initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    memcpy(_state, initial, sizeof(_state));
+    _length = 0;
+    _buffered = 0;
+}
+
+void Sha256::compress(const uchar *block)
+{
+    quint32 w[64];
+    quint32 a = _state[0], b = _state[1], c = _state[2], d = _state[3];
+    quint32 e = _state[4], f = _state[5], g = _state[6], h = _state[7];
+
+    for (int i = 0; i < 16; i++)
+        w[i] = be32(block + 4*i);
+    for (int i = 16; i < 64; i++)
+    {
+        quint32 s0 = ror(w[i-15], 7) ^ ror(w[i-15], 18) ^ (w[i-15] >> 3);
+        quint32 s1 = ror(w[i-2], 17) ^ ror(w[i-2], 19) ^ (w[i-2] >> 10);
+        w[i] = w[i-16] + s0 + w[i-7] + s1;
+    }
+
+    for (int i = 0; i < 64; i += 8)
+    {
+        ROUND(a, b, c, d, e, f, g, h, i);
+        ROUND(h, a, b, c, d, e, f, g, i+1);
+        ROUND(g, h, a, b, c, d, e, f, i+2);
+        ROUND(f, g, h, a, b, c, d, e, i+3);
+        ROUND(e, f, g, h, a, b, c, d, i+4);
+        ROUND(d, e, f, g, h, a, b, c, i+5);
+        ROUND(c, d, e, f, g, h, a, b, i+6);
+        ROUND(b, c, d, e, f, g, h, a, i+7);
+    }
+
+    _state[0] += a; _state[1] += b; _state[2] += c; _state[3] += d;
+    _state[4] += e; _state[5] += f; _state[6] += g; _state[7] += h;
+}
+
+void Sha256::addData(const char *data, int length)
+{
+    const uchar *p = (const uchar *) data;
+    _length += length;
+
+    if (_buffered)
+    {
+        int n = qMin(length, 64 - _buffered);
+        memcpy(_buffer + _buffered, p, n);
+        _buffered += n;
+        p += n;
+        length -= n;
+
+        if (_buffered < 64)
+            return;
+        compress(_buffer);
+        _buffered = 0;
+    }
+
+    /* Whole blocks are hashed in place */
+    for (; length >= 64; p += 64, length -= 64)
+        compress(p);
+
+    memcpy(_buffer, p, length);
+    _buffered = length;
+}
+
+void Sha256::addData(const QByteArray &data)
+{
+    addData(data.constData(), data.size());
+}
+
+QByteArray Sha256::result()
+{
+    quint64 bits = _length * 8;
+    uchar pad[72];
+    int padLength = (_buffered < 56) ? 56 - _buffered : 120 - _buffered;
+
+    memset(pad, 0, sizeof(pad));
+    pad[0] = 0x80;
+    for (int i = 0; i < 8; i++)
+        pad[padLength + i] = bits >> (56 - 8*i);
+    addData((const char *) pad, padLength + 8);
+
+    QByteArray digest(32, 0);
+    for (int i = 0; i < 8; i++)
+    {
+        digest[4*i]   = _state[i] >> 24;
+        digest[4*i+1] = _state[i] >> 16;
+        digest[4*i+2] = _state[i] >> 8;
+        digest[4*i+3] = _state[i];
+    }
+
+    return digest;
+}
+
+QByteArray Sha256::hash(const QByteArray &data)
+{
+    Sha256 h;
+    h.addData(data);
+    return h.result();
+}
+
+ImageChecksums::ImageChecksums()
+    : chunkSize(IMAGE_CHECKSUM_CHUNK_SIZE)
+{
+}
+
+bool ImageChecksums::isEmpty() const
+{
+    return sha256.isEmpty() && chunks.isEmpty();
+}
@@ -0,0 +1,52 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+/* SHA-256, which QCryptographicHash of Qt 4 does not offer,
+ * and the checksums images can be verified against
+ *
+ * Maintained by Raspberry Pi
+ *
+ * See LICENSE.txt for license details
+ *
+ */
+
+#include <QByteArray>
+#include <QList>
+
+/* Default size of the parts of an image that have their own checksum */
+#define IMAGE_CHECKSUM_CHUNK_SIZE  (4 * 1024 * 1024)
+
+class Sha256
+{
+public:
+    Sha256();
+    void reset();
+    void addData(const char *data, int length);
+    void addData(const QByteArray &data);
+    /* Binary digest. The object has to be reset before it is used again */
+    QByteArray result();
+
+    static QByteArray hash(const QByteArray &data);
+
+protected:
+    void compress(const uchar *block);
+
+    quint32 _state[8];
+    quint64 _length;
+    uchar _buffer[64];
+    int _buffered;
+};
+
+/* Expected SHA-256 of an image file as a whole, and of each of its chunks of chunkSize bytes.
+ * Hex digests, empty if not given */
+struct ImageChecksums
+{
+    QByteArray sha256;
+    int chunkSize;
+    QList<QByteArray> chunks;
+
+    ImageChecksums();
+    bool isEmpty() const;
+};
+
+#endif // SHA256_H
@@ -0,0 +1,763 @@
+#include "tarextractor.h"
+#include "decompressor.h"
+#include <QIODevice>
+#include <QFile>
+#include <QDebug>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/xattr.h>
+#include <sys/sysmacros.h>
+
+/* In-process tar extractor
+ *
+ * Maintained by Raspberry Pi
+ *
+ * See LICENSE.txt for license details
+ *
+ */
+
+#define TAR_BLOCK_SIZE  512
+
+/* ustar header */
+struct tar_header
+{
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char padding[12];
+} __attribute__ ((packed));
+
+/* Old GNU sparse header. Shares the first 345 bytes with the ustar header */
+struct tar_sparse_entry
+{
+    char offset[12];
+    char numbytes[12];
+} __attribute__ ((packed));
+
+struct tar_gnu_header
+{
+    char ustar[345];
+    char atime[12];
+    char ctime[12];
+    char offset[12];
+    char longnames[4];
+    char unused;
+    tar_sparse_entry sparse[4];
+    char isextended;
+    char realsize[12];
+    char padding[17];
+} __attribute__ ((packed));
+
+struct tar_gnu_sparse_extension
+{
+    tar_sparse_entry sparse[21];
+    char isextended;
+    char padding[7];
+} __attribute__ ((packed));
+
+qint64 TarExtractor::paddedSize(qint64 size)
+{
+    return (size + TAR_BLOCK_SIZE - 1) & ~qint64(TAR_BLOCK_SIZE - 1);
+}
+
+/* Parse a numeric header field. Either octal, or base-256 for large values */
+static qint64 parseNumber(const char *field, int len)
+{
+    const uchar *p = (const uchar *) field;
+
+    if (p[0] & 0x80)
+    {
+        quint64 value = (p[0] == 0xff) ? ~quint64(0) : (p[0] & 0x7f);
+        for (int i = 1; i < len; i++)
+            value = (value << 8) | p[i];
+        return (qint64) value;
+    }
+
+    qint64 value = 0;
+    int i = 0;
+    while (i < len && p[i] == ' ')
+        i++;
+    while (i < len && p[i] >= '0' && p[i] <= '7')
+        value = (value << 3) | (p[i++] - '0');
+
+    return value;
+}
+
+static QByteArray parseString(const char *field, int len)
+{
+    return QByteArray(field, strnlen(field, len));
+}
+
+TarExtractor::TarExtractor(const QString &destination)
+    : _destination(QFile::encodeName(destination)), _stream(NULL), _buffer(TAREXTRACTOR_BUFFER_SIZE, 0),
+      _bytesProcessed(0), _bytesWritten(0), _entries(0), _warned(false),
+      _haveLongname(false), _haveLonglink(false), _havePax(false)
+{
+    while (_destination.endsWith('/'))
+        _destination.chop(1);
+}
+
+TarExtractor::~TarExtractor()
+{
+}
+
+QString TarExtractor::errorString() const
+{
+    return _error;
+}
+
+qint64 TarExtractor::bytesProcessed() const
+{
+    return _bytesProcessed;
+}
+
+qint64 TarExtractor::bytesWritten() const
+{
+    return _bytesWritten;
+}
+
+int TarExtractor::entriesExtracted() const
+{
+    return _entries;
+}
+
+bool TarExtractor::fail(const QString &msg)
+{
+    qDebug() << "Error extracting tarball:" << msg;
+    _error = msg;
+    return false;
+}
+
+void TarExtractor::metadataWarning(const QByteArray &target, const char *what)
+{
+    /* Filesystems like FAT do not support everything tar stores.
+     * Like tar, do not treat this as fatal, and only log the first occurrence */
+    if (!_warned)
+    {
+        qDebug() << "Warning: unable to set" << what << "of" << target << ":" << strerror(errno)
+                 << "(further warnings suppressed)";
+        _warned = true;
+    }
+}
+
+bool TarExtractor::readStream(char *data, qint64 len)
+{
+    if (!readFullyFromDevice(_stream, data, len))
+    {
+        QString err = _stream->errorString();
+        return fail("Unexpected end of tar stream"+(err.isEmpty() ? QString() : ": "+err));
+    }
+    _bytesProcessed += len;
+
+    return true;
+}
+
+bool TarExtractor::skipStream(qint64 len)
+{
+    while (len)
+    {
+        qint64 n = qMin(len, (qint64) _buffer.size());
+        if (!readStream(_buffer.data(), n))
+            return false;
+        len -= n;
+    }
+
+    return true;
+}
+
+bool TarExtractor::copyToFile(int fd, qint64 len)
+{
+    while (len)
+    {
+        qint64 n = qMin(len, (qint64) _buffer.size());
+        if (!readStream(_buffer.data(), n))
+            return false;
+
+        const char *p = _buffer.constData();
+        qint64 left = n;
+        while (left)
+        {
+            ssize_t written = ::write(fd, p, left);
+            if (written < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                return fail(QString("Error writing file: ")+strerror(errno));
+            }
+            p    += written;
+            left -= written;
+        }
+
+        _bytesWritten += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+bool TarExtractor::readLongData(qint64 size, QByteArray &data)
+{
+    if (size < 0 || size > 16 * 1024 * 1024)
+        return fail("Invalid extended header size");
+
+    data.resize(size);
+    if (!readStream(data.data(), size) || !skipStream(paddedSize(size) - size))
+        return false;
+
+    return true;
+}
+
+/* Reads the next header block. Sets endOfArchive at the end-of-archive marker or end of stream */
+bool TarExtractor::readHeader(char *block, bool &endOfArchive)
+{
+    endOfArchive = false;
+
+    /* End of stream exactly at a block boundary is accepted as end of archive */
+    qint64 n = readFromDevice(_stream, block, TAR_BLOCK_SIZE);
+    if (n == 0)
+    {
+        endOfArchive = true;
+        return true;
+    }
+    if (n < 0)
+        return fail("Error reading tar stream: "+_stream->errorString());
+    _bytesProcessed += n;
+    if (n < TAR_BLOCK_SIZE && !readStream(block+n, TAR_BLOCK_SIZE-n))
+        return false;
+
+    bool allZero = true;
+    for (int i = 0; i < TAR_BLOCK_SIZE && allZero; i++)
+    {
+        if (block[i])
+            allZero = false;
+    }
+    if (allZero)
+    {
+        endOfArchive = true;
+        return true;
+    }
+
+    const tar_header *h = (const tar_header *) block;
+    qint64 expected = parseNumber(h->chksum, sizeof(h->chksum));
+    qint64 usum = 0, ssum = 0;
+    for (int i = 0; i < TAR_BLOCK_SIZE; i++)
+    {
+        bool inChksum = (i >= 148 && i < 156);
+        usum += inChksum ? ' ' : (uchar) block[i];
+        ssum += inChksum ? ' ' : (signed char) block[i];
+    }
+    if (expected != usum && expected != ssum)
+        return fail("Invalid tar header checksum. Not a tar file or corrupted download?");
+
+    return true;
+}
+
+bool TarExtractor::parsePaxHeaders(const QByteArray &data, Entry &e, bool global)
+{
+    qint64 sparseOffset = -1;
+    int pos = 0;
+
+    while (pos < data.size())
+    {
+        /* "<length> <key>=<value>\n", where length includes itself */
+        int sp = data.indexOf(' ', pos);
+        if (sp == -1)
+            break;
+        bool ok;
+        int len = data.mid(pos, sp-pos).toInt(&ok);
+        if (!ok || len <= sp-pos+1 || pos+len > data.size() || data.at(pos+len-1) != '\n')
+            return fail("Invalid pax extended header");
+
+        QByteArray record = data.mid(sp+1, pos+len-sp-2);
+        pos += len;
+        int eq = record.indexOf('=');
+        if (eq == -1)
+            continue;
+        QByteArray key = record.left(eq);
+        QByteArray value = record.mid(eq+1);
+
+        if (key == "path")
+            e.path = value;
+        else if (key == "linkpath")
+            e.linkpath = value;
+        else if (key == "size" && !global)
+            e.size = value.toLongLong();
+        else if (key == "uid")
+            e.uid = value.toUInt();
+        else if (key == "gid")
+            e.gid = value.toUInt();
+        else if (key == "mtime")
+            e.mtime = value.split('.').first().toLongLong();
+        else if (key.startsWith("SCHILY.xattr."))
+            e.xattrs.insert(key.mid(13), value);
+        else if (key == "GNU.sparse.major")
+        {
+            e.sparse = true;
+            e.sparseMajor = value.toInt();
+        }
+        else if (key == "GNU.sparse.name")
+            e.path = value;
+        else if (key == "GNU.sparse.realsize" || key == "GNU.sparse.size")
+        {
+            e.sparse = true;
+            e.realsize = value.toLongLong();
+        }
+        else if (key == "GNU.sparse.offset")
+            sparseOffset = value.toLongLong();
+        else if (key == "GNU.sparse.numbytes")
+        {
+            if (sparseOffset < 0)
+                return fail("Invalid GNU sparse map");
+            e.sparseMap.append(qMakePair(sparseOffset, value.toLongLong()));
+            sparseOffset = -1;
+        }
+        else if (key == "GNU.sparse.map")
+        {
+            QList<QByteArray> numbers = value.split(',');
+            if (numbers.size() % 2)
+                return fail("Invalid GNU sparse map");
+            for (int i = 0; i+1 < numbers.size(); i += 2)
+                e.sparseMap.append(qMakePair(numbers.at(i).toLongLong(), numbers.at(i+1).toLongLong()));
+        }
+    }
+
+    return true;
+}
+
+bool TarExtractor::parseOldGnuSparse(const char *block, Entry &e)
+{
+    const tar_gnu_header *g = (const tar_gnu_header *) block;
+
+    e.sparse = true;
+    e.sparseMajor = 0;
+    e.realsize = parseNumber(g->realsize, sizeof(g->realsize));
+
+    for (int i = 0; i < 4 && g->sparse[i].offset[0]; i++)
+    {
+        e.sparseMap.append(qMakePair(parseNumber(g->sparse[i].offset, 12),
+                                     parseNumber(g->sparse[i].numbytes, 12)));
+    }
+
+    bool extended = g->isextended;
+    while (extended)
+    {
+        char ext[TAR_BLOCK_SIZE];
+        if (!readStream(ext, TAR_BLOCK_SIZE))
+            return false;
+
+        const tar_gnu_sparse_extension *x = (const tar_gnu_sparse_extension *) ext;
+        for (int i = 0; i < 21 && x->sparse[i].offset[0]; i++)
+        {
+            e.sparseMap.append(qMakePair(parseNumber(x->sparse[i].offset, 12),
+                                         parseNumber(x->sparse[i].numbytes, 12)));
+        }
+        extended = x->isextended;
+    }
+
+    return true;
+}
+
+/* Sparse format 1.0 stores the map as decimal numbers at the start of the file data */
+bool TarExtractor::readSparseMap10(Entry &e, qint64 &consumed)
+{
+    QByteArray map;
+    int pos = 0;
+    qint64 count = -1, offset = -1;
+
+    while (count == -1 || e.sparseMap.size() < count)
+    {
+        int nl = map.indexOf('\n', pos);
+        if (nl == -1)
+        {
+            if (consumed + TAR_BLOCK_SIZE > e.size || map.size() > 1024 * 1024)
+                return fail("Invalid GNU sparse map");
+            char block[TAR_BLOCK_SIZE];
+            if (!readStream(block, TAR_BLOCK_SIZE))
+                return false;
+            consumed += TAR_BLOCK_SIZE;
+            map.append(block, TAR_BLOCK_SIZE);
+            continue;
+        }
+
+        bool ok;
+        qint64 value = map.mid(pos, nl-pos).toLongLong(&ok);
+        if (!ok || value < 0)
+            return fail("Invalid GNU sparse map");
+        pos = nl+1;
+
+        if (count == -1)
+            count = value;
+        else if (offset == -1)
+            offset = value;
+        else
+        {
+            e.sparseMap.append(qMakePair(offset, value));
+            offset = -1;
+        }
+    }
+
+    return true;
+}
+
+bool TarExtractor::sanitizePath(QByteArray &path)
+{
+    while (path.startsWith('/'))
+        path.remove(0, 1);
+    while (path.startsWith("./"))
+        path.remove(0, 2);
+    if (path == ".")
+        path.clear();
+    while (path.endsWith('/'))
+        path.chop(1);
+
+    foreach (QByteArray component, path.split('/'))
+    {
+        if (component == "..")
+            return false;
+    }
+
+    return true;
+}
+
+bool TarExtractor::createParents(const QByteArray &target)
+{
+    for (int i = _destination.size()+1; i < target.size(); i++)
+    {
+        if (target.at(i) == '/')
+        {
+            if (::mkdir(target.left(i).constData(), 0755) == -1 && errno != EEXIST)
+                return false;
+        }
+    }
+
+    return true;
+}
+
+void TarExtractor::applyMetadata(const QByteArray &target, int fd, const Entry &e)
+{
+    const char *path = target.constData();
+    bool isLink = (e.type == '2');
+
+    /* Ownership first, as chown() clears setuid bits and file capabilities */
+    if ((fd != -1 ? ::fchown(fd, e.uid, e.gid) : ::lchown(path, e.uid, e.gid)) == -1)
+        metadataWarning(target, "ownership");
+
+    if (!isLink && (fd != -1 ? ::fchmod(fd, e.mode) : ::chmod(path, e.mode)) == -1)
+        metadataWarning(target, "permissions");
+
+    for (QMap<QByteArray,QByteArray>::const_iterator i = e.xattrs.constBegin(); i != e.xattrs.constEnd(); i++)
+    {
+        int ret;
+        if (fd != -1)
+            ret = ::fsetxattr(fd, i.key().constData(), i.value().constData(), i.value().size(), 0);
+        else
+            ret = ::lsetxattr(path, i.key().constData(), i.value().constData(), i.value().size(), 0);
+        if (ret == -1)
+            metadataWarning(target, "extended attributes");
+    }
+
+    if (e.type != '5')
+    {
+        struct timespec times[2];
+        times[0].tv_sec = times[1].tv_sec = e.mtime;
+        times[0].tv_nsec = times[1].tv_nsec = 0;
+        if ((fd != -1 ? ::futimens(fd, times) : ::utimensat(AT_FDCWD, path, times, AT_SYMLINK_NOFOLLOW)) == -1)
+            metadataWarning(target, "modification time");
+    }
+}
+
+bool TarExtractor::extractFile(const QByteArray &target, Entry &e)
+{
+    ::unlink(target.constData());
+    int fd = ::open(target.constData(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1 && errno == ENOENT && createParents(target))
+        fd = ::open(target.constData(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1)
+        return fail("Error creating '"+QString::fromLocal8Bit(target)+"': "+strerror(errno));
+
+    qint64 consumed = 0;
+    bool ok = true;
+
+    if (e.sparse)
+    {
+        if (e.sparseMajor == 1)
+            ok = readSparseMap10(e, consumed);
+
+        for (int i = 0; ok && i < e.sparseMap.size(); i++)
+        {
+            qint64 offset = e.sparseMap.at(i).first, len = e.sparseMap.at(i).second;
+
+            if (offset < 0 || len < 0 || offset+len > e.realsize || consumed+len > e.size)
+                ok = fail("Invalid GNU sparse map");
+            else if (::lseek(fd, offset, SEEK_SET) == -1)
+                ok = fail(QString("Error seeking in sparse file: ")+strerror(errno));
+            else
+                ok = copyToFile(fd, len);
+            consumed += len;
+        }
+
+        if (ok && ::ftruncate(fd, e.realsize) == -1)
+            ok = fail(QString("Error setting size of sparse file: ")+strerror(errno));
+    }
+    else
+    {
+        /* Reserve the space up front, so the file gets contiguous extents.
+         * Not supported by all filesystems, which is fine */
+        if (e.size > 0)
+            ::fallocate(fd, 0, 0, e.size);
+
+        ok = copyToFile(fd, e.size);
+        consumed = e.size;
+    }
+
+    if (ok)
+    {
+        applyMetadata(target, fd, e);
+    }
+
+    if (::close(fd) == -1 && ok)
+        ok = fail("Error writing '"+QString::fromLocal8Bit(target)+"': "+strerror(errno));
+
+    return ok && skipStream(paddedSize(e.size) - consumed);
+}
+
+bool TarExtractor::extractEntry(Entry &e)
+{
+    QByteArray path = e.path;
+
+    if (!sanitizePath(path))
+    {
+        qDebug() << "Skipping tar member with '..' in its path:" << e.path;
+        return skipStream(paddedSize(e.size));
+    }
+    QByteArray target = path.isEmpty() ? _destination : _destination+"/"+path;
+
+    if (path.isEmpty() && e.type != '5')
+        return skipStream(paddedSize(e.size));
+
+    switch (e.type)
+    {
+    case '0':
+    case '7':
+    case 'S':
+        if (!extractFile(target, e))
+            return false;
+        _entries++;
+        return true;
+
+    case '1':
+    {
+        QByteArray linkpath = e.linkpath;
+        if (!sanitizePath(linkpath) || linkpath.isEmpty())
+        {
+            qDebug() << "Skipping hard link to invalid target:" << e.linkpath;
+            break;
+        }
+        linkpath = _destination+"/"+linkpath;
+
+        ::unlink(target.constData());
+        int ret = ::link(linkpath.constData(), target.constData());
+        if (ret == -1 && errno == ENOENT && createParents(target))
+            ret = ::link(linkpath.constData(), target.constData());
+        if (ret == -1)
+            return fail("Error creating hard link '"+QString::fromLocal8Bit(target)+"': "+strerror(errno));
+        _entries++;
+        break;
+    }
+
+    case '2':
+    {
+        ::unlink(target.constData());
+        int ret = ::symlink(e.linkpath.constData(), target.constData());
+        if (ret == -1 && errno == ENOENT && createParents(target))
+            ret = ::symlink(e.linkpath.constData(), target.constData());
+        if (ret == -1)
+            return fail("Error creating symbolic link '"+QString::fromLocal8Bit(target)+"': "+strerror(errno));
+        applyMetadata(target, -1, e);
+        _entries++;
+        break;
+    }
+
+    case '5':
+    {
+        if (!path.isEmpty())
+        {
+            int ret = ::mkdir(target.constData(), 0700);
+            if (ret == -1 && errno == ENOENT && createParents(target))
+                ret = ::mkdir(target.constData(), 0700);
+            if (ret == -1 && errno == EEXIST)
+            {
+                struct stat st;
+                if (::lstat(target.constData(), &st) == 0 && S_ISDIR(st.st_mode))
+                    ret = 0;
+                else if (::unlink(target.constData()) == 0)
+                    ret = ::mkdir(target.constData(), 0700);
+            }
+            if (ret == -1)
+                return fail("Error creating directory '"+QString::fromLocal8Bit(target)+"': "+strerror(errno));
+        }
+        applyMetadata(target, -1, e);
+        _dirTimes.append(qMakePair(target, e.mtime));
+        _entries++;
+        break;
+    }
+
+    case '3':
+    case '4':
+    case '6':
+    {
+        mode_t type = (e.type == '3') ? S_IFCHR : (e.type == '4') ? S_IFBLK : S_IFIFO;
+        ::unlink(target.constData());
+        int ret = ::mknod(target.constData(), type | 0600, makedev(e.devmajor, e.devminor));
+        if (ret == -1 && errno == ENOENT && createParents(target))
+            ret = ::mknod(target.constData(), type | 0600, makedev(e.devmajor, e.devminor));
+        if (ret == -1)
+        {
+            /* e.g. FAT does not support special files */
+            metadataWarning(target, "device node");
+            break;
+        }
+        applyMetadata(target, -1, e);
+        _entries++;
+        break;
+    }
+
+    default:
+        qDebug() << "Skipping tar member of unsupported type" << e.type << ":" << e.path;
+    }
+
+    return skipStream(paddedSize(e.size));
+}
+
+bool TarExtractor::extract(QIODevice *tarstream)
+{
+    char block[TAR_BLOCK_SIZE];
+    const tar_header *h = (const tar_header *) block;
+    _stream = tarstream;
+
+    forever
+    {
+        bool endOfArchive;
+        if (!readHeader(block, endOfArchive))
+            return false;
+        if (endOfArchive)
+            break;
+
+        Entry e;
+        e.type = h->typeflag ? h->typeflag : '0';
+        e.size = parseNumber(h->size, sizeof(h->size));
+
+        /* Extended headers describing the next member */
+        if (e.type == 'L')
+        {
+            if (!readLongData(e.size, _longname))
+                return false;
+            _longname = parseString(_longname.constData(), _longname.size());
+            _haveLongname = true;
+            continue;
+        }
+        else if (e.type == 'K')
+        {
+            if (!readLongData(e.size, _longlink))
+                return false;
+            _longlink = parseString(_longlink.constData(), _longlink.size());
+            _haveLonglink = true;
+            continue;
+        }
+        else if (e.type == 'x' || e.type == 'X')
+        {
+            if (!readLongData(e.size, _paxHeaders))
+                return false;
+            _havePax = true;
+            continue;
+        }
+        else if (e.type == 'g')
+        {
+            QByteArray global;
+            if (!readLongData(e.size, global))
+                return false;
+            _paxGlobalHeaders.append(global);
+            continue;
+        }
+
+        e.path = parseString(h->name, sizeof(h->name));
+        /* POSIX ustar splits long names into prefix and name. Old GNU uses these bytes for other things */
+        if (memcmp(h->magic, "ustar", 6) == 0 && h->prefix[0])
+            e.path = parseString(h->prefix, sizeof(h->prefix))+"/"+e.path;
+        e.linkpath = parseString(h->linkname, sizeof(h->linkname));
+        e.mode     = parseNumber(h->mode, sizeof(h->mode)) & 07777;
+        e.uid      = parseNumber(h->uid, sizeof(h->uid));
+        e.gid      = parseNumber(h->gid, sizeof(h->gid));
+        e.mtime    = parseNumber(h->mtime, sizeof(h->mtime));
+        e.devmajor = parseNumber(h->devmajor, sizeof(h->devmajor));
+        e.devminor = parseNumber(h->devminor, sizeof(h->devminor));
+        e.sparse   = false;
+        e.sparseMajor = 0;
+        e.realsize = 0;
+
+        /* Pre-POSIX archives mark directories with a trailing slash */
+        if (e.type == '0' && e.path.endsWith('/'))
+            e.type = '5';
+
+        if (_haveLongname)
+            e.path = _longname;
+        if (_haveLonglink)
+            e.linkpath = _longlink;
+        if (e.type == 'S' && !parseOldGnuSparse(block, e))
+            return false;
+        if (!_paxGlobalHeaders.isEmpty() && !parsePaxHeaders(_paxGlobalHeaders, e, true))
+            return false;
+        if (_havePax && !parsePaxHeaders(_paxHeaders, e, false))
+            return false;
+        _haveLongname = _haveLonglink = _havePax = false;
+
+        if (e.sparse && e.type != '0' && e.type != '7' && e.type != 'S')
+            e.sparse = false;
+
+        if (e.size < 0)
+            return fail("Invalid tar member size");
+        if (!extractEntry(e))
+            return false;
+    }
+
+    /* Consume the rest of the stream, so the decompressor gets to verify
+     * its checksums and the download can finish */
+    qint64 n;
+    while ((n = readFromDevice(_stream, _buffer.data(), _buffer.size())) > 0)
+        _bytesProcessed += n;
+    if (n < 0)
+        return fail("Error reading tar stream: "+_stream->errorString());
+
+    return finishExtraction();
+}
+
+bool TarExtractor::finishExtraction()
+{
+    for (int i = _dirTimes.size()-1; i >= 0; i--)
+    {
+        struct timespec times[2];
+        times[0].tv_sec = times[1].tv_sec = _dirTimes.at(i).second;
+        times[0].tv_nsec = times[1].tv_nsec = 0;
+        if (::utimensat(AT_FDCWD, _dirTimes.at(i).first.constData(), times, 0) == -1)
+            metadataWarning(_dirTimes.at(i).first, "modification time");
+    }
+
+    return true;
+}
@@ -0,0 +1,100 @@
+#ifndef TAREXTRACTOR_H
+#define TAREXTRACTOR_H
+
+/* In-process tar extractor
+ *
+ * Reads a tar stream (ustar, GNU or pax) from a QIODevice
+ * and recreates the files below a destination directory,
+ * preserving numeric ownership, permissions, modification
+ * times, extended attributes and sparse files.
+ *
+ * Maintained by Raspberry Pi
+ *
+ * See LICENSE.txt for license details
+ *
+ */
+
+#include <QString>
+#include <QByteArray>
+#include <QList>
+#include <QPair>
+#include <QMap>
+
+class QIODevice;
+
+/* Size of the buffer file data is copied through */
+#define TAREXTRACTOR_BUFFER_SIZE  (1024 * 1024)
+
+class TarExtractor
+{
+public:
+    explicit TarExtractor(const QString &destination);
+    virtual ~TarExtractor();
+
+    /* Extract the tar stream read from 'tarstream'. Returns false on error */
+    bool extract(QIODevice *tarstream);
+    QString errorString() const;
+
+    /* Number of bytes of tar stream consumed */
+    qint64 bytesProcessed() const;
+    /* Number of bytes of file data written */
+    qint64 bytesWritten() const;
+    /* Number of archive members created */
+    int entriesExtracted() const;
+
+protected:
+    struct Entry
+    {
+        QByteArray path, linkpath;
+        char type;
+        uint mode, uid, gid, devmajor, devminor;
+        qint64 size, mtime;
+        QMap<QByteArray,QByteArray> xattrs;
+
+        /* Sparse files: list of (offset, length) data segments */
+        bool sparse;
+        int sparseMajor;
+        qint64 realsize;
+        QList<QPair<qint64,qint64> > sparseMap;
+    };
+
+    static qint64 paddedSize(qint64 size);
+    bool readHeader(char *block, bool &endOfArchive);
+    bool parsePaxHeaders(const QByteArray &data, Entry &e, bool global);
+    bool parseOldGnuSparse(const char *block, Entry &e);
+    bool readSparseMap10(Entry &e, qint64 &consumed);
+    bool readLongData(qint64 size, QByteArray &data);
+    /* Create a single archive member. Its data is read from the stream */
+    virtual bool extractEntry(Entry &e);
+    /* Called after the whole stream has been read */
+    virtual bool finishExtraction();
+    bool extractFile(const QByteArray &target, Entry &e);
+    bool createParents(const QByteArray &target);
+    bool sanitizePath(QByteArray &path);
+    void applyMetadata(const QByteArray &target, int fd, const Entry &e);
+    void metadataWarning(const QByteArray &target, const char *what);
+
+    bool readStream(char *data, qint64 len);
+    bool skipStream(qint64 len);
+    bool copyToFile(int fd, qint64 len);
+    bool fail(const QString &msg);
+
+    QByteArray _destination;
+    QIODevice *_stream;
+    QString _error;
+    QByteArray _buffer;
+    qint64 _bytesProcessed, _bytesWritten;
+    int _entries;
+    bool _warned;
+
+    /* Extended headers that apply to the next member, or all following members */
+    QByteArray _longname, _longlink;
+    QByteArray _paxHeaders, _paxGlobalHeaders;
+    bool _haveLongname, _haveLonglink, _havePax;
+
+    /* Directory modification times are set after extraction,
+     * as creating files inside them updates them */
+    QList<QPair<QByteArray,qint64> > _dirTimes;
+};
+
+#endif // TAREXTRACTOR_H
@@ -0,0 +1,164 @@
+#include "taskgraph.h"
+#include <QDebug>
+
+/* Dependency graph of tasks, executed on a pool of worker threads
+ *
+ * Maintained by Raspberry Pi
+ *
+ * See LICENSE.txt for license details
+ *
+ */
+
+TaskGraph::Task::Task()
+    : _dependencies(0), _pending(0), _memory(0)
+{
+}
+
+TaskGraph::Task::~Task()
+{
+}
+
+void TaskGraph::Task::dependsOn(Task *task)
+{
+    task->_dependents.append(this);
+    _dependencies++;
+}
+
+void TaskGraph::Task::setMemory(qint64 bytes)
+{
+    _memory = bytes;
+}
+
+qint64 TaskGraph::Task::memory() const
+{
+    return _memory;
+}
+
+TaskGraph::TaskGraph()
+    : _memoryBudget(0), _unfinished(0), _running(0), _memoryReserved(0), _failed(false)
+{
+}
+
+TaskGraph::~TaskGraph()
+{
+    qDeleteAll(_tasks);
+}
+
+TaskGraph::Task *TaskGraph::add(Task *task)
+{
+    _tasks.append(task);
+    return task;
+}
+
+void TaskGraph::setMemoryBudget(qint64 bytes)
+{
+    _memoryBudget = bytes;
+}
+
+bool TaskGraph::run(int threads)
+{
+    _ready.clear();
+    _unfinished = _tasks.size();
+    _running = 0;
+    _memoryReserved = 0;
+    _failed = false;
+
+    foreach (Task *task, _tasks)
+    {
+        task->_pending = task->_dependencies;
+        if (!task->_pending)
+            _ready.append(task);
+    }
+
+    QList<TaskWorker *> workers;
+    for (int i = 0; i < qMin(qMax(threads, 1), _tasks.size()); i++)
+    {
+        TaskWorker *worker = new TaskWorker(this);
+        worker->start();
+        workers.append(worker);
+    }
+
+    foreach (TaskWorker *worker, workers)
+    {
+        worker->wait();
+        delete worker;
+    }
+
+    return !_failed && !_unfinished;
+}
+
+/* Blocks until a task is ready to run and its memory claim fits. Returns NULL if there is nothing left to do */
+TaskGraph::Task *TaskGraph::takeTask()
+{
+    QMutexLocker lock(&_mutex);
+
+    forever
+    {
+        if (_failed || !_unfinished)
+            return NULL;
+
+        for (int i = 0; i < _ready.size(); i++)
+        {
+            Task *task = _ready.at(i);
+
+            /* Without other claims a task runs even if it wants more than the budget, or it would never start */
+            if (_memoryBudget && _memoryReserved && _memoryReserved + task->_memory > _memoryBudget)
+                continue;
+
+            _running++;
+            _memoryReserved += task->_memory;
+            return _ready.takeAt(i);
+        }
+
+        /* Ready tasks waiting for memory always find it once the running tasks have finished */
+        if (!_running)
+        {
+            /* Nothing running and nothing ready, but unfinished tasks: circular dependency */
+            qDebug() << "Task graph has circular dependencies," << _unfinished << "tasks cannot be started";
+            _failed = true;
+            _changed.wakeAll();
+            return NULL;
+        }
+
+        _changed.wait(&_mutex);
+    }
+}
+
+void TaskGraph::finishTask(Task *task, bool ok)
+{
+    QMutexLocker lock(&_mutex);
+
+    _running--;
+    _unfinished--;
+    _memoryReserved -= task->_memory;
+
+    if (ok)
+    {
+        foreach (Task *dependent, task->_dependents)
+        {
+            if (--dependent->_pending == 0)
+                _ready.append(dependent);
+        }
+    }
+    else
+    {
+        _failed = true;
+    }
+
+    _changed.wakeAll();
+}
+
+TaskWorker::TaskWorker(TaskGraph *graph)
+    : QThread(), _graph(graph)
+{
+}
+
+void TaskWorker::run()
+{
+    TaskGraph::Task *task;
+
+    while ((task = _graph->takeTask()) != NULL)
+    {
+        _graph->finishTask(task, task->run());
+    }
+}
@@ -0,0 +1,92 @@
+#ifndef TASKGRAPH_H
+#define TASKGRAPH_H
+
+/* Dependency graph of tasks, executed on a pool of worker threads
+ *
+ * A task is started as soon as all tasks it depends on have finished
+ * successfully, so independent tasks run at the same time.
+ * If a task fails no further tasks are started, the tasks that are
+ * already running are allowed to finish.
+ *
+ * Tasks may claim part of a shared memory budget. A task is only started
+ * while its claim fits in what the running tasks have left of the budget,
+ * so memory hungry tasks wait for each other instead of each sizing its
+ * buffers for all of the memory. A task with a claim larger than the
+ * budget runs when no other claim is held.
+ *
+ * Maintained by Raspberry Pi
+ *
+ * See LICENSE.txt for license details
+ *
+ */
+
+#include <QList>
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+
+class TaskWorker;
+
+class TaskGraph
+{
+public:
+    class Task
+    {
+    public:
+        Task();
+        virtual ~Task();
+        /* Executed on a worker thread. Returns false on failure */
+        virtual bool run() = 0;
+        /* This task is not started before task finished */
+        void dependsOn(Task *task);
+        /* Bytes of the graph's memory budget held while the task runs */
+        void setMemory(qint64 bytes);
+        qint64 memory() const;
+
+    protected:
+        QList<Task *> _dependents;
+        int _dependencies, _pending;
+        qint64 _memory;
+
+        friend class TaskGraph;
+    };
+
+    TaskGraph();
+    /* Deletes all tasks */
+    virtual ~TaskGraph();
+    /* The graph takes ownership of the task */
+    Task *add(Task *task);
+    /* Memory shared by the claims of the running tasks. 0, the default, is unlimited */
+    void setMemoryBudget(qint64 bytes);
+    /* Runs all tasks, and blocks until they have finished or one failed */
+    bool run(int threads);
+
+protected:
+    Task *takeTask();
+    void finishTask(Task *task, bool ok);
+
+    QList<Task *> _tasks;
+    qint64 _memoryBudget;
+
+    /* Shared with the workers, protected by _mutex */
+    QMutex _mutex;
+    QWaitCondition _changed;
+    QList<Task *> _ready;
+    int _unfinished, _running;
+    qint64 _memoryReserved;
+    bool _failed;
+
+    friend class TaskWorker;
+};
+
+class TaskWorker : public QThread
+{
+public:
+    explicit TaskWorker(TaskGraph *graph);
+
+protected:
+    virtual void run();
+    TaskGraph *_graph;
+};
+
+#endif // TASKGRAPH_H
@@ -1,4 +1,4 @@
-/* Delegate for a QListWidget that can draw a second icon
+/* Delegate for a list view that can draw a second icon
  * at the right side of the item
  *
  * Initial author: Floris Bos
@@ -9,25 +9,60 @@
  */
 
 #include "twoiconsdelegate.h"
+#include "iconstore.h"
+#include <QApplication>
+#include <QStyle>
 #include <QPainter>
 #include <QStyleOptionViewItem>
 #include <QModelIndex>
 
-TwoIconsDelegate::TwoIconsDelegate(QObject *parent) :
-    QStyledItemDelegate(parent)
+TwoIconsDelegate::TwoIconsDelegate(QObject *parent, IconStore *icons) :
+    QStyledItemDelegate(parent), _icons(icons)
 {
 }
 
 void TwoIconsDelegate::paint(QPainter *painter, const QStyleOptionViewItem &option, const QModelIndex &index) const
 {
-    QStyledItemDelegate::paint(painter, option, index);
+    QStyleOptionViewItemV4 opt = option;
+    initStyleOption(&opt, index);
+
+    QString source = index.data(IconSourceRole).toString();
+    if (_icons && opt.icon.isNull() && !source.isEmpty())
+    {
+        opt.icon = _icons->icon(source);
+        opt.features |= QStyleOptionViewItemV2::HasDecoration;
+    }
+
+    const QWidget *widget = opt.widget;
+    QStyle *style = widget ? widget->style() : QApplication::style();
+    style->drawControl(QStyle::CE_ItemViewItem, &opt, painter, widget);
 
     QVariant v = index.data(SecondIconRole);
     if (!v.isNull() && v.canConvert<QIcon>())
     {
         QIcon icon = v.value<QIcon>();
-        QSize size = icon.availableSizes().first();
+        if (!icon.isNull())
+        {
+            /* There are only a few second icons, that are drawn on every repaint */
+            QHash<qint64,QPixmap>::const_iterator it = _secondIcons.constFind(icon.cacheKey());
+            if (it == _secondIcons.constEnd())
+                it = _secondIcons.insert(icon.cacheKey(), icon.pixmap(icon.availableSizes().first()));
 
-        painter->drawPixmap(option.rect.right()-size.width(), option.rect.top(), icon.pixmap(size));
+            painter->drawPixmap(option.rect.right()-it.value().width(), option.rect.top(), it.value());
+        }
     }
 }
+
+/* Leaves room for the icon of the store, without reading it */
+QSize TwoIconsDelegate::sizeHint(const QStyleOptionViewItem &option, const QModelIndex &index) const
+{
+    QStyleOptionViewItemV4 opt = option;
+    initStyleOption(&opt, index);
+
+    if (_icons && !index.data(IconSourceRole).toString().isEmpty())
+        opt.features |= QStyleOptionViewItemV2::HasDecoration;
+
+    const QWidget *widget = opt.widget;
+    QStyle *style = widget ? widget->style() : QApplication::style();
+    return style->sizeFromContents(QStyle::CT_ItemViewItem, &opt, QSize(), widget);
+}
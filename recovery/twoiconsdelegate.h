@@ -1,9 +1,12 @@
 #ifndef TWOICONSDELEGATE_H
 #define TWOICONSDELEGATE_H
 
-/* Delegate for a QListWidget that can draw a second icon
+/* Delegate for a list view that can draw a second icon
  * at the right side of the item
  *
+ * Items can name their icon in an IconStore instead of holding it,
+ * so its pixels are only read once the item is drawn
+ *
  * Initial author: Floris Bos
  * Maintained by Raspberry Pi
  *
@@ -12,15 +15,27 @@
  */
 
 #include <QStyledItemDelegate>
+#include <QHash>
+#include <QPixmap>
 
 #define SecondIconRole  (Qt::UserRole+10)
+/* Source of the icon in the IconStore, used if the item has no icon of its own */
+#define IconSourceRole  (Qt::UserRole+12)
+
+class IconStore;
 
 class TwoIconsDelegate : public QStyledItemDelegate
 {
     Q_OBJECT
 public:
-    explicit TwoIconsDelegate(QObject *parent = 0);
+    explicit TwoIconsDelegate(QObject *parent = 0, IconStore *icons = NULL);
     virtual void paint(QPainter *painter, const QStyleOptionViewItem &option, const QModelIndex &index) const;
+    virtual QSize sizeHint(const QStyleOptionViewItem &option, const QModelIndex &index) const;
+
+protected:
+    IconStore *_icons;
+    /* Pixmaps of the second icons drawn. key: cacheKey() of the icon */
+    mutable QHash<qint64,QPixmap> _secondIcons;
 signals:
 
 public slots:
@@ -1,4 +1,5 @@
 #include "util.h"
+#include "config.h"
 #include <sys/ioctl.h>
 #include <stdint.h>
 #include <unistd.h>
@@ -10,6 +11,8 @@
 #include <QProcess>
 #include <QDebug>
 #include <QList>
+#include <QStringList>
+#include <stdio.h>
 
 /*
  * Convenience functions
@@ -39,6 +42,28 @@ void putFileContents(const QString &filename, const QByteArray &data)
     f.close();
 }
 
+/* Written to a temporary file first, and synced before it replaces the old one,
+ * so a crash or power cut leaves either the old or the new file, never an empty one */
+bool writeFileAtomically(const QString &filename, const QByteArray &data)
+{
+    QFile f(filename+".tmp");
+    if (!f.open(QIODevice::WriteOnly) || f.write(data) != data.size() || !f.flush() || ::fsync(f.handle()) != 0)
+        return false;
+    f.close();
+
+    if (::rename(QFile::encodeName(filename+".tmp").constData(), QFile::encodeName(filename).constData()) != 0)
+        return false;
+
+    /* The rename is only durable once the directory is synced as well */
+    int fd = ::open(QFile::encodeName(QFileInfo(filename).absolutePath()).constData(), O_RDONLY | O_DIRECTORY);
+    if (fd == -1)
+        return false;
+    bool ok = (::fsync(fd) == 0);
+    ::close(fd);
+
+    return ok;
+}
+
 /* Utility function to query current overscan setting */
 #define VCMSG_GET_OVERSCAN 0x0004000a
 #define VCMSG_SET_OVERSCAN 0x0004800a
@@ -146,6 +171,98 @@ bool canBootOs(const QString& name, const QVariantMap& values)
     return true;
 }
 
+/* Whether this OS should be displayed in the list of installable OSes */
+bool canInstallOs(const QString& name, const QVariantMap& values)
+{
+    /* Can't simply pull "name" from "values" because in some JSON files it's "os_name" and in others it's "name" */
+
+    /* If it's not bootable, it isn't really an OS, so is always installable */
+    if (!canBootOs(name, values))
+    {
+        return true;
+    }
+
+    /* RISC_OS needs a matching riscos_offset */
+    if (nameMatchesRiscOS(name))
+    {
+        if (!values.contains(RISCOS_OFFSET_KEY) || (values.value(RISCOS_OFFSET_KEY).toInt() != RISCOS_OFFSET))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* Whether this OS is supported */
+bool isSupportedOs(const QString& name, const QVariantMap& values)
+{
+    /* Can't simply pull "name" from "values" because in some JSON files it's "os_name" and in others it's "name" */
+
+    /* If it's not bootable, it isn't really an OS, so is always supported */
+    if (!canBootOs(name, values))
+    {
+        return true;
+    }
+
+    uint board_revision = readBoardRevision();
+    if (values.find("supported_revisions") != values.end())
+    {
+        /* Check the supported revisions list */
+        QStringList revisions = values.value("supported_revisions").toString().remove(" ").split(",");
+        for (int i=0; i < revisions.size(); i++)
+        {
+            bool ok;
+            uint rev = revisions.at(i).toUInt(&ok, 10);
+            if (ok)
+            {
+                if ((rev & 0xffff) == (board_revision & 0xffff))
+                {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+    else if (values.find("supported_hex_revisions") != values.end())
+    {
+        /* Check the supported revisions list */
+        QStringList revisions = values.value("supported_hex_revisions").toString().remove(" ").split(",");
+        for (int i=0; i < revisions.size(); i++)
+        {
+            bool ok;
+            uint rev = revisions.at(i).toUInt(&ok, 16);
+            if (ok)
+            {
+                if ((rev & 0xffff) == (board_revision & 0xffff))
+                {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+    else
+    {
+        /* Check the feature_level flag */
+        if (board_revision < 64) /* overflow otherwise */
+        {
+            quint64 featurelevel = values.value("feature_level", 58364).toULongLong();
+            quint64 mask = (quint64)1 << board_revision;
+            if ((featurelevel & mask) != mask)
+            {
+                return false;
+            }
+        }
+        else
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
 bool setRebootPartition(QByteArray partition)
 {
     if (QFileInfo("/sys/module/bcm2708/parameters/reboot_part").exists())
@@ -171,3 +288,27 @@ int sizeofSDCardInBlocks()
     return blocks;
 }
 
+
+/* Memory that can be used without pushing the system into swap, in bytes */
+qint64 availableMemory()
+{
+    qint64 memFree = 0, cached = 0;
+
+    foreach (QByteArray line, getFileContents("/proc/meminfo").split('\n'))
+    {
+        QList<QByteArray> fields = line.simplified().split(' ');
+        if (fields.count() < 2)
+            continue;
+
+        qint64 kb = fields.at(1).toLongLong();
+        if (fields.at(0) == "MemAvailable:")
+            return kb * 1024;
+        else if (fields.at(0) == "MemFree:")
+            memFree = kb;
+        else if (fields.at(0) == "Cached:")
+            cached = kb;
+    }
+
+    /* Kernels before 3.14 do not have MemAvailable */
+    return (memFree + cached) * 1024;
+}
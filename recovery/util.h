@@ -16,12 +16,16 @@
 
 QByteArray getFileContents(const QString &filename);
 void putFileContents(const QString &filename, const QByteArray &data);
+bool writeFileAtomically(const QString &filename, const QByteArray &data);
 void getOverscan(int &top, int &bottom, int &left, int &right);
 bool nameMatchesRiscOS(const QString &name);
 bool nameMatchesWinIoT(const QString &name);
 uint readBoardRevision();
 bool canBootOs(const QString& name, const QVariantMap& values);
+bool canInstallOs(const QString& name, const QVariantMap& values);
+bool isSupportedOs(const QString& name, const QVariantMap& values);
 bool setRebootPartition(QByteArray partition);
 int sizeofSDCardInBlocks();
+qint64 availableMemory();
 
 #endif // UTIL_H
@@ -0,0 +1,156 @@
+#include "verifiedfile.h"
+#include "imagepipeline.h"
+#include <QDebug>
+#include <string.h>
+
+/* Local image file, verified against its checksums as it is read
+ *
+ * Maintained by Raspberry Pi
+ *
+ * See LICENSE.txt for license details
+ *
+ */
+
+VerifiedFile::VerifiedFile(const QString &filename, const ImageChecksums &sums, QObject *parent)
+    : QIODevice(parent), _file(filename), _sums(sums), _bufOffset(0), _verified(0), _verifiedChunks(0), _eof(false), _corrupt(false)
+{
+}
+
+bool VerifiedFile::open(OpenMode mode)
+{
+    if (mode != QIODevice::ReadOnly)
+        return false;
+
+    if (!_file.open(QIODevice::ReadOnly))
+    {
+        setErrorString(_file.errorString());
+        return false;
+    }
+
+    return QIODevice::open(QIODevice::ReadOnly | QIODevice::Unbuffered);
+}
+
+void VerifiedFile::close()
+{
+    QIODevice::close();
+    _file.close();
+}
+
+qint64 VerifiedFile::size() const
+{
+    return _file.size();
+}
+
+qint64 VerifiedFile::readData(char *data, qint64 maxlen)
+{
+    qint64 p = pos();
+
+    /* Next part of the file in order */
+    if (p == _verified && !_eof && !readNext())
+        return -1;
+
+    if (p >= _bufOffset && p < _bufOffset + _buf.size())
+    {
+        qint64 n = qMin(maxlen, _bufOffset + _buf.size() - p);
+        memcpy(data, _buf.constData() + (p - _bufOffset), n);
+        return n;
+    }
+
+    /* Random access, or the end of the file */
+    if (!_file.seek(p))
+    {
+        setErrorString(_file.errorString());
+        return -1;
+    }
+    qint64 n = _file.read(data, maxlen);
+    if (n < 0)
+        setErrorString(_file.errorString());
+
+    return n;
+}
+
+qint64 VerifiedFile::writeData(const char *, qint64)
+{
+    return -1;
+}
+
+/* Read and verify the part of the file that follows what is verified already.
+ * With chunk checksums that is a whole chunk, the file hash is updated as the data goes by */
+bool VerifiedFile::readNext()
+{
+    int len = _sums.chunks.isEmpty() ? PIPELINE_CHUNK_SIZE : _sums.chunkSize;
+
+    _buf.resize(len);
+    if (!_file.seek(_verified))
+    {
+        setErrorString(_file.errorString());
+        return false;
+    }
+    /* QFile only returns less than asked for at the end of the file */
+    qint64 n = _file.read(_buf.data(), len);
+    if (n < 0)
+    {
+        setErrorString(_file.errorString());
+        return false;
+    }
+    _buf.resize(n);
+    _bufOffset = _verified;
+
+    if (n == 0)
+    {
+        _eof = true;
+
+        if (!_sums.chunks.isEmpty())
+        {
+            if (_verifiedChunks != _sums.chunks.size())
+                return mismatch(_file.fileName()+" is smaller than its checksums say");
+        }
+        else if (!_sums.sha256.isEmpty() && _fileHash.result().toHex() != _sums.sha256)
+        {
+            return mismatch("Checksum mismatch of "+_file.fileName());
+        }
+        return true;
+    }
+
+    if (_sums.chunks.isEmpty())
+    {
+        if (!_sums.sha256.isEmpty())
+            _fileHash.addData(_buf.constData(), n);
+    }
+    else
+    {
+        if (_verifiedChunks == _sums.chunks.size())
+            return mismatch(_file.fileName()+" is larger than its checksums say");
+        if (Sha256::hash(_buf).toHex() != _sums.chunks.at(_verifiedChunks))
+            return mismatch(QString("Checksum mismatch in bytes %1 to %2 of %3").arg(_verified).arg(_verified+n).arg(_file.fileName()));
+        _verifiedChunks++;
+    }
+
+    _verified += n;
+    return true;
+}
+
+bool VerifiedFile::finish()
+{
+    while (!_eof)
+    {
+        if (_corrupt || !readNext())
+            return false;
+    }
+
+    return !_corrupt;
+}
+
+bool VerifiedFile::isCorrupt() const
+{
+    return _corrupt;
+}
+
+bool VerifiedFile::mismatch(const QString &msg)
+{
+    qDebug() << msg;
+    _corrupt = true;
+    _buf.clear();
+    setErrorString(msg);
+    return false;
+}
@@ -0,0 +1,58 @@
+#ifndef VERIFIEDFILE_H
+#define VERIFIEDFILE_H
+
+/* Local image file, verified against its checksums as it is read
+ *
+ * Unlike a ring buffer in front of the decoder, the file can still be
+ * seeked, so parallel decompressors can read its index. Only data read
+ * in order from the start of the file is verified: with checksums of
+ * its chunks, every chunk is read ahead and verified before any of it
+ * is handed out, so corrupt data never reaches the SD card. Random
+ * access reads, like those of the index, bypass verification.
+ *
+ * Decompressors do not always read up to the end of the file, so
+ * finish() verifies what they left.
+ *
+ * Maintained by Raspberry Pi
+ *
+ * See LICENSE.txt for license details
+ *
+ */
+
+#include "sha256.h"
+#include <QIODevice>
+#include <QFile>
+
+class VerifiedFile : public QIODevice
+{
+public:
+    VerifiedFile(const QString &filename, const ImageChecksums &sums, QObject *parent = 0);
+
+    virtual bool open(OpenMode mode);
+    virtual void close();
+    virtual qint64 size() const;
+
+    /* Verify the rest of the file. Returns false if it does not match its checksums */
+    bool finish();
+    /* Whether reading failed because the file does not match its checksums */
+    bool isCorrupt() const;
+
+protected:
+    virtual qint64 readData(char *data, qint64 maxlen);
+    virtual qint64 writeData(const char *data, qint64 len);
+    bool readNext();
+    bool mismatch(const QString &msg);
+
+    QFile _file;
+    ImageChecksums _sums;
+    Sha256 _fileHash;
+    /* Data verified last, and its offset in the file */
+    QByteArray _buf;
+    qint64 _bufOffset;
+    /* Everything before this offset has been verified */
+    qint64 _verified;
+    int _verifiedChunks;
+    bool _eof, _corrupt;
+};
+
+#endif // VERIFIEDFILE_H
@@ -0,0 +1,202 @@
+#include "writeverifier.h"
+#include <QFile>
+#include <QThread>
+#include <QVector>
+#include <QAtomicInt>
+#include <QTime>
+#include <QDebug>
+#include <zlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+
+/* Read-back verification of the data written to a partition
+ *
+ * Maintained by Raspberry Pi
+ *
+ * See LICENSE.txt for license details
+ *
+ */
+
+/* Reads back and checks the extents, taking the next one from the shared counter */
+class VerifyWorker : public QThread
+{
+public:
+    VerifyWorker(const QString &device, const QVector<WriteVerifier::Extent> &extents, int bufferSize,
+                 QAtomicInt *next, QAtomicInt *failed)
+        : _device(device), _extents(extents), _bufferSize(bufferSize), _next(next), _failed(failed), _bytesVerified(0)
+    {
+    }
+
+    QString errorString() const
+    {
+        return _error;
+    }
+
+    qint64 bytesVerified() const
+    {
+        return _bytesVerified;
+    }
+
+protected:
+    virtual void run();
+    void fail(const QString &msg);
+
+    QString _device;
+    const QVector<WriteVerifier::Extent> &_extents;
+    int _bufferSize;
+    QAtomicInt *_next, *_failed;
+    qint64 _bytesVerified;
+    QString _error;
+};
+
+void VerifyWorker::fail(const QString &msg)
+{
+    _error = msg;
+    _failed->fetchAndStoreOrdered(1);
+}
+
+void VerifyWorker::run()
+{
+    QByteArray path = QFile::encodeName(_device);
+    int fd = ::open(path.constData(), O_RDONLY | O_DIRECT | O_CLOEXEC);
+
+    if (fd == -1)
+    {
+        /* Not all file systems support O_DIRECT, drop the cached pages instead */
+        fd = ::open(path.constData(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+        {
+            fail("Error opening "+_device+": "+strerror(errno));
+            return;
+        }
+        ::posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+
+    void *mem;
+    if (posix_memalign(&mem, VERIFY_ALIGNMENT, _bufferSize) != 0)
+    {
+        ::close(fd);
+        fail("Out of memory allocating read buffer");
+        return;
+    }
+    char *buf = (char *) mem;
+    int i;
+
+    while (!*_failed && (i = _next->fetchAndAddOrdered(1)) < _extents.size())
+    {
+        const WriteVerifier::Extent &e = _extents.at(i);
+        /* Direct I/O needs aligned offsets and sizes. Reads past the end of the device are short */
+        qint64 start = e.offset - e.offset % VERIFY_ALIGNMENT;
+        qint64 end = e.offset + e.len;
+        qint64 alignedEnd = (end + VERIFY_ALIGNMENT - 1) / VERIFY_ALIGNMENT * VERIFY_ALIGNMENT;
+        qint64 got = 0;
+
+        while (start+got < alignedEnd)
+        {
+            ssize_t n = ::pread(fd, buf+got, alignedEnd-start-got, start+got);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            got += n;
+        }
+
+        if (start+got < end)
+        {
+            fail(QString("Error reading back %1 bytes at offset %2 of %3").arg(e.len).arg(e.offset).arg(_device));
+            break;
+        }
+        if (crc32(0, (const Bytef *) buf + (e.offset - start), e.len) != e.crc)
+        {
+            fail(QString("%1 bytes at offset %2 of %3 read back differently than they were written").arg(e.len).arg(e.offset).arg(_device));
+            break;
+        }
+        _bytesVerified += e.len;
+    }
+
+    free(mem);
+    ::close(fd);
+}
+
+WriteVerifier::WriteVerifier(Mode mode)
+    : _mode(mode), _counter(0), _maxLength(0)
+{
+}
+
+void WriteVerifier::record(qint64 offset, const char *data, int len)
+{
+    /* Earlier chunks that are overwritten would not read back the same */
+    QMap<qint64,Extent>::iterator it = _extents.lowerBound(offset);
+    if (it != _extents.begin())
+    {
+        QMap<qint64,Extent>::iterator previous = it - 1;
+        if (previous.key() + previous.value().len > offset)
+            _extents.erase(previous);
+    }
+    while (it != _extents.end() && it.key() < offset+len)
+        it = _extents.erase(it);
+
+    if (_mode == VerifyOff || (_mode == VerifySampled && _counter++ % VERIFY_SAMPLE_INTERVAL))
+        return;
+
+    Extent e;
+    e.offset = offset;
+    e.len    = len;
+    e.crc    = crc32(0, (const Bytef *) data, len);
+    _extents.insert(offset, e);
+    _maxLength = qMax(_maxLength, len);
+}
+
+qint64 WriteVerifier::recordedBytes() const
+{
+    qint64 bytes = 0;
+
+    foreach (const Extent &e, _extents)
+        bytes += e.len;
+
+    return bytes;
+}
+
+bool WriteVerifier::verify(const QString &device)
+{
+    /* In offset order, so the card is read close to sequentially */
+    QVector<Extent> extents = _extents.values().toVector();
+    int threads = qMax(1, QThread::idealThreadCount());
+    QAtomicInt next(0), failed(0);
+    QList<VerifyWorker *> workers;
+    qint64 bytes = 0;
+
+    if (extents.isEmpty())
+        return true;
+
+    QTime t1;
+    t1.start();
+
+    for (int i = 0; i < threads; i++)
+    {
+        VerifyWorker *w = new VerifyWorker(device, extents, _maxLength + 2*VERIFY_ALIGNMENT, &next, &failed);
+        workers.append(w);
+        w->start();
+    }
+
+    foreach (VerifyWorker *w, workers)
+    {
+        w->wait();
+        bytes += w->bytesVerified();
+        if (_error.isEmpty())
+            _error = w->errorString();
+    }
+    qDeleteAll(workers);
+
+    qDebug() << "Verified" << bytes << "bytes of" << device << "in" << (t1.elapsed()/1000.0) << "seconds using" << threads << "threads";
+
+    return _error.isEmpty();
+}
+
+QString WriteVerifier::errorString() const
+{
+    return _error;
+}
@@ -0,0 +1,68 @@
+#ifndef WRITEVERIFIER_H
+#define WRITEVERIFIER_H
+
+/* Read-back verification of the data written to a partition
+ *
+ * BlockWriter passes every chunk it writes to record(), which keeps the
+ * CRC-32 of the chunk: of all chunks in full mode, of one chunk in
+ * VERIFY_SAMPLE_INTERVAL in sampled mode. A chunk that is overwritten
+ * later on (e.g. file system metadata) is forgotten.
+ *
+ * Once the partition is written and flushed, verify() reads the
+ * recorded chunks back with O_DIRECT, so the data comes from the card
+ * and not from the page cache, and checks them on as many threads as
+ * there are cores. This catches cards that silently drop writes, and
+ * counterfeit cards that are smaller than they claim to be and wrap
+ * writes around.
+ *
+ * Maintained by Raspberry Pi
+ *
+ * See LICENSE.txt for license details
+ *
+ */
+
+#include <QString>
+#include <QMap>
+
+/* In sampled mode, one written chunk in this many is verified */
+#define VERIFY_SAMPLE_INTERVAL  16
+/* O_DIRECT buffer, offset and size alignment */
+#define VERIFY_ALIGNMENT        4096
+
+class WriteVerifier
+{
+public:
+    enum Mode
+    {
+        VerifyOff, VerifySampled, VerifyFull
+    };
+
+    explicit WriteVerifier(Mode mode);
+
+    /* Called by the writer, for data about to be written at offset */
+    void record(qint64 offset, const char *data, int len);
+    qint64 recordedBytes() const;
+
+    /* Read the recorded chunks back from device. Returns false if any differs */
+    bool verify(const QString &device);
+    QString errorString() const;
+
+protected:
+    struct Extent
+    {
+        qint64 offset;
+        int len;
+        quint32 crc;
+    };
+
+    Mode _mode;
+    int _counter;
+    int _maxLength;
+    /* key: offset */
+    QMap<qint64,Extent> _extents;
+    QString _error;
+
+    friend class VerifyWorker;
+};
+
+#endif // WRITEVERIFIER_H